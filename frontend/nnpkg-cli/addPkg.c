@@ -19,20 +19,29 @@
 #include <assert.h>
 #include <errno.h>
 #include <libnex.h>
+#include <nnpkg/mem.h>
 #include <nnpkg/pkg.h>
 #include <nnpkg/propdb.h>
 #include <stdio.h>
 #include <string.h>
 
 // Arguments
-static const char* pkgPath = NULL;
+static const char** pkgPaths = NULL;
+static size_t numPkgPaths = 0;
 static const char* confFile = NNPKG_CONFFILE_PATH;
+static bool showTimings = false;
+static bool showMemory = false;
 
 static bool addSetPkg (actionOption_t* opt, char* arg)
 {
     UNUSED (opt);
     assert (arg);
-    pkgPath = arg;
+    const char** newPaths =
+        realloc_s (pkgPaths, (numPkgPaths + 1) * sizeof (const char*));
+    if (!newPaths)
+        return false;
+    pkgPaths = newPaths;
+    pkgPaths[numPkgPaths++] = arg;
     return true;
 }
 
@@ -44,11 +53,29 @@ static bool addSetConf (actionOption_t* opt, char* arg)
     return true;
 }
 
+static bool addSetTimings (actionOption_t* opt, char* arg)
+{
+    UNUSED (opt);
+    UNUSED (arg);
+    showTimings = true;
+    return true;
+}
+
+static bool addSetMemory (actionOption_t* opt, char* arg)
+{
+    UNUSED (opt);
+    UNUSED (arg);
+    showMemory = true;
+    return true;
+}
+
 // Option table
 static actionOption_t addOptions[] = {
-    {'c', "conf", addSetConf, true},
-    {0,   "",     addSetPkg,  true},
-    {0,   NULL,   NULL,       0   }
+    {'c', "conf",    addSetConf,    true },
+    {'t', "timings", addSetTimings, false},
+    {'m', "memory",  addSetMemory,  false},
+    {0,   "",        addSetPkg,     true },
+    {0,   NULL,      NULL,          0    }
 };
 
 actionOption_t* addGetOptions()
@@ -65,6 +92,17 @@ void addProgress (NnpkgTransCb_t* cb, int newState)
             printf ("\n  * Reading package configuration...");
             break;
         case NNPKG_STATE_ADDPKG:
+            if (cb->type == NNPKG_TRANS_ADD_MULTI)
+            {
+                NnpkgTransAddMulti_t* add = cb->transactData;
+                for (size_t i = 0; i < add->numPkgs; ++i)
+                {
+                    NnpkgPackage_t* pkg = add->pkgs[add->order[i]];
+                    printf ("\n  * Adding package %s to database...",
+                            PkgGetIdUtf8 (pkg));
+                }
+                break;
+            }
             printf ("\n  * Adding package %s to database...",
                     UnicodeToHost (StrRefGet (cb->progressHint[0])));
             StrRefDestroy (cb->progressHint[0]);
@@ -95,9 +133,38 @@ void addProgress (NnpkgTransCb_t* cb, int newState)
                     StrRefDestroy (cb->errHint[0]);
                     StrRefDestroy (cb->errHint[1]);
                     break;
+                case NNPKG_ERR_DEP_CONFLICT:
+                    fprintf (stderr,
+                             "%s: error: dependencies of package \"%s\" ",
+                             getprogname(),
+                             UnicodeToHost (StrRefGet (cb->errHint[0])));
+                    fprintf (stderr,
+                             "need conflicting versions of package \"%s\"\n",
+                             UnicodeToHost (StrRefGet (cb->errHint[1])));
+                    StrRefDestroy (cb->errHint[0]);
+                    StrRefDestroy (cb->errHint[1]);
+                    break;
+                case NNPKG_ERR_DEP_CYCLE:
+                    error ("package \"%s\" depends on itself through packages "
+                           "being added with it",
+                           UnicodeToHost (StrRefGet (cb->errHint[0])));
+                    StrRefDestroy (cb->errHint[0]);
+                    break;
                 case NNPKG_ERR_DB_LOCKED:
                     error ("unable to acquire lock on package database");
                     break;
+                case NNPKG_ERR_DB_REVISION:
+                    error ("package database revision mismatch");
+                    break;
+                case NNPKG_ERR_DB_CHANGED:
+                    error ("package database kept changing while planning");
+                    break;
+                case NNPKG_ERR_DEPS_LIMIT:
+                    error ("package \"%s\" has more than %d dependencies",
+                           UnicodeToHost (StrRefGet (cb->errHint[0])),
+                           NNPKG_MAX_DEPS);
+                    StrRefDestroy (cb->errHint[0]);
+                    break;
                 case NNPKG_ERR_PKG_EXIST:
                     error ("package %s already exists",
                            UnicodeToHost (StrRefGet (cb->errHint[0])));
@@ -114,14 +181,78 @@ void addProgress (NnpkgTransCb_t* cb, int newState)
     }
 }
 
+// Prints where the time of a transaction went
+static void addPrintTimings (NnpkgTransCb_t* cb)
+{
+    NnpkgTransStats_t* stats = &cb->stats;
+    uint64_t total = 0;
+    printf ("\nTimings:\n");
+    printf ("  %-28s %10s %8s %8s %8s %10s\n",
+            "state",
+            "time (ms)",
+            "files",
+            "links",
+            "strings",
+            "bytes");
+    for (int i = 0; i < NNPKG_NUM_STATES; ++i)
+    {
+        uint64_t* counts = stats->counts[i];
+        if (!stats->time[i] && !counts[NNPKG_COUNT_FILES_COLLECTED] &&
+            !counts[NNPKG_COUNT_LINKS_WRITTEN] &&
+            !counts[NNPKG_COUNT_STRINGS_ADDED] &&
+            !counts[NNPKG_COUNT_BYTES_WRITTEN])
+        {
+            continue;
+        }
+        total += stats->time[i];
+        printf ("  %-28s %10.3f %8llu %8llu %8llu %10llu\n",
+                TransactGetStateName (i),
+                stats->time[i] / 1000000.0,
+                (unsigned long long) counts[NNPKG_COUNT_FILES_COLLECTED],
+                (unsigned long long) counts[NNPKG_COUNT_LINKS_WRITTEN],
+                (unsigned long long) counts[NNPKG_COUNT_STRINGS_ADDED],
+                (unsigned long long) counts[NNPKG_COUNT_BYTES_WRITTEN]);
+    }
+    printf ("  %-28s %10.3f\n", "total", total / 1000000.0);
+    if (stats->numPlans > 1)
+        printf ("  planned %u times, as the database changed\n", stats->numPlans);
+    if (stats->lockWait)
+        printf ("  waited %.3f ms for the database\n", stats->lockWait / 1000000.0);
+}
+
+// Prints how much memory each part of the library used
+static void addPrintMemory()
+{
+    printf ("\nMemory:\n");
+    printf ("  %-10s %10s %10s %12s %12s\n",
+            "subsystem",
+            "allocs",
+            "frees",
+            "held",
+            "peak");
+    for (int i = 0; i < NNPKG_NUM_MEM; ++i)
+    {
+        NnpkgMemStats_t stats;
+        MemStatsGet (i, &stats);
+        printf ("  %-10s %10llu %10llu %12lld %12lld\n",
+                MemGetSubsysName (i),
+                (unsigned long long) stats.allocs,
+                (unsigned long long) stats.frees,
+                (long long) stats.bytes,
+                (long long) stats.peak);
+    }
+}
+
 bool addRunAction()
 {
-    // Ensure pkgPath was set
-    if (!pkgPath)
+    // Ensure a package was given
+    if (!numPkgPaths)
     {
         error ("Package configuration file not specified");
         return false;
     }
+    if (showMemory)
+        MemStatsEnable();
     printf ("  * Starting transaction...");
     NnpkgTransCb_t cb = {0};
     // Prepare control block
@@ -129,11 +260,41 @@ bool addRunAction()
     cb.confFile = confFile;
     cb.progress = addProgress;
     NnpkgTransAdd_t transData = {0};
-    transData.pkgConf = pkgPath;
-    cb.transactData = &transData;
-    // Run transaction
-    bool res = TransactExecute (&cb);
+    NnpkgTransAddMulti_t multiData = {0};
+    if (numPkgPaths == 1)
+    {
+        transData.pkgConf = pkgPaths[0];
+        cb.transactData = &transData;
+    }
+    else
+    {
+        // Several packages are added in one transaction
+        cb.type = NNPKG_TRANS_ADD_MULTI;
+        multiData.pkgConfs = pkgPaths;
+        multiData.numPkgs = numPkgPaths;
+        cb.transactData = &multiData;
+    }
+    // Run transaction. Timings and memory use are only known for transactions run
+    // here, so nnpkgd is only used without them
+    NnpkgDaemonMsg_t reply;
+    bool res;
+    if (!showTimings && !showMemory && clientRequest (NNPKGD_REQ_ADD,
+                                                      confFile,
+                                                      pkgPaths,
+                                                      numPkgPaths,
+                                                      true,
+                                                      &reply))
+    {
+        res = clientReport (&cb, &reply);
+    }
+    else
+        res = TransactExecute (&cb);
     if (!res)
         printf ("\n  * An error occurred while executing transaction. Aborting.\n");
+    if (showTimings)
+        addPrintTimings (&cb);
+    if (showMemory)
+        addPrintMemory();
+    free (pkgPaths);
     return res;
 }
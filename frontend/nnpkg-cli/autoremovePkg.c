@@ -0,0 +1,122 @@
+/*
+    autoremovePkg.c - handles package autoremove operation
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "include/nnpkg.h"
+#include <assert.h>
+#include <libnex.h>
+#include <nnpkg/pkg.h>
+#include <stdio.h>
+#include <string.h>
+
+// Arguments
+static const char* confFile = NNPKG_CONFFILE_PATH;
+
+static bool autoremoveSetConf (actionOption_t* opt, char* arg)
+{
+    UNUSED (opt);
+    assert (arg);
+    confFile = arg;
+    return true;
+}
+
+// Option table
+static actionOption_t autoremoveOptions[] = {
+    {'c', "conf", autoremoveSetConf, true},
+    {0,   NULL,   NULL,              0   }
+};
+
+actionOption_t* autoremoveGetOptions()
+{
+    return autoremoveOptions;
+}
+
+// Progressing hook
+static void autoremoveProgress (NnpkgTransCb_t* cb, int newState)
+{
+    switch (newState)
+    {
+        case NNPKG_STATE_FIND_ORPHANS:
+            printf ("\n  * Finding unneeded packages...");
+            break;
+        case NNPKG_STATE_REMOVE_INDEX:
+            printf ("\n  * Removing links from index...");
+            break;
+        case NNPKG_STATE_RMPKG: {
+            NnpkgTransAutoRemove_t* autoRm = cb->transactData;
+            ListEntry_t* entry = ListFront (autoRm->orphans);
+            if (!entry)
+                printf ("\n  * No packages to remove");
+            while (entry)
+            {
+                NnpkgPackage_t* pkg = ListEntryData (entry);
+                printf ("\n  * Removing package %s from database...",
+                        PkgGetIdUtf8 (pkg));
+                entry = ListIterate (entry);
+            }
+            break;
+        }
+        case NNPKG_STATE_ACCEPT:
+            printf ("\nDone!\n");
+            break;
+        case NNPKG_TRANS_STATE_ERR: {
+            printf ("\n");
+            switch (cb->error)
+            {
+                case NNPKG_ERR_OOM:
+                    error ("out of memory");
+                    break;
+                case NNPKG_ERR_DB_LOCKED:
+                    error ("unable to acquire lock on package database");
+                    break;
+                case NNPKG_ERR_DB_REVISION:
+                    error ("package database revision mismatch");
+                    break;
+                case NNPKG_ERR_DB_CHANGED:
+                    error ("package database kept changing while planning");
+                    break;
+                case NNPKG_ERR_SYNTAX_ERR:
+                    error ("syntax error in configuration file");
+                    break;
+                case NNPKG_ERR_SYS:
+                    error ("system error: %s", strerror (cb->sysErrno));
+                    break;
+            }
+        }
+    }
+}
+
+bool autoremoveRunAction()
+{
+    printf ("  * Starting transaction...");
+    NnpkgTransCb_t cb = {0};
+    // Prepare control block
+    cb.type = NNPKG_TRANS_AUTOREMOVE;
+    cb.confFile = confFile;
+    cb.progress = autoremoveProgress;
+    NnpkgTransAutoRemove_t transData = {0};
+    cb.transactData = &transData;
+    // Run transaction, on nnpkgd if it is running
+    NnpkgDaemonMsg_t reply;
+    bool res;
+    if (clientRequest (NNPKGD_REQ_AUTOREMOVE, confFile, NULL, 0, false, &reply))
+        res = clientReport (&cb, &reply);
+    else
+        res = TransactExecute (&cb);
+    if (!res)
+        printf ("\n  * An error occurred while executing transaction. Aborting.\n");
+    return res;
+}
@@ -0,0 +1,90 @@
+/*
+    client.c - contains nnpkgd client functions
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "include/nnpkg.h"
+#include <libnex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+bool clientRequest (int type,
+                    const char* confFile,
+                    const char** args,
+                    size_t numArgs,
+                    bool pathArgs,
+                    NnpkgDaemonMsg_t* reply)
+{
+    int fd = DaemonConnect (DaemonGetSocketPath());
+    if (fd == -1)
+        return false;
+    // The daemon runs elsewhere, so paths have to be absolute
+    char** strs = calloc_s ((numArgs + 1) * sizeof (char*));
+    bool res = strs && (strs[0] = realpath (confFile, NULL));
+    for (size_t i = 0; res && i < numArgs; ++i)
+    {
+        if (pathArgs)
+            res = (strs[i + 1] = realpath (args[i], NULL)) != NULL;
+        else
+            strs[i + 1] = (char*) args[i];
+    }
+    res = res && DaemonSend (fd, type, 0, 0, (const char**) strs, numArgs + 1) &&
+          DaemonRecv (fd, reply);
+    close (fd);
+    for (size_t i = 0; strs && i < numArgs + 1; ++i)
+    {
+        if (!i || pathArgs)
+            free (strs[i]);
+    }
+    free (strs);
+    if (!res)
+        return false;
+    // Leave requests the daemon can't carry out to the caller
+    if (reply->type != NNPKGD_REPLY || reply->error < 0)
+    {
+        DaemonMsgFree (reply);
+        return false;
+    }
+    return true;
+}
+
+// Converts a string from a reply to a hint
+static StringRef32_t* clientGetHint (const char* s)
+{
+    size_t len = strlen (s);
+    char32_t* hint = malloc_s ((len + 1) * sizeof (char32_t));
+    if (!hint)
+        return NULL;
+    mbstate_t mbstate = {0};
+    mbstoc32s (hint, s, (len + 1) * sizeof (char32_t), len + 1, &mbstate);
+    return StrRefCreate (hint);
+}
+
+bool clientReport (NnpkgTransCb_t* cb, NnpkgDaemonMsg_t* reply)
+{
+    cb->error = reply->error;
+    cb->sysErrno = reply->sysErrno;
+    for (size_t i = 0; i < reply->numStrs && i < ARRAY_SIZE (cb->errHint); ++i)
+        cb->errHint[i] = clientGetHint (reply->strs[i]);
+    DaemonMsgFree (reply);
+    if (cb->error != NNPKG_ERR_NONE)
+    {
+        cb->progress (cb, NNPKG_TRANS_STATE_ERR);
+        return false;
+    }
+    cb->progress (cb, NNPKG_STATE_ACCEPT);
+    return true;
+}
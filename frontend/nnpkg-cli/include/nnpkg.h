@@ -19,7 +19,10 @@
 #define _NNPKG_H
 
 #include <config.h>
+#include <nnpkg/daemon.h>
+#include <nnpkg/transaction.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct _actionOpt actionOption_t;
 
@@ -56,4 +59,27 @@ bool initRunAction();
 actionOption_t* addGetOptions();
 bool addRunAction();
 
+actionOption_t* whyGetOptions();
+bool whyRunAction();
+
+actionOption_t* autoremoveGetOptions();
+bool autoremoveRunAction();
+
+actionOption_t* removeGetOptions();
+bool removeRunAction();
+
+// Sends a request to nnpkgd, if one is running. If pathArgs is set, args are paths,
+// which are made absolute. Returns false if the request has to be carried out
+// here, as there is no daemon, or it can't carry it out
+bool clientRequest (int type,
+                    const char* confFile,
+                    const char** args,
+                    size_t numArgs,
+                    bool pathArgs,
+                    NnpkgDaemonMsg_t* reply);
+
+// Reports the outcome of a transaction nnpkgd ran through the progress hook of cb,
+// as if it ran here. Returns false if it failed
+bool clientReport (NnpkgTransCb_t* cb, NnpkgDaemonMsg_t* reply);
+
 #endif
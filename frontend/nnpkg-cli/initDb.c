@@ -50,17 +50,19 @@ static void progress (NnpkgTransCb_t* cb, int state)
 // Run init action
 bool initRunAction()
 {
-    NnpkgTransCb_t cb;
+    NnpkgTransCb_t cb = {0};
     cb.progress = progress;
-    PkgParseMainConf (&cb, confFile);
+    if (!PkgParseMainConf (&cb, confFile))
+        return false;
     NnpkgDbLocation_t* dbLoc = &cb.conf->dbLoc;
     if (!PropDbCreate (dbLoc))
     {
         error ("Unable to create package database");
+        PkgDestroyMainConf (&cb);
         return false;
     }
     printf ("Initialized empty package database in %s\n",
             (char*) StrRefGet (dbLoc->dbPath));
-    PkgDestroyMainConf();
+    PkgDestroyMainConf (&cb);
     return true;
 }
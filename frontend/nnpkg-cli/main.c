@@ -33,16 +33,20 @@ static action_t* action = NULL;
 // the action, a function to obtain the actions argument table, and a function to run
 // actions
 static action_t actions[] = {
-    {"init", initGetOptions, initRunAction},
-    {"add",  addGetOptions,  addRunAction }
+    {"init",       initGetOptions,       initRunAction      },
+    {"add",        addGetOptions,        addRunAction       },
+    {"why",        whyGetOptions,        whyRunAction       },
+    {"autoremove", autoremoveGetOptions, autoremoveRunAction},
+    {"remove",     removeGetOptions,     removeRunAction    }
 };
 
 // Runs an argument specified
 bool parseArg (char** argv, int* i, actionOption_t* opt)
 {
-    // Find an argument to it
+    // Find an argument to it. Flags don't take one, so that what follows them is
+    // left for the next option
     char* arg = NULL;
-    if (argv[(*i) + 1] && argv[(*i) + 1][0] != '-')
+    if (opt->argRequired && argv[(*i) + 1] && argv[(*i) + 1][0] != '-')
     {
         arg = argv[*i + 1];
         // ENsure loop doesn't pick up argument
@@ -147,6 +151,8 @@ Here is a list of supported actions:\n\
         filesystem\n\
   remove - removes specified package from database, and cleans up its files\n\
   init - initializes a new package database\n\
+  why - shows which explicitly installed package pulls in specified package\n\
+  autoremove - removes dependency packages no other package needs anymore\n\
 \n\
 For more info on these actions, look at the man page for the action.\n\
 Said man page is in the form nnpkg-ACTION(1).\n\
@@ -0,0 +1,149 @@
+/*
+    removePkg.c - handles package removal operation
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "include/nnpkg.h"
+#include <assert.h>
+#include <libnex.h>
+#include <nnpkg/pkg.h>
+#include <stdio.h>
+#include <string.h>
+
+// Arguments
+static const char* pkgName = NULL;
+static const char* confFile = NNPKG_CONFFILE_PATH;
+
+static bool removeSetPkg (actionOption_t* opt, char* arg)
+{
+    UNUSED (opt);
+    assert (arg);
+    if (pkgName)
+    {
+        error ("only one package can be removed at a time");
+        return false;
+    }
+    pkgName = arg;
+    return true;
+}
+
+static bool removeSetConf (actionOption_t* opt, char* arg)
+{
+    UNUSED (opt);
+    assert (arg);
+    confFile = arg;
+    return true;
+}
+
+// Option table
+static actionOption_t removeOptions[] = {
+    {'c', "conf", removeSetConf, true},
+    {0,   "",     removeSetPkg,  true},
+    {0,   NULL,   NULL,          0   }
+};
+
+actionOption_t* removeGetOptions()
+{
+    return removeOptions;
+}
+
+// Progressing hook
+static void removeProgress (NnpkgTransCb_t* cb, int newState)
+{
+    switch (newState)
+    {
+        case NNPKG_STATE_FIND_PKG:
+            printf ("\n  * Finding package %s...", pkgName);
+            break;
+        case NNPKG_STATE_REMOVE_INDEX:
+            printf ("\n  * Removing links from index...");
+            break;
+        case NNPKG_STATE_RMPKG:
+            printf ("\n  * Removing package %s from database...", pkgName);
+            break;
+        case NNPKG_STATE_ACCEPT:
+            printf ("\nDone!\n");
+            break;
+        case NNPKG_TRANS_STATE_ERR: {
+            printf ("\n");
+            switch (cb->error)
+            {
+                case NNPKG_ERR_OOM:
+                    error ("out of memory");
+                    break;
+                case NNPKG_ERR_PKG_NO_EXIST:
+                    error ("package %s doesn't exist", pkgName);
+                    break;
+                case NNPKG_ERR_PKG_NEEDED:
+                    // NOTE: we split these fprint's to account for the limitations
+                    // of UnicodeToHost
+                    fprintf (stderr,
+                             "%s: error: package \"%s\" ",
+                             getprogname(),
+                             UnicodeToHost (StrRefGet (cb->errHint[0])));
+                    fprintf (stderr,
+                             "is needed by package \"%s\"\n",
+                             UnicodeToHost (StrRefGet (cb->errHint[1])));
+                    StrRefDestroy (cb->errHint[0]);
+                    StrRefDestroy (cb->errHint[1]);
+                    break;
+                case NNPKG_ERR_DB_LOCKED:
+                    error ("unable to acquire lock on package database");
+                    break;
+                case NNPKG_ERR_DB_REVISION:
+                    error ("package database revision mismatch");
+                    break;
+                case NNPKG_ERR_DB_CHANGED:
+                    error ("package database kept changing while planning");
+                    break;
+                case NNPKG_ERR_SYNTAX_ERR:
+                    error ("syntax error in configuration file");
+                    break;
+                case NNPKG_ERR_SYS:
+                    error ("system error: %s", strerror (cb->sysErrno));
+                    break;
+            }
+        }
+    }
+}
+
+bool removeRunAction()
+{
+    // Ensure a package was given
+    if (!pkgName)
+    {
+        error ("Package to remove not specified");
+        return false;
+    }
+    printf ("  * Starting transaction...");
+    NnpkgTransCb_t cb = {0};
+    // Prepare control block
+    cb.type = NNPKG_TRANS_REMOVE;
+    cb.confFile = confFile;
+    cb.progress = removeProgress;
+    NnpkgTransRemove_t transData = {0};
+    transData.pkgName = pkgName;
+    cb.transactData = &transData;
+    // Run transaction, on nnpkgd if it is running
+    NnpkgDaemonMsg_t reply;
+    bool res;
+    if (clientRequest (NNPKGD_REQ_REMOVE, confFile, &pkgName, 1, false, &reply))
+        res = clientReport (&cb, &reply);
+    else
+        res = TransactExecute (&cb);
+    if (!res)
+        printf ("\n  * An error occurred while executing transaction. Aborting.\n");
+    return res;
+}
@@ -0,0 +1,184 @@
+/*
+    whyPkg.c - handles package why operation
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "include/nnpkg.h"
+#include <assert.h>
+#include <libnex.h>
+#include <nnpkg/graph.h>
+#include <nnpkg/pkg.h>
+#include <nnpkg/propdb.h>
+#include <stdio.h>
+#include <string.h>
+
+// Arguments
+static const char* pkgName = NULL;
+static const char* confFile = NNPKG_CONFFILE_PATH;
+
+static bool whySetPkg (actionOption_t* opt, char* arg)
+{
+    UNUSED (opt);
+    assert (arg);
+    pkgName = arg;
+    return true;
+}
+
+static bool whySetConf (actionOption_t* opt, char* arg)
+{
+    UNUSED (opt);
+    assert (arg);
+    confFile = arg;
+    return true;
+}
+
+// Option table
+static actionOption_t whyOptions[] = {
+    {'c', "conf", whySetConf, true},
+    {0,   "",     whySetPkg,  true},
+    {0,   NULL,   NULL,       0   }
+};
+
+actionOption_t* whyGetOptions()
+{
+    return whyOptions;
+}
+
+// Progress hook. Only errors are of interest
+static void whyProgress (NnpkgTransCb_t* cb, int newState)
+{
+    if (newState != NNPKG_TRANS_STATE_ERR)
+        return;
+    switch (cb->error)
+    {
+        case NNPKG_ERR_OOM:
+            error ("out of memory");
+            break;
+        case NNPKG_ERR_DB_LOCKED:
+            error ("unable to acquire lock on package database");
+            break;
+        case NNPKG_ERR_DB_REVISION:
+            error ("package database revision mismatch");
+            break;
+        case NNPKG_ERR_SYNTAX_ERR:
+            error ("syntax error in configuration file");
+            break;
+        case NNPKG_ERR_SYS:
+            error ("system error: %s", strerror (cb->sysErrno));
+            break;
+    }
+}
+
+// Prints the path nnpkgd found to a package
+static bool whyPrintReply (NnpkgTransCb_t* cb, NnpkgDaemonMsg_t* reply)
+{
+    if (reply->error == NNPKG_ERR_PKG_NO_EXIST)
+    {
+        error ("package %s is not installed", pkgName);
+        DaemonMsgFree (reply);
+        return false;
+    }
+    if (reply->error != NNPKG_ERR_NONE)
+        return clientReport (cb, reply);
+    if (!reply->numStrs)
+        printf ("%s is not needed by any explicitly installed package\n", pkgName);
+    else if (reply->numStrs == 1)
+        printf ("%s was installed explicitly\n", pkgName);
+    else
+    {
+        for (size_t i = 0; i < reply->numStrs; ++i)
+        {
+            printf ("%s", reply->strs[i]);
+            printf ((i + 1 < reply->numStrs) ? " -> " : "\n");
+        }
+    }
+    DaemonMsgFree (reply);
+    return true;
+}
+
+bool whyRunAction()
+{
+    if (!pkgName)
+    {
+        error ("Package name not specified");
+        return false;
+    }
+    NnpkgTransCb_t cb = {0};
+    cb.progress = whyProgress;
+    // Ask nnpkgd if it is running, as it has the database open already
+    NnpkgDaemonMsg_t reply;
+    if (clientRequest (NNPKGD_REQ_WHY, confFile, &pkgName, 1, false, &reply))
+        return whyPrintReply (&cb, &reply);
+    if (!PkgParseMainConf (&cb, confFile))
+        return false;
+    // Convert name to UTF-32
+    size_t nameLen = strlen (pkgName);
+    char32_t* name = malloc_s ((nameLen + 1) * sizeof (char32_t));
+    if (!name)
+    {
+        PkgDestroyMainConf (&cb);
+        return false;
+    }
+    mbstate_t mbstate = {0};
+    mbstoc32s (name,
+               pkgName,
+               (nameLen + 1) * sizeof (char32_t),
+               nameLen + 1,
+               &mbstate);
+    NnpkgPropDb_t* db = PkgDbOpenShared (&cb, &cb.conf->dbLoc);
+    if (!db)
+    {
+        free (name);
+        PkgDestroyMainConf (&cb);
+        return false;
+    }
+    bool res = false;
+    NnpkgGraph_t* graph = PkgGraphBuild (&cb, db);
+    if (!graph)
+        goto out;
+    uint32_t node = PkgGraphFindNode (graph, name);
+    if (node == NNPKG_GRAPH_NO_NODE)
+    {
+        error ("package %s is not installed", pkgName);
+        goto out;
+    }
+    uint32_t* path = NULL;
+    size_t pathLen = 0;
+    if (!PkgGraphWhy (&cb, graph, node, &path, &pathLen))
+        goto out;
+    if (!pathLen)
+        printf ("%s is not needed by any explicitly installed package\n", pkgName);
+    else if (pathLen == 1)
+        printf ("%s was installed explicitly\n", pkgName);
+    else
+    {
+        // NOTE: names are printed one at a time to account for the limitations of
+        // UnicodeToHost
+        for (size_t i = 0; i < pathLen; ++i)
+        {
+            printf ("%s", UnicodeToHost (PkgGraphGetName (graph, path[i])));
+            printf ((i + 1 < pathLen) ? " -> " : "\n");
+        }
+    }
+    free (path);
+    res = true;
+out:
+    if (graph)
+        PkgGraphDestroy (graph);
+    PkgDbClose (db);
+    free (name);
+    PkgDestroyMainConf (&cb);
+    return res;
+}
@@ -0,0 +1,35 @@
+/*
+    nnpkgd.h - contains nnpkgd main header
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _NNPKGD_H
+#define _NNPKGD_H
+
+#include <config.h>
+#include <nnpkg/daemon.h>
+#include <stdbool.h>
+
+// Sets up serving of requests for configuration file confFile, which must be an
+// absolute path
+bool serveInit (const char* confFile);
+
+// Carries out a request read from client fd, and sends the reply
+void serveRequest (int fd, NnpkgDaemonMsg_t* req);
+
+// Closes everything kept open between requests
+void serveShutdown();
+
+#endif
@@ -0,0 +1,154 @@
+/*
+    main.c - contains entry point of nnpkgd
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#define _GNU_SOURCE
+#include "include/nnpkgd.h"
+#include <errno.h>
+#include <libnex.h>
+#include <locale.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// How long a client may take to send its request, in seconds
+#define NNPKGD_RECV_TIMEOUT 5
+
+// Set by signals asking the daemon to exit
+static volatile sig_atomic_t stopServing = 0;
+
+static void stopHandler (int sig)
+{
+    UNUSED (sig);
+    stopServing = 1;
+}
+
+// Prints usage of daemon
+static void printUsage()
+{
+    printf (_ ("\
+%s - nnpkg daemon\n\
+Usage: %s [-c conf] [-s socket]\n\
+\n\
+nnpkgd keeps the package database open, and answers queries and runs\n\
+transactions for nnpkg over a local socket, one at a time.\n\
+\n\
+  -c conf - configuration file to serve. Defaults to %s\n\
+  -s socket - socket to listen on. Defaults to %s\n"),
+            getprogname(),
+            getprogname(),
+            NNPKG_CONFFILE_PATH,
+            DaemonGetSocketPath());
+}
+
+// Sets up signals. SA_RESTART is left off, so that accept returns when the daemon
+// is asked to stop
+static void setupSignals()
+{
+    struct sigaction sa = {0};
+    sa.sa_handler = stopHandler;
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+    // Clients that go away shouldn't take the daemon with them
+    signal (SIGPIPE, SIG_IGN);
+}
+
+// Reads a request from a client and serves it
+static void serveClient (int fd)
+{
+    // Don't let a client that never sends its request hold up everybody else
+    struct timeval timeout = {NNPKGD_RECV_TIMEOUT, 0};
+    setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+    NnpkgDaemonMsg_t req;
+    if (!DaemonRecv (fd, &req))
+        return;
+    serveRequest (fd, &req);
+    DaemonMsgFree (&req);
+}
+
+int main (int argc, char** argv)
+{
+    setprogname (argv[0]);
+#ifdef NNPKG_ENABLE_NLS
+    setlocale (LC_ALL, "");
+    bindtextdomain ("nnpkg", NNPKG_LOCALE_BASE);
+#endif
+    const char* confFile = NNPKG_CONFFILE_PATH;
+    const char* sockPath = DaemonGetSocketPath();
+    int opt;
+    while ((opt = getopt (argc, argv, "c:s:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                confFile = optarg;
+                break;
+            case 's':
+                sockPath = optarg;
+                break;
+            case 'h':
+                printUsage();
+                return 0;
+            default:
+                printUsage();
+                return 1;
+        }
+    }
+    // Clients name the configuration they want by its absolute path
+    char* confPath = realpath (confFile, NULL);
+    if (!confPath)
+    {
+        error ("%s: %s", confFile, strerror (errno));
+        return 1;
+    }
+    if (!serveInit (confPath))
+    {
+        error ("unable to read configuration file %s", confPath);
+        free (confPath);
+        return 1;
+    }
+    int listenFd = DaemonListen (sockPath);
+    if (listenFd == -1)
+    {
+        error ("%s: %s", sockPath, strerror (errno));
+        serveShutdown();
+        free (confPath);
+        return 1;
+    }
+    setupSignals();
+    while (!stopServing)
+    {
+        int fd = accept4 (listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+                error ("accept: %s", strerror (errno));
+            continue;
+        }
+        serveClient (fd);
+        close (fd);
+    }
+    close (listenFd);
+    unlink (sockPath);
+    serveShutdown();
+    free (confPath);
+    return 0;
+}
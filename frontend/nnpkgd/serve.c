@@ -0,0 +1,320 @@
+/*
+    serve.c - contains request handlers of nnpkgd
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "include/nnpkgd.h"
+#include <errno.h>
+#include <libnex.h>
+#include <nnpkg/graph.h>
+#include <nnpkg/pkg.h>
+#include <nnpkg/propdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Requests are served one at a time, so transactions run in the order they came
+// in, and queries are answered between them. The database stays mapped and its
+// dependency graph stays built between queries, but the database is only locked
+// while a query is being answered, so that writers aren't kept out. The parsed
+// configuration is shared by queries and transactions, and is only parsed again
+// when its file changes. Transactions still open the database themselves, as
+// their changes are committed when it is closed
+
+static const char* serveConfFile = NULL;    // Configuration being served
+static bool serveConfParsed = false;        // If configuration is parsed
+static struct stat serveConfSt;             // Configuration file when parsed
+static NnpkgTransCb_t queryCb = {0};        // Control block of queries
+static NnpkgPropDb_t* queryDb = NULL;       // Database queries are answered from
+static NnpkgGraph_t* queryGraph = NULL;     // Dependency graph of queryDb
+
+// Hints of last error, in host encoding
+static char* serveHints[ARRAY_SIZE (queryCb.errHint)];
+static size_t serveNumHints = 0;
+
+// Throws out hints of last error
+static void serveClearHints()
+{
+    for (size_t i = 0; i < serveNumHints; ++i)
+        free (serveHints[i]);
+    serveNumHints = 0;
+}
+
+// Copies a string in host encoding
+static char* serveCopyStr (const char* s)
+{
+    size_t len = strlen (s);
+    char* copy = malloc_s (len + 1);
+    if (copy)
+        memcpy (copy, s, len + 1);
+    return copy;
+}
+
+// Progress hook. Nothing is printed, hints are only kept to be sent to the client
+static void serveProgress (NnpkgTransCb_t* cb, int newState)
+{
+    if (newState == NNPKG_STATE_ADDPKG && cb->type == NNPKG_TRANS_ADD)
+    {
+        StrRefDestroy (cb->progressHint[0]);
+        cb->progressHint[0] = NULL;
+    }
+    else if (newState == NNPKG_TRANS_STATE_ERR)
+    {
+        for (size_t i = 0; i < ARRAY_SIZE (cb->errHint); ++i)
+        {
+            if (!cb->errHint[i])
+                continue;
+            const char* hint = UnicodeToHost (StrRefGet (cb->errHint[i]));
+            if (serveNumHints < ARRAY_SIZE (serveHints) &&
+                (serveHints[serveNumHints] = serveCopyStr (hint)))
+            {
+                ++serveNumHints;
+            }
+            StrRefDestroy (cb->errHint[i]);
+            cb->errHint[i] = NULL;
+        }
+    }
+}
+
+// Sends error of a request, with the hints that were kept
+static void serveReplyErr (int fd, int err, int sysErrno)
+{
+    if (!DaemonSend (fd,
+                     NNPKGD_REPLY,
+                     err,
+                     sysErrno,
+                     (const char**) serveHints,
+                     serveNumHints))
+    {
+        error ("unable to send reply: %s", strerror (errno));
+    }
+    serveClearHints();
+}
+
+// Closes the database kept for queries. It is only read, so closing it writes
+// nothing, and it needn't be locked
+static void serveCloseQuery()
+{
+    if (queryGraph)
+        PkgGraphDestroy (queryGraph);
+    if (queryDb)
+        PkgDbClose (queryDb);
+    queryGraph = NULL;
+    queryDb = NULL;
+}
+
+// Throws out the parsed configuration
+static void serveDestroyConf()
+{
+    if (serveConfParsed)
+        PkgDestroyMainConf (&queryCb);
+    serveConfParsed = false;
+}
+
+// Parses the configuration if it isn't parsed, or its file changed since it was.
+// Whatever was opened with an earlier parse is closed, as it may be elsewhere now
+static bool serveParseConf()
+{
+    struct stat st;
+    if (stat (serveConfFile, &st) == -1)
+        memset (&st, 0, sizeof (struct stat));
+    if (serveConfParsed && st.st_ino == serveConfSt.st_ino &&
+        st.st_dev == serveConfSt.st_dev && st.st_size == serveConfSt.st_size &&
+        st.st_mtim.tv_sec == serveConfSt.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == serveConfSt.st_mtim.tv_nsec)
+    {
+        return true;
+    }
+    serveCloseQuery();
+    serveDestroyConf();
+    if (!PkgParseMainConf (&queryCb, serveConfFile))
+        return false;
+    serveConfParsed = true;
+    serveConfSt = st;
+    return true;
+}
+
+// Locks the database for a query, opening it and building its graph if it isn't
+// open or changed since
+static bool serveLockQuery()
+{
+    if (!serveParseConf())
+        return false;
+    if (queryDb)
+    {
+        if (PropDbRelock (&queryCb, queryDb))
+            return true;
+        serveCloseQuery();
+        if (queryCb.error != NNPKG_ERR_DB_CHANGED)
+            return false;
+        queryCb.error = NNPKG_ERR_NONE;
+    }
+    queryDb = PkgDbOpenShared (&queryCb, &queryCb.conf->dbLoc);
+    if (!queryDb)
+        return false;
+    queryGraph = PkgGraphBuild (&queryCb, queryDb);
+    if (!queryGraph)
+    {
+        serveCloseQuery();
+        return false;
+    }
+    return true;
+}
+
+// Answers a why query
+static void serveWhy (int fd, const char* pkgName)
+{
+    queryCb.error = NNPKG_ERR_NONE;
+    if (!serveLockQuery())
+    {
+        serveReplyErr (fd, queryCb.error, queryCb.sysErrno);
+        return;
+    }
+    // Convert name to UTF-32
+    size_t nameLen = strlen (pkgName);
+    char32_t* name = malloc_s ((nameLen + 1) * sizeof (char32_t));
+    uint32_t* path = NULL;
+    size_t pathLen = 0;
+    char** names = NULL;
+    if (!name)
+    {
+        PropDbUnlock (queryDb);
+        serveReplyErr (fd, NNPKG_ERR_OOM, 0);
+        return;
+    }
+    mbstate_t mbstate = {0};
+    mbstoc32s (name,
+               pkgName,
+               (nameLen + 1) * sizeof (char32_t),
+               nameLen + 1,
+               &mbstate);
+    uint32_t node = PkgGraphFindNode (queryGraph, name);
+    free (name);
+    if (node == NNPKG_GRAPH_NO_NODE)
+    {
+        PropDbUnlock (queryDb);
+        serveReplyErr (fd, NNPKG_ERR_PKG_NO_EXIST, 0);
+        return;
+    }
+    if (!PkgGraphWhy (&queryCb, queryGraph, node, &path, &pathLen))
+    {
+        PropDbUnlock (queryDb);
+        serveReplyErr (fd, queryCb.error, queryCb.sysErrno);
+        return;
+    }
+    // Reply with the names along the path
+    names = calloc_s ((pathLen + 1) * sizeof (char*));
+    bool res = names != NULL;
+    for (size_t i = 0; res && i < pathLen; ++i)
+    {
+        const char32_t* pkg = PkgGraphGetName (queryGraph, path[i]);
+        names[i] = serveCopyStr (UnicodeToHost (pkg));
+        res = names[i] != NULL;
+    }
+    PropDbUnlock (queryDb);
+    if (!res)
+        serveReplyErr (fd, NNPKG_ERR_OOM, 0);
+    else if (!DaemonSend (fd, NNPKGD_REPLY, 0, 0, (const char**) names, pathLen))
+        error ("unable to send reply: %s", strerror (errno));
+    for (size_t i = 0; names && i < pathLen; ++i)
+        free (names[i]);
+    free (names);
+    free (path);
+}
+
+// Runs a transaction with the configuration queries use
+static void serveTransact (int fd, int type, void* transactData)
+{
+    queryCb.error = NNPKG_ERR_NONE;
+    if (!serveParseConf())
+    {
+        serveReplyErr (fd, queryCb.error, queryCb.sysErrno);
+        return;
+    }
+    NnpkgTransCb_t cb = {0};
+    cb.type = type;
+    cb.confFile = serveConfFile;
+    cb.conf = queryCb.conf;
+    cb.keepConf = true;
+    cb.progress = serveProgress;
+    cb.transactData = transactData;
+    if (TransactExecute (&cb))
+        serveReplyErr (fd, NNPKG_ERR_NONE, 0);
+    else
+        serveReplyErr (fd, cb.error, cb.sysErrno);
+}
+
+bool serveInit (const char* confFile)
+{
+    serveConfFile = confFile;
+    queryCb.progress = serveProgress;
+    return serveParseConf();
+}
+
+void serveRequest (int fd, NnpkgDaemonMsg_t* req)
+{
+    // Requests for other configurations are left to the client
+    if (!req->numStrs || strcmp (req->strs[0], serveConfFile) != 0)
+    {
+        serveReplyErr (fd, NNPKGD_ERR_CONF, 0);
+        return;
+    }
+    const char** args = req->strs + 1;
+    size_t numArgs = req->numStrs - 1;
+    if (req->type == NNPKGD_REQ_WHY && numArgs == 1)
+        serveWhy (fd, args[0]);
+    else if (req->type == NNPKGD_REQ_ADD && numArgs == 1 && args[0][0] == '/')
+    {
+        NnpkgTransAdd_t transData = {0};
+        transData.pkgConf = args[0];
+        serveTransact (fd, NNPKG_TRANS_ADD, &transData);
+    }
+    else if (req->type == NNPKGD_REQ_ADD && numArgs > 1)
+    {
+        // Paths are relative to the daemon, not the client
+        for (size_t i = 0; i < numArgs; ++i)
+        {
+            if (args[i][0] != '/')
+            {
+                serveReplyErr (fd, NNPKGD_ERR_REQUEST, 0);
+                return;
+            }
+        }
+        NnpkgTransAddMulti_t transData = {0};
+        transData.pkgConfs = args;
+        transData.numPkgs = numArgs;
+        serveTransact (fd, NNPKG_TRANS_ADD_MULTI, &transData);
+    }
+    else if (req->type == NNPKGD_REQ_REMOVE && numArgs == 1)
+    {
+        NnpkgTransRemove_t transData = {0};
+        transData.pkgName = args[0];
+        serveTransact (fd, NNPKG_TRANS_REMOVE, &transData);
+    }
+    else if (req->type == NNPKGD_REQ_AUTOREMOVE && !numArgs)
+    {
+        NnpkgTransAutoRemove_t transData = {0};
+        serveTransact (fd, NNPKG_TRANS_AUTOREMOVE, &transData);
+    }
+    else
+        serveReplyErr (fd, NNPKGD_ERR_REQUEST, 0);
+}
+
+void serveShutdown()
+{
+    serveCloseQuery();
+    serveDestroyConf();
+    serveClearHints();
+}
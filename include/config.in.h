@@ -44,6 +44,8 @@
 #endif
 
 #define NNPKG_CONFFILE_PATH "@NNPKG_CONFFILE_PATH@"
+#define NNPKG_CACHE_PATH "@NNPKG_CACHE_PATH@"
+#define NNPKG_SOCKET_PATH "@NNPKG_SOCKET_PATH@"
 
 // i18n stuff
 #ifdef NNPKG_ENABLE_NLS
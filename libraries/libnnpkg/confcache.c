@@ -0,0 +1,609 @@
+/*
+    confcache.c - contains compiled configuration cache
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file confcache.c
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libnex/safemalloc.h>
+#include <limits.h>
+#include <nnpkg/mem.h>
+#include <nnpkg/pkg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A compiled configuration file is made up of a header, the path of its source
+// file, a record, which is either a package or a main configuration, and a string
+// pool. Strings are stored as a 32 bit length in bytes, followed by the string and
+// a NUL terminator, and are referred to by their offset in the file. An offset of
+// 0 is a NULL string. Everything is in host byte order, as caches are never shared
+// between machines
+
+#define CONFCACHE_MAGIC_PKG  0x43504E4E    // "NNPC"
+#define CONFCACHE_MAGIC_MAIN 0x434D4E4E    // "NNMC"
+#define CONFCACHE_VERSION    4
+
+// Header of cache file. A cache is only fresh if the key fields match the source
+// file
+typedef struct _confcachehdr
+{
+    uint32_t magic;           ///< Type of record in cache
+    uint16_t version;         ///< CONFCACHE_VERSION
+    uint16_t pathLen;         ///< Length of source path following header
+    uint64_t srcDev;          ///< Device of source file
+    uint64_t srcIno;          ///< Inode of source file
+    uint64_t srcSize;         ///< Size of source file
+    int64_t srcMtime;         ///< Modification time of source file
+    int64_t srcMtimeNsec;     ///< Nanoseconds of modification time
+    uint32_t size;            ///< Size of whole cache file
+    uint32_t recOff;          ///< Offset of record
+} confCacheHdr_t;
+
+// Package record
+typedef struct _confcachepkg
+{
+    uint32_t id;              ///< Offset of ID string
+    uint32_t description;     ///< Offset of description string
+    uint32_t prefix;          ///< Offset of prefix string
+    uint32_t numDeps;         ///< Number of dependency records following package
+    uint16_t type;            ///< Type of package
+    uint8_t isDependency;     ///< If package is a dependency
+    uint8_t version[3];       ///< Version of package
+} confCachePkg_t;
+
+// Dependency record
+typedef struct _confcachedep
+{
+    uint32_t name;        ///< Offset of name string
+    uint8_t verOp;        ///< Version operator
+    uint8_t ver[3];       ///< Version operand
+} confCacheDep_t;
+
+// Main configuration record
+typedef struct _confcachemain
+{
+    uint32_t dbPath;        ///< Offset of host encoded database path
+    uint32_t strtabPath;    ///< Offset of host encoded string table path
+    uint32_t idxPath;       ///< Offset of index path
+    uint32_t cachePath;     ///< Offset of host encoded cache path
+    uint32_t flags;         ///< Boolean settings
+    int32_t lockTimeout;    ///< Milliseconds to wait for the database, or -1
+} confCacheMain_t;
+
+// Flags of main configuration record
+#define CONFCACHE_MAIN_STAGED_IDX (1 << 0)    ///< Index is staged
+
+// Cache being built in memory
+typedef struct _confcachebuf
+{
+    uint8_t* data;    ///< Contents of cache
+    size_t size;      ///< Bytes used
+    size_t max;       ///< Bytes allocated
+} confCacheBuf_t;
+
+void pkgDestroy (const Object_t* obj);
+
+// Figures out the path of the cache of a source file
+// The cache is named after a hash of the source file's absolute path
+static bool confCacheGetPath (const char* cacheDir,
+                              const char* srcPath,
+                              const char* ext,
+                              char* out,
+                              size_t outSz)
+{
+    uint64_t hash = 0xCBF29CE484222325;
+    for (const char* s = srcPath; *s; ++s)
+        hash = (hash ^ (uint8_t) *s) * 0x100000001B3;
+    int len = snprintf (out,
+                        outSz,
+                        "%s/%016llx.%s",
+                        cacheDir,
+                        (unsigned long long) hash,
+                        ext);
+    return len > 0 && (size_t) len < outSz;
+}
+
+// Fills in the key fields of a header
+static void confCacheSetKey (confCacheHdr_t* hdr, const struct stat* st)
+{
+    hdr->srcDev = st->st_dev;
+    hdr->srcIno = st->st_ino;
+    hdr->srcSize = st->st_size;
+    hdr->srcMtime = st->st_mtim.tv_sec;
+    hdr->srcMtimeNsec = st->st_mtim.tv_nsec;
+}
+
+// Maps the cache of a source file, if it is fresh and holds a record of the type
+// magic. Returns NULL if there is no such cache
+static const uint8_t* confCacheMap (const char* cacheDir,
+                                    const char* file,
+                                    const char* ext,
+                                    uint32_t magic,
+                                    uint32_t* sizeOut)
+{
+    char srcPath[PATH_MAX];
+    char cachePath[PATH_MAX];
+    if (!realpath (file, srcPath) ||
+        !confCacheGetPath (cacheDir, srcPath, ext, cachePath, sizeof (cachePath)))
+    {
+        return NULL;
+    }
+    struct stat srcSt, cacheSt;
+    if (stat (srcPath, &srcSt) == -1)
+        return NULL;
+    int fd = open (cachePath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    if (fstat (fd, &cacheSt) == -1 ||
+        cacheSt.st_size < (off_t) sizeof (confCacheHdr_t) ||
+        cacheSt.st_size > UINT32_MAX)
+    {
+        close (fd);
+        return NULL;
+    }
+    uint32_t size = (uint32_t) cacheSt.st_size;
+    uint8_t* base = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (base == MAP_FAILED)
+        return NULL;
+    // Make sure cache is of the current source file
+    confCacheHdr_t key = {0};
+    confCacheSetKey (&key, &srcSt);
+    const confCacheHdr_t* hdr = (const confCacheHdr_t*) base;
+    if (hdr->magic != magic || hdr->version != CONFCACHE_VERSION ||
+        hdr->size != size || hdr->srcDev != key.srcDev ||
+        hdr->srcIno != key.srcIno || hdr->srcSize != key.srcSize ||
+        hdr->srcMtime != key.srcMtime || hdr->srcMtimeNsec != key.srcMtimeNsec ||
+        hdr->pathLen != strlen (srcPath) ||
+        hdr->pathLen > size - sizeof (confCacheHdr_t) ||
+        memcmp (base + sizeof (confCacheHdr_t), srcPath, hdr->pathLen) != 0 ||
+        hdr->recOff % sizeof (uint32_t) || hdr->recOff > size)
+    {
+        munmap (base, size);
+        return NULL;
+    }
+    *sizeOut = size;
+    return base;
+}
+
+// Copies a string of charSize byte characters out of a mapped cache
+// Returns false if the string isn't inside the cache
+static bool confCacheCopyStr (const uint8_t* base,
+                              uint32_t size,
+                              uint32_t off,
+                              size_t charSize,
+                              void** out)
+{
+    *out = NULL;
+    if (!off)
+        return true;
+    if (off % sizeof (uint32_t) || off > size - sizeof (uint32_t))
+        return false;
+    uint32_t len = *(const uint32_t*) (base + off);
+    const uint8_t* str = base + off + sizeof (uint32_t);
+    size_t avail = size - off - sizeof (uint32_t);
+    if (len % charSize || avail < charSize || len > avail - charSize)
+        return false;
+    for (size_t i = 0; i < charSize; ++i)
+    {
+        if (str[len + i])
+            return false;
+    }
+    *out = malloc_s (len + charSize);
+    if (!*out)
+        return false;
+    memcpy (*out, str, len + charSize);
+    return true;
+}
+
+// Copies a UTF-32 string out of a mapped cache into a string reference
+static bool confCacheCopyStr32 (const uint8_t* base,
+                                uint32_t size,
+                                uint32_t off,
+                                StringRef32_t** out)
+{
+    void* str = NULL;
+    *out = NULL;
+    if (!confCacheCopyStr (base, size, off, sizeof (char32_t), &str))
+        return false;
+    if (str)
+        *out = StrRefCreate (str);
+    return true;
+}
+
+// Copies a host encoded string out of a mapped cache into a string reference
+static bool confCacheCopyHostStr (const uint8_t* base,
+                                  uint32_t size,
+                                  uint32_t off,
+                                  StringRef_t** out)
+{
+    void* str = NULL;
+    *out = NULL;
+    if (!confCacheCopyStr (base, size, off, sizeof (char), &str))
+        return false;
+    if (str)
+        *out = StrRefCreate (str);
+    return true;
+}
+
+// Turns a mapped cache into a package. Returns NULL if the cache is corrupt
+static NnpkgPackage_t* confCacheMakePkg (const uint8_t* base, uint32_t size)
+{
+    const confCacheHdr_t* hdr = (const confCacheHdr_t*) base;
+    if (hdr->recOff > size - sizeof (confCachePkg_t))
+        return NULL;
+    const confCachePkg_t* cachePkg = (const confCachePkg_t*) (base + hdr->recOff);
+    size_t depsOff = hdr->recOff + sizeof (confCachePkg_t);
+    // Packages with too many dependencies are left to the parser to report
+    if (cachePkg->numDeps > (size - depsOff) / sizeof (confCacheDep_t) ||
+        cachePkg->numDeps > NNPKG_MAX_DEPS ||
+        cachePkg->type > NNPKG_PKG_TYPE_PACKAGE)
+    {
+        return NULL;
+    }
+    const confCacheDep_t* cacheDeps = (const confCacheDep_t*) (base + depsOff);
+    NnpkgPackage_t* pkg = memCalloc (NNPKG_MEM_PKGCONF, sizeof (NnpkgPackage_t));
+    if (!pkg)
+        return NULL;
+    pkg->deps = ListCreate ("NnpkgPackage_t", true, offsetof (NnpkgPackage_t, obj));
+    ObjCreate ("NnpkgPackage_t", &pkg->obj);
+    ObjSetDestroy (&pkg->obj, pkgDestroy);
+    if (!pkg->deps)
+    {
+        ObjDestroy (&pkg->obj);
+        return NULL;
+    }
+    pkg->type = cachePkg->type;
+    pkg->isDependency = cachePkg->isDependency;
+    memcpy (pkg->version, cachePkg->version, sizeof (pkg->version));
+    if (!confCacheCopyStr32 (base, size, cachePkg->id, &pkg->id) || !pkg->id ||
+        !confCacheCopyStr32 (base, size, cachePkg->description, &pkg->description) ||
+        !confCacheCopyStr32 (base, size, cachePkg->prefix, &pkg->prefix))
+    {
+        ObjDestroy (&pkg->obj);
+        return NULL;
+    }
+    if (cachePkg->numDeps)
+    {
+        pkg->depRefs = memCalloc (NNPKG_MEM_PKGCONF,
+                                  cachePkg->numDeps * sizeof (NnpkgDepRef_t));
+        if (!pkg->depRefs)
+        {
+            ObjDestroy (&pkg->obj);
+            return NULL;
+        }
+    }
+    for (uint32_t i = 0; i < cachePkg->numDeps; ++i)
+    {
+        NnpkgDepRef_t* depRef = &pkg->depRefs[i];
+        if (cacheDeps[i].verOp > NNPKG_VER_GE ||
+            !confCacheCopyStr32 (base, size, cacheDeps[i].name, &depRef->name) ||
+            !depRef->name)
+        {
+            ObjDestroy (&pkg->obj);
+            return NULL;
+        }
+        depRef->verOp = cacheDeps[i].verOp;
+        memcpy (depRef->ver, cacheDeps[i].ver, sizeof (depRef->ver));
+        ++pkg->numDeps;
+    }
+    return pkg;
+}
+
+// Loads a package from the cache of a package configuration file
+// Returns NULL if there is no fresh cache, in which case the file must be parsed
+NnpkgPackage_t* confCacheLoad (const char* cacheDir, const char* file)
+{
+    uint32_t size = 0;
+    const uint8_t* base =
+        confCacheMap (cacheDir, file, "pkgc", CONFCACHE_MAGIC_PKG, &size);
+    if (!base)
+        return NULL;
+    NnpkgPackage_t* pkg = confCacheMakePkg (base, size);
+    munmap ((void*) base, size);
+    return pkg;
+}
+
+// Destroys the strings of a main configuration
+static void mainConfCacheDestroy (NnpkgMainConf_t* conf)
+{
+    if (conf->dbLoc.dbPath)
+        StrRefDestroy (conf->dbLoc.dbPath);
+    if (conf->dbLoc.strtabPath)
+        StrRefDestroy (conf->dbLoc.strtabPath);
+    if (conf->idxPath)
+        StrRefDestroy (conf->idxPath);
+    if (conf->cachePath)
+        StrRefDestroy (conf->cachePath);
+}
+
+// Loads the main configuration from the cache of a configuration file
+// Returns false if there is no fresh cache, in which case the file must be parsed
+bool mainConfCacheLoad (const char* cacheDir,
+                        const char* file,
+                        NnpkgMainConf_t* conf)
+{
+    uint32_t size = 0;
+    const uint8_t* base =
+        confCacheMap (cacheDir, file, "mainc", CONFCACHE_MAGIC_MAIN, &size);
+    if (!base)
+        return false;
+    const confCacheHdr_t* hdr = (const confCacheHdr_t*) base;
+    NnpkgMainConf_t newConf = {0};
+    bool res = false;
+    if (hdr->recOff <= size - sizeof (confCacheMain_t))
+    {
+        const confCacheMain_t* rec = (const confCacheMain_t*) (base + hdr->recOff);
+        res = confCacheCopyHostStr (base,
+                                    size,
+                                    rec->dbPath,
+                                    &newConf.dbLoc.dbPath) &&
+              confCacheCopyHostStr (base,
+                                    size,
+                                    rec->strtabPath,
+                                    &newConf.dbLoc.strtabPath) &&
+              confCacheCopyStr32 (base, size, rec->idxPath, &newConf.idxPath) &&
+              confCacheCopyHostStr (base, size, rec->cachePath, &newConf.cachePath);
+        newConf.stagedIdx = (rec->flags & CONFCACHE_MAIN_STAGED_IDX) != 0;
+        newConf.lockTimeout = rec->lockTimeout;
+    }
+    munmap ((void*) base, size);
+    // Caches are only written for valid configurations, but make sure nothing
+    // required is missing anyway
+    if (!res || !newConf.dbLoc.dbPath || !newConf.dbLoc.strtabPath ||
+        !newConf.idxPath)
+    {
+        mainConfCacheDestroy (&newConf);
+        return false;
+    }
+    *conf = newConf;
+    return true;
+}
+
+// Reserves space in a cache, and gets its offset
+static bool confCacheReserve (confCacheBuf_t* buf, size_t len, uint32_t* offOut)
+{
+    // Keep everything 32 bit aligned
+    size_t off = (buf->size + sizeof (uint32_t) - 1) & ~(sizeof (uint32_t) - 1);
+    if (off + len > UINT32_MAX)
+        return false;
+    if (off + len > buf->max)
+    {
+        size_t newMax = buf->max ? buf->max : 512;
+        while (newMax < off + len)
+            newMax *= 2;
+        uint8_t* data = memRealloc (NNPKG_MEM_PKGCONF, buf->data, newMax);
+        if (!data)
+            return false;
+        buf->data = data;
+        buf->max = newMax;
+    }
+    memset (buf->data + buf->size, 0, off + len - buf->size);
+    buf->size = off + len;
+    *offOut = (uint32_t) off;
+    return true;
+}
+
+// Adds a string of len bytes to a cache. Returns its offset, or 0 on failure
+static uint32_t confCacheAddStr (confCacheBuf_t* buf,
+                                 const void* str,
+                                 size_t len,
+                                 size_t charSize)
+{
+    uint32_t off = 0;
+    if (len > UINT32_MAX ||
+        !confCacheReserve (buf, sizeof (uint32_t) + len + charSize, &off))
+    {
+        return 0;
+    }
+    uint32_t len32 = (uint32_t) len;
+    memcpy (buf->data + off, &len32, sizeof (uint32_t));
+    // Terminator was zeroed when space was reserved
+    memcpy (buf->data + off + sizeof (uint32_t), str, len);
+    return off;
+}
+
+// Adds a UTF-32 string to a cache. Returns its offset, or 0 on failure
+static uint32_t confCacheAddStr32 (confCacheBuf_t* buf, StringRef32_t* str)
+{
+    return confCacheAddStr (buf,
+                            StrRefGet (str),
+                            c32len (StrRefGet (str)) * sizeof (char32_t),
+                            sizeof (char32_t));
+}
+
+// Adds a host encoded string to a cache. Returns its offset, or 0 on failure
+static uint32_t confCacheAddHostStr (confCacheBuf_t* buf, StringRef_t* str)
+{
+    const char* s = StrRefGet (str);
+    return confCacheAddStr (buf, s, strlen (s), sizeof (char));
+}
+
+// Starts building a cache of a source file, with a record of recSize bytes
+static bool confCacheStart (confCacheBuf_t* buf,
+                            const char* srcPath,
+                            const struct stat* srcSt,
+                            uint32_t magic,
+                            size_t recSize)
+{
+    size_t pathLen = strlen (srcPath);
+    uint32_t hdrOff = 0, recOff = 0;
+    if (pathLen > UINT16_MAX ||
+        !confCacheReserve (buf, sizeof (confCacheHdr_t) + pathLen, &hdrOff))
+    {
+        return false;
+    }
+    memcpy (buf->data + sizeof (confCacheHdr_t), srcPath, pathLen);
+    if (!confCacheReserve (buf, recSize, &recOff))
+        return false;
+    confCacheHdr_t* hdr = (confCacheHdr_t*) buf->data;
+    confCacheSetKey (hdr, srcSt);
+    hdr->magic = magic;
+    hdr->version = CONFCACHE_VERSION;
+    hdr->pathLen = (uint16_t) pathLen;
+    hdr->recOff = recOff;
+    return true;
+}
+
+// Builds the cache of a package
+static bool confCacheBuildPkg (confCacheBuf_t* buf,
+                               const char* srcPath,
+                               const struct stat* srcSt,
+                               NnpkgPackage_t* pkg)
+{
+    if (!confCacheStart (buf,
+                         srcPath,
+                         srcSt,
+                         CONFCACHE_MAGIC_PKG,
+                         sizeof (confCachePkg_t) +
+                             (pkg->numDeps * sizeof (confCacheDep_t))))
+    {
+        return false;
+    }
+    uint32_t recOff = ((confCacheHdr_t*) buf->data)->recOff;
+    // Add the strings first, as adding them may move the buffer
+    uint32_t strs[3] = {0};
+    StringRef32_t* pkgStrs[3] = {pkg->id, pkg->description, pkg->prefix};
+    for (int i = 0; i < 3; ++i)
+    {
+        if (pkgStrs[i] && !(strs[i] = confCacheAddStr32 (buf, pkgStrs[i])))
+            return false;
+    }
+    for (size_t i = 0; i < pkg->numDeps; ++i)
+    {
+        uint32_t nameOff = confCacheAddStr32 (buf, pkg->depRefs[i].name);
+        if (!nameOff)
+            return false;
+        confCacheDep_t* dep = (confCacheDep_t*) (buf->data + recOff +
+                                                 sizeof (confCachePkg_t)) +
+                              i;
+        dep->name = nameOff;
+        dep->verOp = pkg->depRefs[i].verOp;
+        memcpy (dep->ver, pkg->depRefs[i].ver, sizeof (dep->ver));
+    }
+    confCachePkg_t* cachePkg = (confCachePkg_t*) (buf->data + recOff);
+    cachePkg->id = strs[0];
+    cachePkg->description = strs[1];
+    cachePkg->prefix = strs[2];
+    cachePkg->numDeps = (uint32_t) pkg->numDeps;
+    cachePkg->type = pkg->type;
+    cachePkg->isDependency = pkg->isDependency;
+    memcpy (cachePkg->version, pkg->version, sizeof (cachePkg->version));
+    return true;
+}
+
+// Builds the cache of a main configuration
+static bool confCacheBuildMain (confCacheBuf_t* buf,
+                                const char* srcPath,
+                                const struct stat* srcSt,
+                                NnpkgMainConf_t* conf)
+{
+    if (!confCacheStart (buf,
+                         srcPath,
+                         srcSt,
+                         CONFCACHE_MAGIC_MAIN,
+                         sizeof (confCacheMain_t)))
+    {
+        return false;
+    }
+    uint32_t dbPath = confCacheAddHostStr (buf, conf->dbLoc.dbPath);
+    uint32_t strtabPath = confCacheAddHostStr (buf, conf->dbLoc.strtabPath);
+    uint32_t idxPath = confCacheAddStr32 (buf, conf->idxPath);
+    uint32_t cachePath = 0;
+    if (conf->cachePath)
+    {
+        cachePath = confCacheAddHostStr (buf, conf->cachePath);
+        if (!cachePath)
+            return false;
+    }
+    if (!dbPath || !strtabPath || !idxPath)
+        return false;
+    uint32_t recOff = ((confCacheHdr_t*) buf->data)->recOff;
+    confCacheMain_t* rec = (confCacheMain_t*) (buf->data + recOff);
+    rec->dbPath = dbPath;
+    rec->strtabPath = strtabPath;
+    rec->idxPath = idxPath;
+    rec->cachePath = cachePath;
+    rec->flags = conf->stagedIdx ? CONFCACHE_MAIN_STAGED_IDX : 0;
+    rec->lockTimeout = conf->lockTimeout;
+    return true;
+}
+
+// Writes out a built cache of a source file
+static void confCacheWrite (const char* cacheDir,
+                            const char* srcPath,
+                            const char* ext,
+                            confCacheBuf_t* buf)
+{
+    char cachePath[PATH_MAX];
+    char tmpPath[PATH_MAX];
+    if (!confCacheGetPath (cacheDir, srcPath, ext, cachePath, sizeof (cachePath)))
+        return;
+    int len = snprintf (tmpPath, sizeof (tmpPath), "%s.XXXXXX", cachePath);
+    if (len < 0 || (size_t) len >= sizeof (tmpPath))
+        return;
+    ((confCacheHdr_t*) buf->data)->size = (uint32_t) buf->size;
+    // Write to a temporary file and move it into place, so that readers never see
+    // a partially written cache
+    int fd = mkstemp (tmpPath);
+    if (fd == -1 && errno == ENOENT && mkdir (cacheDir, 0755) != -1)
+        fd = mkstemp (tmpPath);
+    if (fd == -1)
+        return;
+    fchmod (fd, 0644);
+    bool res = write (fd, buf->data, buf->size) == (ssize_t) buf->size;
+    close (fd);
+    if (!res || rename (tmpPath, cachePath) == -1)
+        unlink (tmpPath);
+}
+
+// Writes the cache of a package read from file. srcSt is the status of file from
+// before it was read, so that a change made while reading makes the cache stale.
+// Caching is best effort, so failures are ignored
+void confCacheStore (const char* cacheDir,
+                     const char* file,
+                     const struct stat* srcSt,
+                     NnpkgPackage_t* pkg)
+{
+    char srcPath[PATH_MAX];
+    if (!realpath (file, srcPath))
+        return;
+    confCacheBuf_t buf = {0};
+    if (confCacheBuildPkg (&buf, srcPath, srcSt, pkg))
+        confCacheWrite (cacheDir, srcPath, "pkgc", &buf);
+    memFree (buf.data);
+}
+
+// Writes the cache of a main configuration read from file. As with confCacheStore,
+// srcSt is from before file was read, and failures are ignored
+void mainConfCacheStore (const char* cacheDir,
+                         const char* file,
+                         const struct stat* srcSt,
+                         NnpkgMainConf_t* conf)
+{
+    char srcPath[PATH_MAX];
+    if (!realpath (file, srcPath))
+        return;
+    confCacheBuf_t buf = {0};
+    if (confCacheBuildMain (&buf, srcPath, srcSt, conf))
+        confCacheWrite (cacheDir, srcPath, "mainc", &buf);
+    memFree (buf.data);
+}
@@ -0,0 +1,259 @@
+/*
+    daemon.c - contains nnpkgd protocol functions
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file daemon.c
+
+#include <errno.h>
+#include <libnex/safemalloc.h>
+#include <nnpkg/daemon.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Magic number of messages
+#define NNPKGD_MAGIC 0x6E6E706B
+
+// Header of a message. It is followed by the strings of the message, each ended by
+// a NUL
+typedef struct _daemonhdr
+{
+    uint32_t magic;       ///< NNPKGD_MAGIC
+    uint16_t version;     ///< NNPKGD_VERSION
+    uint16_t type;        ///< Type of message
+    int32_t error;        ///< Error code of a reply
+    int32_t sysErrno;     ///< Saved errno of a reply
+    uint32_t numStrs;     ///< Number of strings in body
+    uint32_t size;        ///< Size of body
+} daemonHdr_t;
+
+NNPKG_PUBLIC const char* DaemonGetSocketPath()
+{
+    const char* path = getenv ("NNPKG_SOCKET");
+    if (path)
+        return path;
+    return NNPKG_SOCKET_PATH;
+}
+
+// Fills in the address of a socket path
+static bool daemonGetAddr (const char* path, struct sockaddr_un* addr)
+{
+    size_t len = strlen (path);
+    if (len >= sizeof (addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    memset (addr, 0, sizeof (struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    memcpy (addr->sun_path, path, len + 1);
+    return true;
+}
+
+NNPKG_PUBLIC int DaemonConnect (const char* path)
+{
+    struct sockaddr_un addr;
+    if (!*path || !daemonGetAddr (path, &addr))
+        return -1;
+    int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    if (connect (fd, (struct sockaddr*) &addr, sizeof (addr)) == -1)
+    {
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+NNPKG_PUBLIC int DaemonListen (const char* path)
+{
+    struct sockaddr_un addr;
+    if (!daemonGetAddr (path, &addr))
+        return -1;
+    // Only take over the socket if nobody answers on it
+    int oldFd = DaemonConnect (path);
+    if (oldFd != -1)
+    {
+        close (oldFd);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink (path);
+    int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    // Clients can't connect until listen is called, so the socket is never open to
+    // others
+    if (bind (fd, (struct sockaddr*) &addr, sizeof (addr)) == -1 ||
+        chmod (path, S_IRUSR | S_IWUSR) == -1 || listen (fd, SOMAXCONN) == -1)
+    {
+        int err = errno;
+        close (fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// Writes all of buf to a socket
+static bool daemonWrite (int fd, const void* buf, size_t size)
+{
+    const uint8_t* p = buf;
+    while (size)
+    {
+        ssize_t written = send (fd, p, size, MSG_NOSIGNAL);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Reads all of buf from a socket
+static bool daemonRead (int fd, void* buf, size_t size)
+{
+    uint8_t* p = buf;
+    while (size)
+    {
+        ssize_t bytesRead = recv (fd, p, size, 0);
+        if (bytesRead == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        // Other end hung up partway
+        if (!bytesRead)
+        {
+            errno = ECONNRESET;
+            return false;
+        }
+        p += bytesRead;
+        size -= bytesRead;
+    }
+    return true;
+}
+
+NNPKG_PUBLIC bool DaemonSend (int fd,
+                              int type,
+                              int error,
+                              int sysErrno,
+                              const char** strs,
+                              size_t numStrs)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < numStrs; ++i)
+        size += strlen (strs[i]) + 1;
+    if (size > NNPKGD_MAX_BODY)
+    {
+        errno = EMSGSIZE;
+        return false;
+    }
+    // Messages go out in one write, so that they aren't split into several packets
+    uint8_t* buf = malloc_s (sizeof (daemonHdr_t) + size);
+    if (!buf)
+        return false;
+    daemonHdr_t* hdr = (daemonHdr_t*) buf;
+    hdr->magic = NNPKGD_MAGIC;
+    hdr->version = NNPKGD_VERSION;
+    hdr->type = type;
+    hdr->error = error;
+    hdr->sysErrno = sysErrno;
+    hdr->numStrs = numStrs;
+    hdr->size = size;
+    uint8_t* p = buf + sizeof (daemonHdr_t);
+    for (size_t i = 0; i < numStrs; ++i)
+    {
+        size_t len = strlen (strs[i]) + 1;
+        memcpy (p, strs[i], len);
+        p += len;
+    }
+    bool res = daemonWrite (fd, buf, sizeof (daemonHdr_t) + size);
+    free (buf);
+    return res;
+}
+
+NNPKG_PUBLIC bool DaemonRecv (int fd, NnpkgDaemonMsg_t* msg)
+{
+    memset (msg, 0, sizeof (NnpkgDaemonMsg_t));
+    daemonHdr_t hdr;
+    if (!daemonRead (fd, &hdr, sizeof (daemonHdr_t)))
+        return false;
+    if (hdr.magic != NNPKGD_MAGIC || hdr.version != NNPKGD_VERSION ||
+        hdr.size > NNPKGD_MAX_BODY || hdr.numStrs > hdr.size)
+    {
+        errno = EPROTO;
+        return false;
+    }
+    msg->type = hdr.type;
+    msg->error = hdr.error;
+    msg->sysErrno = hdr.sysErrno;
+    msg->numStrs = hdr.numStrs;
+    msg->body = malloc_s (hdr.size + 1);
+    msg->strs = malloc_s ((hdr.numStrs + 1) * sizeof (const char*));
+    if (!msg->body || !msg->strs)
+    {
+        DaemonMsgFree (msg);
+        errno = ENOMEM;
+        return false;
+    }
+    if (!daemonRead (fd, msg->body, hdr.size))
+    {
+        DaemonMsgFree (msg);
+        return false;
+    }
+    // Split body into strings, making sure they are all there
+    char* p = msg->body;
+    char* end = msg->body + hdr.size;
+    for (size_t i = 0; i < hdr.numStrs; ++i)
+    {
+        char* nul = memchr (p, 0, end - p);
+        if (!nul)
+        {
+            DaemonMsgFree (msg);
+            errno = EPROTO;
+            return false;
+        }
+        msg->strs[i] = p;
+        p = nul + 1;
+    }
+    if (p != end)
+    {
+        DaemonMsgFree (msg);
+        errno = EPROTO;
+        return false;
+    }
+    return true;
+}
+
+NNPKG_PUBLIC void DaemonMsgFree (NnpkgDaemonMsg_t* msg)
+{
+    free (msg->body);
+    free (msg->strs);
+    msg->body = NULL;
+    msg->strs = NULL;
+    msg->numStrs = 0;
+}
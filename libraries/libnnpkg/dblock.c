@@ -0,0 +1,266 @@
+/*
+    dblock.c - contains database lock queue
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file dblock.c
+
+// Processes wanting a database take turns through a lock file beside it. The
+// file holds the next ticket to hand out and the ticket that last got a turn, and
+// every ticket owns one byte of the file past that, which its owner keeps locked
+// until it is done. A waiter locks the byte of the ticket before its own, which
+// it gets once that ticket is done, so turns go in the order tickets were taken.
+// Tickets that were given up leave their bytes unlocked, so waiters keep going
+// back until they reach the ticket that last had a turn. Locks are open file
+// description locks, so that they are released if their owner dies, and so that
+// handles in one process queue against each other too
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libnex/safemalloc.h>
+#include <nnpkg/propdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+// Deadline of waits that never give up
+#define DBLOCK_FOREVER UINT64_MAX
+
+// Layout of lock file
+#define DBLOCK_NEXT_OFF  0     // Next ticket to hand out
+#define DBLOCK_LAST_OFF  8     // Ticket that last got a turn
+#define DBLOCK_HDR_SIZE  16    // Size of counters
+#define DBLOCK_SLOTS_OFF 16    // Byte of ticket 0
+
+// Bounds of sleeps between tries of waits that can time out, in nanoseconds
+#define DBLOCK_MIN_SLEEP 100000
+#define DBLOCK_MAX_SLEEP 10000000
+
+uint64_t dbLockNow()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+uint64_t dbLockDeadline (int timeout)
+{
+    if (timeout < 0)
+        return DBLOCK_FOREVER;
+    return dbLockNow() + ((uint64_t) timeout * 1000000);
+}
+
+// Sleeps before trying a lock again, backing off each time. Returns false with
+// errno set to ETIMEDOUT once the deadline has passed
+static bool dbLockSleep (uint64_t deadline, uint64_t* delay)
+{
+    uint64_t now = dbLockNow();
+    if (now >= deadline)
+    {
+        errno = ETIMEDOUT;
+        return false;
+    }
+    uint64_t sleepTime = *delay;
+    if (sleepTime > deadline - now)
+        sleepTime = deadline - now;
+    struct timespec ts = {sleepTime / 1000000000, sleepTime % 1000000000};
+    nanosleep (&ts, NULL);
+    *delay *= 2;
+    if (*delay > DBLOCK_MAX_SLEEP)
+        *delay = DBLOCK_MAX_SLEEP;
+    return true;
+}
+
+bool dbLockFile (int fd, int op, uint64_t deadline)
+{
+    if (deadline == DBLOCK_FOREVER)
+    {
+        while (flock (fd, op) == -1)
+        {
+            if (errno != EINTR)
+                return false;
+        }
+        return true;
+    }
+    uint64_t delay = DBLOCK_MIN_SLEEP;
+    while (flock (fd, op | LOCK_NB) == -1)
+    {
+        if (errno != EWOULDBLOCK && errno != EINTR)
+            return false;
+        if (!dbLockSleep (deadline, &delay))
+            return false;
+    }
+    return true;
+}
+
+int dbLockOpen (const char* dbPath)
+{
+    size_t len = strlen (dbPath);
+    char* lockPath = malloc_s (len + 6);
+    if (!lockPath)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    snprintf (lockPath, len + 6, "%s.lock", dbPath);
+    int fd = open (lockPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    free (lockPath);
+    return fd;
+}
+
+#ifdef F_OFD_SETLK
+
+// Locks or unlocks bytes of the lock file, waiting until deadline at most
+static bool dbLockRange (int fd,
+                         short type,
+                         off_t start,
+                         off_t len,
+                         uint64_t deadline)
+{
+    struct flock fl = {0};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    if (deadline == DBLOCK_FOREVER)
+    {
+        while (fcntl (fd, F_OFD_SETLKW, &fl) == -1)
+        {
+            if (errno != EINTR)
+                return false;
+        }
+        return true;
+    }
+    uint64_t delay = DBLOCK_MIN_SLEEP;
+    while (fcntl (fd, F_OFD_SETLK, &fl) == -1)
+    {
+        if (errno != EAGAIN && errno != EACCES && errno != EINTR)
+            return false;
+        if (!dbLockSleep (deadline, &delay))
+            return false;
+    }
+    return true;
+}
+
+// Reads the counters of the lock file. Counters that were never written read as
+// zeroes
+static bool dbLockReadHdr (int fd, uint64_t* hdr)
+{
+    memset (hdr, 0, DBLOCK_HDR_SIZE);
+    return pread (fd, hdr, DBLOCK_HDR_SIZE, 0) != -1;
+}
+
+void dbLockGive (int fd, uint64_t ticket)
+{
+    dbLockRange (fd, F_UNLCK, DBLOCK_SLOTS_OFF + ticket, 1, DBLOCK_FOREVER);
+}
+
+bool dbLockTake (int fd, uint64_t deadline, uint64_t* ticket)
+{
+    uint64_t hdr[2];
+    // Take a ticket, and lock its byte before anybody can queue behind it. The
+    // counters are only ever locked for a moment, so they are waited on however
+    // long it takes, and only the wait for a turn can time out
+    if (!dbLockRange (fd, F_WRLCK, 0, DBLOCK_HDR_SIZE, DBLOCK_FOREVER))
+        return false;
+    if (!dbLockReadHdr (fd, hdr))
+    {
+        int err = errno;
+        dbLockRange (fd, F_UNLCK, 0, DBLOCK_HDR_SIZE, DBLOCK_FOREVER);
+        errno = err;
+        return false;
+    }
+    uint64_t myTicket = hdr[0]++;
+    struct flock fl = {0};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = DBLOCK_SLOTS_OFF + myTicket;
+    fl.l_len = 1;
+    ssize_t written = pwrite (fd, &hdr[0], sizeof (uint64_t), DBLOCK_NEXT_OFF);
+    if (written != sizeof (uint64_t) || fcntl (fd, F_OFD_SETLK, &fl) == -1)
+    {
+        int err = (written == -1 || written == sizeof (uint64_t)) ? errno : EIO;
+        dbLockRange (fd, F_UNLCK, 0, DBLOCK_HDR_SIZE, DBLOCK_FOREVER);
+        errno = err;
+        return false;
+    }
+    dbLockRange (fd, F_UNLCK, 0, DBLOCK_HDR_SIZE, DBLOCK_FOREVER);
+    // Wait for tickets before ours
+    for (uint64_t cur = myTicket; cur > 0; --cur)
+    {
+        off_t prevSlot = DBLOCK_SLOTS_OFF + cur - 1;
+        if (!dbLockRange (fd, F_WRLCK, prevSlot, 1, deadline))
+        {
+            int err = errno;
+            dbLockGive (fd, myTicket);
+            errno = err;
+            return false;
+        }
+        dbLockRange (fd, F_UNLCK, prevSlot, 1, DBLOCK_FOREVER);
+        // Stop once the ticket that last had a turn is done
+        bool gotHdr =
+            dbLockRange (fd, F_RDLCK, 0, DBLOCK_HDR_SIZE, DBLOCK_FOREVER) &&
+            dbLockReadHdr (fd, hdr);
+        int err = errno;
+        dbLockRange (fd, F_UNLCK, 0, DBLOCK_HDR_SIZE, DBLOCK_FOREVER);
+        if (!gotHdr)
+        {
+            dbLockGive (fd, myTicket);
+            errno = err;
+            return false;
+        }
+        if (cur - 1 <= hdr[1])
+            break;
+    }
+    // It's our turn. Record that, so that later waiters don't go back past us
+    if (!dbLockRange (fd, F_WRLCK, 0, DBLOCK_HDR_SIZE, DBLOCK_FOREVER))
+    {
+        int err = errno;
+        dbLockGive (fd, myTicket);
+        errno = err;
+        return false;
+    }
+    written = pwrite (fd, &myTicket, sizeof (uint64_t), DBLOCK_LAST_OFF);
+    int err = (written == -1) ? errno : EIO;
+    dbLockRange (fd, F_UNLCK, 0, DBLOCK_HDR_SIZE, DBLOCK_FOREVER);
+    if (written != sizeof (uint64_t))
+    {
+        dbLockGive (fd, myTicket);
+        errno = err;
+        return false;
+    }
+    *ticket = myTicket;
+    return true;
+}
+
+#else
+
+// Without open file description locks, turns aren't queued, and it is up to flock
+// who gets the database next
+
+bool dbLockTake (int fd, uint64_t deadline, uint64_t* ticket)
+{
+    *ticket = 0;
+    return true;
+}
+
+void dbLockGive (int fd, uint64_t ticket)
+{
+}
+
+#endif
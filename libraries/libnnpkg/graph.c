@@ -0,0 +1,690 @@
+/*
+    graph.c - contains dependency graph
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file graph.c
+
+#include <assert.h>
+#include <libnex/safemalloc.h>
+#include <nnpkg/graph.h>
+#include <string.h>
+
+uint32_t propDbGetNumSlots (NnpkgPropDb_t* db);
+
+const void* propDbPeekSlot (NnpkgPropDb_t* db,
+                            uint32_t slot,
+                            unsigned short* type,
+                            uint32_t* id,
+                            uint16_t* gen);
+
+int pkgDbPeekDeps (NnpkgPropDb_t* db,
+                   const void* data,
+                   NnpkgDepRef_t* deps,
+                   bool* isDependency);
+
+// State needed while building a graph only
+typedef struct _graphbuild
+{
+    uint16_t* gens;         ///< Generation of each node's slot
+    uint16_t* edgeGens;     ///< Generation each edge expects its target to have
+    uint32_t* edgeNames;    ///< String table index of each edge's target's name
+    uint32_t maxEdges;      ///< Size of edge arrays
+    uint32_t* nameMap;      ///< Map from name to node, built when first needed
+    size_t nameMapSz;       ///< Number of buckets in name map
+} graphBuild_t;
+
+// Hashes a name
+static inline size_t graphHashName (const char32_t* name)
+{
+    size_t hash = 0xCBF29CE484222325ULL;
+    while (*name)
+    {
+        hash ^= *name++;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Builds map from names to nodes
+static bool graphBuildNameMap (NnpkgGraph_t* graph, graphBuild_t* build)
+{
+    build->nameMapSz = 64;
+    while (build->nameMapSz < (size_t) graph->numNodes * 2)
+        build->nameMapSz *= 2;
+    build->nameMap = malloc_s (build->nameMapSz * sizeof (uint32_t));
+    if (!build->nameMap)
+        return false;
+    memset (build->nameMap, 0xFF, build->nameMapSz * sizeof (uint32_t));
+    for (uint32_t i = 0; i < graph->numNodes; ++i)
+    {
+        if (!(graph->flags[i] & NNPKG_GRAPH_NODE_VALID))
+            continue;
+        size_t bucket =
+            graphHashName (PkgGraphGetName (graph, i)) & (build->nameMapSz - 1);
+        while (build->nameMap[bucket] != NNPKG_GRAPH_NO_NODE)
+            bucket = (bucket + 1) & (build->nameMapSz - 1);
+        build->nameMap[bucket] = i;
+    }
+    return true;
+}
+
+// Finds node by name in name map
+static uint32_t graphMapFind (NnpkgGraph_t* graph,
+                              graphBuild_t* build,
+                              const char32_t* name)
+{
+    size_t bucket = graphHashName (name) & (build->nameMapSz - 1);
+    while (build->nameMap[bucket] != NNPKG_GRAPH_NO_NODE)
+    {
+        uint32_t node = build->nameMap[bucket];
+        if (!c32cmp (PkgGraphGetName (graph, node), name))
+            return node;
+        bucket = (bucket + 1) & (build->nameMapSz - 1);
+    }
+    return NNPKG_GRAPH_NO_NODE;
+}
+
+// Makes room for count more edges
+static bool graphGrowEdges (NnpkgGraph_t* graph, graphBuild_t* build, uint32_t count)
+{
+    if (graph->numEdges + count <= build->maxEdges)
+        return true;
+    uint32_t newMax = build->maxEdges ? build->maxEdges * 2 : 16;
+    while (newMax < graph->numEdges + count)
+        newMax *= 2;
+    uint32_t* edges = realloc_s (graph->edges, newMax * sizeof (uint32_t));
+    if (!edges)
+        return false;
+    graph->edges = edges;
+    uint16_t* edgeGens = realloc_s (build->edgeGens, newMax * sizeof (uint16_t));
+    if (!edgeGens)
+        return false;
+    build->edgeGens = edgeGens;
+    uint32_t* edgeNames = realloc_s (build->edgeNames, newMax * sizeof (uint32_t));
+    if (!edgeNames)
+        return false;
+    build->edgeNames = edgeNames;
+    build->maxEdges = newMax;
+    return true;
+}
+
+// Points edges at their targets, looking up targets by name when the slot reference
+// is stale. Edges to packages that don't exist are dropped
+static bool graphLinkEdges (NnpkgGraph_t* graph, graphBuild_t* build)
+{
+    uint32_t out = 0;
+    uint32_t begin = 0;
+    for (uint32_t i = 0; i < graph->numNodes; ++i)
+    {
+        uint32_t end = graph->offsets[i + 1];
+        graph->offsets[i] = out;
+        for (uint32_t j = begin; j < end; ++j)
+        {
+            uint32_t target = graph->edges[j];
+            if (target == NNPKG_GRAPH_NO_NODE ||
+                !(graph->flags[target] & NNPKG_GRAPH_NODE_VALID) ||
+                build->gens[target] != build->edgeGens[j])
+            {
+                if (!build->nameMap && !graphBuildNameMap (graph, build))
+                    return false;
+                const char32_t* name =
+                    PropDbGetString (graph->db, build->edgeNames[j]);
+                target = graphMapFind (graph, build, name);
+                if (target == NNPKG_GRAPH_NO_NODE)
+                    continue;
+            }
+            graph->edges[out++] = target;
+        }
+        begin = end;
+    }
+    graph->offsets[graph->numNodes] = out;
+    graph->numEdges = out;
+    return true;
+}
+
+NNPKG_PUBLIC NnpkgGraph_t* PkgGraphBuild (NnpkgTransCb_t* cb, NnpkgPropDb_t* db)
+{
+    NnpkgGraph_t* graph = calloc_s (sizeof (NnpkgGraph_t));
+    graphBuild_t build = {0};
+    if (!graph)
+        goto oom;
+    graph->db = db;
+    graph->numNodes = propDbGetNumSlots (db);
+    graph->offsets = malloc_s ((graph->numNodes + 1) * sizeof (uint32_t));
+    graph->names = calloc_s ((graph->numNodes + 1) * sizeof (uint32_t));
+    graph->flags = calloc_s (graph->numNodes + 1);
+    build.gens = malloc_s ((graph->numNodes + 1) * sizeof (uint16_t));
+    if (!graph->offsets || !graph->names || !graph->flags || !build.gens)
+        goto oom;
+    // Most packages have a few dependencies
+    if (!graphGrowEdges (graph, &build, graph->numNodes * 4))
+        goto oom;
+    // Collect nodes and raw edges in one pass over the records
+    for (uint32_t i = 0; i < graph->numNodes; ++i)
+    {
+        graph->offsets[i] = graph->numEdges;
+        unsigned short type = 0;
+        uint32_t id = 0;
+        const void* data = propDbPeekSlot (db, i + 1, &type, &id, &build.gens[i]);
+        if (!data || type != NNPKG_PROP_TYPE_PKG)
+            continue;
+        NnpkgDepRef_t deps[NNPKG_MAX_DEPS];
+        bool isDependency = false;
+        int numDeps = pkgDbPeekDeps (db, data, deps, &isDependency);
+        graph->names[i] = id;
+        graph->flags[i] = NNPKG_GRAPH_NODE_VALID;
+        if (isDependency)
+            graph->flags[i] |= NNPKG_GRAPH_NODE_IS_DEP;
+        if (!graphGrowEdges (graph, &build, numDeps))
+            goto oom;
+        for (int j = 0; j < numDeps; ++j)
+        {
+            uint32_t slot = deps[j].slot;
+            graph->edges[graph->numEdges] =
+                (slot && slot <= graph->numNodes) ? slot - 1 : NNPKG_GRAPH_NO_NODE;
+            build.edgeGens[graph->numEdges] = deps[j].gen;
+            build.edgeNames[graph->numEdges] = deps[j].nameIdx;
+            ++graph->numEdges;
+        }
+    }
+    graph->offsets[graph->numNodes] = graph->numEdges;
+    if (!graphLinkEdges (graph, &build))
+        goto oom;
+    free (build.gens);
+    free (build.edgeGens);
+    free (build.edgeNames);
+    free (build.nameMap);
+    return graph;
+oom:
+    free (build.gens);
+    free (build.edgeGens);
+    free (build.edgeNames);
+    free (build.nameMap);
+    if (graph)
+        PkgGraphDestroy (graph);
+    cb->error = NNPKG_ERR_OOM;
+    TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+    return NULL;
+}
+
+NNPKG_PUBLIC void PkgGraphDestroy (NnpkgGraph_t* graph)
+{
+    free (graph->offsets);
+    free (graph->edges);
+    free (graph->names);
+    free (graph->flags);
+    free (graph);
+}
+
+NNPKG_PUBLIC uint32_t PkgGraphFindNode (NnpkgGraph_t* graph, const char32_t* name)
+{
+    for (uint32_t i = 0; i < graph->numNodes; ++i)
+    {
+        if ((graph->flags[i] & NNPKG_GRAPH_NODE_VALID) &&
+            !c32cmp (PkgGraphGetName (graph, i), name))
+        {
+            return i;
+        }
+    }
+    return NNPKG_GRAPH_NO_NODE;
+}
+
+NNPKG_PUBLIC const char32_t* PkgGraphGetName (NnpkgGraph_t* graph, uint32_t node)
+{
+    assert (graph->flags[node] & NNPKG_GRAPH_NODE_VALID);
+    return PropDbGetString (graph->db, graph->names[node]);
+}
+
+NNPKG_PUBLIC ssize_t PkgGraphBfs (NnpkgTransCb_t* cb,
+                                  NnpkgGraph_t* graph,
+                                  uint32_t start,
+                                  NnpkgGraphVisit_t visit,
+                                  void* data)
+{
+    assert (start < graph->numNodes);
+    uint8_t* visited = calloc_s (graph->numNodes);
+    uint32_t* queue = malloc_s (graph->numNodes * sizeof (uint32_t));
+    if (!visited || !queue)
+    {
+        free (visited);
+        free (queue);
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return -1;
+    }
+    uint32_t head = 0, tail = 0;
+    queue[tail++] = start;
+    visited[start] = 1;
+    while (head < tail)
+    {
+        uint32_t node = queue[head++];
+        if (visit && !visit (graph, node, data))
+            break;
+        for (uint32_t i = graph->offsets[node]; i < graph->offsets[node + 1]; ++i)
+        {
+            uint32_t dep = graph->edges[i];
+            if (!visited[dep])
+            {
+                visited[dep] = 1;
+                queue[tail++] = dep;
+            }
+        }
+    }
+    free (visited);
+    free (queue);
+    return head;
+}
+
+NNPKG_PUBLIC ssize_t PkgGraphDfs (NnpkgTransCb_t* cb,
+                                  NnpkgGraph_t* graph,
+                                  uint32_t start,
+                                  NnpkgGraphVisit_t visit,
+                                  void* data)
+{
+    assert (start < graph->numNodes);
+    // A node can be pushed once per edge pointing to it, plus the start node
+    uint8_t* visited = calloc_s (graph->numNodes);
+    uint32_t* stack = malloc_s ((graph->numEdges + 1) * sizeof (uint32_t));
+    if (!visited || !stack)
+    {
+        free (visited);
+        free (stack);
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return -1;
+    }
+    ssize_t count = 0;
+    uint32_t top = 0;
+    stack[top++] = start;
+    while (top)
+    {
+        uint32_t node = stack[--top];
+        if (visited[node])
+            continue;
+        visited[node] = 1;
+        ++count;
+        if (visit && !visit (graph, node, data))
+            break;
+        // Push in reverse, so dependencies are visited in the order they're listed
+        for (uint32_t i = graph->offsets[node + 1]; i > graph->offsets[node]; --i)
+        {
+            if (!visited[graph->edges[i - 1]])
+                stack[top++] = graph->edges[i - 1];
+        }
+    }
+    free (visited);
+    free (stack);
+    return count;
+}
+
+NNPKG_PUBLIC bool PkgGraphFindSccs (NnpkgTransCb_t* cb,
+                                    NnpkgGraph_t* graph,
+                                    uint32_t* comps,
+                                    uint32_t* numComps)
+{
+    // This is Tarjan's algorithm, with the recursion turned into an explicit stack
+    // of nodes and the edge each of them is at
+    uint32_t numNodes = graph->numNodes;
+    uint32_t* index = malloc_s (numNodes * sizeof (uint32_t));
+    uint32_t* low = malloc_s (numNodes * sizeof (uint32_t));
+    uint32_t* stack = malloc_s (numNodes * sizeof (uint32_t));
+    uint32_t* callNodes = malloc_s (numNodes * sizeof (uint32_t));
+    uint32_t* callEdges = malloc_s (numNodes * sizeof (uint32_t));
+    uint8_t* onStack = calloc_s (numNodes);
+    bool ret = false;
+    if (numNodes &&
+        (!index || !low || !stack || !callNodes || !callEdges || !onStack))
+    {
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        goto out;
+    }
+    for (uint32_t i = 0; i < numNodes; ++i)
+    {
+        index[i] = NNPKG_GRAPH_NO_NODE;
+        comps[i] = NNPKG_GRAPH_NO_NODE;
+    }
+    uint32_t nextIndex = 0, stackTop = 0;
+    *numComps = 0;
+    for (uint32_t root = 0; root < numNodes; ++root)
+    {
+        if (!(graph->flags[root] & NNPKG_GRAPH_NODE_VALID) ||
+            index[root] != NNPKG_GRAPH_NO_NODE)
+        {
+            continue;
+        }
+        uint32_t depth = 0;
+        index[root] = low[root] = nextIndex++;
+        stack[stackTop++] = root;
+        onStack[root] = 1;
+        callNodes[depth] = root;
+        callEdges[depth++] = graph->offsets[root];
+        while (depth)
+        {
+            uint32_t node = callNodes[depth - 1];
+            uint32_t edge = callEdges[depth - 1];
+            if (edge < graph->offsets[node + 1])
+            {
+                ++callEdges[depth - 1];
+                uint32_t dep = graph->edges[edge];
+                if (index[dep] == NNPKG_GRAPH_NO_NODE)
+                {
+                    // Descend into dependency
+                    index[dep] = low[dep] = nextIndex++;
+                    stack[stackTop++] = dep;
+                    onStack[dep] = 1;
+                    callNodes[depth] = dep;
+                    callEdges[depth++] = graph->offsets[dep];
+                }
+                else if (onStack[dep] && index[dep] < low[node])
+                    low[node] = index[dep];
+                continue;
+            }
+            // All edges done. If node is the root of a component, pop it off
+            if (low[node] == index[node])
+            {
+                uint32_t member;
+                do
+                {
+                    member = stack[--stackTop];
+                    onStack[member] = 0;
+                    comps[member] = *numComps;
+                } while (member != node);
+                ++(*numComps);
+            }
+            --depth;
+            if (depth && low[node] < low[callNodes[depth - 1]])
+                low[callNodes[depth - 1]] = low[node];
+        }
+    }
+    ret = true;
+out:
+    free (index);
+    free (low);
+    free (stack);
+    free (callNodes);
+    free (callEdges);
+    free (onStack);
+    return ret;
+}
+
+NNPKG_PUBLIC bool PkgGraphWhy (NnpkgTransCb_t* cb,
+                               NnpkgGraph_t* graph,
+                               uint32_t node,
+                               uint32_t** path,
+                               size_t* pathLen)
+{
+    *path = NULL;
+    *pathLen = 0;
+    // Search from every explicitly installed package at once, so the first path
+    // found is the shortest
+    uint32_t* parents = malloc_s (graph->numNodes * sizeof (uint32_t));
+    uint32_t* queue = malloc_s (graph->numNodes * sizeof (uint32_t));
+    if (!parents || !queue)
+        goto oom;
+    uint32_t head = 0, tail = 0;
+    for (uint32_t i = 0; i < graph->numNodes; ++i)
+    {
+        parents[i] = NNPKG_GRAPH_NO_NODE;
+        if ((graph->flags[i] & NNPKG_GRAPH_NODE_VALID) &&
+            !(graph->flags[i] & NNPKG_GRAPH_NODE_IS_DEP))
+        {
+            // Sources are their own parent, to mark them as visited
+            parents[i] = i;
+            queue[tail++] = i;
+        }
+    }
+    while (head < tail && parents[node] == NNPKG_GRAPH_NO_NODE)
+    {
+        uint32_t cur = queue[head++];
+        for (uint32_t i = graph->offsets[cur]; i < graph->offsets[cur + 1]; ++i)
+        {
+            uint32_t dep = graph->edges[i];
+            if (parents[dep] == NNPKG_GRAPH_NO_NODE)
+            {
+                parents[dep] = cur;
+                queue[tail++] = dep;
+            }
+        }
+    }
+    if (parents[node] != NNPKG_GRAPH_NO_NODE)
+    {
+        // Walk back to source
+        size_t len = 1;
+        for (uint32_t cur = node; parents[cur] != cur; cur = parents[cur])
+            ++len;
+        *path = malloc_s (len * sizeof (uint32_t));
+        if (!*path)
+            goto oom;
+        *pathLen = len;
+        uint32_t cur = node;
+        for (size_t i = len; i > 0; --i)
+        {
+            (*path)[i - 1] = cur;
+            cur = parents[cur];
+        }
+    }
+    free (parents);
+    free (queue);
+    return true;
+oom:
+    free (parents);
+    free (queue);
+    cb->error = NNPKG_ERR_OOM;
+    TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+    return false;
+}
+
+NNPKG_PUBLIC bool PkgGraphFindOrphans (NnpkgTransCb_t* cb,
+                                       NnpkgGraph_t* graph,
+                                       uint32_t** orphans,
+                                       size_t* numOrphans)
+{
+    *orphans = NULL;
+    *numOrphans = 0;
+    // Mark everything reachable from an explicitly installed package. Each node is
+    // pushed at most once, so this is linear in the size of the graph
+    uint8_t* marks = calloc_s (graph->numNodes);
+    uint32_t* stack = malloc_s (graph->numNodes * sizeof (uint32_t));
+    if (!marks || !stack)
+        goto oom;
+    uint32_t top = 0;
+    for (uint32_t i = 0; i < graph->numNodes; ++i)
+    {
+        if ((graph->flags[i] & NNPKG_GRAPH_NODE_VALID) &&
+            !(graph->flags[i] & NNPKG_GRAPH_NODE_IS_DEP))
+        {
+            marks[i] = 1;
+            stack[top++] = i;
+        }
+    }
+    while (top)
+    {
+        uint32_t cur = stack[--top];
+        for (uint32_t i = graph->offsets[cur]; i < graph->offsets[cur + 1]; ++i)
+        {
+            uint32_t dep = graph->edges[i];
+            if (!marks[dep])
+            {
+                marks[dep] = 1;
+                stack[top++] = dep;
+            }
+        }
+    }
+    // Sweep up unmarked dependencies. The stack isn't needed anymore, so reuse it
+    // for the result
+    size_t count = 0;
+    for (uint32_t i = 0; i < graph->numNodes; ++i)
+    {
+        if ((graph->flags[i] & NNPKG_GRAPH_NODE_VALID) && !marks[i])
+            stack[count++] = i;
+    }
+    free (marks);
+    if (!count)
+    {
+        free (stack);
+        return true;
+    }
+    *orphans = stack;
+    *numOrphans = count;
+    return true;
+oom:
+    free (marks);
+    free (stack);
+    cb->error = NNPKG_ERR_OOM;
+    TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+    return false;
+}
+
+NNPKG_PUBLIC uint32_t PkgGraphFindDependent (NnpkgGraph_t* graph, uint32_t node)
+{
+    // Only forward edges are kept, so look through all of them
+    for (uint32_t i = 0; i < graph->numNodes; ++i)
+    {
+        if (!(graph->flags[i] & NNPKG_GRAPH_NODE_VALID) || i == node)
+            continue;
+        for (uint32_t j = graph->offsets[i]; j < graph->offsets[i + 1]; ++j)
+        {
+            if (graph->edges[j] == node)
+                return i;
+        }
+    }
+    return NNPKG_GRAPH_NO_NODE;
+}
+
+// Finds a package of a batch by name
+static uint32_t graphBatchFind (uint32_t* map,
+                                size_t mapSz,
+                                NnpkgPackage_t** pkgs,
+                                const char32_t* name)
+{
+    size_t bucket = graphHashName (name) & (mapSz - 1);
+    while (map[bucket] != NNPKG_GRAPH_NO_NODE)
+    {
+        if (!c32cmp (StrRefGet (pkgs[map[bucket]]->id), name))
+            return map[bucket];
+        bucket = (bucket + 1) & (mapSz - 1);
+    }
+    return NNPKG_GRAPH_NO_NODE;
+}
+
+NNPKG_PUBLIC bool PkgGraphSortBatch (NnpkgTransCb_t* cb,
+                                     NnpkgPackage_t** pkgs,
+                                     size_t numPkgs,
+                                     size_t* order,
+                                     uint32_t* levels)
+{
+    size_t mapSz = 16;
+    while (mapSz < numPkgs * 2)
+        mapSz *= 2;
+    uint32_t* map = malloc_s (mapSz * sizeof (uint32_t));
+    uint32_t* numBatchDeps = calloc_s (numPkgs * sizeof (uint32_t));
+    uint32_t* offsets = calloc_s ((numPkgs + 1) * sizeof (uint32_t));
+    uint32_t* dependents = NULL;
+    if (!map || !numBatchDeps || !offsets)
+        goto oom;
+    memset (map, 0xFF, mapSz * sizeof (uint32_t));
+    for (size_t i = 0; i < numPkgs; ++i)
+    {
+        size_t bucket = graphHashName (StrRefGet (pkgs[i]->id)) & (mapSz - 1);
+        while (map[bucket] != NNPKG_GRAPH_NO_NODE)
+            bucket = (bucket + 1) & (mapSz - 1);
+        map[bucket] = i;
+    }
+    // Count the dependents of each package, then lay them out like a graph's edges
+    size_t numEdges = 0;
+    for (size_t i = 0; i < numPkgs; ++i)
+    {
+        for (size_t j = 0; j < pkgs[i]->numDeps; ++j)
+        {
+            const char32_t* name = PkgGetDepName (&pkgs[i]->depRefs[j]);
+            uint32_t dep = graphBatchFind (map, mapSz, pkgs, name);
+            if (dep == NNPKG_GRAPH_NO_NODE)
+                continue;
+            ++offsets[dep + 1];
+            ++numBatchDeps[i];
+            ++numEdges;
+        }
+    }
+    for (size_t i = 0; i < numPkgs; ++i)
+        offsets[i + 1] += offsets[i];
+    dependents = malloc_s ((numEdges + 1) * sizeof (uint32_t));
+    if (!dependents)
+        goto oom;
+    for (size_t i = 0; i < numPkgs; ++i)
+    {
+        for (size_t j = 0; j < pkgs[i]->numDeps; ++j)
+        {
+            const char32_t* name = PkgGetDepName (&pkgs[i]->depRefs[j]);
+            uint32_t dep = graphBatchFind (map, mapSz, pkgs, name);
+            if (dep != NNPKG_GRAPH_NO_NODE)
+                dependents[offsets[dep]++] = i;
+        }
+    }
+    // Filling in moved every offset to the start of the next package
+    for (size_t i = numPkgs; i > 0; --i)
+        offsets[i] = offsets[i - 1];
+    offsets[0] = 0;
+    // Kahn's algorithm. order doubles as the queue
+    size_t head = 0, tail = 0;
+    for (size_t i = 0; i < numPkgs; ++i)
+    {
+        levels[i] = 0;
+        if (!numBatchDeps[i])
+            order[tail++] = i;
+    }
+    while (head < tail)
+    {
+        size_t cur = order[head++];
+        for (uint32_t i = offsets[cur]; i < offsets[cur + 1]; ++i)
+        {
+            uint32_t dependent = dependents[i];
+            if (levels[dependent] < levels[cur] + 1)
+                levels[dependent] = levels[cur] + 1;
+            if (!--numBatchDeps[dependent])
+                order[tail++] = dependent;
+        }
+    }
+    if (tail != numPkgs)
+    {
+        // Whatever is left depends on a cycle
+        for (size_t i = 0; i < numPkgs; ++i)
+        {
+            if (numBatchDeps[i])
+            {
+                cb->errHint[0] = StrRefNew (pkgs[i]->id);
+                break;
+            }
+        }
+        cb->error = NNPKG_ERR_DEP_CYCLE;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        goto fail;
+    }
+    free (map);
+    free (numBatchDeps);
+    free (offsets);
+    free (dependents);
+    return true;
+oom:
+    cb->error = NNPKG_ERR_OOM;
+    TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+fail:
+    free (map);
+    free (numBatchDeps);
+    free (offsets);
+    free (dependents);
+    return false;
+}
@@ -0,0 +1,87 @@
+/*
+    daemon.h - contains nnpkgd protocol functions
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file daemon.h
+
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <config.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Protocol version. Bumped whenever messages change
+#define NNPKGD_VERSION 1
+
+// Largest body a message may have
+#define NNPKGD_MAX_BODY (1 << 20)
+
+// Message types. Every request starts with the absolute path of the configuration
+// file it is for, followed by the strings listed
+#define NNPKGD_REQ_WHY        1    ///< Finds what needs a package. Takes its name
+#define NNPKGD_REQ_ADD        2    ///< Adds packages. Takes absolute paths of their
+                                   ///< configuration files
+#define NNPKGD_REQ_REMOVE     3    ///< Removes a package. Takes its name
+#define NNPKGD_REQ_AUTOREMOVE 4    ///< Removes packages nothing needs
+#define NNPKGD_REPLY          5    ///< Answer to a request. Carries the error of
+                                   ///< the request and its hints, or the result of
+                                   ///< a query
+
+// Errors only the daemon gives. They mean the client should do the request
+// itself
+#define NNPKGD_ERR_CONF    -1    ///< Daemon serves another configuration file
+#define NNPKGD_ERR_REQUEST -2    ///< Request isn't understood
+
+/// A message read from a socket
+typedef struct _nnpkgdmsg
+{
+    int type;             ///< Type of message
+    int error;            ///< Error code of a reply
+    int sysErrno;         ///< Saved errno of a reply
+    size_t numStrs;       ///< Number of strings in message
+    const char** strs;    ///< Strings of message, pointing into body
+    char* body;           ///< Body of message
+} NnpkgDaemonMsg_t;
+
+/// Gets path of daemon socket. This is NNPKG_SOCKET from the environment if it is
+/// set, so that clients can be pointed at another daemon, or kept from using one
+/// by setting it to an empty string
+NNPKG_PUBLIC const char* DaemonGetSocketPath();
+
+/// Connects to the daemon listening on path. Returns a socket, or -1 if no daemon
+/// is there
+NNPKG_PUBLIC int DaemonConnect (const char* path);
+
+/// Creates socket at path and listens on it. A socket left by a daemon that is
+/// gone is replaced. The socket is only accessible to the calling user
+NNPKG_PUBLIC int DaemonListen (const char* path);
+
+/// Sends a message made of numStrs strings
+NNPKG_PUBLIC bool DaemonSend (int fd,
+                              int type,
+                              int error,
+                              int sysErrno,
+                              const char** strs,
+                              size_t numStrs);
+
+/// Reads a message. It must be freed with DaemonMsgFree
+NNPKG_PUBLIC bool DaemonRecv (int fd, NnpkgDaemonMsg_t* msg);
+
+/// Frees a message read with DaemonRecv
+NNPKG_PUBLIC void DaemonMsgFree (NnpkgDaemonMsg_t* msg);
+
+#endif
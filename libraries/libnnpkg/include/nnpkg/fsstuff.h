@@ -24,17 +24,42 @@
 #include <nnpkg/pkg.h>
 #include <nnpkg/transaction.h>
 
+// Types of index entries
+#define NNPKG_IDX_LINK 0    ///< Link to a file of a package
+#define NNPKG_IDX_DIR  1    ///< Directory merged from directories of packages
+#define NNPKG_IDX_TOP  2    ///< Top level directory of index. Made if it is
+                            ///< missing, but never removed
+
 /// Index entry structure
 typedef struct _idxentry
 {
     StringRef_t* srcFile;     /// Source file of entry
     StringRef_t* destFile;    /// Destination file of entry
+    int type;                 /// Type of entry
 } NnpkgIdxEntry_t;
 
-/// Collects index entries
+/// Collects index entries of a package. Directories in the indexed directories of
+/// its prefix are merged into the index, rather than linked whole: they are made
+/// in the index, and everything else in them is linked. Each directory comes
+/// before what is in it. Trees with many directories are walked on several
+/// threads
 NNPKG_PUBLIC ListHead_t* IdxCollectEntries (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg);
 
 /// Write stuff to index
 NNPKG_PUBLIC bool IdxWriteIndex (NnpkgTransCb_t* cb, ListHead_t* idxList);
 
+/// Writes several lists of entries to index, in order. If the index is staged,
+/// each directory changes all at once
+NNPKG_PUBLIC bool IdxWriteIndexes (NnpkgTransCb_t* cb,
+                                   ListHead_t** idxLists,
+                                   size_t numLists);
+
+/// Removes links of entries from index
+NNPKG_PUBLIC bool IdxRemoveEntries (NnpkgTransCb_t* cb, ListHead_t* idxList);
+
+/// Removes links of several lists of entries from index
+NNPKG_PUBLIC bool IdxRemoveIndexes (NnpkgTransCb_t* cb,
+                                    ListHead_t** idxLists,
+                                    size_t numLists);
+
 #endif
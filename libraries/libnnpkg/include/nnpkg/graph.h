@@ -0,0 +1,123 @@
+/*
+    graph.h - contains dependency graph interface
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file graph.h
+
+#ifndef _GRAPH_H
+#define _GRAPH_H
+
+#include <config.h>
+#include <libnex/char32.h>
+#include <nnpkg/pkg.h>
+#include <nnpkg/propdb.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Dependency graph of a database in compressed sparse row form
+// Nodes are numbered after database slots, so node n is the property in slot n + 1.
+// The dependencies of node n are edges[offsets[n]] to edges[offsets[n + 1] - 1]
+typedef struct _nnpkggraph
+{
+    NnpkgPropDb_t* db;      ///< Database graph was built from
+    uint32_t numNodes;      ///< Number of nodes, including free slots
+    uint32_t numEdges;      ///< Number of edges
+    uint32_t* offsets;      ///< Offset of each node's first edge
+    uint32_t* edges;        ///< Node each edge points to
+    uint32_t* names;        ///< String table index of each node's name
+    uint8_t* flags;         ///< Flags of each node
+} NnpkgGraph_t;
+
+// Node flags
+#define NNPKG_GRAPH_NODE_VALID  (1 << 0)    ///< Node holds a package
+#define NNPKG_GRAPH_NODE_IS_DEP (1 << 1)    ///< Package is auto-removable
+
+// Invalid node
+#define NNPKG_GRAPH_NO_NODE ((uint32_t) -1)
+
+/// Called for each node in a traversal. Returning false stops the traversal
+typedef bool (*NnpkgGraphVisit_t) (NnpkgGraph_t* graph, uint32_t node, void* data);
+
+/// Builds the dependency graph of a database in one pass over its records
+NNPKG_PUBLIC NnpkgGraph_t* PkgGraphBuild (NnpkgTransCb_t* cb, NnpkgPropDb_t* db);
+
+/// Destroys a dependency graph
+NNPKG_PUBLIC void PkgGraphDestroy (NnpkgGraph_t* graph);
+
+/// Finds the node of a package
+NNPKG_PUBLIC uint32_t PkgGraphFindNode (NnpkgGraph_t* graph, const char32_t* name);
+
+/// Gets name of a node
+NNPKG_PUBLIC const char32_t* PkgGraphGetName (NnpkgGraph_t* graph, uint32_t node);
+
+/// Visits a node and everything it depends on breadth first
+/// Returns number of nodes visited, or -1 on error
+NNPKG_PUBLIC ssize_t PkgGraphBfs (NnpkgTransCb_t* cb,
+                                  NnpkgGraph_t* graph,
+                                  uint32_t start,
+                                  NnpkgGraphVisit_t visit,
+                                  void* data);
+
+/// Visits a node and everything it depends on depth first, in preorder
+/// Returns number of nodes visited, or -1 on error
+NNPKG_PUBLIC ssize_t PkgGraphDfs (NnpkgTransCb_t* cb,
+                                  NnpkgGraph_t* graph,
+                                  uint32_t start,
+                                  NnpkgGraphVisit_t visit,
+                                  void* data);
+
+/// Finds strongly connected components, i.e., dependency cycles
+/// comps must have room for numNodes entries, and receives the component of each
+/// node. Components are numbered in reverse topological order
+NNPKG_PUBLIC bool PkgGraphFindSccs (NnpkgTransCb_t* cb,
+                                    NnpkgGraph_t* graph,
+                                    uint32_t* comps,
+                                    uint32_t* numComps);
+
+/// Finds the shortest chain of dependencies from an explicitly installed package
+/// to a node, explaining why the node is installed. *path is allocated and must be
+/// freed by the caller. *pathLen is 0 if nothing depends on node
+NNPKG_PUBLIC bool PkgGraphWhy (NnpkgTransCb_t* cb,
+                               NnpkgGraph_t* graph,
+                               uint32_t node,
+                               uint32_t** path,
+                               size_t* pathLen);
+
+/// Finds dependency packages that no explicitly installed package needs, directly
+/// or indirectly. *orphans is allocated and must be freed by the caller. It is NULL
+/// if there are no orphans
+NNPKG_PUBLIC bool PkgGraphFindOrphans (NnpkgTransCb_t* cb,
+                                       NnpkgGraph_t* graph,
+                                       uint32_t** orphans,
+                                       size_t* numOrphans);
+
+/// Finds a package that depends on node. Returns NNPKG_GRAPH_NO_NODE if nothing
+/// does
+NNPKG_PUBLIC uint32_t PkgGraphFindDependent (NnpkgGraph_t* graph, uint32_t node);
+
+/// Orders a batch of packages that are added together, so that each package comes
+/// after the packages of the batch it depends on. order receives indices into pkgs.
+/// levels receives the length of the longest chain of batch dependencies below
+/// each package, so packages with the same level don't depend on each other
+NNPKG_PUBLIC bool PkgGraphSortBatch (NnpkgTransCb_t* cb,
+                                     NnpkgPackage_t** pkgs,
+                                     size_t numPkgs,
+                                     size_t* order,
+                                     uint32_t* levels);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+    mem.h - contains memory accounting functions
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file mem.h
+
+#ifndef _MEM_H
+#define _MEM_H
+
+#include <config.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Subsystems memory is charged to
+#define NNPKG_MEM_PROPDB  0    ///< Property database, including its mapping
+#define NNPKG_MEM_STRTAB  1    ///< Mapping of string table
+#define NNPKG_MEM_PKGDB   2    ///< Packages loaded from databases, and lookups
+#define NNPKG_MEM_PKGCONF 3    ///< Packages read from configuration files
+#define NNPKG_MEM_INDEX   4    ///< Index entries
+#define NNPKG_MEM_TOTAL   5    ///< Every subsystem together
+
+#define NNPKG_NUM_MEM 6
+
+/// Memory statistics of a subsystem
+typedef struct _nnpkgmemstats
+{
+    uint64_t allocs;    ///< Number of allocations made
+    uint64_t frees;     ///< Number of allocations freed
+    int64_t bytes;      ///< Bytes held now
+    int64_t peak;       ///< Most bytes held at once
+} NnpkgMemStats_t;
+
+/// Starts accounting memory. Only memory obtained after this is seen, so it
+/// should be called before anything else in the library
+NNPKG_PUBLIC void MemStatsEnable();
+
+/// Gets statistics of a subsystem, or of all of them if subsys is NNPKG_MEM_TOTAL
+NNPKG_PUBLIC void MemStatsGet (int subsys, NnpkgMemStats_t* out);
+
+/// Lowers peaks to what is held now, so the peak of an operation can be measured
+NNPKG_PUBLIC void MemStatsResetPeaks();
+
+/// Gets name of a subsystem
+NNPKG_PUBLIC const char* MemGetSubsysName (int subsys);
+
+#ifdef IN_LIBNNPKG
+// Allocation functions that charge memory to a subsystem. Blocks they return
+// must be freed with memFree, and never by free
+void* memAlloc (int subsys, size_t sz);
+void* memCalloc (int subsys, size_t sz);
+void* memRealloc (int subsys, void* p, size_t sz);
+void memFree (void* p);
+
+// Charges memory that isn't allocated by the functions above, such as mappings
+// and strings handed off to libnex
+void memCharge (int subsys, size_t sz);
+void memUncharge (int subsys, size_t sz);
+#endif
+
+#endif
@@ -36,8 +36,37 @@ typedef struct _nnpkgConf
 {
     NnpkgDbLocation_t dbLoc;    ///< Location of package database
     StringRef32_t* idxPath;     ///< Path to index
+    StringRef_t* cachePath;     ///< Directory of compiled package configuration
+                                ///< files. NULL if they aren't cached
+    bool stagedIdx;             ///< If index directories are built beside the live
+                                ///< ones and swapped in
+    int lockTimeout;            ///< Milliseconds to wait for the database, or -1
+                                ///< to wait as long as it takes
 } NnpkgMainConf_t;
 
+// Version operators
+#define NNPKG_VER_ANY 0    ///< Any version matches
+#define NNPKG_VER_EQ  1    ///< Version must be equal
+#define NNPKG_VER_LT  2    ///< Version must be less
+#define NNPKG_VER_LE  3    ///< Version must be less or equal
+#define NNPKG_VER_GT  4    ///< Version must be greater
+#define NNPKG_VER_GE  5    ///< Version must be greater or equal
+
+// Maximum number of dependencies a package can have in a database
+#define NNPKG_MAX_DEPS 34
+
+// Unresolved dependency of a package
+typedef struct _nnpkgdepref
+{
+    NnpkgPropDb_t* db;       ///< Database the dependency is resolved against
+    size_t nameIdx;          ///< String table index of dependency name
+    StringRef32_t* name;     ///< Name of dependency if it isn't in a string table
+    uint32_t slot;           ///< Database slot of dependency. 0 if unknown
+    uint16_t gen;            ///< Generation of slot when reference was taken
+    uint8_t verOp;           ///< Version operator. See above
+    uint8_t ver[3];          ///< Version operand, as major, minor, and revision
+} NnpkgDepRef_t;
+
 // Package type
 typedef struct _nnpkg
 {
@@ -49,8 +78,16 @@ typedef struct _nnpkg
                             ///< is dependent on it
     unsigned short type;    ///< Type of this package. Can be NNPKG_PKG_TYPE_PACKAGE.
                             ///< Meta-packages coming soon :)
-    ListHead_t* deps;       ///< List of dependencies
-    NnpkgProp_t* prop;      ///< Internal database property
+    uint8_t version[3];     ///< Version of package, as major, minor, and revision
+    ListHead_t* deps;       ///< List of dependencies. NULL until resolved if the
+                            ///< package was found lazily, see PkgGetDeps
+    NnpkgDepRef_t* depRefs;    ///< Dependency handles of a database package
+    size_t numDeps;            ///< Number of entries in depRefs
+    bool depsLoaded;           ///< If the whole dependency closure has been loaded
+    NnpkgProp_t* prop;         ///< Internal database property
+    char* idUtf8;              ///< UTF-8 forms of id, description, and prefix.
+    char* descriptionUtf8;     ///< NULL until first asked for, see PkgGetIdUtf8
+    char* prefixUtf8;
 } NnpkgPackage_t;
 
 // Package types
@@ -75,6 +112,38 @@ typedef struct _nnpkgtransadd
     ListHead_t* idxEntries;    ///< List of entries to be added to index
 } NnpkgTransAdd_t;
 
+// Add transaction for a set of packages
+typedef struct _nnpkgtransaddmulti
+{
+    Object_t obj;
+    const char** pkgConfs;     ///< Paths of package configuration files
+    size_t numPkgs;            ///< Number of packages being added
+    int numThreads;            ///< Number of index workers. 0 means one per CPU
+    NnpkgPackage_t** pkgs;     ///< Package read from each configuration file
+    size_t* order;             ///< Indices of pkgs, dependencies first
+    uint32_t* levels;          ///< Dependency level of each package. See
+                               ///< PkgGraphSortBatch
+    ListHead_t** idxEntries;   ///< Entries to be added to index, for each package
+} NnpkgTransAddMulti_t;
+
+// Auto-remove transaction
+typedef struct _nnpkgtransautorm
+{
+    Object_t obj;
+    ListHead_t* orphans;       ///< Packages that nothing needs anymore
+    ListHead_t* idxEntries;    ///< Lists of entries to be removed from index, one
+                               ///< for each orphan
+} NnpkgTransAutoRemove_t;
+
+// Remove package transaction
+typedef struct _nnpkgtransrm
+{
+    Object_t obj;
+    const char* pkgName;       ///< Name of package to remove, in UTF-8
+    NnpkgPackage_t* pkg;       ///< Package being removed
+    ListHead_t* idxEntries;    ///< List of entries to be removed from index
+} NnpkgTransRemove_t;
+
 // Database types and locations
 #define NNPKGDB_TYPE_SOURCE 1
 #define NNPKGDB_TYPE_DEST   2
@@ -87,6 +156,10 @@ typedef struct _nnpkgtransadd
 /// Opens up the package database
 NNPKG_PUBLIC NnpkgPropDb_t* PkgDbOpen (NnpkgTransCb_t* cb, NnpkgDbLocation_t* dbLoc);
 
+/// Opens up the package database for reading, as with PropDbOpenShared
+NNPKG_PUBLIC NnpkgPropDb_t* PkgDbOpenShared (NnpkgTransCb_t* cb,
+                                             NnpkgDbLocation_t* dbLoc);
+
 /// Close the package database
 NNPKG_PUBLIC void PkgDbClose (NnpkgPropDb_t* db);
 
@@ -100,16 +173,59 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgDbFindPackage (NnpkgTransCb_t* cb,
                                                NnpkgPropDb_t* db,
                                                const char32_t* name);
 
+/// Finds a package in the database without loading its dependencies
+NNPKG_PUBLIC NnpkgPackage_t* PkgDbFindPackageLazy (NnpkgTransCb_t* cb,
+                                                   NnpkgPropDb_t* db,
+                                                   const char32_t* name);
+
+/// Finds several packages in the database with one pass over it. pkgs[i] gets the
+/// package named names[i], without its dependencies loaded, or NULL if the database
+/// doesn't have it. Returns false on error, in which case pkgs is left empty
+NNPKG_PUBLIC bool PkgDbFindPackages (NnpkgTransCb_t* cb,
+                                     NnpkgPropDb_t* db,
+                                     const char32_t** names,
+                                     size_t numNames,
+                                     NnpkgPackage_t** pkgs);
+
+/// Gets dependencies of a package, resolving them on first access
+NNPKG_PUBLIC ListHead_t* PkgGetDeps (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg);
+
+/// Gets name of a dependency
+NNPKG_PUBLIC const char32_t* PkgGetDepName (const NnpkgDepRef_t* depRef);
+
 /// Removes a package
 NNPKG_PUBLIC bool PkgDbRemovePackage (NnpkgTransCb_t* cb,
                                       NnpkgPropDb_t* db,
                                       NnpkgPackage_t* pkg);
 
+/// Gets the package in a database slot, without resolving its dependencies
+/// Returns NULL if the slot doesn't hold a package
+NNPKG_PUBLIC NnpkgPackage_t* PkgDbGetPackageBySlot (NnpkgTransCb_t* cb,
+                                                    NnpkgPropDb_t* db,
+                                                    uint32_t slot);
+
 // Package configuration functions
 
 /// Parses configuration of a package configuration file
 NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file);
 
+/// Parses configuration of a package configuration file, without picking packages
+/// for its dependencies. pkg->deps is left empty, to be filled in by the resolver.
+/// If the main configuration has a cache path, a compiled form of the file is
+/// loaded instead of parsing it, as long as the file hasn't changed since
+NNPKG_PUBLIC NnpkgPackage_t* PkgReadConfUnresolved (NnpkgTransCb_t* cb,
+                                                    const char* file);
+
+/// Parses a set of package configuration files concurrently, on numThreads threads
+/// (0 means one per CPU). pkgs[i] receives the package of files[i], unresolved as
+/// with PkgReadConfUnresolved. If any file fails, nothing is returned and the error
+/// of the first failing file is reported
+NNPKG_PUBLIC bool PkgReadConfs (NnpkgTransCb_t* cb,
+                                const char** files,
+                                size_t numFiles,
+                                int numThreads,
+                                NnpkgPackage_t** pkgs);
+
 // Functions to manage package databases
 
 /// Opens up a package database
@@ -118,8 +234,18 @@ NNPKG_PUBLIC bool PkgOpenDb (NnpkgTransCb_t* cb,
                              unsigned short type,
                              unsigned short location);
 
-/// Closes all open databases
-NNPKG_PUBLIC void PkgCloseDbs();
+/// Opens up a package database for reading. The dest database must be locked with
+/// PkgLockDestDb before anything is added to it or removed from it
+NNPKG_PUBLIC bool PkgOpenDbShared (NnpkgTransCb_t* cb,
+                                   NnpkgDbLocation_t* dbPath,
+                                   unsigned short type,
+                                   unsigned short location);
+
+/// Locks the dest database for writing. See PropDbLock
+NNPKG_PUBLIC bool PkgLockDestDb (NnpkgTransCb_t* cb);
+
+/// Closes all databases opened with cb
+NNPKG_PUBLIC void PkgCloseDbs (NnpkgTransCb_t* cb);
 
 /// Adds a package to dest database
 NNPKG_PUBLIC bool PkgAddPackage (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg);
@@ -131,10 +257,64 @@ NNPKG_PUBLIC bool PkgRemovePackage (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg);
 NNPKG_PUBLIC NnpkgPackage_t* PkgFindPackage (NnpkgTransCb_t* cb,
                                              const char32_t* name);
 
-/// Parse configuration file for nnpkg
+/// Finds a package in the first available database without loading dependencies
+NNPKG_PUBLIC NnpkgPackage_t* PkgFindPackageLazy (NnpkgTransCb_t* cb,
+                                                 const char32_t* name);
+
+/// Finds several packages, searching each database once for all of them. pkgs[i]
+/// gets the package named names[i] from the first database that has it, as with
+/// PkgFindPackageLazy, or NULL if no database has it. Returns false on error, in
+/// which case pkgs is left empty
+NNPKG_PUBLIC bool PkgFindPackages (NnpkgTransCb_t* cb,
+                                   const char32_t** names,
+                                   size_t numNames,
+                                   NnpkgPackage_t** pkgs);
+
+// UTF-8 variants of the above. Names are converted once, and then looked up as
+// with the UTF-32 versions
+
+/// Finds a package in the first available database, by a UTF-8 name
+NNPKG_PUBLIC NnpkgPackage_t* PkgFindPackageUtf8 (NnpkgTransCb_t* cb,
+                                                 const char* name);
+
+/// Finds a package by a UTF-8 name without loading dependencies
+NNPKG_PUBLIC NnpkgPackage_t* PkgFindPackageLazyUtf8 (NnpkgTransCb_t* cb,
+                                                     const char* name);
+
+/// Finds several packages by UTF-8 names. See PkgFindPackages
+NNPKG_PUBLIC bool PkgFindPackagesUtf8 (NnpkgTransCb_t* cb,
+                                       const char** names,
+                                       size_t numNames,
+                                       NnpkgPackage_t** pkgs);
+
+/// Gets ID of a package in UTF-8. The string is made on first use and kept with
+/// the package, so it is valid for as long as the package is. Returns NULL if
+/// memory runs out. It is safe to call this for one package from several threads
+NNPKG_PUBLIC const char* PkgGetIdUtf8 (NnpkgPackage_t* pkg);
+
+/// Gets description of a package in UTF-8, as with PkgGetIdUtf8
+/// Returns NULL if the package has no description
+NNPKG_PUBLIC const char* PkgGetDescriptionUtf8 (NnpkgPackage_t* pkg);
+
+/// Gets prefix of a package in UTF-8, as with PkgGetIdUtf8
+/// Returns NULL if the package has no prefix
+NNPKG_PUBLIC const char* PkgGetPrefixUtf8 (NnpkgPackage_t* pkg);
+
+/// Finds dependency packages in the dest database that no explicitly installed
+/// package needs anymore
+NNPKG_PUBLIC ListHead_t* PkgFindOrphans (NnpkgTransCb_t* cb);
+
+/// Checks that nothing in the dest database depends on a package, so that it can
+/// be removed. Fails with NNPKG_ERR_PKG_NEEDED otherwise, giving the package and
+/// one of its dependents as hints
+NNPKG_PUBLIC bool PkgCheckRemovable (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg);
+
+/// Parse configuration file for nnpkg into cb->conf, which must not be set
+/// A validated snapshot of the file is kept in NNPKG_CACHE_PATH, and used instead
+/// of parsing the file as long as the file hasn't changed since
 NNPKG_PUBLIC bool PkgParseMainConf (NnpkgTransCb_t* cb, const char* file);
 
-/// Destroys main configuration
-NNPKG_PUBLIC void PkgDestroyMainConf();
+/// Destroys main configuration of cb
+NNPKG_PUBLIC void PkgDestroyMainConf (NnpkgTransCb_t* cb);
 
 #endif
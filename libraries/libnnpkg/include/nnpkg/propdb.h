@@ -26,8 +26,10 @@
 #include <libnex/stringref.h>
 #include <nnpkg/transaction.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct _dbProp propDbProperty_t;
+typedef struct _pkgcache pkgDbCache_t;
 
 // Package databse type
 typedef struct _nnpkgDb
@@ -39,6 +41,7 @@ typedef struct _nnpkgDb
     int strtabFd;                   // File descriptor of string table
     size_t strtabSz;                // String table size
     size_t strtabOff;               // Offset pointer to string table
+    size_t strtabMapSz;             // Size of string table mapping
     ListHead_t* propsToAdd;         // Properties that need to be added to database
     ListHead_t* propsToRm;          // Properties to be removed
     propDbProperty_t* allocMark;    // Place to start allocations from
@@ -46,6 +49,14 @@ typedef struct _nnpkgDb
     size_t numFreeProps;            // Number of freee properties in database
     StringRef_t* dbPath;            // Path of database
     StringRef_t* strtabPath;        // Path of string table
+    pkgDbCache_t* pkgCache;         // Identity map of packages loaded from database
+    NnpkgTransCb_t* cb;             // Control block database was opened with, where
+                                    // writes are counted. Must outlive database
+    uint32_t gen;                   // Generation of database when it was opened
+    bool locked;                    // If database is locked exclusively
+    int lockFd;                     // Lock file turns at database are taken through
+    uint64_t turn;                  // Ticket of turn held in lock file
+    bool hasTurn;                   // If a turn is held
 } NnpkgPropDb_t;
 
 // Property
@@ -77,10 +88,35 @@ typedef struct _dbLoc
 /// Creates a new property database and writes it out to disk
 NNPKG_PUBLIC bool PropDbCreate (NnpkgDbLocation_t* dbLoc);
 
-/// Opens up property database from disk
+/// Opens up property database from disk, locking it exclusively. This takes its
+/// turn at the database like everybody else, but fails with NNPKG_ERR_DB_LOCKED
+/// instead of waiting for it
 NNPKG_PUBLIC NnpkgPropDb_t* PropDbOpen (NnpkgTransCb_t* cb,
                                         NnpkgDbLocation_t* dbLoc);
 
+/// Opens up property database from disk for reading, sharing it with other
+/// readers. It must be locked with PropDbLock before anything is added or removed.
+/// Writers ahead of the caller go first, and if they take longer than the lock
+/// timeout of the configuration, this fails with NNPKG_ERR_DB_LOCKED
+NNPKG_PUBLIC NnpkgPropDb_t* PropDbOpenShared (NnpkgTransCb_t* cb,
+                                              NnpkgDbLocation_t* dbLoc);
+
+/// Locks a database opened with PropDbOpenShared exclusively, waiting for other
+/// writers in the order they came, for the lock timeout at most. If anything was
+/// committed to the database since it was opened, this fails with
+/// NNPKG_ERR_DB_CHANGED, without entering the error state, as whatever was decided
+/// from the database has to be decided again
+NNPKG_PUBLIC bool PropDbLock (NnpkgTransCb_t* cb, NnpkgPropDb_t* db);
+
+/// Unlocks a database opened with PropDbOpenShared, keeping it mapped. Nothing may
+/// be read from it until it is locked again with PropDbRelock
+NNPKG_PUBLIC void PropDbUnlock (NnpkgPropDb_t* db);
+
+/// Locks a database unlocked by PropDbUnlock for reading again. If anything was
+/// committed to it in between, this fails with NNPKG_ERR_DB_CHANGED, without
+/// entering the error state, and the database has to be closed and opened again
+NNPKG_PUBLIC bool PropDbRelock (NnpkgTransCb_t* cb, NnpkgPropDb_t* db);
+
 /// Closes property database
 NNPKG_PUBLIC void PropDbClose (NnpkgPropDb_t* db);
 
@@ -94,6 +130,18 @@ NNPKG_PUBLIC bool PropDbFindProp (NnpkgPropDb_t* db,
                                   const char32_t* name,
                                   NnpkgProp_t* out);
 
+/// Gets the slot and generation of a property found in the database
+NNPKG_PUBLIC bool PropDbGetPropRef (NnpkgPropDb_t* db,
+                                    const NnpkgProp_t* prop,
+                                    uint32_t* slot,
+                                    uint16_t* gen);
+
+/// Gets the property in a slot, if the slot is still on the same generation
+NNPKG_PUBLIC bool PropDbGetPropBySlot (NnpkgPropDb_t* db,
+                                       uint32_t slot,
+                                       uint16_t gen,
+                                       NnpkgProp_t* out);
+
 /// Removes a property from the database
 NNPKG_PUBLIC bool PropDbRemoveProp (NnpkgTransCb_t* cb,
                                     NnpkgPropDb_t* db,
@@ -0,0 +1,105 @@
+/*
+    resolver.h - contains dependency resolver interface
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file resolver.h
+
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+
+#include <config.h>
+#include <libnex/char32.h>
+#include <nnpkg/pkg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Resolver state. Opaque to users
+typedef struct _nnpkgresolver NnpkgResolver_t;
+
+// Returned by resolver functions on failure, or if no candidate was selected
+#define RESOLVER_NONE ((size_t) -1)
+
+// Maximum number of candidates a package can have
+#define RESOLVER_MAX_CANDS 63
+
+/// Creates a new resolver
+NNPKG_PUBLIC NnpkgResolver_t* ResolverCreate();
+
+/// Destroys a resolver
+NNPKG_PUBLIC void ResolverDestroy (NnpkgResolver_t* res);
+
+/// Adds a package name to the resolver, returning its index
+/// If the name is already known, the existing index is returned. name must stay
+/// valid for the lifetime of the resolver
+NNPKG_PUBLIC size_t ResolverAddPackage (NnpkgResolver_t* res,
+                                        const char32_t* name,
+                                        bool* isNew);
+
+/// Adds a candidate version of a package, returning its index
+NNPKG_PUBLIC size_t ResolverAddCandidate (NnpkgResolver_t* res,
+                                          size_t pkgIdx,
+                                          const uint8_t* ver,
+                                          void* data);
+
+/// Makes a candidate depend on a version range of a package
+NNPKG_PUBLIC bool ResolverAddDep (NnpkgResolver_t* res,
+                                  size_t candIdx,
+                                  size_t pkgIdx,
+                                  uint8_t verOp,
+                                  const uint8_t* ver);
+
+/// Requires a version range of a package to be selected
+NNPKG_PUBLIC bool ResolverRequire (NnpkgResolver_t* res,
+                                   size_t pkgIdx,
+                                   uint8_t verOp,
+                                   const uint8_t* ver);
+
+/// Picks a candidate for each required package
+NNPKG_PUBLIC bool ResolverSolve (NnpkgResolver_t* res);
+
+/// Gets candidate selected for a package, or RESOLVER_NONE if it isn't needed
+NNPKG_PUBLIC size_t ResolverGetSelection (NnpkgResolver_t* res, size_t pkgIdx);
+
+/// Counts candidates of a package that satisfy a version constraint
+NNPKG_PUBLIC int ResolverCountMatches (NnpkgResolver_t* res,
+                                      size_t pkgIdx,
+                                      uint8_t verOp,
+                                      const uint8_t* ver);
+
+/// Gets data associated with a candidate
+NNPKG_PUBLIC void* ResolverGetCandidateData (NnpkgResolver_t* res, size_t candIdx);
+
+/// Gets name of the package blamed for the last failure to solve
+NNPKG_PUBLIC const char32_t* ResolverGetConflict (NnpkgResolver_t* res);
+
+/// Checks if a version satisfies a version constraint
+NNPKG_PUBLIC bool ResolverVersionMatches (uint8_t verOp,
+                                          const uint8_t* ver,
+                                          const uint8_t* candVer);
+
+/// Picks versions for the dependencies of a package across all open databases
+/// On success, pkg->deps contains the chosen package for each dependency
+NNPKG_PUBLIC bool ResolverSelectDeps (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg);
+
+/// Picks versions for the dependencies of a package, also considering packages that
+/// are about to be added alongside it and aren't in a database yet
+NNPKG_PUBLIC bool ResolverSelectDepsFrom (NnpkgTransCb_t* cb,
+                                          NnpkgPackage_t* pkg,
+                                          NnpkgPackage_t** pending,
+                                          size_t numPending);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+    trace.h - contains tracing functions
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file trace.h
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <config.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Set while trace spans are being recorded
+NNPKG_PUBLIC extern bool NnpkgTraceOn;
+
+/// A span being timed
+typedef struct _nnpkgtracespan
+{
+    const char* name;    ///< Name of span. Must be a string literal
+    uint64_t start;      ///< Start time in nanoseconds, or 0 if not recording
+} NnpkgTraceSpan_t;
+
+/// Starts recording spans, to be written to file as Chrome trace JSON. If
+/// NNPKG_TRACE is set in the environment, this is done when the library is loaded.
+/// Tracing must only be started or stopped while no other thread is using the
+/// library
+NNPKG_PUBLIC bool TraceStart (const char* file);
+
+/// Writes out recorded spans and stops recording
+NNPKG_PUBLIC void TraceStop();
+
+/// Gets current time for a span
+NNPKG_PUBLIC uint64_t TraceNow();
+
+/// Records a finished span in the calling thread's ring
+NNPKG_PUBLIC void TraceRecord (const NnpkgTraceSpan_t* span);
+
+static inline void traceSpanEnd (NnpkgTraceSpan_t* span)
+{
+    if (__builtin_expect (span->start != 0, 0))
+        TraceRecord (span);
+}
+
+/// Times the rest of the enclosing scope as span name. When tracing is off, this
+/// only costs a test of NnpkgTraceOn on the way in and of the start time on the
+/// way out
+#define NNPKG_TRACE_SPAN(name)                                      \
+    NnpkgTraceSpan_t _traceSpan __attribute__ ((cleanup (traceSpanEnd))) = \
+        {name, __builtin_expect (NnpkgTraceOn, 0) ? TraceNow() : 0}
+
+#endif
@@ -23,9 +23,11 @@
 #include <config.h>
 #include <libnex/list.h>
 #include <libnex/stringref.h>
+#include <stdint.h>
 
 // Configuration struct forward decl
 typedef struct _nnpkgConf NnpkgMainConf_t;
+typedef struct _nnpkgdb NnpkgPackageDb_t;
 
 // Error codes
 #define NNPKG_ERR_NONE         0
@@ -38,9 +40,20 @@ typedef struct _nnpkgConf NnpkgMainConf_t;
 #define NNPKG_ERR_SYNTAX_ERR \
     7    // Syntax error in file. Error has been printed already
          // FIXME: This won't work when we add a GUI frontend
+#define NNPKG_ERR_DEP_CONFLICT 8    // Dependency versions can't be satisfied
+#define NNPKG_ERR_DEP_CYCLE    9    // Packages added together depend on each other
+#define NNPKG_ERR_PKG_NEEDED   10   // Another package depends on package
+#define NNPKG_ERR_DB_CHANGED   11   // Database kept changing while transaction was
+                                    // being planned
+#define NNPKG_ERR_DEPS_LIMIT   12   // Package has more than NNPKG_MAX_DEPS
+                                    // dependencies
+#define NNPKG_ERR_DB_REVISION  13   // Database was made by another revision
 
 // Transaction types
-#define NNPKG_TRANS_ADD 1
+#define NNPKG_TRANS_ADD        1
+#define NNPKG_TRANS_AUTOREMOVE 2
+#define NNPKG_TRANS_ADD_MULTI  3
+#define NNPKG_TRANS_REMOVE     4
 
 // Transaction states
 #define NNPKG_TRANS_STATE_ERR      1
@@ -51,8 +64,40 @@ typedef struct _nnpkgConf NnpkgMainConf_t;
 #define NNPKG_STATE_CLEANUP_PKGSYS 6
 #define NNPKG_STATE_COLLECT_INDEX  7
 #define NNPKG_STATE_WRITE_INDEX    8
+#define NNPKG_STATE_FIND_ORPHANS   9
+#define NNPKG_STATE_REMOVE_INDEX   10
+#define NNPKG_STATE_RMPKG          11
+#define NNPKG_STATE_FIND_PKG       12
+#define NNPKG_STATE_LOCK_DB        13
+#define NNPKG_NUM_STATES           14
+
+// Counters kept for each state
+#define NNPKG_COUNT_FILES_COLLECTED 0    ///< Index entries collected
+#define NNPKG_COUNT_LINKS_WRITTEN   1    ///< Links made in index
+#define NNPKG_COUNT_LINKS_REMOVED   2    ///< Links removed from index
+#define NNPKG_COUNT_STRINGS_ADDED   3    ///< Strings appended to string table
+#define NNPKG_COUNT_BYTES_WRITTEN   4    ///< Bytes written to database files
+#define NNPKG_NUM_COUNTS            5
+
+// Time spent in, and work done by, each state of a transaction
+typedef struct _nnpkgtransstats
+{
+    uint64_t stateStart;                    ///< When current state began, in ns
+    uint64_t time[NNPKG_NUM_STATES];        ///< Nanoseconds spent in each state
+    uint64_t counts[NNPKG_NUM_STATES][NNPKG_NUM_COUNTS];    ///< Counters of each
+                                                            ///< state
+    uint32_t numPlans;    ///< Times the transaction was planned. More than one if
+                          ///< the database changed before it could be applied
+    uint64_t lockWait;    ///< Nanoseconds spent waiting for the database
+} NnpkgTransStats_t;
 
 // Transaction structure
+// Everything a transaction opens hangs off of its control block, so transactions
+// with different control blocks can run at the same time on different threads,
+// against the same root or different ones. A control block itself must only be
+// used by one thread at a time. Transactions on the same database are kept apart
+// by its lock, just as transactions in different processes are. Tracing and
+// memory accounting are the only state shared by the whole process
 typedef struct _nnpkgact
 {
     // State information
@@ -68,12 +113,18 @@ typedef struct _nnpkgact
 #define progressHint errHint
 
     // Internal configuration
-    ListHead_t* pkgDbs;       ///< Databases loaded
-    const char* confFile;     ///< Configuration file
-    NnpkgMainConf_t* conf;    ///< Configuration of program
+    ListHead_t* pkgDbs;          ///< Databases loaded
+    NnpkgPackageDb_t* destDb;    ///< Database packages are added to
+    const char* confFile;        ///< Configuration file
+    NnpkgMainConf_t* conf;       ///< Configuration of program
+    bool keepConf;               ///< If conf was parsed by the caller, and is left
+                                 ///< to it when the transaction is done
 
     // Block of data pertaining to transaction type
     void* transactData;
+
+    // Instrumentation. Reset when the transaction starts
+    NnpkgTransStats_t stats;    ///< Timings and counters of each state
 } NnpkgTransCb_t;
 
 /// Sets state, performing any special processing that must be done
@@ -82,4 +133,10 @@ NNPKG_PUBLIC void TransactSetState (NnpkgTransCb_t* cb, int state);
 /// Executes transaction state machine
 NNPKG_PUBLIC bool TransactExecute (NnpkgTransCb_t* cb);
 
+/// Adds n to a counter of the current state
+NNPKG_PUBLIC void TransactCount (NnpkgTransCb_t* cb, int counter, uint64_t n);
+
+/// Gets a readable name of a state
+NNPKG_PUBLIC const char* TransactGetStateName (int state);
+
 #endif
@@ -0,0 +1,47 @@
+/*
+    workpool.h - contains worker thread pool interface
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file workpool.h
+
+#ifndef _WORKPOOL_H
+#define _WORKPOOL_H
+
+#include <config.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct _nnpkgworkpool NnpkgWorkPool_t;
+
+/// Function run on a worker thread
+typedef void (*NnpkgWorkFunc_t) (void* data);
+
+/// Creates a pool of worker threads. If numThreads is 0, one thread is started
+/// for each online CPU
+NNPKG_PUBLIC NnpkgWorkPool_t* WorkPoolCreate (int numThreads);
+
+/// Queues a job on a pool
+NNPKG_PUBLIC bool WorkPoolSubmit (NnpkgWorkPool_t* pool,
+                                  NnpkgWorkFunc_t func,
+                                  void* data);
+
+/// Waits until every job queued on a pool has finished
+NNPKG_PUBLIC void WorkPoolWait (NnpkgWorkPool_t* pool);
+
+/// Waits for queued jobs, then stops and destroys a pool
+NNPKG_PUBLIC void WorkPoolDestroy (NnpkgWorkPool_t* pool);
+
+#endif
@@ -15,69 +15,390 @@
     limitations under the License.
 */
 
+// For renameat2
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libnex/base.h>
 #include <libnex/safemalloc.h>
 #include <libnex/unicode.h>
+#include <limits.h>
 #include <nnpkg/fsstuff.h>
+#include <nnpkg/mem.h>
 #include <nnpkg/pkg.h>
+#include <nnpkg/trace.h>
 #include <nnpkg/transaction.h>
+#include <nnpkg/workpool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+bool pkgHostIsUtf8();
+char* pkgUtf32ToHost (const char32_t* s);
+
+// Directories of a prefix that get indexed
+static const char* idxDirs[] =
+    {"bin", "sbin", "etc", "share", "libexec", "var", "lib", "include"};
+
 // Returns a concatenated path
-static inline StringRef32_t* makeCatedPath (char32_t* str1, char32_t* str2)
+static inline StringRef_t* makeCatedPath (const char* str1, const char* str2)
 {
-    size_t len = c32len (str1) + c32len (str2) + 2;
-    char32_t* str = malloc_s ((len) * sizeof (char32_t));
+    size_t len1 = strlen (str1);
+    size_t len2 = strlen (str2);
+    char* str = malloc_s (len1 + len2 + 2);
     if (!str)
         return NULL;
-    c32lcpy (str, str1, len);
-    c32lcat (str, U"/", len);
-    c32lcat (str, str2, len);
+    memcpy (str, str1, len1);
+    str[len1] = '/';
+    memcpy (str + len1 + 1, str2, len2 + 1);
     return StrRefCreate (str);
 }
 
-// Returns a concatenated path, converting second component to UTF-32
-static inline StringRef32_t* makeCatedPathFromSys (char32_t* str1, char* str2)
+// Destroys index entries
+void idxEntryDestroy (const void* data)
+{
+    NnpkgIdxEntry_t* ent = (NnpkgIdxEntry_t*) data;
+    // Paths are freed by libnex, so they were charged separately
+    memUncharge (NNPKG_MEM_INDEX, strlen (StrRefGet (ent->destFile)) + 1);
+    memUncharge (NNPKG_MEM_INDEX, strlen (StrRefGet (ent->srcFile)) + 1);
+    StrRefDestroy (ent->destFile);
+    StrRefDestroy (ent->srcFile);
+    memFree ((void*) data);
+}
+
+// Number of directories waiting to be read before the walk of a package moves to a
+// pool of threads. Most packages never get there, and are walked on the calling
+// thread without starting any
+#define IDX_WALK_POOL_DIRS 64
+
+// Threads taken by walks running now. Walks share one thread per CPU between them,
+// so that pipelined transactions collecting several packages at once don't each
+// start a thread per CPU
+static int idxWalkThreads = 0;
+
+struct _idxwalk;
+
+// Directory of a package being walked. Each one is read by a single task, which
+// makes entries for what is in it and finds the directories below it
+typedef struct _idxwalkdir
+{
+    char* rel;                       ///< Path relative to prefix
+    NnpkgIdxEntry_t** ents;          ///< Entries in directory, after its own
+    size_t numEnts;                  ///< Number of entries
+    size_t maxEnts;                  ///< Size of ents
+    struct _idxwalkdir** subdirs;    ///< Directories in this one, in order found
+    size_t numSubdirs;               ///< Number of subdirectories
+    size_t maxSubdirs;               ///< Size of subdirs
+    struct _idxwalk* walk;           ///< Walk directory is part of
+} idxWalkDir_t;
+
+// Walk of the indexed directories of a package
+typedef struct _idxwalk
+{
+    int prefixFd;               ///< Prefix of package. Directories are opened in it
+    const char* prefix;         ///< Path of prefix
+    const char* idxBase;        ///< Path of index
+    NnpkgWorkPool_t* pool;      ///< Pool reading directories, once there is one
+    int numThreads;             ///< Threads taken for pool
+    idxWalkDir_t** pending;     ///< Directories left to read on the calling thread
+    size_t numPending;          ///< Number of pending directories
+    size_t maxPending;          ///< Size of pending
+    int error;                  ///< First error hit. Set atomically
+    int sysErrno;               ///< Saved errno of error
+} idxWalk_t;
+
+// Makes room for one more element in an array
+static bool idxGrow (void** arr, size_t* max, size_t num, size_t elemSz)
+{
+    if (num < *max)
+        return true;
+    size_t newMax = *max ? *max * 2 : 8;
+    void* newArr = memRealloc (NNPKG_MEM_INDEX, *arr, newMax * elemSz);
+    if (!newArr)
+        return false;
+    *arr = newArr;
+    *max = newMax;
+    return true;
+}
+
+// Takes threads for the pool of a walk, out of what other walks left. Returns the
+// number taken, or 0 if too few are left to be worth a pool
+static int idxWalkTakeThreads()
+{
+    long numCpus = sysconf (_SC_NPROCESSORS_ONLN);
+    int maxThreads = (numCpus > 0) ? (int) numCpus : 1;
+    int used = __atomic_load_n (&idxWalkThreads, __ATOMIC_RELAXED);
+    int numThreads = 0;
+    do
+    {
+        numThreads = maxThreads - used;
+        if (numThreads < 2)
+            return 0;
+    } while (!__atomic_compare_exchange_n (&idxWalkThreads,
+                                           &used,
+                                           used + numThreads,
+                                           false,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED));
+    return numThreads;
+}
+
+// Gives threads taken with idxWalkTakeThreads back
+static void idxWalkGiveThreads (int numThreads)
+{
+    __atomic_sub_fetch (&idxWalkThreads, numThreads, __ATOMIC_RELAXED);
+}
+
+// Records an error of a walk. Only the first one is kept
+static void idxWalkFail (idxWalk_t* walk, int err, int sysErrno)
 {
-    size_t str2len = strlen (str2);
-    char32_t* ustr = malloc_s ((str2len + 1) * sizeof (char32_t));
-    if (!ustr)
+    int none = NNPKG_ERR_NONE;
+    if (__atomic_compare_exchange_n (&walk->error,
+                                     &none,
+                                     err,
+                                     false,
+                                     __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+    {
+        walk->sysErrno = sysErrno;
+    }
+}
+
+// Makes an entry for a path relative to prefix
+static NnpkgIdxEntry_t* idxMakeEntry (idxWalk_t* walk, const char* rel, int type)
+{
+    NnpkgIdxEntry_t* idxEntry = memAlloc (NNPKG_MEM_INDEX, sizeof (NnpkgIdxEntry_t));
+    StringRef_t* prefixPath = makeCatedPath (walk->prefix, rel);
+    StringRef_t* idxPath = makeCatedPath (walk->idxBase, rel);
+    if (!idxEntry || !prefixPath || !idxPath)
+    {
+        memFree (idxEntry);
+        if (prefixPath)
+            StrRefDestroy (prefixPath);
+        if (idxPath)
+            StrRefDestroy (idxPath);
         return NULL;
-    mbstate_t mbstate = {0};
-    mbstoc32s (ustr, str2, (str2len + 1) * sizeof (char32_t), str2len + 1, &mbstate);
-    StringRef32_t* retRef = makeCatedPath (str1, ustr);
-    free (ustr);
-    return retRef;
+    }
+    idxEntry->destFile = idxPath;
+    idxEntry->srcFile = prefixPath;
+    idxEntry->type = type;
+    memCharge (NNPKG_MEM_INDEX, strlen (StrRefGet (idxPath)) + 1);
+    memCharge (NNPKG_MEM_INDEX, strlen (StrRefGet (prefixPath)) + 1);
+    return idxEntry;
 }
 
-static inline char* makeHostStr (char32_t* ustr)
+// Adds an entry to a directory
+static bool idxWalkAddEntry (idxWalkDir_t* dir, NnpkgIdxEntry_t* idxEntry)
 {
-    size_t len = (c32len (ustr) * MB_CUR_MAX) + 1;
-    char* out = malloc_s (len);
-    if (!out)
+    if (!idxGrow ((void**) &dir->ents,
+                  &dir->maxEnts,
+                  dir->numEnts,
+                  sizeof (NnpkgIdxEntry_t*)))
+    {
+        idxEntryDestroy (idxEntry);
+        return false;
+    }
+    dir->ents[dir->numEnts++] = idxEntry;
+    return true;
+}
+
+// Creates a directory to be walked, with its own entry
+static idxWalkDir_t* idxWalkNewDir (idxWalk_t* walk, const char* rel, int type)
+{
+    idxWalkDir_t* dir = memCalloc (NNPKG_MEM_INDEX, sizeof (idxWalkDir_t));
+    size_t relLen = strlen (rel);
+    char* dirRel = memAlloc (NNPKG_MEM_INDEX, relLen + 1);
+    NnpkgIdxEntry_t* idxEntry = idxMakeEntry (walk, rel, type);
+    if (!dir || !dirRel || !idxEntry)
+    {
+        memFree (dir);
+        memFree (dirRel);
+        if (idxEntry)
+            idxEntryDestroy (idxEntry);
+        return NULL;
+    }
+    memcpy (dirRel, rel, relLen + 1);
+    dir->rel = dirRel;
+    dir->walk = walk;
+    if (!idxWalkAddEntry (dir, idxEntry))
+    {
+        memFree (dirRel);
+        memFree (dir);
         return NULL;
-    mbstate_t mbState = {0};
-    c32stombs (out, ustr, len, &mbState);
-    return out;
+    }
+    return dir;
 }
 
-// Destroys index entries
-void idxEntryDestroy (const void* data)
+// Frees a tree of walked directories. Entries are destroyed too, unless they were
+// handed off to a list
+static void idxWalkFreeDir (idxWalkDir_t* dir, bool freeEnts)
 {
-    NnpkgIdxEntry_t* ent = (NnpkgIdxEntry_t*) data;
-    StrRefDestroy (ent->destFile);
-    StrRefDestroy (ent->srcFile);
-    free ((void*) data);
+    for (size_t i = 0; freeEnts && i < dir->numEnts; ++i)
+        idxEntryDestroy (dir->ents[i]);
+    for (size_t i = 0; i < dir->numSubdirs; ++i)
+        idxWalkFreeDir (dir->subdirs[i], freeEnts);
+    memFree (dir->ents);
+    memFree (dir->subdirs);
+    memFree (dir->rel);
+    memFree (dir);
+}
+
+static void idxWalkRead (idxWalkDir_t* dir);
+
+static void idxWalkJob (void* data)
+{
+    idxWalkRead (data);
+}
+
+// Hands a directory off to be read, by the pool if there is one
+static void idxWalkQueue (idxWalk_t* walk, idxWalkDir_t* dir)
+{
+    if (walk->pool)
+    {
+        if (!WorkPoolSubmit (walk->pool, idxWalkJob, dir))
+            idxWalkRead (dir);
+        return;
+    }
+    if (!idxGrow ((void**) &walk->pending,
+                  &walk->maxPending,
+                  walk->numPending,
+                  sizeof (idxWalkDir_t*)))
+    {
+        idxWalkFail (walk, NNPKG_ERR_OOM, 0);
+        return;
+    }
+    walk->pending[walk->numPending++] = dir;
+}
+
+// Reads a directory, making entries for everything in it that isn't a directory,
+// and queueing the directories below it
+static void idxWalkRead (idxWalkDir_t* dir)
+{
+    idxWalk_t* walk = dir->walk;
+    if (__atomic_load_n (&walk->error, __ATOMIC_RELAXED))
+        return;
+    // Top level directories may be links, such as lib to lib64, but nothing below
+    // them is followed
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    bool isTop = dir->ents[0]->type == NNPKG_IDX_TOP;
+    if (!isTop)
+        flags |= O_NOFOLLOW;
+    int fd = openat (walk->prefixFd, dir->rel, flags);
+    DIR* srcDir = (fd != -1) ? fdopendir (fd) : NULL;
+    if (!srcDir)
+    {
+        int err = errno;
+        if (fd != -1)
+            close (fd);
+        // Packages don't have to have every top level directory. The index only
+        // gets the ones they have
+        if (err == ENOENT && isTop)
+        {
+            idxEntryDestroy (dir->ents[0]);
+            dir->numEnts = 0;
+            return;
+        }
+        idxWalkFail (walk, NNPKG_ERR_SYS, err);
+        return;
+    }
+    size_t relLen = strlen (dir->rel);
+    struct dirent* curDirEnt = NULL;
+    while ((curDirEnt = readdir (srcDir)))
+    {
+        const char* name = curDirEnt->d_name;
+        // Skip . and ..
+        if (!strcmp (name, ".") || !strcmp (name, ".."))
+            continue;
+        bool isDir = curDirEnt->d_type == DT_DIR;
+        if (curDirEnt->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (fstatat (fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            {
+                idxWalkFail (walk, NNPKG_ERR_SYS, errno);
+                break;
+            }
+            isDir = S_ISDIR (st.st_mode);
+        }
+        size_t nameLen = strlen (name);
+        char* rel = malloc_s (relLen + nameLen + 2);
+        if (!rel)
+        {
+            idxWalkFail (walk, NNPKG_ERR_OOM, 0);
+            break;
+        }
+        memcpy (rel, dir->rel, relLen);
+        rel[relLen] = '/';
+        memcpy (rel + relLen + 1, name, nameLen + 1);
+        bool res = false;
+        if (isDir)
+        {
+            idxWalkDir_t* subdir = idxWalkNewDir (walk, rel, NNPKG_IDX_DIR);
+            res = subdir && idxGrow ((void**) &dir->subdirs,
+                                     &dir->maxSubdirs,
+                                     dir->numSubdirs,
+                                     sizeof (idxWalkDir_t*));
+            if (res)
+                dir->subdirs[dir->numSubdirs++] = subdir;
+            else if (subdir)
+                idxWalkFreeDir (subdir, true);
+        }
+        else
+        {
+            NnpkgIdxEntry_t* idxEntry = idxMakeEntry (walk, rel, NNPKG_IDX_LINK);
+            res = idxEntry && idxWalkAddEntry (dir, idxEntry);
+        }
+        free (rel);
+        if (!res)
+        {
+            idxWalkFail (walk, NNPKG_ERR_OOM, 0);
+            break;
+        }
+    }
+    closedir (srcDir);
+    // Directories below are only queued once this one is closed, so that the
+    // number of descriptors open stays at one per thread
+    for (size_t i = 0; i < dir->numSubdirs; ++i)
+        idxWalkQueue (walk, dir->subdirs[i]);
+}
+
+// Moves entries of a tree of directories to a list, each directory before what is
+// in it
+static bool idxWalkCollect (NnpkgTransCb_t* cb,
+                            idxWalkDir_t* dir,
+                            ListHead_t* idxList)
+{
+    for (size_t i = 0; i < dir->numEnts; ++i)
+    {
+        if (!ListAddBack (idxList, dir->ents[i], 0))
+        {
+            // Whatever wasn't moved yet is still the directory's to free
+            memmove (dir->ents, dir->ents + i, (dir->numEnts - i) * sizeof (void*));
+            dir->numEnts -= i;
+            return false;
+        }
+        if (dir->ents[i]->type == NNPKG_IDX_LINK)
+            TransactCount (cb, NNPKG_COUNT_FILES_COLLECTED, 1);
+    }
+    dir->numEnts = 0;
+    for (size_t i = 0; i < dir->numSubdirs; ++i)
+    {
+        if (!idxWalkCollect (cb, dir->subdirs[i], idxList))
+            return false;
+    }
+    return true;
 }
 
 // Collects index entries
+// Paths are converted to host encoding once and kept in it from start to finish, so
+// that nothing has to be converted for each entry
 NNPKG_PUBLIC ListHead_t* IdxCollectEntries (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg)
 {
+    NNPKG_TRACE_SPAN ("IdxCollectEntries");
     assert (pkg->prefix);
     ListHead_t* idxList = ListCreate ("NnpkgIdxEntry_t", false, 0);
     if (!idxList)
@@ -87,150 +408,1045 @@ NNPKG_PUBLIC ListHead_t* IdxCollectEntries (NnpkgTransCb_t* cb, NnpkgPackage_t*
         return NULL;
     }
     ListSetDestroy (idxList, idxEntryDestroy);
-    // Iterate through directories
-    static char32_t* dirs[] =
-        {U"bin", U"sbin", U"etc", U"share", U"libexec", U"var", U"lib", U"include"};
-    for (int i = 0; i < ARRAY_SIZE (dirs); ++i)
+    idxWalk_t walk = {0};
+    walk.prefixFd = -1;
+    // UTF-8 hosts can use the prefix the package keeps around
+    char* hostPrefix = NULL;
+    if (pkgHostIsUtf8())
+        walk.prefix = PkgGetPrefixUtf8 (pkg);
+    else
+        walk.prefix = hostPrefix = pkgUtf32ToHost (StrRefGet (pkg->prefix));
+    char* idxBase = pkgUtf32ToHost (StrRefGet (cb->conf->idxPath));
+    walk.idxBase = idxBase;
+    idxWalkDir_t* tops[ARRAY_SIZE (idxDirs)] = {0};
+    if (!walk.prefix || !idxBase)
+    {
+        walk.error = NNPKG_ERR_OOM;
+        goto out;
+    }
+    walk.prefixFd = open (walk.prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (walk.prefixFd == -1)
     {
-        // Prepare prefixed paths
-        StringRef32_t* curDir = makeCatedPath (StrRefGet (pkg->prefix), dirs[i]);
-        if (!curDir)
+        // A package with no prefix has nothing to index
+        if (errno != ENOENT)
         {
-            cb->error = NNPKG_ERR_OOM;
-            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-            ListDestroy (idxList);
-            return NULL;
+            walk.error = NNPKG_ERR_SYS;
+            walk.sysErrno = errno;
+        }
+        goto out;
+    }
+    for (size_t i = 0; i < ARRAY_SIZE (idxDirs); ++i)
+    {
+        tops[i] = idxWalkNewDir (&walk, idxDirs[i], NNPKG_IDX_TOP);
+        if (!tops[i])
+        {
+            walk.error = NNPKG_ERR_OOM;
+            goto out;
+        }
+        idxWalkQueue (&walk, tops[i]);
+    }
+    // Walk depth first on this thread, until it turns out there is enough to go
+    // around
+    bool triedPool = false;
+    while (walk.numPending && !walk.error)
+    {
+        if (!triedPool && walk.numPending >= IDX_WALK_POOL_DIRS)
+        {
+            triedPool = true;
+            walk.numThreads = idxWalkTakeThreads();
+            if (walk.numThreads)
+                walk.pool = WorkPoolCreate (walk.numThreads);
+            if (walk.pool)
+            {
+                size_t numPending = walk.numPending;
+                walk.numPending = 0;
+                for (size_t i = 0; i < numPending; ++i)
+                    idxWalkQueue (&walk, walk.pending[i]);
+                break;
+            }
+        }
+        idxWalkRead (walk.pending[--walk.numPending]);
+    }
+    // Jobs queue the directories they find, so wait for all of them before the pool
+    // is stopped, rather than letting workers leave as the queue runs dry
+    if (walk.pool)
+    {
+        WorkPoolWait (walk.pool);
+        WorkPoolDestroy (walk.pool);
+    }
+    if (walk.numThreads)
+        idxWalkGiveThreads (walk.numThreads);
+    for (size_t i = 0; !walk.error && i < ARRAY_SIZE (idxDirs); ++i)
+    {
+        if (!idxWalkCollect (cb, tops[i], idxList))
+            walk.error = NNPKG_ERR_OOM;
+    }
+out:
+    for (size_t i = 0; i < ARRAY_SIZE (idxDirs); ++i)
+    {
+        if (tops[i])
+            idxWalkFreeDir (tops[i], true);
+    }
+    if (walk.prefixFd != -1)
+        close (walk.prefixFd);
+    memFree (walk.pending);
+    free (hostPrefix);
+    free (idxBase);
+    if (walk.error)
+    {
+        ListDestroy (idxList);
+        cb->error = walk.error;
+        cb->sysErrno = walk.sysErrno;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return NULL;
+    }
+    return idxList;
+}
+
+
+// Checks whether name in dirFd is a link to srcFile. buf is a buffer of bufSz bytes
+// for reading the link, which is grown as needed. Returns -1 if memory runs out
+static int idxLinkMatches (int dirFd,
+                           const char* name,
+                           const char* srcFile,
+                           char** buf,
+                           size_t* bufSz)
+{
+    size_t srcLen = strlen (srcFile);
+    if (srcLen + 2 > *bufSz)
+    {
+        free (*buf);
+        *bufSz = srcLen + 2;
+        *buf = malloc_s (*bufSz);
+        if (!*buf)
+        {
+            *bufSz = 0;
+            return -1;
+        }
+    }
+    ssize_t linkLen = readlinkat (dirFd, name, *buf, srcLen + 1);
+    return linkLen == (ssize_t) srcLen && !memcmp (*buf, srcFile, srcLen);
+}
+
+// Checks if a path is below a directory
+static inline bool idxInDir (const char* path, const char* dir, size_t dirLen)
+{
+    return dir && !strncmp (path, dir, dirLen) && path[dirLen] == '/';
+}
+
+// Makes the directory of an entry at path in dirFd. Returns 1 if the directory is
+// there, 0 if its name is taken by something else, or -1 on error
+static int idxMakeDir (int dirFd, const char* path, int type)
+{
+    if (mkdirat (dirFd, path, 0755) != -1)
+        return 1;
+    if (errno != EEXIST)
+        return -1;
+    // Top level directories may be links to directories, but nothing below them is
+    // followed, so that nothing is written into a directory of a package that was
+    // linked whole
+    struct stat st;
+    int flags = (type == NNPKG_IDX_TOP) ? 0 : AT_SYMLINK_NOFOLLOW;
+    if (fstatat (dirFd, path, &st, flags) == -1)
+        return -1;
+    return S_ISDIR (st.st_mode);
+}
+
+// Looks at what is in place of the directory of an entry being removed, at path in
+// dirFd. A link to the package's directory, as whole directories used to be
+// linked, is removed. Returns 1 if a directory of the index is there, 0 if not, or
+// -1 on error
+static int idxCheckDir (NnpkgTransCb_t* cb,
+                        int dirFd,
+                        const char* path,
+                        NnpkgIdxEntry_t* idxEnt,
+                        char** linkBuf,
+                        size_t* linkBufSz)
+{
+    struct stat st;
+    int flags = (idxEnt->type == NNPKG_IDX_TOP) ? 0 : AT_SYMLINK_NOFOLLOW;
+    if (fstatat (dirFd, path, &st, flags) == -1)
+    {
+        if (errno == ENOENT)
+            return 0;
+        goto sysErr;
+    }
+    if (S_ISDIR (st.st_mode))
+        return 1;
+    if (!S_ISLNK (st.st_mode))
+        return 0;
+    const char* srcFile = StrRefGet (idxEnt->srcFile);
+    int match = idxLinkMatches (dirFd, path, srcFile, linkBuf, linkBufSz);
+    if (match == -1)
+    {
+        cb->error = NNPKG_ERR_OOM;
+        return -1;
+    }
+    if (match)
+    {
+        if (unlinkat (dirFd, path, 0) == -1 && errno != ENOENT)
+            goto sysErr;
+        TransactCount (cb, NNPKG_COUNT_LINKS_REMOVED, 1);
+    }
+    return 0;
+sysErr:
+    cb->error = NNPKG_ERR_SYS;
+    cb->sysErrno = errno;
+    return -1;
+}
+
+// Removes directories of entries that nothing is left in, deepest first. Paths are
+// taken skip bytes into the destination of each entry, relative to dirFd
+static bool idxRemoveDirs (NnpkgTransCb_t* cb,
+                           int dirFd,
+                           NnpkgIdxEntry_t** dirs,
+                           size_t numDirs,
+                           size_t skip)
+{
+    for (size_t i = numDirs; i-- > 0;)
+    {
+        const char* path = StrRefGet (dirs[i]->destFile) + skip;
+        if (unlinkat (dirFd, path, AT_REMOVEDIR) == -1 && errno != ENOTEMPTY &&
+            errno != EEXIST && errno != ENOENT)
+        {
+            cb->error = NNPKG_ERR_SYS;
+            cb->sysErrno = errno;
+            return false;
         }
-        // Iterate through source directory
-        DIR* srcDir = opendir (UnicodeToHost (StrRefGet (curDir)));
-        if (!srcDir)
+    }
+    return true;
+}
+
+// Links entries of a list into the live index
+static bool idxWriteLinks (NnpkgTransCb_t* cb, ListHead_t* idxList)
+{
+    const char* skipDir = NULL;    // Directory whose name is taken by something else
+    size_t skipLen = 0;
+    // Iterate through list
+    ListEntry_t* entry = ListFront (idxList);
+    for (; entry; entry = ListIterate (entry))
+    {
+        NnpkgIdxEntry_t* idxEnt = ListEntryData (entry);
+        const char* srcFile = StrRefGet (idxEnt->srcFile);
+        const char* destFile = StrRefGet (idxEnt->destFile);
+        // Directories come before what is in them, so everything in one that was
+        // passed over follows it
+        if (idxInDir (destFile, skipDir, skipLen))
+            continue;
+        skipDir = NULL;
+        if (idxEnt->type != NNPKG_IDX_LINK)
         {
-            if (errno != ENOENT)
+            int made = idxMakeDir (AT_FDCWD, destFile, idxEnt->type);
+            if (made == -1)
             {
                 cb->error = NNPKG_ERR_SYS;
                 cb->sysErrno = errno;
                 TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-                StrRefDestroy (curDir);
-                ListDestroy (idxList);
-                return NULL;
+                return false;
             }
-            else
+            if (!made)
             {
-                StrRefDestroy (curDir);
-                continue;
+                skipDir = destFile;
+                skipLen = strlen (destFile);
             }
+            continue;
         }
-        // Prepare indexed path
-        StringRef32_t* idxedPath =
-            makeCatedPath (StrRefGet (cb->conf->idxPath), dirs[i]);
-        if (!idxedPath)
+        // Create symbolic link
+        if (symlink (srcFile, destFile) == -1)
         {
-            cb->error = NNPKG_ERR_OOM;
-            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-            ListDestroy (idxList);
-            StrRefDestroy (curDir);
-            return NULL;
+            if (errno != EEXIST)
+            {
+                cb->error = NNPKG_ERR_SYS;
+                cb->sysErrno = errno;
+                TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+                return false;
+            }
         }
-        struct dirent* curDirEnt = readdir (srcDir);
-        while (curDirEnt)
+        else
+            TransactCount (cb, NNPKG_COUNT_LINKS_WRITTEN, 1);
+    }
+    return true;
+}
+
+// Removes links of entries of a list from the live index
+// Entries are collected a directory at a time, so each run of entries in one
+// directory is removed through a single directory descriptor, rather than walking
+// every path from the root again. Directories are removed last, once whatever
+// other packages had in them is known to be all that is left. If dirsOnly is set,
+// only directories are removed, the links having been removed already
+static bool idxRemoveLinks (NnpkgTransCb_t* cb, ListHead_t* idxList, bool dirsOnly)
+{
+    int dirFd = -1;
+    const char* dirPath = NULL;    // Path of dirFd, up to dirLen
+    size_t dirLen = 0;
+    char* linkBuf = NULL;
+    size_t linkBufSz = 0;
+    const char* skipDir = NULL;    // Directory that isn't the index's
+    size_t skipLen = 0;
+    NnpkgIdxEntry_t** dirs = NULL;    // Directories to remove
+    size_t numDirs = 0, maxDirs = 0;
+    ListEntry_t* entry = ListFront (idxList);
+    while (entry)
+    {
+        NnpkgIdxEntry_t* idxEnt = ListEntryData (entry);
+        entry = ListIterate (entry);
+        const char* srcFile = StrRefGet (idxEnt->srcFile);
+        const char* destFile = StrRefGet (idxEnt->destFile);
+        if (idxInDir (destFile, skipDir, skipLen))
+            continue;
+        skipDir = NULL;
+        if (idxEnt->type != NNPKG_IDX_LINK)
         {
-            // SKip . and ..
-            if (!strcmp (curDirEnt->d_name, ".") ||
-                !strcmp (curDirEnt->d_name, ".."))
+            int isDir =
+                idxCheckDir (cb, AT_FDCWD, destFile, idxEnt, &linkBuf, &linkBufSz);
+            if (isDir == -1)
+                goto fail;
+            if (!isDir)
             {
-                curDirEnt = readdir (srcDir);
+                skipDir = destFile;
+                skipLen = strlen (destFile);
                 continue;
             }
-            // Create path in prefix
-            StringRef32_t* prefixPath =
-                makeCatedPathFromSys (StrRefGet (curDir), curDirEnt->d_name);
-            if (!prefixPath)
+            if (idxEnt->type == NNPKG_IDX_TOP)
+                continue;
+            if (!idxGrow ((void**) &dirs,
+                          &maxDirs,
+                          numDirs,
+                          sizeof (NnpkgIdxEntry_t*)))
             {
                 cb->error = NNPKG_ERR_OOM;
-                TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-                StrRefDestroy (curDir);
-                StrRefDestroy (idxedPath);
-                closedir (srcDir);
-                ListDestroy (idxList);
-                return NULL;
+                goto fail;
             }
-            // Create path in index
-            StringRef32_t* idxPath =
-                makeCatedPathFromSys (StrRefGet (idxedPath), curDirEnt->d_name);
-            if (!idxPath)
+            dirs[numDirs++] = idxEnt;
+            continue;
+        }
+        if (dirsOnly)
+            continue;
+        const char* baseName = strrchr (destFile, '/');
+        assert (baseName);
+        size_t destDirLen = baseName - destFile;
+        ++baseName;
+        // Start a new batch if this entry is in another directory
+        if (!dirPath || destDirLen != dirLen || memcmp (destFile, dirPath, dirLen))
+        {
+            if (dirFd != -1)
+                close (dirFd);
+            dirFd = -1;
+            char* destDir = malloc_s (destDirLen + 1);
+            if (!destDir)
             {
                 cb->error = NNPKG_ERR_OOM;
-                TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-                StrRefDestroy (curDir);
-                StrRefDestroy (idxedPath);
-                StrRefDestroy (prefixPath);
-                closedir (srcDir);
-                ListDestroy (idxList);
-                return NULL;
+                goto fail;
             }
-            // We have source and destination, prepare entry
-            NnpkgIdxEntry_t* idxEntry = malloc_s (sizeof (NnpkgIdxEntry_t));
-            if (!idxEntry)
+            memcpy (destDir, destFile, destDirLen);
+            destDir[destDirLen] = 0;
+            dirFd = open (destDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            free (destDir);
+            dirPath = destFile;
+            dirLen = destDirLen;
+            if (dirFd == -1 && errno != ENOENT)
             {
-                cb->error = NNPKG_ERR_OOM;
-                TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-                StrRefDestroy (idxPath);
-                StrRefDestroy (prefixPath);
-                StrRefDestroy (curDir);
-                StrRefDestroy (idxedPath);
-                closedir (srcDir);
-                ListDestroy (idxList);
-                return NULL;
-            }
-            idxEntry->destFile = idxPath;
-            idxEntry->srcFile = prefixPath;
-            // Add to list
-            ListAddBack (idxList, idxEntry, 0);
-            curDirEnt = readdir (srcDir);
-        }
-        StrRefDestroy (curDir);
-        StrRefDestroy (idxedPath);
-        closedir (srcDir);
+                cb->error = NNPKG_ERR_SYS;
+                cb->sysErrno = errno;
+                goto fail;
+            }
+        }
+        // Nothing to remove if the directory is gone
+        if (dirFd == -1)
+            continue;
+        // Only remove links that still point into the package, in case another
+        // package took over the name
+        int match = idxLinkMatches (dirFd, baseName, srcFile, &linkBuf, &linkBufSz);
+        if (match == -1)
+        {
+            cb->error = NNPKG_ERR_OOM;
+            goto fail;
+        }
+        if (!match)
+            continue;
+        if (unlinkat (dirFd, baseName, 0) == -1)
+        {
+            if (errno == ENOENT)
+                continue;
+            cb->error = NNPKG_ERR_SYS;
+            cb->sysErrno = errno;
+            goto fail;
+        }
+        TransactCount (cb, NNPKG_COUNT_LINKS_REMOVED, 1);
     }
-    return idxList;
+    if (dirFd != -1)
+        close (dirFd);
+    dirFd = -1;
+    if (!idxRemoveDirs (cb, AT_FDCWD, dirs, numDirs, 0))
+        goto fail;
+    memFree (dirs);
+    free (linkBuf);
+    return true;
+fail:
+    if (dirFd != -1)
+        close (dirFd);
+    memFree (dirs);
+    free (linkBuf);
+    TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+    return false;
 }
 
-// Write stuff to index
-NNPKG_PUBLIC bool IdxWriteIndex (NnpkgTransCb_t* cb, ListHead_t* idxList)
+#ifdef RENAME_EXCHANGE
+// Set once renameat2 turns out to be missing, so that indexes are written in place
+static bool idxNoExchange = false;
+
+// Index directory being rebuilt beside the live one. Only the deepest directories
+// whose own entries change are staged, and only if there are no directories in
+// them, so what a transaction copies is the links of those, never a whole tree
+typedef struct _idxstage
 {
-    // Iterate through list
-    ListEntry_t* entry = ListFront (idxList);
-    while (entry)
+    char* live;                // Path of directory readers see
+    char* stage;               // Path of staging directory
+    NnpkgIdxEntry_t** ents;    // Entries below the directory, in list order
+    size_t numEnts;            // Number of entries
+    size_t maxEnts;            // Size of ents
+    bool exists;               // If live directory was there when staging started
+    bool built;                // If entries were applied to the staging directory
+    bool inPlace;              // If entries go to the live directory instead
+    bool published;            // If the staging directory has been swapped in
+} idxStage_t;
+
+// Removes everything in a directory of links, and the directories below it
+static bool idxEmptyDir (int fd)
+{
+    int dupFd = dup (fd);
+    DIR* dir = (dupFd != -1) ? fdopendir (dupFd) : NULL;
+    if (!dir)
     {
-        NnpkgIdxEntry_t* idxEnt = ListEntryData (entry);
-        // Create symbolic link
-        char* srcFile = makeHostStr (StrRefGet (idxEnt->srcFile));
-        if (!srcFile)
+        if (dupFd != -1)
+            close (dupFd);
+        return false;
+    }
+    struct dirent* ent = NULL;
+    while ((ent = readdir (dir)))
+    {
+        const char* name = ent->d_name;
+        if (!strcmp (name, ".") || !strcmp (name, ".."))
+            continue;
+        if (unlinkat (fd, name, 0) != -1 || errno == ENOENT)
+            continue;
+        if (errno != EISDIR && errno != EPERM)
+            goto fail;
+        int subFd =
+            openat (fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (subFd == -1)
+            goto fail;
+        bool res = idxEmptyDir (subFd);
+        close (subFd);
+        if (!res || unlinkat (fd, name, AT_REMOVEDIR) == -1)
+            goto fail;
+    }
+    closedir (dir);
+    return true;
+fail:
+    closedir (dir);
+    return false;
+}
+
+// Removes a directory of links, and everything in it
+static bool idxRemoveDir (const char* path)
+{
+    int fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return errno == ENOENT;
+    bool res = idxEmptyDir (fd);
+    close (fd);
+    return res && (rmdir (path) != -1 || errno == ENOENT);
+}
+
+// Copies the links in a live directory into its staging directory, hard linking
+// them over as they are. Returns 1 once they are copied, 0 if there are directories
+// in it, which would have to be copied whole, or -1 on error
+static int idxCopyDir (int liveFd, int stageFd)
+{
+    int fd = dup (liveFd);
+    DIR* dir = (fd != -1) ? fdopendir (fd) : NULL;
+    if (!dir)
+    {
+        if (fd != -1)
+            close (fd);
+        return -1;
+    }
+    char target[PATH_MAX];
+    struct dirent* ent = NULL;
+    while ((ent = readdir (dir)))
+    {
+        const char* name = ent->d_name;
+        if (!strcmp (name, ".") || !strcmp (name, ".."))
+            continue;
+        if (ent->d_type == DT_DIR)
+            goto hasDirs;
+        if (linkat (liveFd, name, stageFd, name, 0) != -1)
+            continue;
+        // Directories can't be hard linked, and neither can links of other users
+        // where hard links are protected
+        if (errno != EPERM)
+            goto fail;
+        struct stat st;
+        if (fstatat (liveFd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            goto fail;
+        if (S_ISDIR (st.st_mode))
+            goto hasDirs;
+        if (!S_ISLNK (st.st_mode))
         {
-            cb->error = NNPKG_ERR_OOM;
-            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-            return NULL;
+            errno = EPERM;
+            goto fail;
+        }
+        ssize_t len = readlinkat (liveFd, name, target, sizeof (target));
+        if (len == -1)
+            goto fail;
+        if (len == sizeof (target))
+        {
+            errno = ENAMETOOLONG;
+            goto fail;
+        }
+        target[len] = 0;
+        if (symlinkat (target, stageFd, name) == -1)
+            goto fail;
+    }
+    closedir (dir);
+    return 1;
+hasDirs:
+    closedir (dir);
+    return 0;
+fail:
+    closedir (dir);
+    return -1;
+}
+
+// Applies entries below a directory to it, or to its staging directory. Entries
+// are applied by their path below the directory, relative to dirFd
+static bool idxApplyEntries (NnpkgTransCb_t* cb,
+                             int dirFd,
+                             const char* live,
+                             NnpkgIdxEntry_t** ents,
+                             size_t numEnts,
+                             bool removing)
+{
+    size_t liveLen = strlen (live);
+    char* linkBuf = NULL;
+    size_t linkBufSz = 0;
+    NnpkgIdxEntry_t** dirs = NULL;    // Directories to remove
+    size_t numDirs = 0, maxDirs = 0;
+    const char* skipDir = NULL;       // Directory that isn't the index's
+    size_t skipLen = 0;
+    for (size_t i = 0; i < numEnts; ++i)
+    {
+        NnpkgIdxEntry_t* idxEnt = ents[i];
+        const char* srcFile = StrRefGet (idxEnt->srcFile);
+        const char* destFile = StrRefGet (idxEnt->destFile);
+        if (idxInDir (destFile, skipDir, skipLen))
+            continue;
+        skipDir = NULL;
+        const char* path = destFile + liveLen + 1;
+        if (idxEnt->type != NNPKG_IDX_LINK)
+        {
+            int isDir = 0;
+            if (removing)
+            {
+                isDir =
+                    idxCheckDir (cb, dirFd, path, idxEnt, &linkBuf, &linkBufSz);
+            }
+            else if ((isDir = idxMakeDir (dirFd, path, idxEnt->type)) == -1)
+            {
+                cb->error = NNPKG_ERR_SYS;
+                cb->sysErrno = errno;
+            }
+            if (isDir == -1)
+                goto fail;
+            if (!isDir)
+            {
+                skipDir = destFile;
+                skipLen = strlen (destFile);
+            }
+            else if (removing)
+            {
+                if (!idxGrow ((void**) &dirs,
+                              &maxDirs,
+                              numDirs,
+                              sizeof (NnpkgIdxEntry_t*)))
+                {
+                    cb->error = NNPKG_ERR_OOM;
+                    goto fail;
+                }
+                dirs[numDirs++] = idxEnt;
+            }
+            continue;
         }
-        char* destFile = makeHostStr (StrRefGet (idxEnt->destFile));
-        if (!destFile)
+        if (!removing)
+        {
+            // As in the live index, names that are taken already are left
+            if (symlinkat (srcFile, dirFd, path) == -1)
+            {
+                if (errno == EEXIST)
+                    continue;
+                cb->error = NNPKG_ERR_SYS;
+                cb->sysErrno = errno;
+                goto fail;
+            }
+            TransactCount (cb, NNPKG_COUNT_LINKS_WRITTEN, 1);
+            continue;
+        }
+        int match = idxLinkMatches (dirFd, path, srcFile, &linkBuf, &linkBufSz);
+        if (match == -1)
         {
             cb->error = NNPKG_ERR_OOM;
-            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-            free (srcFile);
-            return NULL;
+            goto fail;
         }
-        if (symlink (srcFile, destFile) == -1 && errno != EEXIST)
+        if (!match)
+            continue;
+        if (unlinkat (dirFd, path, 0) == -1)
         {
             cb->error = NNPKG_ERR_SYS;
             cb->sysErrno = errno;
-            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-            free (srcFile);
-            free (destFile);
-            return NULL;
+            goto fail;
         }
-        free (srcFile);
-        free (destFile);
-        entry = ListIterate (entry);
+        TransactCount (cb, NNPKG_COUNT_LINKS_REMOVED, 1);
+    }
+    if (!idxRemoveDirs (cb, dirFd, dirs, numDirs, liveLen + 1))
+        goto fail;
+    memFree (dirs);
+    free (linkBuf);
+    return true;
+fail:
+    memFree (dirs);
+    free (linkBuf);
+    return false;
+}
+
+// Orders paths so that everything below a directory comes right after it
+static int idxComparePaths (const char* path1, const char* path2)
+{
+    const unsigned char* s1 = (const unsigned char*) path1;
+    const unsigned char* s2 = (const unsigned char*) path2;
+    while (*s1 && *s1 == *s2)
+    {
+        ++s1;
+        ++s2;
     }
+    int c1 = (*s1 == '/') ? 1 : (*s1 ? *s1 + 1 : 0);
+    int c2 = (*s2 == '/') ? 1 : (*s2 ? *s2 + 1 : 0);
+    return c1 - c2;
+}
+
+static int idxCompareStages (const void* a, const void* b)
+{
+    return idxComparePaths (((const idxStage_t*) a)->live,
+                            ((const idxStage_t*) b)->live);
+}
+
+// Adds the first len bytes of path as a directory to stage, unless it was the last
+// one added
+static bool idxAddStage (idxStage_t** stages,
+                         size_t* numStages,
+                         size_t* maxStages,
+                         const char* path,
+                         size_t len)
+{
+    idxStage_t* last = *numStages ? &(*stages)[*numStages - 1] : NULL;
+    if (last && !strncmp (last->live, path, len) && !last->live[len])
+        return true;
+    if (!idxGrow ((void**) stages, maxStages, *numStages, sizeof (idxStage_t)))
+        return false;
+    char* live = malloc_s (len + 1);
+    if (!live)
+        return false;
+    memcpy (live, path, len);
+    live[len] = 0;
+    idxStage_t* stage = &(*stages)[(*numStages)++];
+    memset (stage, 0, sizeof (idxStage_t));
+    stage->live = live;
     return true;
 }
+
+// Finds the directories to stage. Those are the directories links are added to or
+// removed from, and directories that are new to the index, which are built whole
+// and renamed into place. Directories only removed are left empty, and removed in
+// place once the rest is published. Directories below another one that is staged
+// are left to that one
+static bool idxFindStages (NnpkgTransCb_t* cb,
+                           ListHead_t** idxLists,
+                           size_t numLists,
+                           bool removing,
+                           idxStage_t** stages,
+                           size_t* numStages)
+{
+    size_t maxStages = 0;
+    for (size_t i = 0; i < numLists; ++i)
+    {
+        const char* skipDir = NULL;    // Directory that isn't the index's, or is new
+        size_t skipLen = 0;
+        ListEntry_t* entry = ListFront (idxLists[i]);
+        for (; entry; entry = ListIterate (entry))
+        {
+            NnpkgIdxEntry_t* idxEnt = ListEntryData (entry);
+            const char* destFile = StrRefGet (idxEnt->destFile);
+            if (idxInDir (destFile, skipDir, skipLen))
+                continue;
+            skipDir = NULL;
+            size_t len = 0;
+            if (idxEnt->type == NNPKG_IDX_LINK)
+                len = strrchr (destFile, '/') - destFile;
+            else
+            {
+                // Top level directories may be links to directories
+                struct stat st;
+                int flags =
+                    (idxEnt->type == NNPKG_IDX_TOP) ? 0 : AT_SYMLINK_NOFOLLOW;
+                if (fstatat (AT_FDCWD, destFile, &st, flags) != -1 &&
+                    S_ISDIR (st.st_mode))
+                {
+                    continue;
+                }
+                if (errno != ENOENT && errno != ENOTDIR)
+                    goto sysErr;
+                skipDir = destFile;
+                skipLen = strlen (destFile);
+                if (removing || errno != ENOENT)
+                    continue;
+                len = skipLen;
+            }
+            if (!idxAddStage (stages, numStages, &maxStages, destFile, len))
+            {
+                cb->error = NNPKG_ERR_OOM;
+                return false;
+            }
+        }
+    }
+    if (!*numStages)
+        return true;
+    qsort (*stages, *numStages, sizeof (idxStage_t), idxCompareStages);
+    // Drop repeats, and directories in directories that are staged
+    size_t numKept = 0;
+    for (size_t i = 0; i < *numStages; ++i)
+    {
+        idxStage_t* stage = &(*stages)[i];
+        idxStage_t* last = numKept ? &(*stages)[numKept - 1] : NULL;
+        if (last && (!strcmp (stage->live, last->live) ||
+                     idxInDir (stage->live, last->live, strlen (last->live))))
+        {
+            free (stage->live);
+            continue;
+        }
+        (*stages)[numKept++] = *stage;
+    }
+    *numStages = numKept;
+    return true;
+sysErr:
+    cb->error = NNPKG_ERR_SYS;
+    cb->sysErrno = errno;
+    return false;
+}
+
+// Finds the staged directory that an entry is below, if any
+static idxStage_t* idxFindStage (idxStage_t* stages,
+                                 size_t numStages,
+                                 const char* path)
+{
+    // Only the last directory that comes before the path can hold it
+    size_t low = 0, high = numStages;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (idxComparePaths (stages[mid].live, path) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (!low)
+        return NULL;
+    idxStage_t* stage = &stages[low - 1];
+    return idxInDir (path, stage->live, strlen (stage->live)) ? stage : NULL;
+}
+
+// Builds a directory's new contents in its staging directory
+static bool idxBuildStage (NnpkgTransCb_t* cb, idxStage_t* stage, bool removing)
+{
+    const char* live = stage->live;
+    // Staging directories are hidden beside the live ones, so that they're on the
+    // same file system
+    const char* name = strrchr (live, '/') + 1;
+    size_t stageLen = strlen (live) + 8;
+    stage->stage = malloc_s (stageLen);
+    if (!stage->stage)
+    {
+        cb->error = NNPKG_ERR_OOM;
+        return false;
+    }
+    snprintf (stage->stage,
+              stageLen,
+              "%.*s.%s.stage",
+              (int) (name - live),
+              live,
+              name);
+    // Clear out what a failed update left behind
+    if (!idxRemoveDir (stage->stage))
+        goto sysErr;
+    int liveFd = open (live, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (liveFd == -1 && errno != ENOENT)
+        goto sysErr;
+    stage->exists = liveFd != -1;
+    // Keep the mode of the live directory
+    struct stat st;
+    st.st_mode = 0755;
+    if (stage->exists && fstat (liveFd, &st) == -1)
+    {
+        close (liveFd);
+        goto sysErr;
+    }
+    if (mkdir (stage->stage, st.st_mode & 07777) == -1)
+    {
+        if (liveFd != -1)
+            close (liveFd);
+        goto sysErr;
+    }
+    int stageFd = open (stage->stage, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int copied = -1;
+    if (stageFd != -1)
+        copied = stage->exists ? idxCopyDir (liveFd, stageFd) : 1;
+    if (copied != 1)
+    {
+        int err = errno;
+        if (stageFd != -1)
+            close (stageFd);
+        if (liveFd != -1)
+            close (liveFd);
+        errno = err;
+        // Directories that have others in them are changed in place, rather than
+        // copied whole with the lock held
+        stage->inPlace = !copied;
+        if (stage->inPlace)
+            return true;
+        goto sysErr;
+    }
+    if (liveFd != -1)
+        close (liveFd);
+    stage->built = true;
+    bool res =
+        idxApplyEntries (cb, stageFd, live, stage->ents, stage->numEnts, removing);
+    close (stageFd);
+    return res;
+sysErr:
+    cb->error = NNPKG_ERR_SYS;
+    cb->sysErrno = errno;
+    return false;
+}
+
+// Applies the entries of a staged directory to the live one instead, when the two
+// can't be swapped or the directory isn't staged after all
+static bool idxApplyLive (NnpkgTransCb_t* cb, idxStage_t* stage, bool removing)
+{
+    int liveFd = open (stage->live, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (liveFd == -1)
+    {
+        cb->error = NNPKG_ERR_SYS;
+        cb->sysErrno = errno;
+        return false;
+    }
+    // Links were counted as the stage was built
+    uint64_t written = 0, removed = 0;
+    bool counted = stage->built && cb->state >= 0 && cb->state < NNPKG_NUM_STATES;
+    if (counted)
+    {
+        written = cb->stats.counts[cb->state][NNPKG_COUNT_LINKS_WRITTEN];
+        removed = cb->stats.counts[cb->state][NNPKG_COUNT_LINKS_REMOVED];
+    }
+    bool res = idxApplyEntries (cb,
+                                liveFd,
+                                stage->live,
+                                stage->ents,
+                                stage->numEnts,
+                                removing);
+    close (liveFd);
+    if (counted)
+    {
+        cb->stats.counts[cb->state][NNPKG_COUNT_LINKS_WRITTEN] = written;
+        cb->stats.counts[cb->state][NNPKG_COUNT_LINKS_REMOVED] = removed;
+    }
+    return res;
+}
+
+// Updates the index by building each directory that changes in a staging
+// directory beside it, then swapping the two. Readers see either all or none of
+// the changes to a directory, and nothing in the live index is touched until every
+// directory has been built, so publishing is one rename per directory. If one
+// can't be published, the ones that were are swapped back. Where the file system
+// can't swap directories, the changes are made in place once the rest are
+// published, as are directories that have others in them
+static bool idxUpdateStaged (NnpkgTransCb_t* cb,
+                             ListHead_t** idxLists,
+                             size_t numLists,
+                             bool removing)
+{
+    idxStage_t* stages = NULL;
+    size_t numStages = 0;
+    bool res =
+        idxFindStages (cb, idxLists, numLists, removing, &stages, &numStages);
+    // Hand each entry to the directory it is staged in
+    for (size_t i = 0; res && i < numLists; ++i)
+    {
+        ListEntry_t* entry = ListFront (idxLists[i]);
+        for (; res && entry; entry = ListIterate (entry))
+        {
+            NnpkgIdxEntry_t* idxEnt = ListEntryData (entry);
+            idxStage_t* stage =
+                idxFindStage (stages, numStages, StrRefGet (idxEnt->destFile));
+            if (!stage)
+                continue;
+            if (!idxGrow ((void**) &stage->ents,
+                          &stage->maxEnts,
+                          stage->numEnts,
+                          sizeof (NnpkgIdxEntry_t*)))
+            {
+                cb->error = NNPKG_ERR_OOM;
+                res = false;
+                break;
+            }
+            stage->ents[stage->numEnts++] = idxEnt;
+        }
+    }
+    for (size_t i = 0; res && i < numStages; ++i)
+        res = idxBuildStage (cb, &stages[i], removing);
+    // Publish every directory
+    for (size_t i = 0; res && i < numStages; ++i)
+    {
+        idxStage_t* stage = &stages[i];
+        if (stage->inPlace)
+            continue;
+        int ret = 0;
+        if (stage->exists)
+        {
+            ret = renameat2 (AT_FDCWD,
+                             stage->stage,
+                             AT_FDCWD,
+                             stage->live,
+                             RENAME_EXCHANGE);
+        }
+        else
+            ret = rename (stage->stage, stage->live);
+        if (ret == -1 && (errno == EINVAL || errno == ENOSYS))
+        {
+            if (errno == ENOSYS)
+                __atomic_store_n (&idxNoExchange, true, __ATOMIC_RELAXED);
+            stage->inPlace = true;
+            continue;
+        }
+        if (ret == -1)
+        {
+            cb->error = NNPKG_ERR_SYS;
+            cb->sysErrno = errno;
+            res = false;
+        }
+        stage->published = !ret;
+    }
+    for (size_t i = 0; res && i < numStages; ++i)
+    {
+        if (stages[i].inPlace)
+            res = idxApplyLive (cb, &stages[i], removing);
+    }
+    // Put back what was published if the rest couldn't be, so that the live index
+    // keeps none of a transaction that failed
+    for (size_t i = 0; !res && i < numStages; ++i)
+    {
+        idxStage_t* stage = &stages[i];
+        if (!stage->published)
+            continue;
+        int ret = 0;
+        if (stage->exists)
+        {
+            ret = renameat2 (AT_FDCWD,
+                             stage->stage,
+                             AT_FDCWD,
+                             stage->live,
+                             RENAME_EXCHANGE);
+        }
+        else
+            ret = rename (stage->live, stage->stage);
+        stage->published = ret == -1;
+    }
+    // Throw away old directories once everything is published. Otherwise the
+    // staging directories hold the new ones, and are thrown away instead, unless
+    // they couldn't be put back
+    for (size_t i = 0; i < numStages; ++i)
+    {
+        idxStage_t* stage = &stages[i];
+        if (stage->stage && (!stage->published || (res && stage->exists)))
+            idxRemoveDir (stage->stage);
+        free (stage->live);
+        free (stage->stage);
+        memFree (stage->ents);
+    }
+    memFree (stages);
+    if (!res)
+    {
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return false;
+    }
+    // Directories that nothing is left in go once the rest is published
+    for (size_t i = 0; removing && i < numLists; ++i)
+    {
+        if (!idxRemoveLinks (cb, idxLists[i], true))
+            return false;
+    }
+    return true;
+}
+#endif
+
+NNPKG_PUBLIC bool IdxWriteIndexes (NnpkgTransCb_t* cb,
+                                   ListHead_t** idxLists,
+                                   size_t numLists)
+{
+    NNPKG_TRACE_SPAN ("IdxWriteIndexes");
+#ifdef RENAME_EXCHANGE
+    if (cb->conf && cb->conf->stagedIdx &&
+        !__atomic_load_n (&idxNoExchange, __ATOMIC_RELAXED))
+    {
+        return idxUpdateStaged (cb, idxLists, numLists, false);
+    }
+#endif
+    for (size_t i = 0; i < numLists; ++i)
+    {
+        if (!idxWriteLinks (cb, idxLists[i]))
+            return false;
+    }
+    return true;
+}
+
+// Write stuff to index
+NNPKG_PUBLIC bool IdxWriteIndex (NnpkgTransCb_t* cb, ListHead_t* idxList)
+{
+    NNPKG_TRACE_SPAN ("IdxWriteIndex");
+    return IdxWriteIndexes (cb, &idxList, 1);
+}
+
+NNPKG_PUBLIC bool IdxRemoveIndexes (NnpkgTransCb_t* cb,
+                                    ListHead_t** idxLists,
+                                    size_t numLists)
+{
+    NNPKG_TRACE_SPAN ("IdxRemoveIndexes");
+#ifdef RENAME_EXCHANGE
+    if (cb->conf && cb->conf->stagedIdx &&
+        !__atomic_load_n (&idxNoExchange, __ATOMIC_RELAXED))
+    {
+        return idxUpdateStaged (cb, idxLists, numLists, true);
+    }
+#endif
+    for (size_t i = 0; i < numLists; ++i)
+    {
+        if (!idxRemoveLinks (cb, idxLists[i], false))
+            return false;
+    }
+    return true;
+}
+
+// Removes stuff from index
+NNPKG_PUBLIC bool IdxRemoveEntries (NnpkgTransCb_t* cb, ListHead_t* idxList)
+{
+    NNPKG_TRACE_SPAN ("IdxRemoveEntries");
+    return IdxRemoveIndexes (cb, &idxList, 1);
+}
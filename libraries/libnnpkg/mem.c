@@ -0,0 +1,169 @@
+/*
+    mem.c - contains memory accounting functions
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file mem.c
+
+#include <assert.h>
+#include <libnex/safemalloc.h>
+#include <nnpkg/mem.h>
+#include <string.h>
+
+// Header in front of accounted blocks. It is kept whether accounting is on or
+// not, so that blocks can be freed correctly if it is turned on halfway
+typedef union _memhdr
+{
+    struct
+    {
+        size_t size;     ///< Size of block, without header
+        int subsys;      ///< Subsystem block is charged to
+        bool counted;    ///< If block was allocated while accounting was on
+    };
+    max_align_t align;    ///< Keeps blocks aligned
+} memHdr_t;
+
+static bool memOn = false;
+static NnpkgMemStats_t memStats[NNPKG_NUM_MEM];
+
+static const char* memSubsysNames[] =
+    {"propdb", "strtab", "pkgdb", "pkgconf", "index", "total"};
+
+// Raises a peak to bytes if bytes is higher
+static inline void memRaisePeak (int64_t* peak, int64_t bytes)
+{
+    int64_t cur = __atomic_load_n (peak, __ATOMIC_RELAXED);
+    while (bytes > cur && !__atomic_compare_exchange_n (peak,
+                                                        &cur,
+                                                        bytes,
+                                                        true,
+                                                        __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED))
+        ;
+}
+
+// Adds delta bytes to a subsystem and to the total, counting an allocation or a
+// free
+static void memAccount (int subsys, int64_t delta, bool isAlloc)
+{
+    assert (subsys >= 0 && subsys < NNPKG_MEM_TOTAL);
+    NnpkgMemStats_t* stats[] = {&memStats[subsys], &memStats[NNPKG_MEM_TOTAL]};
+    for (int i = 0; i < 2; ++i)
+    {
+        if (isAlloc)
+            __atomic_add_fetch (&stats[i]->allocs, 1, __ATOMIC_RELAXED);
+        else
+            __atomic_add_fetch (&stats[i]->frees, 1, __ATOMIC_RELAXED);
+        int64_t bytes =
+            __atomic_add_fetch (&stats[i]->bytes, delta, __ATOMIC_RELAXED);
+        memRaisePeak (&stats[i]->peak, bytes);
+    }
+}
+
+NNPKG_PUBLIC void MemStatsEnable()
+{
+    __atomic_store_n (&memOn, true, __ATOMIC_RELAXED);
+}
+
+NNPKG_PUBLIC void MemStatsGet (int subsys, NnpkgMemStats_t* out)
+{
+    assert (subsys >= 0 && subsys < NNPKG_NUM_MEM);
+    out->allocs = __atomic_load_n (&memStats[subsys].allocs, __ATOMIC_RELAXED);
+    out->frees = __atomic_load_n (&memStats[subsys].frees, __ATOMIC_RELAXED);
+    out->bytes = __atomic_load_n (&memStats[subsys].bytes, __ATOMIC_RELAXED);
+    out->peak = __atomic_load_n (&memStats[subsys].peak, __ATOMIC_RELAXED);
+}
+
+NNPKG_PUBLIC void MemStatsResetPeaks()
+{
+    for (int i = 0; i < NNPKG_NUM_MEM; ++i)
+    {
+        int64_t bytes = __atomic_load_n (&memStats[i].bytes, __ATOMIC_RELAXED);
+        __atomic_store_n (&memStats[i].peak, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+NNPKG_PUBLIC const char* MemGetSubsysName (int subsys)
+{
+    if (subsys < 0 || subsys >= NNPKG_NUM_MEM)
+        return "unknown";
+    return memSubsysNames[subsys];
+}
+
+// Fills in header of a new block, returning the block
+static void* memStartBlock (memHdr_t* hdr, int subsys, size_t sz)
+{
+    hdr->size = sz;
+    hdr->subsys = subsys;
+    hdr->counted = __atomic_load_n (&memOn, __ATOMIC_RELAXED);
+    if (hdr->counted)
+        memAccount (subsys, (int64_t) sz, true);
+    return hdr + 1;
+}
+
+void* memAlloc (int subsys, size_t sz)
+{
+    memHdr_t* hdr = malloc_s (sizeof (memHdr_t) + sz);
+    if (!hdr)
+        return NULL;
+    return memStartBlock (hdr, subsys, sz);
+}
+
+void* memCalloc (int subsys, size_t sz)
+{
+    memHdr_t* hdr = calloc_s (sizeof (memHdr_t) + sz);
+    if (!hdr)
+        return NULL;
+    return memStartBlock (hdr, subsys, sz);
+}
+
+void* memRealloc (int subsys, void* p, size_t sz)
+{
+    if (!p)
+        return memAlloc (subsys, sz);
+    memHdr_t* hdr = (memHdr_t*) p - 1;
+    assert (hdr->subsys == subsys);
+    size_t oldSz = hdr->size;
+    bool counted = hdr->counted;
+    memHdr_t* newHdr = realloc_s (hdr, sizeof (memHdr_t) + sz);
+    if (!newHdr)
+        return NULL;
+    // Moving a block counts as freeing the old one and allocating a new one
+    if (counted)
+        memAccount (subsys, -(int64_t) oldSz, false);
+    return memStartBlock (newHdr, subsys, sz);
+}
+
+void memFree (void* p)
+{
+    if (!p)
+        return;
+    memHdr_t* hdr = (memHdr_t*) p - 1;
+    if (hdr->counted)
+        memAccount (hdr->subsys, -(int64_t) hdr->size, false);
+    free (hdr);
+}
+
+void memCharge (int subsys, size_t sz)
+{
+    if (__atomic_load_n (&memOn, __ATOMIC_RELAXED))
+        memAccount (subsys, (int64_t) sz, true);
+}
+
+void memUncharge (int subsys, size_t sz)
+{
+    if (__atomic_load_n (&memOn, __ATOMIC_RELAXED))
+        memAccount (subsys, -(int64_t) sz, false);
+}
@@ -20,10 +20,13 @@
 #include <assert.h>
 #include <libnex/list.h>
 #include <libnex/safemalloc.h>
+#include <nnpkg/graph.h>
+#include <nnpkg/mem.h>
 #include <nnpkg/pkg.h>
+#include <string.h>
 
-static ListHead_t* pkgDbs = NULL;          // List of package databases
-static NnpkgPackageDb_t* destDb = NULL;    // Destination database
+char* pkgUtf32ToUtf8 (const char32_t* s);
+char32_t* pkgUtf8ToUtf32 (const char* s);
 
 void pkgDbDestroy (const Object_t* obj)
 {
@@ -32,10 +35,12 @@ void pkgDbDestroy (const Object_t* obj)
     free (pkgDb);
 }
 
-NNPKG_PUBLIC bool PkgOpenDb (NnpkgTransCb_t* cb,
-                             NnpkgDbLocation_t* dbPath,
-                             unsigned short type,
-                             unsigned short location)
+// Opens up a package database, shared or not
+static bool pkgOpenDb (NnpkgTransCb_t* cb,
+                       NnpkgDbLocation_t* dbPath,
+                       unsigned short type,
+                       unsigned short location,
+                       bool shared)
 {
     NnpkgPackageDb_t* pkgDb = malloc_s (sizeof (NnpkgPackageDb_t));
     if (!pkgDb)
@@ -50,7 +55,10 @@ NNPKG_PUBLIC bool PkgOpenDb (NnpkgTransCb_t* cb,
     assert (location && location <= NNPKGDB_LOCATION_REMOTE);
     pkgDb->type = type;
     pkgDb->location = location;
-    pkgDb->propDb = PkgDbOpen (cb, dbPath);
+    if (shared)
+        pkgDb->propDb = PkgDbOpenShared (cb, dbPath);
+    else
+        pkgDb->propDb = PkgDbOpen (cb, dbPath);
     if (!pkgDb->propDb)
     {
         free (pkgDb);
@@ -59,38 +67,59 @@ NNPKG_PUBLIC bool PkgOpenDb (NnpkgTransCb_t* cb,
     // See if this is the destination database
     if (type == NNPKGDB_TYPE_DEST)
     {
-        assert (!destDb);
-        destDb = pkgDb;
+        assert (!cb->destDb);
+        cb->destDb = pkgDb;
     }
     // Add to list
-    if (!pkgDbs)
+    if (!cb->pkgDbs)
     {
-        pkgDbs =
+        cb->pkgDbs =
             ListCreate ("NnpkgPackageDb_t", true, offsetof (NnpkgPackageDb_t, obj));
-        cb->pkgDbs = pkgDbs;
     }
-    ListAddBack (pkgDbs, pkgDb, 0);
+    ListAddBack (cb->pkgDbs, pkgDb, 0);
     return true;
 }
 
+NNPKG_PUBLIC bool PkgOpenDb (NnpkgTransCb_t* cb,
+                             NnpkgDbLocation_t* dbPath,
+                             unsigned short type,
+                             unsigned short location)
+{
+    return pkgOpenDb (cb, dbPath, type, location, false);
+}
+
+NNPKG_PUBLIC bool PkgOpenDbShared (NnpkgTransCb_t* cb,
+                                   NnpkgDbLocation_t* dbPath,
+                                   unsigned short type,
+                                   unsigned short location)
+{
+    return pkgOpenDb (cb, dbPath, type, location, true);
+}
+
+NNPKG_PUBLIC bool PkgLockDestDb (NnpkgTransCb_t* cb)
+{
+    assert (cb->destDb);
+    return PropDbLock (cb, cb->destDb->propDb);
+}
+
 NNPKG_PUBLIC bool PkgAddPackage (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg)
 {
-    assert (destDb);
-    return PkgDbAddPackage (cb, destDb->propDb, pkg);
+    assert (cb->destDb);
+    return PkgDbAddPackage (cb, cb->destDb->propDb, pkg);
 }
 
 NNPKG_PUBLIC bool PkgRemovePackage (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg)
 {
-    assert (destDb);
-    return PkgDbRemovePackage (cb, destDb->propDb, pkg);
+    assert (cb->destDb);
+    return PkgDbRemovePackage (cb, cb->destDb->propDb, pkg);
 }
 
 NNPKG_PUBLIC NnpkgPackage_t* PkgFindPackage (NnpkgTransCb_t* cb,
                                              const char32_t* name)
 {
-    assert (pkgDbs);
+    assert (cb->pkgDbs);
     // Iterate through all databases
-    ListEntry_t* curEntry = ListFront (pkgDbs);
+    ListEntry_t* curEntry = ListFront (cb->pkgDbs);
     while (curEntry)
     {
         NnpkgPackageDb_t* pkgDb = ListEntryData (curEntry);
@@ -102,9 +131,265 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgFindPackage (NnpkgTransCb_t* cb,
     return NULL;
 }
 
-NNPKG_PUBLIC void PkgCloseDbs()
+NNPKG_PUBLIC NnpkgPackage_t* PkgFindPackageLazy (NnpkgTransCb_t* cb,
+                                                 const char32_t* name)
+{
+    assert (cb->pkgDbs);
+    // Iterate through all databases
+    ListEntry_t* curEntry = ListFront (cb->pkgDbs);
+    while (curEntry)
+    {
+        NnpkgPackageDb_t* pkgDb = ListEntryData (curEntry);
+        NnpkgPackage_t* pkg = PkgDbFindPackageLazy (cb, pkgDb->propDb, name);
+        if (pkg)
+            return pkg;
+        curEntry = ListIterate (curEntry);
+    }
+    return NULL;
+}
+
+NNPKG_PUBLIC bool PkgFindPackages (NnpkgTransCb_t* cb,
+                                   const char32_t** names,
+                                   size_t numNames,
+                                   NnpkgPackage_t** pkgs)
+{
+    assert (cb->pkgDbs);
+    memset (pkgs, 0, numNames * sizeof (NnpkgPackage_t*));
+    // Names not found yet, and where their packages go
+    const char32_t** left =
+        memAlloc (NNPKG_MEM_PKGDB, numNames * sizeof (const char32_t*));
+    size_t* leftIdx = memAlloc (NNPKG_MEM_PKGDB, numNames * sizeof (size_t));
+    NnpkgPackage_t** found =
+        memAlloc (NNPKG_MEM_PKGDB, numNames * sizeof (NnpkgPackage_t*));
+    if (!left || !leftIdx || !found)
+    {
+        memFree (left);
+        memFree (leftIdx);
+        memFree (found);
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return false;
+    }
+    for (size_t i = 0; i < numNames; ++i)
+    {
+        left[i] = names[i];
+        leftIdx[i] = i;
+    }
+    size_t numLeft = numNames;
+    // Each database is only asked for the names earlier ones didn't have
+    ListEntry_t* curEntry = ListFront (cb->pkgDbs);
+    while (curEntry && numLeft)
+    {
+        NnpkgPackageDb_t* pkgDb = ListEntryData (curEntry);
+        if (!PkgDbFindPackages (cb, pkgDb->propDb, left, numLeft, found))
+        {
+            for (size_t i = 0; i < numNames; ++i)
+            {
+                if (pkgs[i])
+                    ObjDestroy (&pkgs[i]->obj);
+                pkgs[i] = NULL;
+            }
+            memFree (left);
+            memFree (leftIdx);
+            memFree (found);
+            return false;
+        }
+        size_t newLeft = 0;
+        for (size_t i = 0; i < numLeft; ++i)
+        {
+            if (found[i])
+                pkgs[leftIdx[i]] = found[i];
+            else
+            {
+                left[newLeft] = left[i];
+                leftIdx[newLeft++] = leftIdx[i];
+            }
+        }
+        numLeft = newLeft;
+        curEntry = ListIterate (curEntry);
+    }
+    memFree (left);
+    memFree (leftIdx);
+    memFree (found);
+    return true;
+}
+
+NNPKG_PUBLIC NnpkgPackage_t* PkgFindPackageUtf8 (NnpkgTransCb_t* cb,
+                                                 const char* name)
+{
+    char32_t* name32 = pkgUtf8ToUtf32 (name);
+    if (!name32)
+    {
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return NULL;
+    }
+    NnpkgPackage_t* pkg = PkgFindPackage (cb, name32);
+    free (name32);
+    return pkg;
+}
+
+NNPKG_PUBLIC NnpkgPackage_t* PkgFindPackageLazyUtf8 (NnpkgTransCb_t* cb,
+                                                     const char* name)
+{
+    char32_t* name32 = pkgUtf8ToUtf32 (name);
+    if (!name32)
+    {
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return NULL;
+    }
+    NnpkgPackage_t* pkg = PkgFindPackageLazy (cb, name32);
+    free (name32);
+    return pkg;
+}
+
+NNPKG_PUBLIC bool PkgFindPackagesUtf8 (NnpkgTransCb_t* cb,
+                                       const char** names,
+                                       size_t numNames,
+                                       NnpkgPackage_t** pkgs)
+{
+    char32_t** names32 = calloc_s (numNames * sizeof (char32_t*));
+    bool res = names32 != NULL;
+    for (size_t i = 0; res && i < numNames; ++i)
+    {
+        names32[i] = pkgUtf8ToUtf32 (names[i]);
+        res = names32[i] != NULL;
+    }
+    if (!res)
+    {
+        memset (pkgs, 0, numNames * sizeof (NnpkgPackage_t*));
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+    }
+    else
+        res = PkgFindPackages (cb, (const char32_t**) names32, numNames, pkgs);
+    for (size_t i = 0; names32 && i < numNames; ++i)
+        free (names32[i]);
+    free (names32);
+    return res;
+}
+
+// Gets the UTF-8 form of a package string, making it if need be
+// Several threads may race to make it, in which case one of them wins and the
+// others throw theirs away
+static const char* pkgGetUtf8 (char** cached, StringRef32_t* str)
+{
+    char* utf8 = __atomic_load_n (cached, __ATOMIC_ACQUIRE);
+    if (utf8 || !str)
+        return utf8;
+    utf8 = pkgUtf32ToUtf8 (StrRefGet (str));
+    if (!utf8)
+        return NULL;
+    char* expected = NULL;
+    if (!__atomic_compare_exchange_n (cached,
+                                      &expected,
+                                      utf8,
+                                      false,
+                                      __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE))
+    {
+        free (utf8);
+        return expected;
+    }
+    return utf8;
+}
+
+NNPKG_PUBLIC const char* PkgGetIdUtf8 (NnpkgPackage_t* pkg)
+{
+    return pkgGetUtf8 (&pkg->idUtf8, pkg->id);
+}
+
+NNPKG_PUBLIC const char* PkgGetDescriptionUtf8 (NnpkgPackage_t* pkg)
+{
+    return pkgGetUtf8 (&pkg->descriptionUtf8, pkg->description);
+}
+
+NNPKG_PUBLIC const char* PkgGetPrefixUtf8 (NnpkgPackage_t* pkg)
+{
+    return pkgGetUtf8 (&pkg->prefixUtf8, pkg->prefix);
+}
+
+NNPKG_PUBLIC ListHead_t* PkgFindOrphans (NnpkgTransCb_t* cb)
+{
+    assert (cb->destDb);
+    ListHead_t* orphans =
+        ListCreate ("NnpkgPackage_t", true, offsetof (NnpkgPackage_t, obj));
+    if (!orphans)
+    {
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return NULL;
+    }
+    // Mark and sweep over the dependency graph, rather than looking up the
+    // dependents of every package
+    NnpkgGraph_t* graph = PkgGraphBuild (cb, cb->destDb->propDb);
+    if (!graph)
+    {
+        ListDestroy (orphans);
+        return NULL;
+    }
+    uint32_t* nodes = NULL;
+    size_t numNodes = 0;
+    if (!PkgGraphFindOrphans (cb, graph, &nodes, &numNodes))
+    {
+        PkgGraphDestroy (graph);
+        ListDestroy (orphans);
+        return NULL;
+    }
+    PkgGraphDestroy (graph);
+    for (size_t i = 0; i < numNodes; ++i)
+    {
+        // Nodes are numbered after slots
+        NnpkgPackage_t* pkg =
+            PkgDbGetPackageBySlot (cb, cb->destDb->propDb, nodes[i] + 1);
+        if (!pkg || !ListAddBack (orphans, pkg, 0))
+        {
+            if (pkg)
+                ObjDeRef (&pkg->obj);
+            if (cb->state != NNPKG_TRANS_STATE_ERR)
+            {
+                cb->error = NNPKG_ERR_OOM;
+                TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+            }
+            free (nodes);
+            ListDestroy (orphans);
+            return NULL;
+        }
+    }
+    free (nodes);
+    return orphans;
+}
+
+NNPKG_PUBLIC bool PkgCheckRemovable (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg)
+{
+    assert (cb->destDb);
+    NnpkgGraph_t* graph = PkgGraphBuild (cb, cb->destDb->propDb);
+    if (!graph)
+        return false;
+    uint32_t node = PkgGraphFindNode (graph, StrRefGet (pkg->id));
+    uint32_t dependent = NNPKG_GRAPH_NO_NODE;
+    if (node != NNPKG_GRAPH_NO_NODE)
+        dependent = PkgGraphFindDependent (graph, node);
+    if (dependent != NNPKG_GRAPH_NO_NODE)
+    {
+        cb->error = NNPKG_ERR_PKG_NEEDED;
+        cb->errHint[0] = StrRefNew (pkg->id);
+        // The name lives in the string table, not the graph
+        cb->errHint[1] = StrRefCreate (PkgGraphGetName (graph, dependent));
+        StrRefNoFree (cb->errHint[1]);
+        PkgGraphDestroy (graph);
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return false;
+    }
+    PkgGraphDestroy (graph);
+    return true;
+}
+
+NNPKG_PUBLIC void PkgCloseDbs (NnpkgTransCb_t* cb)
 {
-    ListDestroy (pkgDbs);
-    destDb = NULL;
-    pkgDbs = NULL;
+    if (cb->pkgDbs)
+        ListDestroy (cb->pkgDbs);
+    cb->destDb = NULL;
+    cb->pkgDbs = NULL;
 }
@@ -19,24 +19,37 @@
 
 #include <assert.h>
 #include <libconf.h>
+#include <libnex/base.h>
 #include <libnex/error.h>
 #include <libnex/list.h>
 #include <libnex/safemalloc.h>
 #include <libnex/unicode.h>
+#include <nnpkg/mem.h>
 #include <nnpkg/pkg.h>
+#include <nnpkg/resolver.h>
+#include <nnpkg/trace.h>
+#include <limits.h>
+#include <nnpkg/workpool.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
-
-// Configuration line number
-static int lineNo = 0;
+#include <sys/stat.h>
 
 #define EXPECTING_SETTINGS 1
 
-// What we are expecting
-static int expecting = 0;
+// State of a configuration file being read. It lives on the reader's stack, so
+// that several files can be read at once
+typedef struct _pkgconfparser
+{
+    const char* file;          ///< Name of file being read
+    int lineNo;                ///< Configuration line number
+    int expecting;             ///< What we are expecting
+    StringRef32_t* curProp;    ///< Current property being operated on
+    NnpkgMainConf_t* conf;     ///< Configuration being filled in
+} pkgConfParser_t;
 
-// Current property being operated on
-static StringRef32_t* curProp = NULL;
+// libconf keeps its parser state in globals, so only one thread may be in it
+static pthread_mutex_t pkgConfLock = PTHREAD_MUTEX_INITIALIZER;
 
 union val
 {
@@ -44,32 +57,68 @@ union val
     StringRef32_t* strVal;
 };
 
-// Configuration structure
-static NnpkgMainConf_t conf = {0};
+void pkgDestroy (const Object_t* obj);
+NnpkgPackage_t* confCacheLoad (const char* cacheDir, const char* file);
+void confCacheStore (const char* cacheDir,
+                     const char* file,
+                     const struct stat* srcSt,
+                     NnpkgPackage_t* pkg);
+bool mainConfCacheLoad (const char* cacheDir,
+                        const char* file,
+                        NnpkgMainConf_t* conf);
+void mainConfCacheStore (const char* cacheDir,
+                         const char* file,
+                         const struct stat* srcSt,
+                         NnpkgMainConf_t* conf);
 
-NnpkgPackage_t* pkgDbFindPackage (NnpkgTransCb_t* cb,
-                                  NnpkgPropDb_t* db,
-                                  const char32_t* name,
-                                  bool findingDep);
+// Parses a configuration file into a tree of blocks
+static ListHead_t* pkgConfLoad (const char* file)
+{
+    pthread_mutex_lock (&pkgConfLock);
+    ListHead_t* blocks = ConfInit (file);
+    pthread_mutex_unlock (&pkgConfLock);
+    return blocks;
+}
 
-void pkgDestroy (const Object_t* obj);
+char* pkgUtf32ToHost (const char32_t* s);
 
-NNPKG_PUBLIC NnpkgMainConf_t* PkgGetMainConf()
+// Converts a string value to host encoding
+static StringRef_t* pkgConfToHost (StringRef32_t* str)
 {
-    return &conf;
+    char* hostStr = pkgUtf32ToHost (StrRefGet (str));
+    return hostStr ? StrRefCreate (hostStr) : NULL;
 }
 
-bool pkgConfAddProperty (StringRef32_t* newProp,
+// Prints an error at a line of a configuration file, with str put in place of the
+// %s in fmt. str is converted on a buffer of its own, rather than UnicodeToHost's
+// static one, as configuration files are read on several threads at once
+static void pkgConfError (const char* file,
+                          int lineNo,
+                          const char* fmt,
+                          StringRef32_t* str)
+{
+    StringRef_t* hostStr = pkgConfToHost (str);
+    char msg[512];
+    snprintf (msg, sizeof (msg), fmt, hostStr ? (char*) StrRefGet (hostStr) : "");
+    if (hostStr)
+        StrRefDestroy (hostStr);
+    error ("%s:%d: %s", file, lineNo, msg);
+}
+
+bool pkgConfAddProperty (pkgConfParser_t* parser,
+                         StringRef32_t* newProp,
                          union val* val,
                          bool isStart,
                          int dataType)
 {
     if (isStart)
     {
-        curProp = newProp;
+        parser->curProp = newProp;
         return true;
     }
-    if (expecting == EXPECTING_SETTINGS)
+    StringRef32_t* curProp = parser->curProp;
+    NnpkgMainConf_t* conf = parser->conf;
+    if (parser->expecting == EXPECTING_SETTINGS)
     {
         // Check if this is the database path
         if (!c32cmp (StrRefGet (curProp), U"packageDb"))
@@ -77,18 +126,13 @@ bool pkgConfAddProperty (StringRef32_t* newProp,
             if (dataType != DATATYPE_STRING)
             {
                 error ("%s:%d: property \"packageDb\" requires a string value",
-                       ConfGetFileName(),
-                       lineNo);
+                       parser->file,
+                       parser->lineNo);
                 return false;
             }
-            // Convert to host encoding
-            size_t hostLen = (c32len (StrRefGet (val->strVal)) * MB_CUR_MAX) + 1;
-            char* hostStrtab = malloc_s (hostLen);
-            if (!hostStrtab)
+            conf->dbLoc.dbPath = pkgConfToHost (val->strVal);
+            if (!conf->dbLoc.dbPath)
                 return false;
-            mbstate_t mbstate;
-            c32stombs (hostStrtab, StrRefGet (val->strVal), hostLen, &mbstate);
-            conf.dbLoc.dbPath = StrRefCreate (hostStrtab);
         }
         // Check if this is the string table path
         else if (!c32cmp (StrRefGet (curProp), U"strtab"))
@@ -96,36 +140,78 @@ bool pkgConfAddProperty (StringRef32_t* newProp,
             if (dataType != DATATYPE_STRING)
             {
                 error ("%s:%d: property \"strtab\" requires a string value",
-                       ConfGetFileName(),
-                       lineNo);
+                       parser->file,
+                       parser->lineNo);
                 return false;
             }
-            // Convert to host encoding
-            size_t hostLen = (c32len (StrRefGet (val->strVal)) * MB_CUR_MAX) + 1;
-            char* hostStrtab = malloc_s (hostLen);
-            if (!hostStrtab)
+            conf->dbLoc.strtabPath = pkgConfToHost (val->strVal);
+            if (!conf->dbLoc.strtabPath)
                 return false;
-            mbstate_t mbstate;
-            c32stombs (hostStrtab, StrRefGet (val->strVal), hostLen, &mbstate);
-            conf.dbLoc.strtabPath = StrRefCreate (hostStrtab);
         }
         else if (!c32cmp (StrRefGet (curProp), U"indexPath"))
         {
             if (dataType != DATATYPE_STRING)
             {
                 error ("%s:%d: property \"indexPath\" requires a string value",
-                       ConfGetFileName(),
-                       lineNo);
+                       parser->file,
+                       parser->lineNo);
+                return false;
+            }
+            conf->idxPath = StrRefNew (val->strVal);
+        }
+        else if (!c32cmp (StrRefGet (curProp), U"cachePath"))
+        {
+            if (dataType != DATATYPE_STRING)
+            {
+                error ("%s:%d: property \"cachePath\" requires a string value",
+                       parser->file,
+                       parser->lineNo);
                 return false;
             }
-            conf.idxPath = StrRefNew (val->strVal);
+            conf->cachePath = pkgConfToHost (val->strVal);
+            if (!conf->cachePath)
+                return false;
+        }
+        else if (!c32cmp (StrRefGet (curProp), U"stagedIndex"))
+        {
+            if (dataType != DATATYPE_IDENTIFIER)
+            {
+                error ("%s:%d: property \"stagedIndex\" requires boolean value",
+                       parser->file,
+                       parser->lineNo);
+                return false;
+            }
+            if (!c32cmp (StrRefGet (val->strVal), U"true"))
+                conf->stagedIdx = true;
+            else if (!c32cmp (StrRefGet (val->strVal), U"false"))
+                conf->stagedIdx = false;
+            else
+            {
+                error ("%s:%d: property \"stagedIndex\" requires boolean value",
+                       parser->file,
+                       parser->lineNo);
+                return false;
+            }
+        }
+        else if (!c32cmp (StrRefGet (curProp), U"lockTimeout"))
+        {
+            if (dataType != DATATYPE_NUMBER || val->numVal < 0 ||
+                val->numVal > INT_MAX)
+            {
+                error ("%s:%d: property \"lockTimeout\" requires a number of "
+                       "milliseconds",
+                       parser->file,
+                       parser->lineNo);
+                return false;
+            }
+            conf->lockTimeout = (int) val->numVal;
         }
         else
         {
-            error ("%s:%d property \"%s\" unrecognized",
-                   ConfGetFileName(),
-                   lineNo,
-                   UnicodeToHost (StrRefGet (curProp)));
+            pkgConfError (parser->file,
+                          parser->lineNo,
+                          "property \"%s\" unrecognized",
+                          curProp);
             return false;
         }
     }
@@ -134,10 +220,15 @@ bool pkgConfAddProperty (StringRef32_t* newProp,
     return true;
 }
 
-// Parse configuration file for nnpkg
-NNPKG_PUBLIC bool PkgParseMainConf (NnpkgTransCb_t* cb, const char* file)
+// Parses configuration file for nnpkg with libconf
+static bool pkgParseMainConf (NnpkgTransCb_t* cb,
+                              const char* file,
+                              NnpkgMainConf_t* conf)
 {
-    ListHead_t* blocks = ConfInit (file);
+    pkgConfParser_t parser = {0};
+    parser.file = file;
+    parser.conf = conf;
+    ListHead_t* blocks = pkgConfLoad (file);
     if (!blocks)
     {
         cb->error = NNPKG_ERR_SYNTAX_ERR;
@@ -149,7 +240,7 @@ NNPKG_PUBLIC bool PkgParseMainConf (NnpkgTransCb_t* cb, const char* file)
     while (curEntry)
     {
         ConfBlock_t* block = ListEntryData (curEntry);
-        lineNo = block->lineNo;
+        parser.lineNo = block->lineNo;
         // Figure out block type
         if (!c32cmp (StrRefGet (block->blockType), U"settings"))
         {
@@ -157,21 +248,21 @@ NNPKG_PUBLIC bool PkgParseMainConf (NnpkgTransCb_t* cb, const char* file)
             if (block->blockName)
             {
                 error ("%s:%d: block type \"settings\" does not accept a name",
-                       ConfGetFileName(),
-                       lineNo);
+                       file,
+                       parser.lineNo);
                 ConfFreeParseTree (blocks);
                 cb->error = NNPKG_ERR_SYNTAX_ERR;
                 TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
                 return false;
             }
-            expecting = EXPECTING_SETTINGS;
+            parser.expecting = EXPECTING_SETTINGS;
         }
         else
         {
-            error ("%s:%d: invalid block type %s specified",
-                   ConfGetFileName(),
-                   lineNo,
-                   UnicodeToHost (StrRefGet (block->blockType)));
+            pkgConfError (file,
+                          parser.lineNo,
+                          "invalid block type %s specified",
+                          block->blockType);
             ConfFreeParseTree (blocks);
             cb->error = NNPKG_ERR_SYNTAX_ERR;
             TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
@@ -183,9 +274,9 @@ NNPKG_PUBLIC bool PkgParseMainConf (NnpkgTransCb_t* cb, const char* file)
         while (propEntry)
         {
             ConfProperty_t* curProp = ListEntryData (propEntry);
-            lineNo = curProp->lineNo;
+            parser.lineNo = curProp->lineNo;
             // Start a new property
-            if (!pkgConfAddProperty (curProp->name, NULL, true, 0))
+            if (!pkgConfAddProperty (&parser, curProp->name, NULL, true, 0))
             {
                 ConfFreeParseTree (blocks);
                 cb->error = NNPKG_ERR_SYNTAX_ERR;
@@ -195,7 +286,7 @@ NNPKG_PUBLIC bool PkgParseMainConf (NnpkgTransCb_t* cb, const char* file)
             // Add all the actual values
             for (int i = 0; i < curProp->nextVal; ++i)
             {
-                lineNo = curProp->lineNo;
+                parser.lineNo = curProp->lineNo;
                 // Obtain value
                 union val val;
                 if (curProp->vals[i].type == DATATYPE_IDENTIFIER ||
@@ -205,7 +296,11 @@ NNPKG_PUBLIC bool PkgParseMainConf (NnpkgTransCb_t* cb, const char* file)
                 }
                 else
                     val.numVal = curProp->vals[i].numVal;
-                if (!pkgConfAddProperty (NULL, &val, false, curProp->vals[i].type))
+                if (!pkgConfAddProperty (&parser,
+                                         NULL,
+                                         &val,
+                                         false,
+                                         curProp->vals[i].type))
                 {
                     ConfFreeParseTree (blocks);
                     cb->error = NNPKG_ERR_SYNTAX_ERR;
@@ -218,63 +313,196 @@ NNPKG_PUBLIC bool PkgParseMainConf (NnpkgTransCb_t* cb, const char* file)
         curEntry = ListIterate (curEntry);
     }
     // Ensure database and string table path are valid
-    if (!conf.dbLoc.dbPath)
+    if (!conf->dbLoc.dbPath)
     {
-        error ("%s: package database path not specified", ConfGetFileName());
+        error ("%s: package database path not specified", file);
         ConfFreeParseTree (blocks);
         cb->error = NNPKG_ERR_SYNTAX_ERR;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
         return false;
     }
-    if (!conf.dbLoc.strtabPath)
+    if (!conf->dbLoc.strtabPath)
     {
-        error ("%s: string table path not specified", ConfGetFileName());
+        error ("%s: string table path not specified", file);
         ConfFreeParseTree (blocks);
         cb->error = NNPKG_ERR_SYNTAX_ERR;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
         return false;
     }
-    if (!conf.idxPath)
+    if (!conf->idxPath)
     {
-        error ("%s: index path not specified", ConfGetFileName());
+        error ("%s: index path not specified", file);
         ConfFreeParseTree (blocks);
         cb->error = NNPKG_ERR_SYNTAX_ERR;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
         return false;
     }
     ConfFreeParseTree (blocks);
-    cb->conf = &conf;
+    return true;
+}
+
+// Frees everything a configuration holds, and the configuration
+static void pkgFreeMainConf (NnpkgMainConf_t* conf)
+{
+    if (conf->dbLoc.dbPath)
+        StrRefDestroy (conf->dbLoc.dbPath);
+    if (conf->dbLoc.strtabPath)
+        StrRefDestroy (conf->dbLoc.strtabPath);
+    if (conf->idxPath)
+        StrRefDestroy (conf->idxPath);
+    if (conf->cachePath)
+        StrRefDestroy (conf->cachePath);
+    free (conf);
+}
+
+// Parse configuration file for nnpkg
+NNPKG_PUBLIC bool PkgParseMainConf (NnpkgTransCb_t* cb, const char* file)
+{
+    assert (!cb->conf);
+    NnpkgMainConf_t* conf = calloc_s (sizeof (NnpkgMainConf_t));
+    if (!conf)
+    {
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return false;
+    }
+    conf->lockTimeout = -1;
+    // The snapshot of a configuration is only written once it has been validated,
+    // so it can be used as is
+    if (mainConfCacheLoad (NNPKG_CACHE_PATH, file, conf))
+    {
+        cb->conf = conf;
+        return true;
+    }
+    struct stat st;
+    bool haveSt = stat (file, &st) != -1;
+    if (!pkgParseMainConf (cb, file, conf))
+    {
+        pkgFreeMainConf (conf);
+        return false;
+    }
+    if (haveSt)
+        mainConfCacheStore (NNPKG_CACHE_PATH, file, &st, conf);
+    cb->conf = conf;
     return true;
 }
 
 // Destroys main configuration
-NNPKG_PUBLIC void PkgDestroyMainConf()
+NNPKG_PUBLIC void PkgDestroyMainConf (NnpkgTransCb_t* cb)
 {
-    StrRefDestroy (conf.dbLoc.dbPath);
-    StrRefDestroy (conf.dbLoc.strtabPath);
-    StrRefDestroy (conf.idxPath);
+    if (cb->conf)
+        pkgFreeMainConf (cb->conf);
+    cb->conf = NULL;
 }
 
-NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
+// Parses a version of the form major[.minor[.revision]]
+// Returns pointer to first character after the version, or NULL if it's invalid
+static const char32_t* pkgConfParseVersion (const char32_t* s, uint8_t* ver)
+{
+    memset (ver, 0, 3);
+    for (int i = 0; i < 3; ++i)
+    {
+        if (*s < U'0' || *s > U'9')
+            return NULL;
+        unsigned int part = 0;
+        while (*s >= U'0' && *s <= U'9')
+        {
+            part = (part * 10) + (*s - U'0');
+            if (part > UINT8_MAX)
+                return NULL;
+            ++s;
+        }
+        ver[i] = (uint8_t) part;
+        if (*s != U'.')
+            break;
+        ++s;
+    }
+    return s;
+}
+
+// Parses a dependency of the form "name [op version]"
+// Returns 1 on success, 0 if it's invalid, or -1 if memory runs out
+static int pkgConfParseDep (const char32_t* s, NnpkgDepRef_t* depRef)
+{
+    // Find end of name
+    const char32_t* nameEnd = s;
+    while (*nameEnd && *nameEnd != U' ' && *nameEnd != U'<' && *nameEnd != U'>' &&
+           *nameEnd != U'=')
+    {
+        ++nameEnd;
+    }
+    if (nameEnd == s)
+        return 0;
+    const char32_t* op = nameEnd;
+    while (*op == U' ')
+        ++op;
+    depRef->verOp = NNPKG_VER_ANY;
+    if (*op)
+    {
+        if (op[0] == U'=')
+        {
+            depRef->verOp = NNPKG_VER_EQ;
+            op += (op[1] == U'=') ? 2 : 1;
+        }
+        else if (op[0] == U'<')
+        {
+            depRef->verOp = (op[1] == U'=') ? NNPKG_VER_LE : NNPKG_VER_LT;
+            op += (op[1] == U'=') ? 2 : 1;
+        }
+        else if (op[0] == U'>')
+        {
+            depRef->verOp = (op[1] == U'=') ? NNPKG_VER_GE : NNPKG_VER_GT;
+            op += (op[1] == U'=') ? 2 : 1;
+        }
+        else
+            return 0;
+        while (*op == U' ')
+            ++op;
+        const char32_t* verEnd = pkgConfParseVersion (op, depRef->ver);
+        if (!verEnd)
+            return 0;
+        while (*verEnd == U' ')
+            ++verEnd;
+        if (*verEnd)
+            return 0;
+    }
+    // Copy out name
+    size_t nameLen = nameEnd - s;
+    char32_t* name = malloc_s ((nameLen + 1) * sizeof (char32_t));
+    if (!name)
+        return -1;
+    memcpy (name, s, nameLen * sizeof (char32_t));
+    name[nameLen] = 0;
+    depRef->name = StrRefCreate (name);
+    return 1;
+}
+
+// Parses a package configuration file
+static NnpkgPackage_t* pkgConfRead (NnpkgTransCb_t* cb, const char* file)
 {
     // Parse file
-    ListHead_t* blocks = ConfInit (file);
+    ListHead_t* blocks = pkgConfLoad (file);
     if (!blocks)
     {
         cb->error = NNPKG_ERR_SYNTAX_ERR;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
         return NULL;
     }
-    NnpkgPackage_t* pkgOut = calloc_s (sizeof (NnpkgPackage_t));
+    NnpkgPackage_t* pkgOut = memCalloc (NNPKG_MEM_PKGCONF, sizeof (NnpkgPackage_t));
     if (!pkgOut)
+    {
+        ConfFreeParseTree (blocks);
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
         return NULL;
+    }
     pkgOut->deps =
         ListCreate ("NnpkgPackage_t", true, offsetof (NnpkgPackage_t, obj));
     ObjCreate ("NnpkgPackage_t", &pkgOut->obj);
     ObjSetDestroy (&pkgOut->obj, pkgDestroy);
     if (!ListFront (blocks))
     {
-        error ("%s: empty package configuaration file", ConfGetFileName());
+        error ("%s: empty package configuaration file", file);
         ConfFreeParseTree (blocks);
         cb->error = NNPKG_ERR_SYNTAX_ERR;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
@@ -284,7 +512,7 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
     if (ListIterate (ListFront (blocks)))
     {
         error ("%s: only one package block supported in a configuration file",
-               ConfGetFileName());
+               file);
         ConfFreeParseTree (blocks);
         cb->error = NNPKG_ERR_SYNTAX_ERR;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
@@ -297,10 +525,10 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
     lineNo = block->lineNo;
     if (c32cmp (StrRefGet (block->blockType), U"package") != 0)
     {
-        error ("%s:%d: unrecognized block type \"%s\"",
-               ConfGetFileName(),
-               lineNo,
-               UnicodeToHost (StrRefGet (block->blockType)));
+        pkgConfError (file,
+                      lineNo,
+                      "unrecognized block type \"%s\"",
+                      block->blockType);
         ConfFreeParseTree (blocks);
         cb->error = NNPKG_ERR_SYNTAX_ERR;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
@@ -309,10 +537,10 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
     }
     if (!block->blockName)
     {
-        error ("%s:%d: block name required for block type \"%s\"",
-               ConfGetFileName(),
-               lineNo,
-               UnicodeToHost (StrRefGet (block->blockType)));
+        pkgConfError (file,
+                      lineNo,
+                      "block name required for block type \"%s\"",
+                      block->blockType);
         ConfFreeParseTree (blocks);
         cb->error = NNPKG_ERR_SYNTAX_ERR;
         ObjDestroy (&pkgOut->obj);
@@ -331,10 +559,10 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
         {
             if (prop->nextVal != 1)
             {
-                error ("%s:%d: property \"%s\" requires exactly one value",
-                       ConfGetFileName(),
-                       lineNo,
-                       UnicodeToHost (StrRefGet (prop->name)));
+                pkgConfError (file,
+                              lineNo,
+                              "property \"%s\" requires exactly one value",
+                              prop->name);
                 ConfFreeParseTree (blocks);
                 cb->error = NNPKG_ERR_SYNTAX_ERR;
                 TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
@@ -343,10 +571,10 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
             }
             if (prop->vals[0].type != DATATYPE_STRING)
             {
-                error ("%s:%d: property \"%s\" requires string value",
-                       ConfGetFileName(),
-                       lineNo,
-                       UnicodeToHost (StrRefGet (prop->name)));
+                pkgConfError (file,
+                              lineNo,
+                              "property \"%s\" requires string value",
+                              prop->name);
                 ConfFreeParseTree (blocks);
                 cb->error = NNPKG_ERR_SYNTAX_ERR;
                 TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
@@ -359,10 +587,10 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
         {
             if (prop->nextVal != 1)
             {
-                error ("%s:%d: property \"%s\" requires exactly one value",
-                       ConfGetFileName(),
-                       lineNo,
-                       UnicodeToHost (StrRefGet (prop->name)));
+                pkgConfError (file,
+                              lineNo,
+                              "property \"%s\" requires exactly one value",
+                              prop->name);
                 ConfFreeParseTree (blocks);
                 cb->error = NNPKG_ERR_SYNTAX_ERR;
                 TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
@@ -371,10 +599,10 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
             }
             if (prop->vals[0].type != DATATYPE_STRING)
             {
-                error ("%s:%d: property \"%s\" requires string value",
-                       ConfGetFileName(),
-                       lineNo,
-                       UnicodeToHost (StrRefGet (prop->name)));
+                pkgConfError (file,
+                              lineNo,
+                              "property \"%s\" requires string value",
+                              prop->name);
                 ConfFreeParseTree (blocks);
                 cb->error = NNPKG_ERR_SYNTAX_ERR;
                 TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
@@ -383,14 +611,45 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
             }
             pkgOut->prefix = StrRefNew (prop->vals[0].str);
         }
+        else if (!c32cmp (StrRefGet (prop->name), U"version"))
+        {
+            if (prop->nextVal != 1)
+            {
+                pkgConfError (file,
+                              lineNo,
+                              "property \"%s\" requires exactly one value",
+                              prop->name);
+                ConfFreeParseTree (blocks);
+                cb->error = NNPKG_ERR_SYNTAX_ERR;
+                TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+                ObjDestroy (&pkgOut->obj);
+                return NULL;
+            }
+            const char32_t* verEnd = NULL;
+            if (prop->vals[0].type == DATATYPE_STRING)
+                verEnd = pkgConfParseVersion (StrRefGet (prop->vals[0].str),
+                                              pkgOut->version);
+            if (!verEnd || *verEnd)
+            {
+                pkgConfError (file,
+                              lineNo,
+                              "property \"%s\" requires version string value",
+                              prop->name);
+                ConfFreeParseTree (blocks);
+                cb->error = NNPKG_ERR_SYNTAX_ERR;
+                TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+                ObjDestroy (&pkgOut->obj);
+                return NULL;
+            }
+        }
         else if (!c32cmp (StrRefGet (prop->name), U"isDependency"))
         {
             if (prop->nextVal != 1)
             {
-                error ("%s:%d: property \"%s\" requires exactly one value",
-                       ConfGetFileName(),
-                       lineNo,
-                       UnicodeToHost (StrRefGet (prop->name)));
+                pkgConfError (file,
+                              lineNo,
+                              "property \"%s\" requires exactly one value",
+                              prop->name);
                 ConfFreeParseTree (blocks);
                 cb->error = NNPKG_ERR_SYNTAX_ERR;
                 TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
@@ -398,10 +657,10 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
             }
             if (prop->vals[0].type != DATATYPE_IDENTIFIER)
             {
-                error ("%s:%d: property \"%s\" requires boolean value",
-                       ConfGetFileName(),
-                       lineNo,
-                       UnicodeToHost (StrRefGet (prop->name)));
+                pkgConfError (file,
+                              lineNo,
+                              "property \"%s\" requires boolean value",
+                              prop->name);
                 ConfFreeParseTree (blocks);
                 cb->error = NNPKG_ERR_SYNTAX_ERR;
                 TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
@@ -415,10 +674,10 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
                 pkgOut->isDependency = false;
             else
             {
-                error ("%s:%d: property \"%s\" requires boolean value",
-                       ConfGetFileName(),
-                       lineNo,
-                       UnicodeToHost (StrRefGet (prop->name)));
+                pkgConfError (file,
+                              lineNo,
+                              "property \"%s\" requires boolean value",
+                              prop->name);
                 ConfFreeParseTree (blocks);
                 cb->error = NNPKG_ERR_SYNTAX_ERR;
                 TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
@@ -428,51 +687,66 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
         }
         else if (!c32cmp (StrRefGet (prop->name), U"dependencies"))
         {
-            bool depError = false;
+            size_t numDeps = pkgOut->numDeps + prop->nextVal;
+            // Database records only have room for so many
+            if (numDeps > NNPKG_MAX_DEPS)
+            {
+                ConfFreeParseTree (blocks);
+                cb->error = NNPKG_ERR_DEPS_LIMIT;
+                cb->errHint[0] = StrRefNew (pkgOut->id);
+                TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+                ObjDestroy (&pkgOut->obj);
+                return NULL;
+            }
+            NnpkgDepRef_t* depRefs = memRealloc (NNPKG_MEM_PKGCONF,
+                                                 pkgOut->depRefs,
+                                                 numDeps * sizeof (NnpkgDepRef_t));
+            if (!depRefs)
+            {
+                ConfFreeParseTree (blocks);
+                cb->error = NNPKG_ERR_OOM;
+                TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+                ObjDestroy (&pkgOut->obj);
+                return NULL;
+            }
+            pkgOut->depRefs = depRefs;
             for (int i = 0; i < prop->nextVal; ++i)
             {
                 ConfPropVal_t* propVal = &prop->vals[i];
                 lineNo = propVal->lineNo;
-                // Sanity checks
-                if (propVal->type != DATATYPE_IDENTIFIER)
+                NnpkgDepRef_t* depRef = &pkgOut->depRefs[pkgOut->numDeps];
+                memset (depRef, 0, sizeof (NnpkgDepRef_t));
+                // Dependencies are either a bare name, or a string with a version
+                // constraint, such as "libfoo >= 1.2"
+                int parsed = 1;
+                if (propVal->type == DATATYPE_IDENTIFIER)
+                    depRef->name = StrRefNew (propVal->id);
+                else if (propVal->type == DATATYPE_STRING)
+                    parsed = pkgConfParseDep (StrRefGet (propVal->str), depRef);
+                else
+                    parsed = 0;
+                if (parsed == -1)
                 {
-                    error ("%s:%d: property \"%s\" requires identifier value",
-                           ConfGetFileName(),
-                           lineNo,
-                           UnicodeToHost (StrRefGet (prop->name)));
-                    cb->error = NNPKG_ERR_SYNTAX_ERR;
+                    ConfFreeParseTree (blocks);
+                    cb->error = NNPKG_ERR_OOM;
                     TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
                     ObjDestroy (&pkgOut->obj);
                     return NULL;
                 }
-                // Find this package
-                // TODO: versioning support
-                ListEntry_t* curEntry = ListFront (cb->pkgDbs);
-                NnpkgPackage_t* pkg = NULL;
-                while (curEntry && !pkg)
+                if (!parsed)
                 {
-                    pkg = pkgDbFindPackage (cb,
-                                            ListEntryData (curEntry),
-                                            StrRefGet (propVal->id),
-                                            true);
-                    curEntry = ListIterate (curEntry);
-                }
-                if (pkg)
-                    ListAddBack (pkgOut->deps, pkg, 0);
-                else
-                {
-                    cb->error = NNPKG_ERR_BROKEN_DEP;
-                    cb->errHint[0] = StrRefNew (pkgOut->id);
-                    cb->errHint[1] = StrRefNew (propVal->id);
+                    pkgConfError (file,
+                                  lineNo,
+                                  "property \"%s\" requires identifier or "
+                                  "dependency string value",
+                                  prop->name);
+                    ConfFreeParseTree (blocks);
+                    cb->error = NNPKG_ERR_SYNTAX_ERR;
                     TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-                    depError = true;
+                    ObjDestroy (&pkgOut->obj);
+                    return NULL;
                 }
-            }
-            if (depError)
-            {
-                ConfFreeParseTree (blocks);
-                ObjDestroy (&pkgOut->obj);
-                return NULL;
+                ++pkgOut->numDeps;
             }
         }
         propEntry = ListIterate (propEntry);
@@ -480,3 +754,129 @@ NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
     ConfFreeParseTree (blocks);
     return pkgOut;
 }
+
+NNPKG_PUBLIC NnpkgPackage_t* PkgReadConfUnresolved (NnpkgTransCb_t* cb,
+                                                    const char* file)
+{
+    NNPKG_TRACE_SPAN ("PkgReadConfUnresolved");
+    if (!cb->conf || !cb->conf->cachePath)
+        return pkgConfRead (cb, file);
+    // Use the compiled form of the file if it is still fresh
+    const char* cacheDir = StrRefGet (cb->conf->cachePath);
+    NnpkgPackage_t* pkg = confCacheLoad (cacheDir, file);
+    if (pkg)
+        return pkg;
+    // Status must be taken before parsing, so a concurrent change to the file
+    // leaves the cache stale rather than wrong
+    struct stat st;
+    bool haveSt = stat (file, &st) != -1;
+    pkg = pkgConfRead (cb, file);
+    if (pkg && haveSt)
+        confCacheStore (cacheDir, file, &st, pkg);
+    return pkg;
+}
+
+NNPKG_PUBLIC NnpkgPackage_t* PkgReadConf (NnpkgTransCb_t* cb, const char* file)
+{
+    NNPKG_TRACE_SPAN ("PkgReadConf");
+    NnpkgPackage_t* pkg = PkgReadConfUnresolved (cb, file);
+    if (!pkg)
+        return NULL;
+    // Pick versions of dependencies
+    if (pkg->numDeps && !ResolverSelectDeps (cb, pkg))
+    {
+        ObjDestroy (&pkg->obj);
+        return NULL;
+    }
+    return pkg;
+}
+
+// Configuration file read on a worker thread
+typedef struct _pkgconfjob
+{
+    NnpkgTransCb_t cb;        ///< Control block of job, so workers don't share one
+    const char* file;         ///< File to read
+    NnpkgPackage_t** pkg;     ///< Where to put package
+} pkgConfJob_t;
+
+// Errors are picked up from the job's control block once every file is read
+static void pkgConfJobProgress (NnpkgTransCb_t* cb, int newState)
+{
+    UNUSED (cb);
+    UNUSED (newState);
+}
+
+static void pkgConfReadJob (void* data)
+{
+    pkgConfJob_t* job = data;
+    *job->pkg = PkgReadConfUnresolved (&job->cb, job->file);
+}
+
+NNPKG_PUBLIC bool PkgReadConfs (NnpkgTransCb_t* cb,
+                                const char** files,
+                                size_t numFiles,
+                                int numThreads,
+                                NnpkgPackage_t** pkgs)
+{
+    memset (pkgs, 0, numFiles * sizeof (NnpkgPackage_t*));
+    pkgConfJob_t* jobs =
+        memCalloc (NNPKG_MEM_PKGCONF, numFiles * sizeof (pkgConfJob_t));
+    if (!jobs)
+    {
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return false;
+    }
+    for (size_t i = 0; i < numFiles; ++i)
+    {
+        jobs[i].cb.type = cb->type;
+        jobs[i].cb.conf = cb->conf;
+        jobs[i].cb.progress = pkgConfJobProgress;
+        jobs[i].file = files[i];
+        jobs[i].pkg = &pkgs[i];
+    }
+    // Read files on worker threads if possible, or on this one if not
+    NnpkgWorkPool_t* pool = (numFiles > 1) ? WorkPoolCreate (numThreads) : NULL;
+    for (size_t i = 0; i < numFiles; ++i)
+    {
+        if (!pool || !WorkPoolSubmit (pool, pkgConfReadJob, &jobs[i]))
+            pkgConfReadJob (&jobs[i]);
+    }
+    if (pool)
+        WorkPoolDestroy (pool);
+    // Report the error of the first file that failed, so the result doesn't depend
+    // on how jobs were scheduled
+    bool res = true;
+    for (size_t i = 0; i < numFiles; ++i)
+    {
+        if (pkgs[i])
+            continue;
+        if (res)
+        {
+            cb->error = jobs[i].cb.error;
+            cb->sysErrno = jobs[i].cb.sysErrno;
+            memcpy (cb->errHint, jobs[i].cb.errHint, sizeof (cb->errHint));
+            res = false;
+        }
+        else
+        {
+            for (size_t j = 0; j < ARRAY_SIZE (jobs[i].cb.errHint); ++j)
+            {
+                if (jobs[i].cb.errHint[j])
+                    StrRefDestroy (jobs[i].cb.errHint[j]);
+            }
+        }
+    }
+    memFree (jobs);
+    if (!res)
+    {
+        for (size_t i = 0; i < numFiles; ++i)
+        {
+            if (pkgs[i])
+                ObjDestroy (&pkgs[i]->obj);
+            pkgs[i] = NULL;
+        }
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+    }
+    return res;
+}
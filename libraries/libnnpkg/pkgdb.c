@@ -18,10 +18,12 @@
 /// @file pkgdb.c
 
 #include <assert.h>
+#include <libnex/base.h>
 #include <libnex/error.h>
 #include <libnex/safemalloc.h>
 #include <libnex/safestring.h>
 #include <libnex/unicode.h>
+#include <nnpkg/mem.h>
 #include <nnpkg/pkg.h>
 #include <nnpkg/propdb.h>
 #include <stdint.h>
@@ -32,10 +34,13 @@
 typedef struct _dbdep
 {
     uint32_t idx;      ///< String index of name
-    uint8_t verOp;     ///< Version operator. See pkg.h. Unused for now
+    uint32_t slot;     ///< Database slot of dependency, or 0 if not known
+    uint16_t gen;      ///< Generation of slot. If it doesn't match, the dependency
+                       ///< is looked up by name instead
+    uint8_t verOp;     ///< Version operator. See pkg.h
     uint8_t ver[3];    ///< Version being affected by verOp.
                        ///< ver[0] contains major, ver[1] contains minor, and ver[2]
-                       ///< contains revision. Unused for now
+                       ///< contains revision
 } __attribute__ ((packed)) propDbPkgDep_t;
 
 // Package serialized representation
@@ -45,10 +50,36 @@ typedef struct _dbpkg
     uint32_t prefix;         ///< String tabe index of prefix
     uint16_t pkgType;        ///< Type of this package. See pkg.h for valid types
     uint8_t isDependency;    ///< If this package is auto-removable
-    uint8_t resvd[9];
-    propDbPkgDep_t deps[60];
+    uint8_t version[3];      ///< Version of package
+    uint8_t resvd[10];
+    propDbPkgDep_t deps[NNPKG_MAX_DEPS];
 } __attribute__ ((packed)) propDbPkg_t;
 
+// Reads the dependencies out of a package record without creating a package
+// deps must have room for NNPKG_MAX_DEPS entries. Returns number of dependencies
+int pkgDbPeekDeps (NnpkgPropDb_t* db,
+                   const void* data,
+                   NnpkgDepRef_t* deps,
+                   bool* isDependency)
+{
+    const propDbPkg_t* intProp = data;
+    *isDependency = intProp->isDependency;
+    int numDeps = 0;
+    while (numDeps < NNPKG_MAX_DEPS && intProp->deps[numDeps].idx)
+    {
+        NnpkgDepRef_t* depRef = &deps[numDeps];
+        depRef->db = db;
+        depRef->nameIdx = intProp->deps[numDeps].idx;
+        depRef->name = NULL;
+        depRef->slot = intProp->deps[numDeps].slot;
+        depRef->gen = intProp->deps[numDeps].gen;
+        depRef->verOp = intProp->deps[numDeps].verOp;
+        memcpy (depRef->ver, intProp->deps[numDeps].ver, sizeof (depRef->ver));
+        ++numDeps;
+    }
+    return numDeps;
+}
+
 // Destroys a package
 void pkgDestroy (const Object_t* obj)
 {
@@ -64,21 +95,203 @@ void pkgDestroy (const Object_t* obj)
     // Destroy dependencies
     if (pkg->deps)
         ListDestroy (pkg->deps);
-    free (pkg);
+    for (size_t i = 0; i < pkg->numDeps; ++i)
+    {
+        if (pkg->depRefs[i].name)
+            StrRefDestroy (pkg->depRefs[i].name);
+    }
+    memFree (pkg->depRefs);
+    free (pkg->idUtf8);
+    free (pkg->descriptionUtf8);
+    free (pkg->prefixUtf8);
+    memFree (pkg);
 }
 
-NNPKG_PUBLIC NnpkgPropDb_t* PkgDbOpen (NnpkgTransCb_t* cb, NnpkgDbLocation_t* dbLoc)
+// Identity map of packages loaded from a database
+// Packages are keyed by their database record, so each record is only turned into
+// a package once while the database is open, and every dependent shares it
+typedef struct _pkgcache
+{
+    const void** keys;        ///< Database record of each bucket
+    NnpkgPackage_t** pkgs;    ///< Package loaded from record
+    size_t size;              ///< Number of buckets. Always a power of two
+    size_t count;             ///< Number of packages in map
+} pkgDbCache_t;
+
+#define PKGDB_CACHE_INIT_SIZE 64
+
+// Hashes a record address
+static inline size_t pkgCacheHash (const pkgDbCache_t* cache, const void* key)
+{
+    return (size_t) (((uintptr_t) key * 0x9E3779B97F4A7C15ULL) >> 16) &
+           (cache->size - 1);
+}
+
+// Creates a package cache
+static pkgDbCache_t* pkgCacheCreate()
+{
+    pkgDbCache_t* cache = memCalloc (NNPKG_MEM_PKGDB, sizeof (pkgDbCache_t));
+    if (!cache)
+        return NULL;
+    cache->size = PKGDB_CACHE_INIT_SIZE;
+    cache->keys = memCalloc (NNPKG_MEM_PKGDB, cache->size * sizeof (void*));
+    cache->pkgs =
+        memCalloc (NNPKG_MEM_PKGDB, cache->size * sizeof (NnpkgPackage_t*));
+    if (!cache->keys || !cache->pkgs)
+    {
+        memFree (cache->keys);
+        memFree (cache->pkgs);
+        memFree (cache);
+        return NULL;
+    }
+    return cache;
+}
+
+// Destroys a package cache, releasing its reference to each package
+static void pkgCacheDestroy (pkgDbCache_t* cache)
+{
+    // Drop dependency lists first, as packages that depend on each other in a cycle
+    // would otherwise keep each other alive
+    for (size_t i = 0; i < cache->size; ++i)
+    {
+        NnpkgPackage_t* pkg = cache->pkgs[i];
+        if (pkg && pkg->deps)
+        {
+            ListDestroy (pkg->deps);
+            pkg->deps = NULL;
+        }
+    }
+    for (size_t i = 0; i < cache->size; ++i)
+    {
+        if (cache->pkgs[i])
+            ObjDeRef (&cache->pkgs[i]->obj);
+    }
+    memFree (cache->keys);
+    memFree (cache->pkgs);
+    memFree (cache);
+}
+
+// Finds package loaded from record key
+static NnpkgPackage_t* pkgCacheFind (pkgDbCache_t* cache, const void* key)
+{
+    size_t bucket = pkgCacheHash (cache, key);
+    while (cache->keys[bucket])
+    {
+        if (cache->keys[bucket] == key)
+            return cache->pkgs[bucket];
+        bucket = (bucket + 1) & (cache->size - 1);
+    }
+    return NULL;
+}
+
+// Inserts a bucket without checking the load factor
+static void pkgCacheInsertBucket (pkgDbCache_t* cache,
+                                  const void* key,
+                                  NnpkgPackage_t* pkg)
+{
+    size_t bucket = pkgCacheHash (cache, key);
+    while (cache->keys[bucket])
+        bucket = (bucket + 1) & (cache->size - 1);
+    cache->keys[bucket] = key;
+    cache->pkgs[bucket] = pkg;
+}
+
+// Adds package to cache. The cache takes over the caller's reference
+static bool pkgCacheInsert (pkgDbCache_t* cache,
+                            const void* key,
+                            NnpkgPackage_t* pkg)
+{
+    // Grow when the map is more than half full
+    if ((cache->count + 1) * 2 > cache->size)
+    {
+        const void** oldKeys = cache->keys;
+        NnpkgPackage_t** oldPkgs = cache->pkgs;
+        size_t oldSize = cache->size;
+        cache->keys = memCalloc (NNPKG_MEM_PKGDB, oldSize * 2 * sizeof (void*));
+        cache->pkgs =
+            memCalloc (NNPKG_MEM_PKGDB, oldSize * 2 * sizeof (NnpkgPackage_t*));
+        if (!cache->keys || !cache->pkgs)
+        {
+            memFree (cache->keys);
+            memFree (cache->pkgs);
+            cache->keys = oldKeys;
+            cache->pkgs = oldPkgs;
+            return false;
+        }
+        cache->size = oldSize * 2;
+        for (size_t i = 0; i < oldSize; ++i)
+        {
+            if (oldKeys[i])
+                pkgCacheInsertBucket (cache, oldKeys[i], oldPkgs[i]);
+        }
+        memFree (oldKeys);
+        memFree (oldPkgs);
+    }
+    pkgCacheInsertBucket (cache, key, pkg);
+    ++cache->count;
+    return true;
+}
+
+// Removes a package from the cache without releasing it
+static void pkgCacheRemove (pkgDbCache_t* cache, const void* key)
+{
+    size_t bucket = pkgCacheHash (cache, key);
+    while (cache->keys[bucket] != key)
+    {
+        if (!cache->keys[bucket])
+            return;
+        bucket = (bucket + 1) & (cache->size - 1);
+    }
+    cache->keys[bucket] = NULL;
+    cache->pkgs[bucket] = NULL;
+    --cache->count;
+    // Re-insert the rest of the cluster so probing never stops early
+    bucket = (bucket + 1) & (cache->size - 1);
+    while (cache->keys[bucket])
+    {
+        const void* movedKey = cache->keys[bucket];
+        NnpkgPackage_t* movedPkg = cache->pkgs[bucket];
+        cache->keys[bucket] = NULL;
+        cache->pkgs[bucket] = NULL;
+        pkgCacheInsertBucket (cache, movedKey, movedPkg);
+        bucket = (bucket + 1) & (cache->size - 1);
+    }
+}
+
+// Sets up package state of an opened database
+static NnpkgPropDb_t* pkgDbInit (NnpkgTransCb_t* cb,
+                                 NnpkgPropDb_t* db,
+                                 NnpkgDbLocation_t* dbLoc)
 {
-    NnpkgPropDb_t* db = PropDbOpen (cb, dbLoc);
     if (!db)
         return NULL;
+    db->pkgCache = pkgCacheCreate();
+    if (!db->pkgCache)
+    {
+        PropDbClose (db);
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return NULL;
+    }
     db->strtabPath = StrRefNew (dbLoc->strtabPath);
     db->dbPath = StrRefNew (dbLoc->dbPath);
     return db;
 }
 
+NNPKG_PUBLIC NnpkgPropDb_t* PkgDbOpen (NnpkgTransCb_t* cb, NnpkgDbLocation_t* dbLoc)
+{
+    return pkgDbInit (cb, PropDbOpen (cb, dbLoc), dbLoc);
+}
+
+NNPKG_PUBLIC NnpkgPropDb_t* PkgDbOpenShared (NnpkgTransCb_t* cb,
+                                             NnpkgDbLocation_t* dbLoc)
+{
+    return pkgDbInit (cb, PropDbOpenShared (cb, dbLoc), dbLoc);
+}
+
 NNPKG_PUBLIC void PkgDbClose (NnpkgPropDb_t* db)
 {
+    pkgCacheDestroy (db->pkgCache);
     StrRefDestroy (db->strtabPath);
     StrRefDestroy (db->dbPath);
     PropDbClose (db);
@@ -101,8 +314,23 @@ NNPKG_PUBLIC bool PkgDbAddPackage (NnpkgTransCb_t* cb,
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
         return false;
     }
+    // Packages found lazily need their dependencies resolved first
+    ListHead_t* deps = PkgGetDeps (cb, pkg);
+    if (!deps)
+        return false;
+    // Record only has room for so many dependencies
+    size_t numDeps = 0;
+    for (ListEntry_t* entry = ListFront (deps); entry; entry = ListIterate (entry))
+        ++numDeps;
+    if (numDeps > NNPKG_MAX_DEPS)
+    {
+        cb->error = NNPKG_ERR_DEPS_LIMIT;
+        cb->errHint[0] = StrRefNew (pkg->id);
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return false;
+    }
     // Initialize new property
-    NnpkgProp_t* prop = malloc_s (sizeof (NnpkgProp_t));
+    NnpkgProp_t* prop = calloc_s (sizeof (NnpkgProp_t));
     if (!prop)
     {
         cb->error = NNPKG_ERR_OOM;
@@ -120,16 +348,33 @@ NNPKG_PUBLIC bool PkgDbAddPackage (NnpkgTransCb_t* cb,
     }
     internalPkg->isDependency = pkg->isDependency;
     internalPkg->pkgType = pkg->type;
+    memcpy (internalPkg->version, pkg->version, sizeof (pkg->version));
     internalPkg->description = PropDbAddString (db, StrRefGet (pkg->description));
     internalPkg->prefix = PropDbAddString (db, StrRefGet (pkg->prefix));
     // Set up dependency info. Note that we don't automatically add dependencies to
     // database
-    int i = 0;
-    ListEntry_t* depEntry = ListFront (pkg->deps);
+    size_t i = 0;
+    ListEntry_t* depEntry = ListFront (deps);
     while (depEntry)
     {
         NnpkgPackage_t* dep = ListEntryData (depEntry);
         internalPkg->deps[i].idx = PropDbAddString (db, StrRefGet (dep->id));
+        // Reference dependency's record directly if it lives in this database
+        uint32_t slot = 0;
+        uint16_t gen = 0;
+        if (dep->prop && PropDbGetPropRef (db, dep->prop, &slot, &gen))
+        {
+            internalPkg->deps[i].slot = slot;
+            internalPkg->deps[i].gen = gen;
+        }
+        // Dependency handles are in the same order as the list
+        if (i < pkg->numDeps)
+        {
+            internalPkg->deps[i].verOp = pkg->depRefs[i].verOp;
+            memcpy (internalPkg->deps[i].ver,
+                    pkg->depRefs[i].ver,
+                    sizeof (internalPkg->deps[i].ver));
+        }
         depEntry = ListIterate (depEntry);
         ++i;
     }
@@ -146,28 +391,17 @@ NNPKG_PUBLIC bool PkgDbAddPackage (NnpkgTransCb_t* cb,
 NnpkgPackage_t* pkgDbFindPackage (NnpkgTransCb_t* cb,
                                   NnpkgPropDb_t* db,
                                   const char32_t* name,
-                                  bool findingDep)
+                                  bool findingDep,
+                                  bool lazy);
+
+// Loads the package stored in a record, without resolving its dependencies
+// The package is added to the identity map, and a new reference is returned
+static NnpkgPackage_t* pkgDbLoadPackage (NnpkgTransCb_t* cb,
+                                         NnpkgPropDb_t* db,
+                                         NnpkgProp_t* prop)
 {
-    // Find property
-    NnpkgProp_t* prop = malloc_s (sizeof (NnpkgProp_t));
-    if (!prop)
-    {
-        cb->error = NNPKG_ERR_OOM;
-        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-        return NULL;
-    }
-    if (!PropDbFindProp (db, name, prop))
-    {
-        if (!findingDep)
-        {
-            cb->error = NNPKG_ERR_PKG_NO_EXIST;
-            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-        }
-        free (prop);
-        return NULL;
-    }
     // Initialize package
-    NnpkgPackage_t* pkg = malloc_s (sizeof (NnpkgPackage_t));
+    NnpkgPackage_t* pkg = memCalloc (NNPKG_MEM_PKGDB, sizeof (NnpkgPackage_t));
     if (!pkg)
     {
         ObjDestroy (&prop->obj);
@@ -183,69 +417,312 @@ NnpkgPackage_t* pkgDbFindPackage (NnpkgTransCb_t* cb,
     pkg->prefix = StrRefCreate (PropDbGetString (db, intProp->prefix));
     StrRefNoFree (pkg->prefix);
     pkg->type = intProp->pkgType;
-    pkg->isDependency = intProp->isDependency;
+    memcpy (pkg->version, intProp->version, sizeof (pkg->version));
     pkg->prop = prop;
-    pkg->deps = ListCreate ("NnpkgPackage_t", true, offsetof (NnpkgPackage_t, obj));
-    if (!pkg->deps)
+    ObjCreate ("NnpkgPackage_t", &pkg->obj);
+    ObjSetDestroy (&pkg->obj, pkgDestroy);
+    // Record a handle for each dependency
+    NnpkgDepRef_t depRefs[NNPKG_MAX_DEPS];
+    pkg->numDeps = pkgDbPeekDeps (db, intProp, depRefs, &pkg->isDependency);
+    if (pkg->numDeps)
+    {
+        pkg->depRefs =
+            memAlloc (NNPKG_MEM_PKGDB, pkg->numDeps * sizeof (NnpkgDepRef_t));
+        if (!pkg->depRefs)
+        {
+            pkg->numDeps = 0;
+            ObjDestroy (&pkg->obj);
+            cb->error = NNPKG_ERR_OOM;
+            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+            return NULL;
+        }
+        memcpy (pkg->depRefs, depRefs, pkg->numDeps * sizeof (NnpkgDepRef_t));
+    }
+    if (!pkgCacheInsert (db->pkgCache, prop->internal, pkg))
+    {
+        ObjDestroy (&pkg->obj);
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return NULL;
+    }
+    // Hand out a reference of our own, the cache keeps the original one
+    return ObjGetContainer (ObjRef (&pkg->obj), NnpkgPackage_t, obj);
+}
+
+// Gets the package stored in a found property, reusing it if it was loaded already
+static NnpkgPackage_t* pkgDbGetPackage (NnpkgTransCb_t* cb,
+                                        NnpkgPropDb_t* db,
+                                        NnpkgProp_t* prop)
+{
+    NnpkgPackage_t* pkg = pkgCacheFind (db->pkgCache, prop->internal);
+    if (pkg)
     {
         ObjDestroy (&prop->obj);
+        return ObjGetContainer (ObjRef (&pkg->obj), NnpkgPackage_t, obj);
+    }
+    pkg = pkgDbLoadPackage (cb, db, prop);
+    return pkg ? pkg : (NnpkgPackage_t*) -1;
+}
+
+// Resolves a dependency handle through its record reference
+// Returns NULL if the reference is stale, in which case a name lookup is needed
+static NnpkgPackage_t* pkgDbResolveDepRef (NnpkgTransCb_t* cb, NnpkgDepRef_t* depRef)
+{
+    if (!depRef->slot)
+        return NULL;
+    NnpkgProp_t* prop = malloc_s (sizeof (NnpkgProp_t));
+    if (!prop)
+    {
         cb->error = NNPKG_ERR_OOM;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return (NnpkgPackage_t*) -1;
+    }
+    if (!PropDbGetPropBySlot (depRef->db, depRef->slot, depRef->gen, prop))
+    {
+        free (prop);
         return NULL;
     }
-    // Add each dependency
-    int i = 0;
-    while (intProp->deps[i].idx)
+    if (prop->type != NNPKG_PROP_TYPE_PKG)
     {
-        // Find package
-        NnpkgPackage_t* dep =
-            pkgDbFindPackage (cb,
-                              db,
-                              PropDbGetString (db, intProp->deps[i].idx),
-                              true);
+        ObjDestroy (&prop->obj);
+        return NULL;
+    }
+    return pkgDbGetPackage (cb, depRef->db, prop);
+}
+
+// Resolves the dependency handles of a package into a list of packages
+// Dependencies are found lazily, so only one level of the graph is loaded
+static bool pkgDbResolveDeps (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg)
+{
+    if (pkg->deps)
+        return true;
+    ListHead_t* deps =
+        ListCreate ("NnpkgPackage_t", true, offsetof (NnpkgPackage_t, obj));
+    if (!deps)
+    {
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return false;
+    }
+    for (size_t i = 0; i < pkg->numDeps; ++i)
+    {
+        NnpkgDepRef_t* depRef = &pkg->depRefs[i];
+        const char32_t* depName = PkgGetDepName (depRef);
+        NnpkgPackage_t* dep = pkgDbResolveDepRef (cb, depRef);
+        if (!dep)
+            dep = pkgDbFindPackage (cb, depRef->db, depName, true, true);
         // If we can't find the package, than we return -1 to indicate a broken
         // dependency As we go up the recursion chain, we will keep returning -1 to
         // prevent overwriting diagnostic info.
         // The actual interface will normalize -1 to NULL for consistency's sake
         if (!dep)
         {
-            ObjDestroy (&prop->obj);
-            ListDestroy (pkg->deps);
             cb->error = NNPKG_ERR_BROKEN_DEP;
-            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-            cb->errHint[0] = pkg->id;
-            cb->errHint[1] =
-                StrRefCreate (PropDbGetString (db, intProp->deps[i].idx));
+            cb->errHint[0] = StrRefNew (pkg->id);
+            cb->errHint[1] = StrRefCreate (depName);
             StrRefNoFree (cb->errHint[1]);
-            return (NnpkgPackage_t*) -1;
+            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+            ListDestroy (deps);
+            return false;
         }
         else if (dep == (NnpkgPackage_t*) -1)
         {
-            ObjDestroy (&prop->obj);
-            ListDestroy (pkg->deps);
-            return (NnpkgPackage_t*) -1;
+            ListDestroy (deps);
+            return false;
         }
-        ListAddBack (pkg->deps, dep, 0);
-        ++i;
+        ListAddBack (deps, dep, 0);
+    }
+    pkg->deps = deps;
+    return true;
+}
+
+// Loads the whole dependency closure of a package
+static bool pkgDbLoadClosure (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg)
+{
+    // Packages are marked before recursing, so that cycles terminate
+    if (pkg->depsLoaded)
+        return true;
+    pkg->depsLoaded = true;
+    if (!pkgDbResolveDeps (cb, pkg))
+    {
+        pkg->depsLoaded = false;
+        return false;
+    }
+    ListEntry_t* depEntry = ListFront (pkg->deps);
+    while (depEntry)
+    {
+        if (!pkgDbLoadClosure (cb, ListEntryData (depEntry)))
+        {
+            pkg->depsLoaded = false;
+            return false;
+        }
+        depEntry = ListIterate (depEntry);
+    }
+    return true;
+}
+
+NnpkgPackage_t* pkgDbFindPackage (NnpkgTransCb_t* cb,
+                                  NnpkgPropDb_t* db,
+                                  const char32_t* name,
+                                  bool findingDep,
+                                  bool lazy)
+{
+    // Find property
+    NnpkgProp_t* prop = malloc_s (sizeof (NnpkgProp_t));
+    if (!prop)
+    {
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return NULL;
+    }
+    if (!PropDbFindProp (db, name, prop))
+    {
+        if (!findingDep)
+        {
+            cb->error = NNPKG_ERR_PKG_NO_EXIST;
+            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        }
+        free (prop);
+        return NULL;
+    }
+    NnpkgPackage_t* pkg = pkgDbGetPackage (cb, db, prop);
+    if (pkg == (NnpkgPackage_t*) -1)
+        return pkg;
+    if (!lazy && !pkgDbLoadClosure (cb, pkg))
+    {
+        ObjDestroy (&pkg->obj);
+        return (NnpkgPackage_t*) -1;
     }
-    ObjCreate ("NnpkgPackage_t", &pkg->obj);
-    ObjSetDestroy (&pkg->obj, pkgDestroy);
     return pkg;
 }
 
+bool propDbFindProps (NnpkgPropDb_t* db,
+                      const char32_t** names,
+                      size_t numNames,
+                      uint32_t* slots,
+                      uint16_t* gens);
+
+NNPKG_PUBLIC bool PkgDbFindPackages (NnpkgTransCb_t* cb,
+                                     NnpkgPropDb_t* db,
+                                     const char32_t** names,
+                                     size_t numNames,
+                                     NnpkgPackage_t** pkgs)
+{
+    memset (pkgs, 0, numNames * sizeof (NnpkgPackage_t*));
+    uint32_t* slots = memAlloc (NNPKG_MEM_PKGDB, numNames * sizeof (uint32_t));
+    uint16_t* gens = memAlloc (NNPKG_MEM_PKGDB, numNames * sizeof (uint16_t));
+    if (!slots || !gens || !propDbFindProps (db, names, numNames, slots, gens))
+    {
+        memFree (slots);
+        memFree (gens);
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return false;
+    }
+    for (size_t i = 0; i < numNames; ++i)
+    {
+        NnpkgDepRef_t depRef = {0};
+        depRef.db = db;
+        depRef.slot = slots[i];
+        depRef.gen = gens[i];
+        NnpkgPackage_t* pkg = pkgDbResolveDepRef (cb, &depRef);
+        if (pkg == (NnpkgPackage_t*) -1)
+        {
+            for (size_t j = 0; j < i; ++j)
+            {
+                if (pkgs[j])
+                    ObjDestroy (&pkgs[j]->obj);
+                pkgs[j] = NULL;
+            }
+            memFree (slots);
+            memFree (gens);
+            return false;
+        }
+        pkgs[i] = pkg;
+    }
+    memFree (slots);
+    memFree (gens);
+    return true;
+}
+
 NNPKG_PUBLIC NnpkgPackage_t* PkgDbFindPackage (NnpkgTransCb_t* cb,
                                                NnpkgPropDb_t* db,
                                                const char32_t* name)
 {
-    NnpkgPackage_t* pkg = pkgDbFindPackage (cb, db, name, false);
+    NnpkgPackage_t* pkg = pkgDbFindPackage (cb, db, name, false, false);
     // Normalize -1 return value to NULL, as error info is in the control block
     return (pkg == (NnpkgPackage_t*) -1) ? NULL : pkg;
 }
 
+NNPKG_PUBLIC NnpkgPackage_t* PkgDbFindPackageLazy (NnpkgTransCb_t* cb,
+                                                   NnpkgPropDb_t* db,
+                                                   const char32_t* name)
+{
+    NnpkgPackage_t* pkg = pkgDbFindPackage (cb, db, name, false, true);
+    return (pkg == (NnpkgPackage_t*) -1) ? NULL : pkg;
+}
+
+NNPKG_PUBLIC ListHead_t* PkgGetDeps (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg)
+{
+    if (!pkgDbResolveDeps (cb, pkg))
+        return NULL;
+    return pkg->deps;
+}
+
+NNPKG_PUBLIC const char32_t* PkgGetDepName (const NnpkgDepRef_t* depRef)
+{
+    if (depRef->name)
+        return StrRefGet (depRef->name);
+    return PropDbGetString (depRef->db, depRef->nameIdx);
+}
+
 NNPKG_PUBLIC bool PkgDbRemovePackage (NnpkgTransCb_t* cb,
                                       NnpkgPropDb_t* db,
                                       NnpkgPackage_t* pkg)
 {
     assert (pkg->prop);
-    return PropDbRemoveProp (cb, db, pkg->prop);
+    // The removal list takes a reference of its own, as the package keeps its
+    // property
+    ObjRef (&pkg->prop->obj);
+    if (!PropDbRemoveProp (cb, db, pkg->prop))
+    {
+        ObjDeRef (&pkg->prop->obj);
+        return false;
+    }
+    // The package leaves the cache, so it goes as soon as its holders let go of it
+    const void* key = pkg->prop->internal;
+    if (pkgCacheFind (db->pkgCache, key) == pkg)
+    {
+        pkgCacheRemove (db->pkgCache, key);
+        ObjDeRef (&pkg->obj);
+    }
+    return true;
+}
+
+uint32_t propDbGetNumSlots (NnpkgPropDb_t* db);
+
+const void* propDbPeekSlot (NnpkgPropDb_t* db,
+                            uint32_t slot,
+                            unsigned short* type,
+                            uint32_t* id,
+                            uint16_t* gen);
+
+NNPKG_PUBLIC NnpkgPackage_t* PkgDbGetPackageBySlot (NnpkgTransCb_t* cb,
+                                                    NnpkgPropDb_t* db,
+                                                    uint32_t slot)
+{
+    // Look up the slot's current generation, then go through the same path as a
+    // dependency handle
+    unsigned short type = 0;
+    uint32_t id = 0;
+    NnpkgDepRef_t depRef = {0};
+    depRef.db = db;
+    depRef.slot = slot;
+    if (!slot || slot > propDbGetNumSlots (db) ||
+        !propDbPeekSlot (db, slot, &type, &id, &depRef.gen))
+    {
+        return NULL;
+    }
+    NnpkgPackage_t* pkg = pkgDbResolveDepRef (cb, &depRef);
+    return (pkg == (NnpkgPackage_t*) -1) ? NULL : pkg;
 }
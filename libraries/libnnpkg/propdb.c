@@ -19,7 +19,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <nnpkg/mem.h>
+#include <nnpkg/pkg.h>
 #include <nnpkg/propdb.h>
+#include <nnpkg/trace.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/file.h>
@@ -44,19 +47,22 @@ typedef struct _dbHeader
     uint32_t numProps;        // Number of properties in database
     uint32_t numFreeProps;    // Number of free properties
     uint32_t propSize;
+    uint32_t generation;    // Bumped every time changes are committed, so that plans
+                            // made against an older database can be caught
 } __attribute__ ((packed)) propDbHeader_t;
 
 // Header constants
 #define NNPKG_SIGNATURE        0x7878807571686600
 #define NNPKG_CURRENT_VERSION  0
-#define NNPKG_CURRENT_REVISION 1
+#define NNPKG_CURRENT_REVISION 3
 
 typedef struct _dbProp
 {
     uint32_t id;       // String ID of ID
     uint32_t crc32;    // Checksum of this property
     uint16_t type;     // Property type
-    uint8_t resvd[2];
+    uint16_t gen;      // Generation of this slot. Bumped every time it is freed, so
+                       // that stale references to it can be detected
 } __attribute__ ((packed)) propDbProperty_t;
 
 NNPKG_PUBLIC bool PropDbCreate (NnpkgDbLocation_t* dbLoc)
@@ -103,6 +109,7 @@ NNPKG_PUBLIC bool PropDbCreate (NnpkgDbLocation_t* dbLoc)
     hdr.numProps = 0;
     hdr.numFreeProps = 0;
     hdr.propSize = PROPDB_PROP_SIZE;
+    hdr.generation = 0;
     hdr.crc32 = 0;
     hdr.crc32 = Crc32Calc ((uint8_t*) &hdr, sizeof (propDbHeader_t));
     // Write it out
@@ -142,57 +149,145 @@ bool propAddListFind (const ListEntry_t* entry, const void* data)
         return false;
 }
 
-NNPKG_PUBLIC NnpkgPropDb_t* PropDbOpen (NnpkgTransCb_t* cb, NnpkgDbLocation_t* dbLoc)
+// Lock queue functions
+int dbLockOpen (const char* dbPath);
+uint64_t dbLockNow();
+uint64_t dbLockDeadline (int timeout);
+bool dbLockTake (int fd, uint64_t deadline, uint64_t* ticket);
+void dbLockGive (int fd, uint64_t ticket);
+bool dbLockFile (int fd, int op, uint64_t deadline);
+
+// Gets how long to wait for the database, in milliseconds
+static int propDbTimeout (NnpkgTransCb_t* cb)
+{
+    return cb->conf ? cb->conf->lockTimeout : -1;
+}
+
+// Gives up turn at database, if one is held
+static void propDbGiveTurn (NnpkgPropDb_t* db)
+{
+    if (db->hasTurn)
+        dbLockGive (db->lockFd, db->turn);
+    db->hasTurn = false;
+}
+
+// Waits for a turn at the database, then locks it with op. Readers give their
+// turn up once they are in, so that writers only wait for readers that came
+// before them
+static bool propDbTakeLock (NnpkgTransCb_t* cb,
+                            NnpkgPropDb_t* db,
+                            int op,
+                            int timeout)
+{
+    uint64_t start = dbLockNow();
+    uint64_t deadline = dbLockDeadline (timeout);
+    bool res = dbLockTake (db->lockFd, deadline, &db->turn);
+    if (res)
+    {
+        db->hasTurn = true;
+        res = dbLockFile (db->fd, op, deadline);
+        int err = errno;
+        if (!res || op == LOCK_SH)
+            propDbGiveTurn (db);
+        errno = err;
+    }
+    cb->stats.lockWait += dbLockNow() - start;
+    if (!res)
+    {
+        if (errno == ETIMEDOUT)
+            cb->error = NNPKG_ERR_DB_LOCKED;
+        else
+        {
+            cb->error = NNPKG_ERR_SYS;
+            cb->sysErrno = errno;
+        }
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+    }
+    return res;
+}
+
+// Unlocks database and leaves the lock queue
+static void propDbDropLock (NnpkgPropDb_t* db)
+{
+    flock (db->fd, LOCK_UN);
+    propDbGiveTurn (db);
+    close (db->lockFd);
+}
+
+// Loads what is kept from the header. Only valid while the database is locked, as
+// writers change the header when they commit
+static void propDbLoadHdr (NnpkgPropDb_t* db)
+{
+    propDbHeader_t* dbHdr = db->memBase;
+    db->numFreeProps = dbHdr->numFreeProps;
+    // Slots before the allocation mark may have been freed since
+    db->allocMark = NULL;
+    db->propsLeft = 0;
+}
+
+// Opens database, locking it exclusively, or shared if it is only to be read until
+// PropDbLock is called
+static NnpkgPropDb_t* propDbOpen (NnpkgTransCb_t* cb,
+                                  NnpkgDbLocation_t* dbLoc,
+                                  bool shared)
 {
     const char* fileName = StrRefGet (dbLoc->dbPath);
     const char* strtab = StrRefGet (dbLoc->strtabPath);
     // Prepare state
-    NnpkgPropDb_t* db = calloc_s (sizeof (NnpkgPropDb_t));
+    NnpkgPropDb_t* db = memCalloc (NNPKG_MEM_PROPDB, sizeof (NnpkgPropDb_t));
     if (!db)
     {
         cb->error = NNPKG_ERR_OOM;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
         return NULL;
     }
-    // Get size of database
-    struct stat st;
-    if (stat (fileName, &st) == -1)
+    // Open database
+    db->fd = open (fileName, O_RDWR);
+    if (db->fd == -1)
     {
         cb->error = NNPKG_ERR_SYS;
         cb->sysErrno = errno;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-        free (db);
+        memFree (db);
         return NULL;
     }
-    db->sz = st.st_size;
-    // Open database
-    db->fd = open (fileName, O_RDWR);
-    if (db->fd == -1)
+    db->lockFd = dbLockOpen (fileName);
+    if (db->lockFd == -1)
     {
         cb->error = NNPKG_ERR_SYS;
         cb->sysErrno = errno;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-        free (db);
+        close (db->fd);
+        memFree (db);
         return NULL;
     }
-    // Lock database
-    if (flock (db->fd, LOCK_EX | LOCK_NB) == -1)
+    // Lock database. Exclusive lockers don't wait, as they hold the lock for as
+    // long as the database is open
+    if (!propDbTakeLock (cb,
+                         db,
+                         shared ? LOCK_SH : LOCK_EX,
+                         shared ? propDbTimeout (cb) : 0))
     {
-        if (errno == EWOULDBLOCK)
-        {
-            cb->error = NNPKG_ERR_DB_LOCKED;
-            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-        }
-        else
-        {
-            cb->error = NNPKG_ERR_SYS;
-            cb->sysErrno = errno;
-            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-        }
+        close (db->lockFd);
+        close (db->fd);
+        memFree (db);
+        return NULL;
+    }
+    db->locked = !shared;
+    // Get size of database, now that nobody can be growing it
+    struct stat st;
+    if (fstat (db->fd, &st) == -1)
+    {
+        cb->error = NNPKG_ERR_SYS;
+        cb->sysErrno = errno;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        propDbDropLock (db);
         close (db->fd);
-        free (db);
+        memFree (db);
         return NULL;
     }
+    db->sz = st.st_size;
+    db->cb = cb;
     // Map database
     db->memBase = mmap (NULL, db->sz, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, 0);
     if (!db->memBase)
@@ -200,9 +295,24 @@ NNPKG_PUBLIC NnpkgPropDb_t* PropDbOpen (NnpkgTransCb_t* cb, NnpkgDbLocation_t* d
         cb->error = NNPKG_ERR_SYS;
         cb->sysErrno = errno;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-        flock (db->fd, LOCK_UN);
+        propDbDropLock (db);
+        close (db->fd);
+        memFree (db);
+        return NULL;
+    }
+    // Databases of other revisions lay their records out differently
+    propDbHeader_t* dbHdr = (propDbHeader_t*) db->memBase;
+    if (db->sz < sizeof (propDbHeader_t) || dbHdr->sig != NNPKG_SIGNATURE ||
+        dbHdr->version != NNPKG_CURRENT_VERSION ||
+        dbHdr->revision != NNPKG_CURRENT_REVISION ||
+        dbHdr->propSize != PROPDB_PROP_SIZE)
+    {
+        cb->error = NNPKG_ERR_DB_REVISION;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        propDbDropLock (db);
         close (db->fd);
-        free (db);
+        munmap (db->memBase, db->sz);
+        memFree (db);
         return NULL;
     }
     // Initialize packages-to-add
@@ -212,10 +322,10 @@ NNPKG_PUBLIC NnpkgPropDb_t* PropDbOpen (NnpkgTransCb_t* cb, NnpkgDbLocation_t* d
     {
         cb->error = NNPKG_ERR_OOM;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-        flock (db->fd, LOCK_UN);
+        propDbDropLock (db);
         close (db->fd);
         munmap (db->memBase, db->sz);
-        free (db);
+        memFree (db);
         return NULL;
     }
     // Initialize packages-to-remove
@@ -224,29 +334,102 @@ NNPKG_PUBLIC NnpkgPropDb_t* PropDbOpen (NnpkgTransCb_t* cb, NnpkgDbLocation_t* d
     {
         cb->error = NNPKG_ERR_OOM;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-        flock (db->fd, LOCK_UN);
+        propDbDropLock (db);
         close (db->fd);
         munmap (db->memBase, db->sz);
         ListDestroy (db->propsToAdd);
-        free (db);
+        memFree (db);
         return NULL;
     }
-    propDbHeader_t* dbHdr = (propDbHeader_t*) db->memBase;
-    db->numFreeProps = dbHdr->numFreeProps;
-    assert (dbHdr->propSize == PROPDB_PROP_SIZE);
+    propDbLoadHdr (db);
+    db->gen = dbHdr->generation;
     if (!PropDbOpenStrtab (cb, db, strtab))
     {
-        flock (db->fd, LOCK_UN);
+        propDbDropLock (db);
         close (db->fd);
         munmap (db->memBase, db->sz);
         ListDestroy (db->propsToAdd);
         ListDestroy (db->propsToRm);
-        free (db);
+        memFree (db);
         return NULL;
     }
+    memCharge (NNPKG_MEM_PROPDB, db->sz);
     return db;
 }
 
+NNPKG_PUBLIC NnpkgPropDb_t* PropDbOpen (NnpkgTransCb_t* cb, NnpkgDbLocation_t* dbLoc)
+{
+    NNPKG_TRACE_SPAN ("PropDbOpen");
+    return propDbOpen (cb, dbLoc, false);
+}
+
+NNPKG_PUBLIC NnpkgPropDb_t* PropDbOpenShared (NnpkgTransCb_t* cb,
+                                              NnpkgDbLocation_t* dbLoc)
+{
+    NNPKG_TRACE_SPAN ("PropDbOpenShared");
+    return propDbOpen (cb, dbLoc, true);
+}
+
+NNPKG_PUBLIC bool PropDbLock (NnpkgTransCb_t* cb, NnpkgPropDb_t* db)
+{
+    NNPKG_TRACE_SPAN ("PropDbLock");
+    if (db->locked)
+        return true;
+    // Let go of the shared lock before queueing, as writers ahead of us wait for
+    // it. They may commit before we get in, which shows up in the generation
+    flock (db->fd, LOCK_UN);
+    if (!propDbTakeLock (cb, db, LOCK_EX, propDbTimeout (cb)))
+        return false;
+    db->locked = true;
+    propDbLoadHdr (db);
+    propDbHeader_t* dbHdr = db->memBase;
+    if (dbHdr->generation != db->gen)
+    {
+        cb->error = NNPKG_ERR_DB_CHANGED;
+        return false;
+    }
+    // A commit that failed partway may have left strings at the end of the string
+    // table. Append after them
+    struct stat st;
+    if (fstat (db->strtabFd, &st) == -1)
+    {
+        cb->error = NNPKG_ERR_SYS;
+        cb->sysErrno = errno;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return false;
+    }
+    if ((size_t) st.st_size > db->strtabOff)
+    {
+        db->strtabSz += st.st_size - db->strtabOff;
+        db->strtabOff = st.st_size;
+    }
+    return true;
+}
+
+NNPKG_PUBLIC void PropDbUnlock (NnpkgPropDb_t* db)
+{
+    assert (!db->locked);
+    flock (db->fd, LOCK_UN);
+}
+
+NNPKG_PUBLIC bool PropDbRelock (NnpkgTransCb_t* cb, NnpkgPropDb_t* db)
+{
+    NNPKG_TRACE_SPAN ("PropDbRelock");
+    assert (!db->locked);
+    if (!propDbTakeLock (cb, db, LOCK_SH, propDbTimeout (cb)))
+        return false;
+    propDbLoadHdr (db);
+    // Commits may have grown the database past the mapping, or reused slots that
+    // were read before
+    propDbHeader_t* dbHdr = db->memBase;
+    if (dbHdr->generation != db->gen)
+    {
+        cb->error = NNPKG_ERR_DB_CHANGED;
+        return false;
+    }
+    return true;
+}
+
 // Allocates a new property database entry
 // This algorithm is disgraceful. We really need to use a hash table
 propDbProperty_t* propDbAllocProp (NnpkgPropDb_t* db)
@@ -275,11 +458,14 @@ propDbProperty_t* propDbAllocProp (NnpkgPropDb_t* db)
         if (curProp->type == NNPKG_PROP_TYPE_INVALID)
         {
             --db->numFreeProps;
-            db->propsLeft = propsLeft - i;
-            db->allocMark = curProp + 1;
+            db->propsLeft = propsLeft - i - 1;
+            db->allocMark = (void*) curProp + PROPDB_PROP_SIZE;
+            // Don't leave the last owner's data lying around in the slot
+            memset (curProp + 1, 0, PROPDB_PROP_SIZE - sizeof (propDbProperty_t));
             return curProp;
         }
-        ++curProp;
+        // Properties are a fixed size on disk, not the size of the header
+        curProp = (void*) curProp + PROPDB_PROP_SIZE;
     }
     return NULL;
 }
@@ -331,10 +517,26 @@ NNPKG_PUBLIC bool PropDbRemoveProp (NnpkgTransCb_t* cb,
     return true;
 }
 
+// Prepares a property found in the database
+static void propDbFillProp (NnpkgPropDb_t* db,
+                            propDbProperty_t* prop,
+                            NnpkgProp_t* out)
+{
+    out->id = StrRefCreate (PropDbGetString (db, prop->id));
+    StrRefNoFree (out->id);
+    out->type = prop->type;
+    out->data = prop + 1;
+    out->dataLen = PROPDB_PROP_SIZE - sizeof (propDbProperty_t);
+    out->internal = prop;
+    ObjCreate ("NnpkgProp_t", &out->obj);
+    ObjSetDestroy (&out->obj, propDestroyFound);
+}
+
 NNPKG_PUBLIC bool PropDbFindProp (NnpkgPropDb_t* db,
                                   const char32_t* name,
                                   NnpkgProp_t* out)
 {
+    NNPKG_TRACE_SPAN ("PropDbFindProp");
     assert (out);
     // Loop through database
     propDbProperty_t* prop =
@@ -342,17 +544,10 @@ NNPKG_PUBLIC bool PropDbFindProp (NnpkgPropDb_t* db,
     propDbHeader_t* dbHdr = db->memBase;
     for (int i = 0; i < dbHdr->numProps; ++i)
     {
-        if (!c32cmp (PropDbGetString (db, prop->id), name))
+        if (prop->type != NNPKG_PROP_TYPE_INVALID &&
+            !c32cmp (PropDbGetString (db, prop->id), name))
         {
-            // Prepare property
-            out->id = StrRefCreate (PropDbGetString (db, prop->id));
-            StrRefNoFree (out->id);
-            out->type = prop->type;
-            out->data = prop + 1;
-            out->dataLen = PROPDB_PROP_SIZE - sizeof (propDbProperty_t);
-            out->internal = prop;
-            ObjCreate ("NnpkgProp_t", &out->obj);
-            ObjSetDestroy (&out->obj, propDestroyFound);
+            propDbFillProp (db, prop, out);
             return true;
         }
         prop = (((void*) prop + PROPDB_PROP_SIZE));
@@ -360,18 +555,186 @@ NNPKG_PUBLIC bool PropDbFindProp (NnpkgPropDb_t* db,
     return false;
 }
 
+NNPKG_PUBLIC bool PropDbGetPropRef (NnpkgPropDb_t* db,
+                                    const NnpkgProp_t* prop,
+                                    uint32_t* slot,
+                                    uint16_t* gen)
+{
+    // Ensure property was found in this database
+    void* propBase = db->memBase + sizeof (propDbHeader_t);
+    if (prop->internal < propBase || prop->internal >= db->memBase + db->sz)
+        return false;
+    propDbProperty_t* intProp = prop->internal;
+    // Slots are 1-based, so that 0 can mean "no slot"
+    *slot = ((prop->internal - propBase) / PROPDB_PROP_SIZE) + 1;
+    *gen = intProp->gen;
+    return true;
+}
+
+NNPKG_PUBLIC bool PropDbGetPropBySlot (NnpkgPropDb_t* db,
+                                       uint32_t slot,
+                                       uint16_t gen,
+                                       NnpkgProp_t* out)
+{
+    assert (out);
+    propDbHeader_t* dbHdr = db->memBase;
+    size_t off = sizeof (propDbHeader_t) + ((size_t) (slot - 1) * PROPDB_PROP_SIZE);
+    if (!slot || slot > dbHdr->numProps || off + PROPDB_PROP_SIZE > db->sz)
+        return false;
+    propDbProperty_t* prop = db->memBase + off;
+    // Check that the slot hasn't been freed or reused since reference was taken
+    if (prop->type == NNPKG_PROP_TYPE_INVALID || prop->gen != gen)
+        return false;
+    propDbFillProp (db, prop, out);
+    return true;
+}
+
+// Gets number of slots in database, including free ones
+uint32_t propDbGetNumSlots (NnpkgPropDb_t* db)
+{
+    propDbHeader_t* dbHdr = db->memBase;
+    return dbHdr->numProps;
+}
+
+// Looks at the property in a slot without creating an object for it, for passes
+// over the whole database. Returns the property's data, or NULL if the slot is free
+const void* propDbPeekSlot (NnpkgPropDb_t* db,
+                            uint32_t slot,
+                            unsigned short* type,
+                            uint32_t* id,
+                            uint16_t* gen)
+{
+    assert (slot && slot <= propDbGetNumSlots (db));
+    size_t off = sizeof (propDbHeader_t) + ((size_t) (slot - 1) * PROPDB_PROP_SIZE);
+    propDbProperty_t* prop = db->memBase + off;
+    if (prop->type == NNPKG_PROP_TYPE_INVALID)
+        return NULL;
+    *type = prop->type;
+    *id = prop->id;
+    *gen = prop->gen;
+    return prop + 1;
+}
+
+// Hashes a property name for propDbFindProps
+static uint32_t propDbHashName (const char32_t* name)
+{
+    uint32_t hash = 2166136261;
+    for (; *name; ++name)
+        hash = (hash ^ *name) * 16777619;
+    return hash;
+}
+
+// Finds several properties with one pass over the database, instead of a pass per
+// name. slots[i] gets the slot of names[i], or 0 if it isn't in the database, and
+// gens[i] gets the slot's generation. As with PropDbFindProp, the first property
+// of a name wins. Returns false if memory runs out
+bool propDbFindProps (NnpkgPropDb_t* db,
+                      const char32_t** names,
+                      size_t numNames,
+                      uint32_t* slots,
+                      uint16_t* gens)
+{
+    NNPKG_TRACE_SPAN ("propDbFindProps");
+    memset (slots, 0, numNames * sizeof (uint32_t));
+    if (!numNames)
+        return true;
+    // Build an open addressed table of names. Table entries are indices into names
+    // plus one, so that 0 is free. Duplicate names are chained off the first one
+    size_t tableSz = 1;
+    while (tableSz < numNames * 2)
+        tableSz *= 2;
+    size_t* table = memCalloc (NNPKG_MEM_PROPDB, tableSz * sizeof (size_t));
+    uint32_t* hashes = memAlloc (NNPKG_MEM_PROPDB, numNames * sizeof (uint32_t));
+    size_t* dups = memAlloc (NNPKG_MEM_PROPDB, numNames * sizeof (size_t));
+    if (!table || !hashes || !dups)
+    {
+        memFree (table);
+        memFree (hashes);
+        memFree (dups);
+        return false;
+    }
+    size_t numLeft = 0;
+    for (size_t i = 0; i < numNames; ++i)
+    {
+        hashes[i] = propDbHashName (names[i]);
+        dups[i] = 0;
+        size_t pos = hashes[i] & (tableSz - 1);
+        while (table[pos])
+        {
+            size_t other = table[pos] - 1;
+            if (hashes[other] == hashes[i] && !c32cmp (names[other], names[i]))
+                break;
+            pos = (pos + 1) & (tableSz - 1);
+        }
+        if (table[pos])
+        {
+            // Put name at the end of the chain of its first occurrence
+            size_t last = table[pos] - 1;
+            while (dups[last])
+                last = dups[last] - 1;
+            dups[last] = i + 1;
+            continue;
+        }
+        table[pos] = i + 1;
+        ++numLeft;
+    }
+    // Go through database, looking up each property in the table
+    propDbHeader_t* dbHdr = db->memBase;
+    propDbProperty_t* prop =
+        (propDbProperty_t*) (db->memBase + sizeof (propDbHeader_t));
+    for (uint32_t slot = 1; slot <= dbHdr->numProps && numLeft; ++slot)
+    {
+        if (prop->type != NNPKG_PROP_TYPE_INVALID)
+        {
+            const char32_t* name = PropDbGetString (db, prop->id);
+            uint32_t hash = propDbHashName (name);
+            size_t pos = hash & (tableSz - 1);
+            while (table[pos])
+            {
+                size_t idx = table[pos] - 1;
+                if (hashes[idx] == hash && !c32cmp (names[idx], name))
+                {
+                    if (!slots[idx])
+                    {
+                        for (size_t i = idx + 1; i; i = dups[i - 1])
+                        {
+                            slots[i - 1] = slot;
+                            gens[i - 1] = prop->gen;
+                        }
+                        --numLeft;
+                    }
+                    break;
+                }
+                pos = (pos + 1) & (tableSz - 1);
+            }
+        }
+        prop = (((void*) prop + PROPDB_PROP_SIZE));
+    }
+    memFree (table);
+    memFree (hashes);
+    memFree (dups);
+    return true;
+}
+
 NNPKG_PUBLIC void PropDbClose (NnpkgPropDb_t* db)
 {
+    NNPKG_TRACE_SPAN ("PropDbClose");
     size_t curEnd = db->sz;
     propDbHeader_t* dbHdr = (propDbHeader_t*) db->memBase;
     uint32_t numProps = dbHdr->numProps;
+    bool changed = ListFront (db->propsToRm) || ListFront (db->propsToAdd);
+    // Changes may only be committed while the database is locked exclusively
+    assert (db->locked || !changed);
     // Remove properties that need to be removed
     ListEntry_t* curEntry = ListFront (db->propsToRm);
     while (curEntry)
     {
         NnpkgProp_t* prop = ListEntryData (curEntry);
-        // Clear property
-        memset (prop->internal, 0, sizeof (propDbProperty_t));
+        // Clear property, moving slot to a new generation
+        propDbProperty_t* intProp = prop->internal;
+        uint16_t gen = intProp->gen;
+        memset (intProp, 0, sizeof (propDbProperty_t));
+        intProp->gen = gen + 1;
         ++db->numFreeProps;
         curEntry = ListIterate (curEntry);
     }
@@ -386,30 +749,39 @@ NNPKG_PUBLIC void PropDbClose (NnpkgPropDb_t* db)
         if (!newProp)
         {
             // Serialize property, then expand database
-            newProp = calloc_s (PROPDB_PROP_SIZE);
+            newProp = memCalloc (NNPKG_MEM_PROPDB, PROPDB_PROP_SIZE);
             propDbSerializeProp (db, prop, newProp);
             // Write out to file
             pwrite (db->fd, newProp, PROPDB_PROP_SIZE, curEnd);
+            TransactCount (db->cb, NNPKG_COUNT_BYTES_WRITTEN, PROPDB_PROP_SIZE);
             curEnd += PROPDB_PROP_SIZE;
-            free (newProp);
+            memFree (newProp);
+            // Only new slots count, reused ones were counted already
+            ++numProps;
         }
         else
             propDbSerializeProp (db, prop, newProp);
-        ++numProps;
         curEntry = ListIterate (curEntry);
     }
-    // Set header fields that need to be updated
-    dbHdr->numProps = numProps;
-    dbHdr->numFreeProps = db->numFreeProps;
-    // Recompute CRC32 of header
-    dbHdr->crc32 = 0;
-    dbHdr->crc32 = Crc32Calc ((uint8_t*) dbHdr, sizeof (propDbHeader_t));
+    // Set header fields that need to be updated. Handles that only read the
+    // database leave the header alone, as they may not hold the lock anymore, and
+    // what they read of it may be out of date
+    if (changed)
+    {
+        dbHdr->numProps = numProps;
+        dbHdr->numFreeProps = db->numFreeProps;
+        ++dbHdr->generation;
+        // Recompute CRC32 of header
+        dbHdr->crc32 = 0;
+        dbHdr->crc32 = Crc32Calc ((uint8_t*) dbHdr, sizeof (propDbHeader_t));
+    }
     // Cleanup
     PropDbCloseStrtab (db);
     munmap (db->memBase, db->sz);
+    memUncharge (NNPKG_MEM_PROPDB, db->sz);
     ListDestroy (db->propsToAdd);
     ListDestroy (db->propsToRm);
-    flock (db->fd, LOCK_UN);
+    propDbDropLock (db);
     close (db->fd);
-    free (db);
+    memFree (db);
 }
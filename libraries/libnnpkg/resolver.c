@@ -0,0 +1,1061 @@
+/*
+    resolver.c - contains dependency resolver
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file resolver.c
+
+// The resolver is a conflict-driven solver in the spirit of PubGrub. Every package
+// has a domain, which is the set of candidates it may still end up as, plus a
+// special "none" member meaning the package isn't installed at all. Constraints
+// are stored as incompatibilities, i.e., sets of terms of the form "package is
+// in set S" that may not all hold at once. A dependency of candidate c of p on a
+// range R of q is the incompatibility {p in {c}, q in not R}.
+//
+// The solver alternates between unit propagation, which narrows domains using
+// incompatibilities that have all but one term satisfied, and decisions, which
+// pick the newest candidate left for a package that is required. When every term
+// of an incompatibility is satisfied, the conflict is resolved against the causes
+// of the assignments involved until a new incompatibility is found that lets the
+// solver backjump, and that incompatibility is learned so the conflict never
+// comes back.
+
+#include <assert.h>
+#include <libnex/char32.h>
+#include <libnex/safemalloc.h>
+#include <nnpkg/pkg.h>
+#include <nnpkg/resolver.h>
+#include <nnpkg/transaction.h>
+#include <string.h>
+
+// Domain bit for "package not selected"
+#define RESOLVER_BIT_NONE (1ULL << 63)
+
+// Candidate version of a package
+typedef struct _rescand
+{
+    size_t pkg;        ///< Package this is a candidate of
+    uint8_t ver[3];    ///< Version of candidate
+    int bit;           ///< Bit of candidate in package's domain
+    void* data;        ///< User data
+} resolverCand_t;
+
+// Package known to the resolver
+typedef struct _respkg
+{
+    const char32_t* name;    ///< Name of package
+    size_t cands[RESOLVER_MAX_CANDS];    ///< Candidates of package
+    int numCands;                        ///< Number of candidates
+    uint64_t dom;                        ///< Current domain
+    size_t lastAssign;                   ///< Latest assignment to package
+    size_t* incompats;                   ///< Incompatibilities referencing package
+    size_t numIncompats;                 ///< Number of entries in incompats
+    size_t maxIncompats;                 ///< Size of incompats
+} resolverPkg_t;
+
+// Dependency edge, turned into an incompatibility when solving
+typedef struct _resdep
+{
+    size_t cand;       ///< Candidate that has the dependency
+    size_t pkg;        ///< Package depended on
+    uint8_t verOp;     ///< Version operator
+    uint8_t ver[3];    ///< Version operand
+} resolverDep_t;
+
+// Term of an incompatibility
+typedef struct _resterm
+{
+    size_t pkg;      ///< Package term refers to
+    uint64_t set;    ///< Set of candidates term is satisfied by
+} resolverTerm_t;
+
+// Incompatibility
+typedef struct _resincompat
+{
+    size_t firstTerm;    ///< Index of first term in term array
+    size_t numTerms;     ///< Number of terms
+    bool watched;        ///< Whether propagation looks at this
+} resolverIncompat_t;
+
+// Assignment in partial solution
+typedef struct _resassign
+{
+    size_t pkg;           ///< Package being assigned
+    uint64_t dom;         ///< Domain of package after assignment
+    uint64_t prevDom;     ///< Domain of package before assignment
+    uint64_t mask;    ///< Set domain was intersected with
+    size_t prevAssign;    ///< Previous assignment to package
+    size_t cause;         ///< Incompatibility that derived this, or RESOLVER_NONE
+                          ///< for a decision
+    int level;            ///< Decision level
+} resolverAssign_t;
+
+typedef struct _nnpkgresolver
+{
+    resolverPkg_t* pkgs;    ///< Packages
+    size_t numPkgs;
+    size_t maxPkgs;
+    resolverCand_t* cands;    ///< Candidates
+    size_t numCands;
+    size_t maxCands;
+    resolverDep_t* deps;    ///< Dependency edges
+    size_t numDeps;
+    size_t maxDeps;
+    resolverTerm_t* terms;    ///< Terms of all incompatibilities
+    size_t numTerms;
+    size_t maxTerms;
+    resolverIncompat_t* incompats;    ///< Incompatibilities
+    size_t numIncompats;
+    size_t maxIncompats;
+    resolverAssign_t* trail;    ///< Partial solution
+    size_t trailLen;
+    size_t maxTrail;
+    size_t* nameMap;    ///< Open-addressed map from name to package
+    size_t nameMapSz;
+    size_t propPos;       ///< Next assignment to propagate
+    size_t scanPos;       ///< Next assignment to look for decisions at
+    int level;            ///< Current decision level
+    size_t conflict;      ///< Package blamed for failure
+} NnpkgResolver_t;
+
+// Index of root package, which requirements hang off of
+#define RESOLVER_ROOT 0
+
+// Grows a dynamic array so it can hold one more element
+static bool resolverGrow (void** array, size_t* max, size_t count, size_t elemSz)
+{
+    if (count < *max)
+        return true;
+    size_t newMax = (*max) ? (*max * 2) : 16;
+    void* newArray = realloc_s (*array, newMax * elemSz);
+    if (!newArray)
+        return false;
+    *array = newArray;
+    *max = newMax;
+    return true;
+}
+
+// Hashes a package name
+static inline size_t resolverHashName (const char32_t* name)
+{
+    size_t hash = 0xCBF29CE484222325ULL;
+    while (*name)
+    {
+        hash ^= *name++;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Gets full domain of a package
+static inline uint64_t resolverFullDom (const resolverPkg_t* pkg)
+{
+    return ((1ULL << pkg->numCands) - 1) | RESOLVER_BIT_NONE;
+}
+
+// Compares two versions
+static inline int resolverCmpVer (const uint8_t* ver1, const uint8_t* ver2)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        if (ver1[i] != ver2[i])
+            return (ver1[i] < ver2[i]) ? -1 : 1;
+    }
+    return 0;
+}
+
+NNPKG_PUBLIC bool ResolverVersionMatches (uint8_t verOp,
+                                          const uint8_t* ver,
+                                          const uint8_t* candVer)
+{
+    int cmp = resolverCmpVer (candVer, ver);
+    switch (verOp)
+    {
+        case NNPKG_VER_ANY:
+            return true;
+        case NNPKG_VER_EQ:
+            return cmp == 0;
+        case NNPKG_VER_LT:
+            return cmp < 0;
+        case NNPKG_VER_LE:
+            return cmp <= 0;
+        case NNPKG_VER_GT:
+            return cmp > 0;
+        case NNPKG_VER_GE:
+            return cmp >= 0;
+        default:
+            assert (!"Invalid version operator");
+    }
+    return false;
+}
+
+// Appends a package to the package array
+static size_t resolverNewPackage (NnpkgResolver_t* res, const char32_t* name)
+{
+    if (!resolverGrow ((void**) &res->pkgs,
+                       &res->maxPkgs,
+                       res->numPkgs,
+                       sizeof (resolverPkg_t)))
+    {
+        return RESOLVER_NONE;
+    }
+    resolverPkg_t* pkg = &res->pkgs[res->numPkgs];
+    memset (pkg, 0, sizeof (resolverPkg_t));
+    pkg->name = name;
+    pkg->lastAssign = RESOLVER_NONE;
+    return res->numPkgs++;
+}
+
+NNPKG_PUBLIC NnpkgResolver_t* ResolverCreate()
+{
+    NnpkgResolver_t* res = calloc_s (sizeof (NnpkgResolver_t));
+    if (!res)
+        return NULL;
+    res->nameMapSz = 64;
+    res->nameMap = malloc_s (res->nameMapSz * sizeof (size_t));
+    if (!res->nameMap)
+    {
+        free (res);
+        return NULL;
+    }
+    memset (res->nameMap, 0xFF, res->nameMapSz * sizeof (size_t));
+    // Create root package with its single candidate
+    static const uint8_t rootVer[3] = {0};
+    if (resolverNewPackage (res, NULL) == RESOLVER_NONE ||
+        ResolverAddCandidate (res, RESOLVER_ROOT, rootVer, NULL) == RESOLVER_NONE)
+    {
+        ResolverDestroy (res);
+        return NULL;
+    }
+    return res;
+}
+
+NNPKG_PUBLIC void ResolverDestroy (NnpkgResolver_t* res)
+{
+    for (size_t i = 0; i < res->numPkgs; ++i)
+        free (res->pkgs[i].incompats);
+    free (res->pkgs);
+    free (res->cands);
+    free (res->deps);
+    free (res->terms);
+    free (res->incompats);
+    free (res->trail);
+    free (res->nameMap);
+    free (res);
+}
+
+// Rehashes name map to twice its size
+static bool resolverGrowNameMap (NnpkgResolver_t* res)
+{
+    size_t newSz = res->nameMapSz * 2;
+    size_t* newMap = malloc_s (newSz * sizeof (size_t));
+    if (!newMap)
+        return false;
+    memset (newMap, 0xFF, newSz * sizeof (size_t));
+    for (size_t i = 0; i < res->nameMapSz; ++i)
+    {
+        size_t pkgIdx = res->nameMap[i];
+        if (pkgIdx == RESOLVER_NONE)
+            continue;
+        size_t bucket = resolverHashName (res->pkgs[pkgIdx].name) & (newSz - 1);
+        while (newMap[bucket] != RESOLVER_NONE)
+            bucket = (bucket + 1) & (newSz - 1);
+        newMap[bucket] = pkgIdx;
+    }
+    free (res->nameMap);
+    res->nameMap = newMap;
+    res->nameMapSz = newSz;
+    return true;
+}
+
+NNPKG_PUBLIC size_t ResolverAddPackage (NnpkgResolver_t* res,
+                                        const char32_t* name,
+                                        bool* isNew)
+{
+    size_t bucket = resolverHashName (name) & (res->nameMapSz - 1);
+    while (res->nameMap[bucket] != RESOLVER_NONE)
+    {
+        size_t pkgIdx = res->nameMap[bucket];
+        if (!c32cmp (res->pkgs[pkgIdx].name, name))
+        {
+            if (isNew)
+                *isNew = false;
+            return pkgIdx;
+        }
+        bucket = (bucket + 1) & (res->nameMapSz - 1);
+    }
+    size_t pkgIdx = resolverNewPackage (res, name);
+    if (pkgIdx == RESOLVER_NONE)
+        return RESOLVER_NONE;
+    res->nameMap[bucket] = pkgIdx;
+    // Keep map at most half full. The root package isn't in it, hence numPkgs - 1
+    if ((res->numPkgs - 1) * 2 > res->nameMapSz && !resolverGrowNameMap (res))
+        return RESOLVER_NONE;
+    if (isNew)
+        *isNew = true;
+    return pkgIdx;
+}
+
+NNPKG_PUBLIC size_t ResolverAddCandidate (NnpkgResolver_t* res,
+                                          size_t pkgIdx,
+                                          const uint8_t* ver,
+                                          void* data)
+{
+    resolverPkg_t* pkg = &res->pkgs[pkgIdx];
+    if (pkg->numCands == RESOLVER_MAX_CANDS)
+        return RESOLVER_NONE;
+    if (!resolverGrow ((void**) &res->cands,
+                       &res->maxCands,
+                       res->numCands,
+                       sizeof (resolverCand_t)))
+    {
+        return RESOLVER_NONE;
+    }
+    resolverCand_t* cand = &res->cands[res->numCands];
+    cand->pkg = pkgIdx;
+    memcpy (cand->ver, ver, sizeof (cand->ver));
+    cand->bit = pkg->numCands;
+    cand->data = data;
+    pkg->cands[pkg->numCands++] = res->numCands;
+    return res->numCands++;
+}
+
+NNPKG_PUBLIC bool ResolverAddDep (NnpkgResolver_t* res,
+                                  size_t candIdx,
+                                  size_t pkgIdx,
+                                  uint8_t verOp,
+                                  const uint8_t* ver)
+{
+    if (!resolverGrow ((void**) &res->deps,
+                       &res->maxDeps,
+                       res->numDeps,
+                       sizeof (resolverDep_t)))
+    {
+        return false;
+    }
+    resolverDep_t* dep = &res->deps[res->numDeps++];
+    dep->cand = candIdx;
+    dep->pkg = pkgIdx;
+    dep->verOp = verOp;
+    memcpy (dep->ver, ver, sizeof (dep->ver));
+    return true;
+}
+
+NNPKG_PUBLIC bool ResolverRequire (NnpkgResolver_t* res,
+                                   size_t pkgIdx,
+                                   uint8_t verOp,
+                                   const uint8_t* ver)
+{
+    // Requirements are dependencies of the root candidate
+    return ResolverAddDep (res,
+                           res->pkgs[RESOLVER_ROOT].cands[0],
+                           pkgIdx,
+                           verOp,
+                           ver);
+}
+
+NNPKG_PUBLIC int ResolverCountMatches (NnpkgResolver_t* res,
+                                      size_t pkgIdx,
+                                      uint8_t verOp,
+                                      const uint8_t* ver)
+{
+    resolverPkg_t* pkg = &res->pkgs[pkgIdx];
+    int count = 0;
+    for (int i = 0; i < pkg->numCands; ++i)
+    {
+        if (ResolverVersionMatches (verOp, ver, res->cands[pkg->cands[i]].ver))
+            ++count;
+    }
+    return count;
+}
+
+NNPKG_PUBLIC void* ResolverGetCandidateData (NnpkgResolver_t* res, size_t candIdx)
+{
+    return res->cands[candIdx].data;
+}
+
+NNPKG_PUBLIC size_t ResolverGetSelection (NnpkgResolver_t* res, size_t pkgIdx)
+{
+    resolverPkg_t* pkg = &res->pkgs[pkgIdx];
+    if (pkg->dom & RESOLVER_BIT_NONE)
+        return RESOLVER_NONE;
+    assert (pkg->dom && !(pkg->dom & (pkg->dom - 1)));
+    return pkg->cands[__builtin_ctzll (pkg->dom)];
+}
+
+NNPKG_PUBLIC const char32_t* ResolverGetConflict (NnpkgResolver_t* res)
+{
+    if (res->conflict == RESOLVER_NONE)
+        return NULL;
+    return res->pkgs[res->conflict].name;
+}
+
+// Adds an incompatibility made of the terms at the end of the term array
+static size_t resolverAddIncompat (NnpkgResolver_t* res, size_t firstTerm)
+{
+    if (!resolverGrow ((void**) &res->incompats,
+                       &res->maxIncompats,
+                       res->numIncompats,
+                       sizeof (resolverIncompat_t)))
+    {
+        return RESOLVER_NONE;
+    }
+    resolverIncompat_t* incompat = &res->incompats[res->numIncompats];
+    incompat->firstTerm = firstTerm;
+    incompat->numTerms = res->numTerms - firstTerm;
+    incompat->watched = false;
+    return res->numIncompats++;
+}
+
+// Appends a term to the term array
+static bool resolverAddTerm (NnpkgResolver_t* res, size_t pkg, uint64_t set)
+{
+    if (!resolverGrow ((void**) &res->terms,
+                       &res->maxTerms,
+                       res->numTerms,
+                       sizeof (resolverTerm_t)))
+    {
+        return false;
+    }
+    res->terms[res->numTerms].pkg = pkg;
+    res->terms[res->numTerms].set = set;
+    ++res->numTerms;
+    return true;
+}
+
+// Makes an incompatibility visible to propagation
+static bool resolverWatchIncompat (NnpkgResolver_t* res, size_t incompatIdx)
+{
+    resolverIncompat_t* incompat = &res->incompats[incompatIdx];
+    if (incompat->watched)
+        return true;
+    incompat->watched = true;
+    for (size_t i = 0; i < incompat->numTerms; ++i)
+    {
+        resolverPkg_t* pkg = &res->pkgs[res->terms[incompat->firstTerm + i].pkg];
+        if (!resolverGrow ((void**) &pkg->incompats,
+                           &pkg->maxIncompats,
+                           pkg->numIncompats,
+                           sizeof (size_t)))
+        {
+            return false;
+        }
+        pkg->incompats[pkg->numIncompats++] = incompatIdx;
+    }
+    return true;
+}
+
+// Turns dependency edges into incompatibilities
+static bool resolverBuildIncompats (NnpkgResolver_t* res)
+{
+    for (size_t i = 0; i < res->numDeps; ++i)
+    {
+        resolverDep_t* dep = &res->deps[i];
+        resolverCand_t* cand = &res->cands[dep->cand];
+        resolverPkg_t* depPkg = &res->pkgs[dep->pkg];
+        // Figure out which candidates satisfy the dependency
+        uint64_t allowed = 0;
+        for (int j = 0; j < depPkg->numCands; ++j)
+        {
+            if (ResolverVersionMatches (dep->verOp,
+                                        dep->ver,
+                                        res->cands[depPkg->cands[j]].ver))
+            {
+                allowed |= 1ULL << j;
+            }
+        }
+        size_t firstTerm = res->numTerms;
+        if (!resolverAddTerm (res, cand->pkg, 1ULL << cand->bit))
+            return false;
+        // If nothing satisfies the dependency, the candidate itself is unusable.
+        // The dependency term is then always satisfied and can be left out
+        uint64_t depSet = resolverFullDom (depPkg) & ~allowed;
+        if (depSet != resolverFullDom (depPkg) &&
+            !resolverAddTerm (res, dep->pkg, depSet))
+        {
+            return false;
+        }
+        size_t incompat = resolverAddIncompat (res, firstTerm);
+        if (incompat == RESOLVER_NONE || !resolverWatchIncompat (res, incompat))
+            return false;
+    }
+    return true;
+}
+
+// Records an assignment to the partial solution
+static bool resolverAssign (NnpkgResolver_t* res,
+                            size_t pkgIdx,
+                            uint64_t mask,
+                            size_t cause)
+{
+    if (!resolverGrow ((void**) &res->trail,
+                       &res->maxTrail,
+                       res->trailLen,
+                       sizeof (resolverAssign_t)))
+    {
+        return false;
+    }
+    resolverPkg_t* pkg = &res->pkgs[pkgIdx];
+    resolverAssign_t* assign = &res->trail[res->trailLen];
+    assign->pkg = pkgIdx;
+    assign->prevDom = pkg->dom;
+    assign->dom = pkg->dom & mask;
+    assign->mask = mask;
+    assign->prevAssign = pkg->lastAssign;
+    assign->cause = cause;
+    assign->level = res->level;
+    pkg->dom = assign->dom;
+    pkg->lastAssign = res->trailLen++;
+    return true;
+}
+
+// Undoes all assignments above a decision level
+static void resolverBacktrack (NnpkgResolver_t* res, int level)
+{
+    while (res->trailLen && res->trail[res->trailLen - 1].level > level)
+    {
+        resolverAssign_t* assign = &res->trail[--res->trailLen];
+        resolverPkg_t* pkg = &res->pkgs[assign->pkg];
+        pkg->dom = assign->prevDom;
+        pkg->lastAssign = assign->prevAssign;
+        // The package may need a decision again
+        if (assign->prevAssign != RESOLVER_NONE && assign->prevAssign < res->scanPos)
+            res->scanPos = assign->prevAssign;
+    }
+    if (res->propPos > res->trailLen)
+        res->propPos = res->trailLen;
+    if (res->scanPos > res->trailLen)
+        res->scanPos = res->trailLen;
+    res->level = level;
+}
+
+// Result of checking an incompatibility
+#define RESOLVER_INCOMPAT_OK       0
+#define RESOLVER_INCOMPAT_CONFLICT 1
+#define RESOLVER_INCOMPAT_ERR      2
+
+// Checks an incompatibility against the partial solution, deriving an assignment
+// if all but one of its terms are satisfied
+static int resolverCheckIncompat (NnpkgResolver_t* res, size_t incompatIdx)
+{
+    resolverIncompat_t* incompat = &res->incompats[incompatIdx];
+    resolverTerm_t* openTerm = NULL;
+    for (size_t i = 0; i < incompat->numTerms; ++i)
+    {
+        resolverTerm_t* term = &res->terms[incompat->firstTerm + i];
+        uint64_t dom = res->pkgs[term->pkg].dom;
+        if (!(dom & ~term->set))
+            continue;    // Satisfied
+        if (!(dom & term->set))
+            return RESOLVER_INCOMPAT_OK;    // Can never be satisfied
+        if (openTerm)
+            return RESOLVER_INCOMPAT_OK;    // More than one term left open
+        openTerm = term;
+    }
+    if (!openTerm)
+        return RESOLVER_INCOMPAT_CONFLICT;
+    // Remaining term must be false
+    if (!resolverAssign (res, openTerm->pkg, ~openTerm->set, incompatIdx))
+        return RESOLVER_INCOMPAT_ERR;
+    return RESOLVER_INCOMPAT_OK;
+}
+
+// Propagates assignments. Returns the violated incompatibility on conflict
+static bool resolverPropagate (NnpkgResolver_t* res, size_t* conflict)
+{
+    *conflict = RESOLVER_NONE;
+    while (res->propPos < res->trailLen)
+    {
+        resolverPkg_t* pkg = &res->pkgs[res->trail[res->propPos++].pkg];
+        for (size_t i = 0; i < pkg->numIncompats; ++i)
+        {
+            int status = resolverCheckIncompat (res, pkg->incompats[i]);
+            if (status == RESOLVER_INCOMPAT_ERR)
+                return false;
+            else if (status == RESOLVER_INCOMPAT_CONFLICT)
+            {
+                *conflict = pkg->incompats[i];
+                return true;
+            }
+        }
+    }
+    return true;
+}
+
+// Finds the earliest assignment after which a term is satisfied
+// Only assignments before index before are looked at, and each is intersected
+// with mask first
+static size_t resolverFindSatisfier (NnpkgResolver_t* res,
+                                     resolverTerm_t* term,
+                                     size_t before,
+                                     uint64_t mask)
+{
+    size_t satisfier = RESOLVER_NONE;
+    size_t assignIdx = res->pkgs[term->pkg].lastAssign;
+    while (assignIdx != RESOLVER_NONE)
+    {
+        resolverAssign_t* assign = &res->trail[assignIdx];
+        if (assignIdx < before && (assign->dom & mask & ~term->set))
+            break;
+        if (assignIdx < before)
+            satisfier = assignIdx;
+        assignIdx = assign->prevAssign;
+    }
+    return satisfier;
+}
+
+// Merges a term into the term list starting at firstTerm
+static bool resolverMergeTerm (NnpkgResolver_t* res,
+                               size_t firstTerm,
+                               size_t pkgIdx,
+                               uint64_t set)
+{
+    for (size_t i = firstTerm; i < res->numTerms; ++i)
+    {
+        if (res->terms[i].pkg == pkgIdx)
+        {
+            res->terms[i].set &= set;
+            return true;
+        }
+    }
+    return resolverAddTerm (res, pkgIdx, set);
+}
+
+// Resolves a conflict, learning a new incompatibility and backjumping
+// Returns false if the conflict can't be resolved
+static bool resolverResolveConflict (NnpkgResolver_t* res, size_t incompatIdx)
+{
+    while (true)
+    {
+        resolverIncompat_t* incompat = &res->incompats[incompatIdx];
+        // Find assignment that made the incompatibility satisfied
+        size_t satisfier = 0;
+        resolverTerm_t* satTerm = NULL;
+        for (size_t i = 0; i < incompat->numTerms; ++i)
+        {
+            resolverTerm_t* term = &res->terms[incompat->firstTerm + i];
+            size_t termSatisfier =
+                resolverFindSatisfier (res, term, res->trailLen, ~0ULL);
+            assert (termSatisfier != RESOLVER_NONE);
+            if (!satTerm || termSatisfier > satisfier)
+            {
+                satisfier = termSatisfier;
+                satTerm = term;
+            }
+        }
+        resolverAssign_t* satAssign = &res->trail[satisfier];
+        if (!satAssign->level)
+        {
+            // Conflict doesn't depend on any decision, so there is no way out
+            res->conflict = satTerm->pkg;
+            for (size_t i = 0; i < incompat->numTerms; ++i)
+            {
+                if (res->terms[incompat->firstTerm + i].pkg != RESOLVER_ROOT)
+                    res->conflict = res->terms[incompat->firstTerm + i].pkg;
+            }
+            return false;
+        }
+        // Find level at which everything but the satisfier was in place
+        int prevLevel = 0;
+        for (size_t i = 0; i < incompat->numTerms; ++i)
+        {
+            resolverTerm_t* term = &res->terms[incompat->firstTerm + i];
+            if (term == satTerm)
+                continue;
+            size_t termSatisfier =
+                resolverFindSatisfier (res, term, res->trailLen, ~0ULL);
+            if (res->trail[termSatisfier].level > prevLevel)
+                prevLevel = res->trail[termSatisfier].level;
+        }
+        size_t prevSatisfier =
+            resolverFindSatisfier (res, satTerm, satisfier, satAssign->mask);
+        if (prevSatisfier != RESOLVER_NONE &&
+            res->trail[prevSatisfier].level > prevLevel)
+        {
+            prevLevel = res->trail[prevSatisfier].level;
+        }
+        if (satAssign->cause == RESOLVER_NONE || prevLevel < satAssign->level)
+        {
+            // Learn incompatibility and backjump. The incompatibility will then
+            // derive the opposite of the satisfier's term
+            resolverBacktrack (res, prevLevel);
+            if (!resolverWatchIncompat (res, incompatIdx))
+                return false;
+            int status = resolverCheckIncompat (res, incompatIdx);
+            if (status == RESOLVER_INCOMPAT_ERR)
+                return false;
+            else if (status == RESOLVER_INCOMPAT_CONFLICT)
+                continue;
+            return true;
+        }
+        // Resolve with the cause of the satisfier, eliminating its package.
+        // For that package, the new term is the union of both terms, and for
+        // everything else it is the intersection
+        resolverIncompat_t* cause = &res->incompats[satAssign->cause];
+        size_t satPkg = satTerm->pkg;
+        uint64_t satSet = 0;
+        size_t firstTerm = res->numTerms;
+        size_t firstTerms[2] = {incompat->firstTerm, cause->firstTerm};
+        size_t numTerms[2] = {incompat->numTerms, cause->numTerms};
+        for (int i = 0; i < 2; ++i)
+        {
+            for (size_t j = 0; j < numTerms[i]; ++j)
+            {
+                resolverTerm_t term = res->terms[firstTerms[i] + j];
+                if (term.pkg == satPkg)
+                    satSet |= term.set;
+                else if (!resolverMergeTerm (res, firstTerm, term.pkg, term.set))
+                    return false;
+            }
+        }
+        if (satSet != resolverFullDom (&res->pkgs[satPkg]) &&
+            !resolverAddTerm (res, satPkg, satSet))
+        {
+            return false;
+        }
+        incompatIdx = resolverAddIncompat (res, firstTerm);
+        if (incompatIdx == RESOLVER_NONE)
+            return false;
+        if (!res->incompats[incompatIdx].numTerms)
+        {
+            res->conflict = satPkg;
+            return false;
+        }
+    }
+}
+
+// Picks the next package to decide on. Returns RESOLVER_NONE if there is none
+static size_t resolverNextDecision (NnpkgResolver_t* res)
+{
+    // Any package that needs a decision has an assignment that made it required,
+    // and assignments before scanPos never need one again unless we backtrack
+    while (res->scanPos < res->trailLen)
+    {
+        resolverPkg_t* pkg = &res->pkgs[res->trail[res->scanPos].pkg];
+        if (!(pkg->dom & RESOLVER_BIT_NONE) && (pkg->dom & (pkg->dom - 1)))
+            return res->trail[res->scanPos].pkg;
+        ++res->scanPos;
+    }
+    return RESOLVER_NONE;
+}
+
+NNPKG_PUBLIC bool ResolverSolve (NnpkgResolver_t* res)
+{
+    res->conflict = RESOLVER_NONE;
+    res->trailLen = 0;
+    res->propPos = 0;
+    res->scanPos = 0;
+    res->level = 0;
+    for (size_t i = 0; i < res->numPkgs; ++i)
+    {
+        res->pkgs[i].dom = resolverFullDom (&res->pkgs[i]);
+        res->pkgs[i].lastAssign = RESOLVER_NONE;
+    }
+    if (!res->numIncompats && !resolverBuildIncompats (res))
+        return false;
+    // Root is always selected
+    if (!resolverAssign (res, RESOLVER_ROOT, 1, RESOLVER_NONE))
+        return false;
+    // Apply incompatibilities that hold no matter what
+    for (size_t i = 0; i < res->numIncompats; ++i)
+    {
+        int status = resolverCheckIncompat (res, i);
+        if (status == RESOLVER_INCOMPAT_ERR)
+            return false;
+        else if (status == RESOLVER_INCOMPAT_CONFLICT &&
+                 !resolverResolveConflict (res, i))
+        {
+            return false;
+        }
+    }
+    while (true)
+    {
+        size_t conflict = RESOLVER_NONE;
+        if (!resolverPropagate (res, &conflict))
+            return false;
+        if (conflict != RESOLVER_NONE)
+        {
+            if (!resolverResolveConflict (res, conflict))
+                return false;
+            continue;
+        }
+        size_t pkgIdx = resolverNextDecision (res);
+        if (pkgIdx == RESOLVER_NONE)
+            return true;
+        // Pick newest candidate left
+        resolverPkg_t* pkg = &res->pkgs[pkgIdx];
+        int best = -1;
+        for (int i = 0; i < pkg->numCands; ++i)
+        {
+            if (!(pkg->dom & (1ULL << i)))
+                continue;
+            if (best == -1 || resolverCmpVer (res->cands[pkg->cands[i]].ver,
+                                              res->cands[pkg->cands[best]].ver) > 0)
+            {
+                best = i;
+            }
+        }
+        assert (best != -1);
+        ++res->level;
+        if (!resolverAssign (res, pkgIdx, 1ULL << best, RESOLVER_NONE))
+            return false;
+    }
+}
+
+// Adds the dependencies of a package as dependencies of a candidate
+// New packages are added to the queue of packages to look up
+static bool resolverAddPkgDeps (NnpkgResolver_t* res,
+                                size_t candIdx,
+                                NnpkgPackage_t* pkg,
+                                size_t** queue,
+                                size_t* queueLen,
+                                size_t* queueMax)
+{
+    for (size_t i = 0; i < pkg->numDeps; ++i)
+    {
+        NnpkgDepRef_t* depRef = &pkg->depRefs[i];
+        bool isNew = false;
+        size_t depIdx = ResolverAddPackage (res, PkgGetDepName (depRef), &isNew);
+        if (depIdx == RESOLVER_NONE)
+            return false;
+        if (isNew)
+        {
+            if (!resolverGrow ((void**) queue, queueMax, *queueLen, sizeof (size_t)))
+                return false;
+            (*queue)[(*queueLen)++] = depIdx;
+        }
+        if (!ResolverAddDep (res, candIdx, depIdx, depRef->verOp, depRef->ver))
+            return false;
+    }
+    return true;
+}
+
+// Looks up every candidate of the dependency closure of pkg
+// Returns false on error, with cb set up
+static bool resolverCollect (NnpkgTransCb_t* cb,
+                             NnpkgResolver_t* res,
+                             NnpkgPackage_t* pkg,
+                             NnpkgPackage_t** pending,
+                             size_t numPending,
+                             ListHead_t* found)
+{
+    size_t* queue = NULL;
+    size_t queueLen = 0, queueMax = 0;
+    const char32_t** names = NULL;    // Names of current wave
+    NnpkgPackage_t** cands = NULL;    // Packages found for names
+    size_t waveMax = 0;
+    size_t pkgIdx = ResolverAddPackage (res, StrRefGet (pkg->id), NULL);
+    if (pkgIdx == RESOLVER_NONE)
+        goto oom;
+    size_t candIdx = ResolverAddCandidate (res, pkgIdx, pkg->version, pkg);
+    if (candIdx == RESOLVER_NONE ||
+        !ResolverRequire (res, pkgIdx, NNPKG_VER_EQ, pkg->version) ||
+        !resolverAddPkgDeps (res, candIdx, pkg, &queue, &queueLen, &queueMax))
+    {
+        goto oom;
+    }
+    // Names are looked up a wave at a time, where a wave is every name queued by
+    // the wave before it. Each database is searched once per wave, rather than
+    // once per name
+    size_t waveStart = 0;
+    while (waveStart < queueLen)
+    {
+        size_t waveEnd = queueLen;
+        size_t waveLen = waveEnd - waveStart;
+        if (waveLen > waveMax)
+        {
+            const char32_t** newNames =
+                realloc_s (names, waveLen * sizeof (const char32_t*));
+            if (!newNames)
+                goto oom;
+            names = newNames;
+            NnpkgPackage_t** newCands =
+                realloc_s (cands, waveLen * sizeof (NnpkgPackage_t*));
+            if (!newCands)
+                goto oom;
+            cands = newCands;
+            waveMax = waveLen;
+        }
+        for (size_t i = waveStart; i < waveEnd; ++i)
+        {
+            const char32_t* name = res->pkgs[queue[i]].name;
+            names[i - waveStart] = name;
+            // Pending packages are candidates too. There are few of them, so they
+            // are just scanned
+            for (size_t j = 0; j < numPending; ++j)
+            {
+                NnpkgPackage_t* cand = pending[j];
+                if (cand == pkg || c32cmp (StrRefGet (cand->id), name))
+                    continue;
+                candIdx = ResolverAddCandidate (res, queue[i], cand->version, cand);
+                if (candIdx == RESOLVER_NONE ||
+                    !resolverAddPkgDeps (res,
+                                         candIdx,
+                                         cand,
+                                         &queue,
+                                         &queueLen,
+                                         &queueMax))
+                {
+                    goto oom;
+                }
+            }
+        }
+        ListEntry_t* dbEntry = ListFront (cb->pkgDbs);
+        while (dbEntry)
+        {
+            NnpkgPackageDb_t* pkgDb = ListEntryData (dbEntry);
+            dbEntry = ListIterate (dbEntry);
+            if (!PkgDbFindPackages (cb, pkgDb->propDb, names, waveLen, cands))
+            {
+                free (queue);
+                free (names);
+                free (cands);
+                return false;
+            }
+            // Hand every package over to found first, so none leak on failure
+            for (size_t i = 0; i < waveLen; ++i)
+            {
+                if (cands[i] && !ListAddBack (found, cands[i], 0))
+                {
+                    // Release the ones that weren't handed over
+                    for (size_t j = i; j < waveLen; ++j)
+                    {
+                        if (cands[j])
+                            ObjDestroy (&cands[j]->obj);
+                    }
+                    goto oom;
+                }
+            }
+            for (size_t i = 0; i < waveLen; ++i)
+            {
+                if (!cands[i])
+                    continue;
+                candIdx = ResolverAddCandidate (res,
+                                                queue[waveStart + i],
+                                                cands[i]->version,
+                                                cands[i]);
+                if (candIdx == RESOLVER_NONE ||
+                    !resolverAddPkgDeps (res,
+                                         candIdx,
+                                         cands[i],
+                                         &queue,
+                                         &queueLen,
+                                         &queueMax))
+                {
+                    goto oom;
+                }
+            }
+        }
+        waveStart = waveEnd;
+    }
+    free (names);
+    free (cands);
+    free (queue);
+    return true;
+oom:
+    free (queue);
+    free (names);
+    free (cands);
+    cb->error = NNPKG_ERR_OOM;
+    TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+    return false;
+}
+
+NNPKG_PUBLIC bool ResolverSelectDeps (NnpkgTransCb_t* cb, NnpkgPackage_t* pkg)
+{
+    return ResolverSelectDepsFrom (cb, pkg, NULL, 0);
+}
+
+NNPKG_PUBLIC bool ResolverSelectDepsFrom (NnpkgTransCb_t* cb,
+                                          NnpkgPackage_t* pkg,
+                                          NnpkgPackage_t** pending,
+                                          size_t numPending)
+{
+    NnpkgResolver_t* res = ResolverCreate();
+    ListHead_t* found =
+        ListCreate ("NnpkgPackage_t", true, offsetof (NnpkgPackage_t, obj));
+    if (!res || !found)
+    {
+        if (res)
+            ResolverDestroy (res);
+        if (found)
+            ListDestroy (found);
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        return false;
+    }
+    bool ret = false;
+    if (!resolverCollect (cb, res, pkg, pending, numPending, found))
+        goto out;
+    // Give precise errors for direct dependencies that can't be satisfied by
+    // themselves, as the solver can only tell that something went wrong
+    for (size_t i = 0; i < pkg->numDeps; ++i)
+    {
+        NnpkgDepRef_t* depRef = &pkg->depRefs[i];
+        const char32_t* depName = PkgGetDepName (depRef);
+        size_t depIdx = ResolverAddPackage (res, depName, NULL);
+        int error = NNPKG_ERR_NONE;
+        if (!ResolverCountMatches (res, depIdx, NNPKG_VER_ANY, depRef->ver))
+            error = NNPKG_ERR_BROKEN_DEP;
+        else if (!ResolverCountMatches (res, depIdx, depRef->verOp, depRef->ver))
+            error = NNPKG_ERR_DEP_CONFLICT;
+        if (error != NNPKG_ERR_NONE)
+        {
+            cb->error = error;
+            cb->errHint[0] = StrRefNew (pkg->id);
+            cb->errHint[1] = StrRefCreate (depName);
+            StrRefNoFree (cb->errHint[1]);
+            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+            goto out;
+        }
+    }
+    if (!ResolverSolve (res))
+    {
+        const char32_t* conflict = ResolverGetConflict (res);
+        if (conflict)
+        {
+            cb->error = NNPKG_ERR_DEP_CONFLICT;
+            cb->errHint[0] = StrRefNew (pkg->id);
+            cb->errHint[1] = StrRefCreate (conflict);
+            StrRefNoFree (cb->errHint[1]);
+        }
+        else
+            cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        goto out;
+    }
+    // Hand out chosen dependencies, in the order they were declared
+    for (size_t i = 0; i < pkg->numDeps; ++i)
+    {
+        size_t depIdx =
+            ResolverAddPackage (res, PkgGetDepName (&pkg->depRefs[i]), NULL);
+        size_t candIdx = ResolverGetSelection (res, depIdx);
+        assert (candIdx != RESOLVER_NONE);
+        NnpkgPackage_t* dep = ResolverGetCandidateData (res, candIdx);
+        dep = ObjGetContainer (ObjRef (&dep->obj), NnpkgPackage_t, obj);
+        if (!ListAddBack (pkg->deps, dep, 0))
+        {
+            ObjDestroy (&dep->obj);
+            cb->error = NNPKG_ERR_OOM;
+            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+            goto out;
+        }
+    }
+    ret = true;
+out:
+    ListDestroy (found);
+    ResolverDestroy (res);
+    return ret;
+}
@@ -25,6 +25,7 @@
 #include <libnex/error.h>
 #include <libnex/safemalloc.h>
 #include <libnex/safestring.h>
+#include <nnpkg/mem.h>
 #include <nnpkg/propdb.h>
 #include <nnpkg/transaction.h>
 #include <stdint.h>
@@ -95,6 +96,7 @@ NNPKG_PUBLIC bool PropDbOpenStrtab (NnpkgTransCb_t* cb,
                                     NnpkgPropDb_t* db,
                                     const char* fileName)
 {
+    db->cb = cb;
     // Get size of database
     struct stat st;
     if (stat (fileName, &st) == -1)
@@ -102,8 +104,7 @@ NNPKG_PUBLIC bool PropDbOpenStrtab (NnpkgTransCb_t* cb,
         cb->error = NNPKG_ERR_SYS;
         cb->sysErrno = errno;
         TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
-        free (db);
-        return NULL;
+        return false;
     }
     db->strtabSz = st.st_size;
     db->strtabOff = st.st_size;
@@ -127,6 +128,8 @@ NNPKG_PUBLIC bool PropDbOpenStrtab (NnpkgTransCb_t* cb,
         close (db->strtabFd);
         return false;
     }
+    db->strtabMapSz = db->strtabSz;
+    memCharge (NNPKG_MEM_STRTAB, db->strtabMapSz);
     return true;
 }
 
@@ -135,6 +138,8 @@ NNPKG_PUBLIC size_t PropDbAddString (NnpkgPropDb_t* db, const char32_t* s)
     // Write it out
     size_t len = c32len (s);
     pwrite (db->strtabFd, s, (len + 1) * sizeof (char32_t), (off_t) db->strtabOff);
+    TransactCount (db->cb, NNPKG_COUNT_STRINGS_ADDED, 1);
+    TransactCount (db->cb, NNPKG_COUNT_BYTES_WRITTEN, (len + 1) * sizeof (char32_t));
     size_t ret = db->strtabOff;
     db->strtabOff += strtabAlign ((len + 1) * sizeof (char32_t));
     db->strtabSz += strtabAlign ((len + 1) * sizeof (char32_t));
@@ -151,6 +156,7 @@ NNPKG_PUBLIC const char32_t* PropDbGetString (NnpkgPropDb_t* db, size_t idx)
 
 NNPKG_PUBLIC void PropDbCloseStrtab (NnpkgPropDb_t* db)
 {
-    munmap (db->strtabBase, db->strtabSz);
+    munmap (db->strtabBase, db->strtabMapSz);
+    memUncharge (NNPKG_MEM_STRTAB, db->strtabMapSz);
     close (db->strtabFd);
 }
@@ -0,0 +1,669 @@
+/*
+    addmulti.c - contains test suite for adding sets of packages
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file addmulti.c
+
+#include <stdio.h>
+#define NEXTEST_NAME "addmulti"
+#include <errno.h>
+#include <fcntl.h>
+#ifdef NNPKG_ENABLE_NLS
+#include <libintl.h>
+#endif
+#include <libnex/base.h>
+#include <libnex/error.h>
+#include <libnex/progname.h>
+#include <libnex/unicode.h>
+#include <locale.h>
+#include <nextest.h>
+#include <nnpkg/graph.h>
+#include <nnpkg/mem.h>
+#include <nnpkg/pkg.h>
+#include <nnpkg/transaction.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// States reported, in order, and if any came from another thread
+static int states[32];
+static size_t numStates = 0;
+static pthread_t mainThread;
+static bool otherThread = false;
+
+// Set to have another transaction seem to commit just before the database is locked
+static bool interfere = false;
+
+// Set if links were removed while the database was still open
+static bool uncommittedRemove = false;
+
+// Moves database to a new generation behind the transaction's back
+static void bumpDbGen (NnpkgTransCb_t* cb)
+{
+    int fd = open (StrRefGet (cb->conf->dbLoc.dbPath), O_RDWR);
+    uint32_t gen = 0;
+    // Generation is after the rest of the header
+    if (fd == -1 || pread (fd, &gen, sizeof (gen), 28) != sizeof (gen))
+        return;
+    ++gen;
+    pwrite (fd, &gen, sizeof (gen), 28);
+    close (fd);
+}
+
+void progHandler (NnpkgTransCb_t* cb, int state)
+{
+    printf ("%d\n", cb->error);
+    if (numStates < ARRAY_SIZE (states))
+        states[numStates++] = state;
+    if (!pthread_equal (pthread_self(), mainThread))
+        otherThread = true;
+    if (state == NNPKG_STATE_REMOVE_INDEX && cb->pkgDbs)
+        uncommittedRemove = true;
+    if (state == NNPKG_STATE_LOCK_DB && interfere)
+    {
+        interfere = false;
+        bumpDbGen (cb);
+    }
+}
+
+// Finds where a state was first reported
+static int findState (int state)
+{
+    for (size_t i = 0; i < numStates; ++i)
+    {
+        if (states[i] == state)
+            return (int) i;
+    }
+    return -1;
+}
+
+// Directory packages are made in
+static char tmpDir[] = "/tmp/nnpkgtestXXXXXX";
+
+// Writes a package configuration file, and gives its prefix a program
+static const char* makePkg (const char* name, const char* deps)
+{
+    static char confs[32][256];
+    static int numConfs = 0;
+    char* conf = confs[numConfs++];
+    char path[256];
+    snprintf (path, sizeof (path), "%s/%s", tmpDir, name);
+    mkdir (path, 0755);
+    snprintf (path, sizeof (path), "%s/%s/bin", tmpDir, name);
+    mkdir (path, 0755);
+    snprintf (path, sizeof (path), "%s/%s/bin/%s", tmpDir, name, name);
+    fclose (fopen (path, "w"));
+    snprintf (conf, 256, "%s/%s.conf", tmpDir, name);
+    FILE* file = fopen (conf, "w");
+    fprintf (file,
+             "package %s\n{\n    description: \"Test package\";\n"
+             "    prefix: '%s/%s';\n    isDependency: %s;\n",
+             name,
+             tmpDir,
+             name,
+             strcmp (name, "multiapp") ? "true" : "false");
+    if (deps)
+        fprintf (file, "    dependencies: %s;\n", deps);
+    fprintf (file, "}\n");
+    fclose (file);
+    return conf;
+}
+
+// Gets path of a package's program in the index
+static void linkPath (NnpkgTransCb_t* cb, const char* name, char* path, size_t sz)
+{
+    snprintf (path,
+              sz,
+              "%s/bin/%s",
+              UnicodeToHost (StrRefGet (cb->conf->idxPath)),
+              name);
+}
+
+// Checks whether the index has a link to a package's program
+static bool hasLink (NnpkgTransCb_t* cb, const char* name)
+{
+    char path[512];
+    linkPath (cb, name, path, sizeof (path));
+    struct stat st;
+    return !lstat (path, &st) && S_ISLNK (st.st_mode);
+}
+
+// Checks that the index has a link to a package's program, and removes it
+static bool checkLink (NnpkgTransCb_t* cb, const char* name)
+{
+    char path[512];
+    linkPath (cb, name, path, sizeof (path));
+    struct stat st;
+    bool res = !lstat (path, &st) && S_ISLNK (st.st_mode);
+    unlink (path);
+    return res;
+}
+
+// Makes a file in a package's prefix, along with the directories it is in
+static void makeFile (const char* name, const char* rel)
+{
+    char path[512];
+    int len = snprintf (path, sizeof (path), "%s/%s/%s", tmpDir, name, rel);
+    for (char* p = path + len - strlen (rel); (p = strchr (p, '/')); ++p)
+    {
+        *p = 0;
+        mkdir (path, 0755);
+        *p = '/';
+    }
+    fclose (fopen (path, "w"));
+}
+
+// Gets the type of a path in the index, or 0 if nothing is there
+static mode_t idxType (NnpkgTransCb_t* cb, const char* rel)
+{
+    char path[512];
+    snprintf (path,
+              sizeof (path),
+              "%s/%s",
+              UnicodeToHost (StrRefGet (cb->conf->idxPath)),
+              rel);
+    struct stat st;
+    if (lstat (path, &st) == -1)
+        return 0;
+    return st.st_mode & S_IFMT;
+}
+
+// Gets the inode of a path in the index, or 0 if there is nothing there
+static ino_t idxIno (NnpkgTransCb_t* cb, const char* rel)
+{
+    char path[512];
+    snprintf (path,
+              sizeof (path),
+              "%s/%s",
+              UnicodeToHost (StrRefGet (cb->conf->idxPath)),
+              rel);
+    struct stat st;
+    if (lstat (path, &st) == -1)
+        return 0;
+    return st.st_ino;
+}
+
+// A root of its own, with a transaction run on it from another thread
+typedef struct _testroot
+{
+    char conf[256];              ///< Main configuration of root
+    NnpkgTransCb_t cb;           ///< Control block of transaction
+    NnpkgTransAddMulti_t add;    ///< Packages added to root
+    bool res;                    ///< Result of transaction
+} testRoot_t;
+
+static void quietProgress (NnpkgTransCb_t* cb, int state)
+{
+    UNUSED (cb);
+    UNUSED (state);
+}
+
+// Creates a root with an empty database and index under tmpDir
+static bool makeRoot (testRoot_t* root, const char* name)
+{
+    char path[256];
+    snprintf (path, sizeof (path), "%s/%s", tmpDir, name);
+    mkdir (path, 0755);
+    snprintf (path, sizeof (path), "%s/%s/Index", tmpDir, name);
+    mkdir (path, 0755);
+    snprintf (path, sizeof (path), "%s/%s/Index/bin", tmpDir, name);
+    mkdir (path, 0755);
+    snprintf (root->conf, sizeof (root->conf), "%s/%s.conf", tmpDir, name);
+    FILE* file = fopen (root->conf, "w");
+    if (!file)
+        return false;
+    fprintf (file,
+             "settings\n{\n    packageDb: \"%s/%s/db\";\n"
+             "    strtab: \"%s/%s/strtab\";\n    indexPath: \"%s/%s/Index\";\n}\n",
+             tmpDir,
+             name,
+             tmpDir,
+             name,
+             tmpDir,
+             name);
+    fclose (file);
+    root->cb.progress = quietProgress;
+    if (!PkgParseMainConf (&root->cb, root->conf))
+        return false;
+    bool res = PropDbCreate (&root->cb.conf->dbLoc);
+    PkgDestroyMainConf (&root->cb);
+    return res;
+}
+
+static void* rootJob (void* data)
+{
+    testRoot_t* root = data;
+    root->res = TransactExecute (&root->cb);
+    return NULL;
+}
+
+// Checks whether a root's index has a link to a package's program
+static bool rootHasLink (const char* rootName, const char* name)
+{
+    char path[512];
+    snprintf (path, sizeof (path), "%s/%s/Index/bin/%s", tmpDir, rootName, name);
+    struct stat st;
+    return !lstat (path, &st) && S_ISLNK (st.st_mode);
+}
+
+int main (int argc, char** argv)
+{
+    setprogname (argv[0]);
+#ifdef NNPKG_ENABLE_NLS
+    setlocale (LC_ALL, "");
+    bindtextdomain ("libnnpkg", NNPKG_LOCALE_BASE);
+#endif
+    mainThread = pthread_self();
+    MemStatsEnable();
+    NnpkgTransCb_t cb = {0};
+    cb.progress = progHandler;
+    TEST_BOOL (PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH),
+               "PkgParseMainConf success");
+    NnpkgDbLocation_t* dbLoc = &cb.conf->dbLoc;
+    if (unlink (StrRefGet (dbLoc->dbPath)) == -1 && errno != ENOENT)
+    {
+        error ("%s: %s", dbLoc->dbPath, strerror (errno));
+        return 1;
+    }
+    if (unlink (StrRefGet (dbLoc->strtabPath)) == -1 && errno != ENOENT)
+    {
+        error ("%s: %s", dbLoc->strtabPath, strerror (errno));
+        return 1;
+    }
+    TEST_BOOL (PropDbCreate (dbLoc), "PkgDbCreate() success");
+    // Make sure index exists
+    char idxBin[256];
+    snprintf (idxBin,
+              sizeof (idxBin),
+              "%s/bin",
+              UnicodeToHost (StrRefGet (cb.conf->idxPath)));
+    mkdir (UnicodeToHost (StrRefGet (cb.conf->idxPath)), 0755);
+    mkdir (idxBin, 0755);
+    PkgDestroyMainConf (&cb);
+    TEST_BOOL (mkdtemp (tmpDir), "mkdtemp() success");
+    // Packages are given out of order. multiapp depends on multilib and multitool,
+    // and multilib depends on multibase
+    const char* confs[4];
+    confs[0] = makePkg ("multiapp", "multilib, multitool");
+    confs[1] = makePkg ("multilib", "multibase");
+    confs[2] = makePkg ("multibase", NULL);
+    confs[3] = makePkg ("multitool", NULL);
+    cb.type = NNPKG_TRANS_ADD_MULTI;
+    cb.confFile = NNPKG_CONFFILE_PATH;
+    NnpkgTransAddMulti_t add = {0};
+    add.pkgConfs = confs;
+    add.numPkgs = 4;
+    add.numThreads = 2;
+    cb.transactData = &add;
+    numStates = 0;
+    TEST_BOOL (TransactExecute (&cb), "NNPKG_TRANS_ADD_MULTI success");
+    // Stages overlap, but progress is still reported in order, and only from the
+    // thread running the transaction
+    TEST_BOOL (findState (NNPKG_STATE_READ_PKGCONF) <
+                       findState (NNPKG_STATE_COLLECT_INDEX) &&
+                   findState (NNPKG_STATE_COLLECT_INDEX) <
+                       findState (NNPKG_STATE_LOCK_DB) &&
+                   findState (NNPKG_STATE_LOCK_DB) <
+                       findState (NNPKG_STATE_WRITE_INDEX) &&
+                   findState (NNPKG_STATE_WRITE_INDEX) <
+                       findState (NNPKG_STATE_ADDPKG) &&
+                   findState (NNPKG_STATE_READ_PKGCONF) >= 0 && !otherThread,
+               "NNPKG_TRANS_ADD_MULTI progress order");
+    // Every state is timed, and work is counted against the state doing it
+    NnpkgTransStats_t* stats = &cb.stats;
+    TEST_BOOL (stats->time[NNPKG_STATE_READ_PKGCONF] &&
+                   stats->time[NNPKG_STATE_CLEANUP_PKGSYS],
+               "NNPKG_TRANS_ADD_MULTI timings");
+    TEST (stats->counts[NNPKG_STATE_COLLECT_INDEX][NNPKG_COUNT_FILES_COLLECTED],
+          4,
+          "NNPKG_TRANS_ADD_MULTI files collected");
+    TEST (stats->counts[NNPKG_STATE_WRITE_INDEX][NNPKG_COUNT_LINKS_WRITTEN],
+          4,
+          "NNPKG_TRANS_ADD_MULTI links written");
+    uint64_t* cleanupCounts = stats->counts[NNPKG_STATE_CLEANUP_PKGSYS];
+    TEST_BOOL (cleanupCounts[NNPKG_COUNT_STRINGS_ADDED] &&
+                   cleanupCounts[NNPKG_COUNT_BYTES_WRITTEN],
+               "NNPKG_TRANS_ADD_MULTI database writes");
+    // Everything a transaction allocates is gone once it finishes
+    NnpkgMemStats_t memStats[NNPKG_NUM_MEM];
+    for (int i = 0; i < NNPKG_NUM_MEM; ++i)
+    {
+        MemStatsGet (i, &memStats[i]);
+        TEST (memStats[i].bytes, 0, "NNPKG_TRANS_ADD_MULTI memory freed");
+        TEST (memStats[i].allocs, memStats[i].frees, "NNPKG_TRANS_ADD_MULTI frees");
+    }
+    TEST_BOOL (memStats[NNPKG_MEM_PROPDB].peak && memStats[NNPKG_MEM_STRTAB].peak &&
+                   memStats[NNPKG_MEM_PKGCONF].peak &&
+                   memStats[NNPKG_MEM_INDEX].peak,
+               "NNPKG_TRANS_ADD_MULTI memory accounted");
+    TEST_BOOL (memStats[NNPKG_MEM_TOTAL].peak >= memStats[NNPKG_MEM_PKGCONF].peak,
+               "NNPKG_TRANS_ADD_MULTI memory peak");
+    // Check the database
+    cb.state = 0;
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    dbLoc = &cb.conf->dbLoc;
+    NnpkgPropDb_t* db = PkgDbOpen (&cb, dbLoc);
+    NnpkgGraph_t* graph = PkgGraphBuild (&cb, db);
+    TEST_BOOL (graph, "PkgGraphBuild() success");
+    TEST (graph->numEdges, 3, "NNPKG_TRANS_ADD_MULTI dependencies");
+    uint32_t* path = NULL;
+    size_t pathLen = 0;
+    uint32_t base = PkgGraphFindNode (graph, U"multibase");
+    PkgGraphWhy (&cb, graph, base, &path, &pathLen);
+    TEST (pathLen, 3, "NNPKG_TRANS_ADD_MULTI dependencies 2");
+    free (path);
+    // Packages are stored dependencies first
+    TEST (base, 0, "NNPKG_TRANS_ADD_MULTI order");
+    TEST (PkgGraphFindNode (graph, U"multiapp"), 3, "NNPKG_TRANS_ADD_MULTI order 2");
+    PkgGraphDestroy (graph);
+    PkgDbClose (db);
+    TEST_BOOL (hasLink (&cb, "multiapp"), "NNPKG_TRANS_ADD_MULTI index");
+    PkgDestroyMainConf (&cb);
+    // multilib can't be removed while multiapp needs it
+    cb.type = NNPKG_TRANS_REMOVE;
+    cb.state = 0;
+    NnpkgTransRemove_t rm = {0};
+    rm.pkgName = "multilib";
+    cb.transactData = &rm;
+    TEST_BOOL (!TransactExecute (&cb), "NNPKG_TRANS_REMOVE on needed package");
+    TEST (cb.error, NNPKG_ERR_PKG_NEEDED, "NNPKG_TRANS_REMOVE on needed package 2");
+    StrRefDestroy (cb.errHint[0]);
+    StrRefDestroy (cb.errHint[1]);
+    memset (&rm, 0, sizeof (NnpkgTransRemove_t));
+    rm.pkgName = "multinonexistent";
+    cb.state = 0;
+    TEST_BOOL (!TransactExecute (&cb) && cb.error == NNPKG_ERR_PKG_NO_EXIST,
+               "NNPKG_TRANS_REMOVE on nonexistent package");
+    // multiapp can, and takes its link with it
+    memset (&rm, 0, sizeof (NnpkgTransRemove_t));
+    rm.pkgName = "multiapp";
+    cb.state = 0;
+    numStates = 0;
+    TEST_BOOL (TransactExecute (&cb), "NNPKG_TRANS_REMOVE success");
+    TEST (cb.stats.counts[NNPKG_STATE_REMOVE_INDEX][NNPKG_COUNT_LINKS_REMOVED],
+          1,
+          "NNPKG_TRANS_REMOVE links removed");
+    // Links only go once the database no longer has the package
+    TEST_BOOL (findState (NNPKG_STATE_RMPKG) <
+                       findState (NNPKG_STATE_REMOVE_INDEX) &&
+                   findState (NNPKG_STATE_RMPKG) >= 0 && !uncommittedRemove,
+               "NNPKG_TRANS_REMOVE commits before removing links");
+    cb.state = 0;
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    dbLoc = &cb.conf->dbLoc;
+    db = PkgDbOpen (&cb, dbLoc);
+    graph = PkgGraphBuild (&cb, db);
+    TEST_BOOL (graph && PkgGraphFindNode (graph, U"multiapp") == NNPKG_GRAPH_NO_NODE,
+               "NNPKG_TRANS_REMOVE database");
+    PkgGraphDestroy (graph);
+    PkgDbClose (db);
+    // Check the index
+    TEST_BOOL (!hasLink (&cb, "multiapp") && checkLink (&cb, "multilib") &&
+                   checkLink (&cb, "multibase") && checkLink (&cb, "multitool"),
+               "NNPKG_TRANS_REMOVE index");
+    PkgDestroyMainConf (&cb);
+    cb.type = NNPKG_TRANS_ADD_MULTI;
+    cb.transactData = &add;
+    // Packages that depend on each other can't be ordered
+    confs[0] = makePkg ("multicyc1", "multicyc2");
+    confs[1] = makePkg ("multicyc2", "multicyc1");
+    memset (&add, 0, sizeof (NnpkgTransAddMulti_t));
+    add.pkgConfs = confs;
+    add.numPkgs = 2;
+    cb.state = 0;
+    TEST_BOOL (!TransactExecute (&cb), "NNPKG_TRANS_ADD_MULTI on cycle");
+    TEST (cb.error, NNPKG_ERR_DEP_CYCLE, "NNPKG_TRANS_ADD_MULTI on cycle 2");
+    StrRefDestroy (cb.errHint[0]);
+    // Nothing is written to the index until every package has been read
+    confs[0] = makePkg ("multiok1", NULL);
+    confs[1] = "/nonexistent/multibad.conf";
+    confs[2] = makePkg ("multiok2", NULL);
+    memset (&add, 0, sizeof (NnpkgTransAddMulti_t));
+    add.pkgConfs = confs;
+    add.numPkgs = 3;
+    cb.state = 0;
+    TEST_BOOL (!TransactExecute (&cb), "NNPKG_TRANS_ADD_MULTI on bad file");
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    dbLoc = &cb.conf->dbLoc;
+    TEST_BOOL (!hasLink (&cb, "multiok1") && !hasLink (&cb, "multiok2"),
+               "NNPKG_TRANS_ADD_MULTI on bad file index");
+    PkgDestroyMainConf (&cb);
+    // multiapp's slot is free now, so one of these reuses it. Neither may clobber
+    // the packages around it
+    confs[0] = makePkg ("multinew1", NULL);
+    confs[1] = makePkg ("multinew2", "multinew1");
+    memset (&add, 0, sizeof (NnpkgTransAddMulti_t));
+    add.pkgConfs = confs;
+    add.numPkgs = 2;
+    cb.state = 0;
+    // Another commit sneaks in after planning, so the set is planned again
+    interfere = true;
+    TEST_BOOL (TransactExecute (&cb), "NNPKG_TRANS_ADD_MULTI into free slot");
+    TEST (cb.stats.numPlans, 2, "NNPKG_TRANS_ADD_MULTI planned again");
+    cb.state = 0;
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    dbLoc = &cb.conf->dbLoc;
+    db = PkgDbOpen (&cb, dbLoc);
+    graph = PkgGraphBuild (&cb, db);
+    TEST_BOOL (graph, "NNPKG_TRANS_ADD_MULTI into free slot 2");
+    static const char32_t* names[] =
+        {U"multibase", U"multilib", U"multitool", U"multinew1", U"multinew2"};
+    for (size_t i = 0; i < ARRAY_SIZE (names); ++i)
+    {
+        TEST_BOOL (PkgGraphFindNode (graph, names[i]) != NNPKG_GRAPH_NO_NODE,
+                   "NNPKG_TRANS_ADD_MULTI into free slot database");
+    }
+    PkgGraphDestroy (graph);
+    PkgDbClose (db);
+    // Same configuration, with a staged index
+    char stagedConf[256];
+    snprintf (stagedConf, sizeof (stagedConf), "%s/staged.conf", tmpDir);
+    FILE* confFile = fopen (stagedConf, "w");
+    TEST_BOOL (confFile, "staged configuration created");
+    fprintf (confFile,
+             "settings\n{\n    packageDb: \"%s\";\n    strtab: \"%s\";\n"
+             "    indexPath: \"%s\";\n    stagedIndex: true;\n}\n",
+             (const char*) StrRefGet (dbLoc->dbPath),
+             (const char*) StrRefGet (dbLoc->strtabPath),
+             UnicodeToHost (StrRefGet (cb.conf->idxPath)));
+    fclose (confFile);
+    char stagePath[512];
+    snprintf (stagePath,
+              sizeof (stagePath),
+              "%s/.bin.stage",
+              UnicodeToHost (StrRefGet (cb.conf->idxPath)));
+    PkgDestroyMainConf (&cb);
+    confs[0] = makePkg ("multistage2", "multistage1");
+    confs[1] = makePkg ("multistage1", NULL);
+    memset (&add, 0, sizeof (NnpkgTransAddMulti_t));
+    add.pkgConfs = confs;
+    add.numPkgs = 2;
+    add.numThreads = 2;
+    cb.type = NNPKG_TRANS_ADD_MULTI;
+    cb.transactData = &add;
+    cb.confFile = stagedConf;
+    cb.state = 0;
+    // The directory is swapped for a new one, rather than written to
+    struct stat st;
+    TEST_BOOL (!stat (idxBin, &st), "index stat() success");
+    ino_t binIno = st.st_ino;
+    TEST_BOOL (TransactExecute (&cb), "NNPKG_TRANS_ADD_MULTI staged");
+    TEST_BOOL (!stat (idxBin, &st) && st.st_ino != binIno,
+               "NNPKG_TRANS_ADD_MULTI staged swap");
+    TEST (cb.stats.counts[NNPKG_STATE_WRITE_INDEX][NNPKG_COUNT_LINKS_WRITTEN],
+          2,
+          "NNPKG_TRANS_ADD_MULTI staged links written");
+    // Links already in the index are carried over, and the stage is gone
+    cb.state = 0;
+    PkgParseMainConf (&cb, stagedConf);
+    TEST_BOOL (hasLink (&cb, "multistage1") && hasLink (&cb, "multistage2") &&
+                   hasLink (&cb, "multinew1") && hasLink (&cb, "multinew2") &&
+                   lstat (stagePath, &st) == -1,
+               "NNPKG_TRANS_ADD_MULTI staged index");
+    PkgDestroyMainConf (&cb);
+    memset (&rm, 0, sizeof (NnpkgTransRemove_t));
+    rm.pkgName = "multistage2";
+    cb.type = NNPKG_TRANS_REMOVE;
+    cb.transactData = &rm;
+    cb.state = 0;
+    TEST_BOOL (TransactExecute (&cb), "NNPKG_TRANS_REMOVE staged");
+    TEST (cb.stats.counts[NNPKG_STATE_REMOVE_INDEX][NNPKG_COUNT_LINKS_REMOVED],
+          1,
+          "NNPKG_TRANS_REMOVE staged links removed");
+    cb.state = 0;
+    PkgParseMainConf (&cb, stagedConf);
+    TEST_BOOL (!hasLink (&cb, "multistage2") && checkLink (&cb, "multistage1") &&
+                   hasLink (&cb, "multinew1") && lstat (stagePath, &st) == -1,
+               "NNPKG_TRANS_REMOVE staged index");
+    PkgDestroyMainConf (&cb);
+    // Transactions on different roots run side by side in one process
+    static testRoot_t roots[2];
+    static const char* rootNames[] = {"root1", "root2"};
+    static const char* rootPkgs[] = {"rootpkg1", "rootpkg2"};
+    for (int i = 0; i < 2; ++i)
+    {
+        TEST_BOOL (makeRoot (&roots[i], rootNames[i]), "root created");
+        confs[i] = makePkg (rootPkgs[i], NULL);
+        roots[i].add.pkgConfs = &confs[i];
+        roots[i].add.numPkgs = 1;
+        roots[i].add.numThreads = 1;
+        roots[i].cb.type = NNPKG_TRANS_ADD_MULTI;
+        roots[i].cb.confFile = roots[i].conf;
+        roots[i].cb.transactData = &roots[i].add;
+    }
+    pthread_t threads[2];
+    for (int i = 0; i < 2; ++i)
+        pthread_create (&threads[i], NULL, rootJob, &roots[i]);
+    for (int i = 0; i < 2; ++i)
+        pthread_join (threads[i], NULL);
+    TEST_BOOL (roots[0].res && roots[1].res, "concurrent roots success");
+    TEST_BOOL (rootHasLink ("root1", "rootpkg1") &&
+                   rootHasLink ("root2", "rootpkg2") &&
+                   !rootHasLink ("root1", "rootpkg2") &&
+                   !rootHasLink ("root2", "rootpkg1"),
+               "concurrent roots kept apart");
+    TEST_BOOL (!roots[0].cb.conf && !roots[0].cb.pkgDbs && !roots[1].cb.conf &&
+                   !roots[1].cb.pkgDbs,
+               "concurrent roots cleaned up");
+    // Directories are merged into the index, rather than linked whole, so that
+    // packages can share them
+    confs[0] = makePkg ("treepkg1", NULL);
+    confs[1] = makePkg ("treepkg2", NULL);
+    makeFile ("treepkg1", "share/man/man1/treepkg1.1");
+    makeFile ("treepkg2", "share/man/man1/treepkg2.1");
+    // Enough directories to be walked on several threads
+    for (int i = 0; i < 80; ++i)
+    {
+        char rel[64];
+        snprintf (rel, sizeof (rel), "share/doc/treepkg2/%d/README", i);
+        makeFile ("treepkg2", rel);
+    }
+    memset (&add, 0, sizeof (NnpkgTransAddMulti_t));
+    add.pkgConfs = confs;
+    add.numPkgs = 2;
+    add.numThreads = 2;
+    cb.type = NNPKG_TRANS_ADD_MULTI;
+    cb.transactData = &add;
+    cb.confFile = NNPKG_CONFFILE_PATH;
+    cb.state = 0;
+    TEST_BOOL (TransactExecute (&cb), "NNPKG_TRANS_ADD_MULTI merged trees");
+    TEST (cb.stats.counts[NNPKG_STATE_COLLECT_INDEX][NNPKG_COUNT_FILES_COLLECTED],
+          84,
+          "NNPKG_TRANS_ADD_MULTI merged files collected");
+    cb.state = 0;
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    TEST_BOOL (idxType (&cb, "share/man/man1") == S_IFDIR &&
+                   idxType (&cb, "share/man/man1/treepkg1.1") == S_IFLNK &&
+                   idxType (&cb, "share/man/man1/treepkg2.1") == S_IFLNK &&
+                   idxType (&cb, "share/doc/treepkg2/79/README") == S_IFLNK,
+               "NNPKG_TRANS_ADD_MULTI merged index");
+    PkgDestroyMainConf (&cb);
+    // Staged directories that have others in them are changed in place, rather
+    // than copied whole
+    cb.state = 0;
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    ino_t outerIno = idxIno (&cb, "share/man");
+    PkgDestroyMainConf (&cb);
+    confs[0] = makePkg ("treepkg3", NULL);
+    makeFile ("treepkg3", "share/man/treepkg3.txt");
+    memset (&add, 0, sizeof (NnpkgTransAddMulti_t));
+    add.pkgConfs = confs;
+    add.numPkgs = 1;
+    add.numThreads = 1;
+    cb.type = NNPKG_TRANS_ADD_MULTI;
+    cb.transactData = &add;
+    cb.confFile = stagedConf;
+    cb.state = 0;
+    TEST_BOOL (TransactExecute (&cb),
+               "NNPKG_TRANS_ADD_MULTI staged outer directory");
+    cb.state = 0;
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    TEST_BOOL (idxType (&cb, "share/man/treepkg3.txt") == S_IFLNK &&
+                   idxIno (&cb, "share/man") == outerIno &&
+                   !idxType (&cb, "share/.man.stage"),
+               "NNPKG_TRANS_ADD_MULTI staged outer directory in place");
+    PkgDestroyMainConf (&cb);
+    memset (&rm, 0, sizeof (NnpkgTransRemove_t));
+    rm.pkgName = "treepkg3";
+    cb.type = NNPKG_TRANS_REMOVE;
+    cb.transactData = &rm;
+    cb.state = 0;
+    TEST_BOOL (TransactExecute (&cb), "NNPKG_TRANS_REMOVE staged outer directory");
+    cb.state = 0;
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    TEST_BOOL (!idxType (&cb, "share/man/treepkg3.txt") &&
+                   idxIno (&cb, "share/man") == outerIno,
+               "NNPKG_TRANS_REMOVE staged outer directory in place");
+    PkgDestroyMainConf (&cb);
+    // Directories only one package had go with it, in a staged index too. Only the
+    // directories links go from are swapped
+    cb.state = 0;
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    ino_t manIno = idxIno (&cb, "share/man");
+    ino_t man1Ino = idxIno (&cb, "share/man/man1");
+    PkgDestroyMainConf (&cb);
+    memset (&rm, 0, sizeof (NnpkgTransRemove_t));
+    rm.pkgName = "treepkg2";
+    cb.type = NNPKG_TRANS_REMOVE;
+    cb.transactData = &rm;
+    cb.confFile = stagedConf;
+    cb.state = 0;
+    TEST_BOOL (TransactExecute (&cb), "NNPKG_TRANS_REMOVE merged trees staged");
+    cb.state = 0;
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    TEST_BOOL (idxType (&cb, "share/man/man1/treepkg1.1") == S_IFLNK &&
+                   !idxType (&cb, "share/man/man1/treepkg2.1") &&
+                   !idxType (&cb, "share/doc") &&
+                   !idxType (&cb, "share/man/.man1.stage"),
+               "NNPKG_TRANS_REMOVE merged index staged");
+    TEST_BOOL (idxIno (&cb, "share/man") == manIno &&
+                   idxIno (&cb, "share/man/man1") != man1Ino,
+               "NNPKG_TRANS_REMOVE merged index staged swap");
+    PkgDestroyMainConf (&cb);
+    memset (&rm, 0, sizeof (NnpkgTransRemove_t));
+    rm.pkgName = "treepkg1";
+    cb.confFile = NNPKG_CONFFILE_PATH;
+    cb.state = 0;
+    TEST_BOOL (TransactExecute (&cb), "NNPKG_TRANS_REMOVE merged trees");
+    cb.state = 0;
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    TEST_BOOL (!idxType (&cb, "share/man") && idxType (&cb, "share") == S_IFDIR,
+               "NNPKG_TRANS_REMOVE merged index");
+    PkgDestroyMainConf (&cb);
+    return 0;
+}
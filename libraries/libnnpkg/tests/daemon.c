@@ -0,0 +1,92 @@
+/*
+    daemon.c - contains daemon protocol test suite
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file daemon.c
+
+#include <stdio.h>
+#define NEXTEST_NAME "daemon"
+#include <errno.h>
+#include <libnex/progname.h>
+#include <locale.h>
+#include <nextest.h>
+#include <nnpkg/daemon.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int main (int argc, char** argv)
+{
+    setprogname (argv[0]);
+    setlocale (LC_ALL, "");
+    bindtextdomain ("libnnpkg", NNPKG_LOCALE_BASE);
+    int fds[2];
+    TEST_BOOL (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0,
+               "socketpair() success");
+    // Messages come out as they went in
+    const char* strs[] = {"/etc/nnpkg.conf", "", "pkg"};
+    TEST_BOOL (DaemonSend (fds[0], NNPKGD_REQ_WHY, 3, 4, strs, 3),
+               "DaemonSend() success");
+    NnpkgDaemonMsg_t msg;
+    TEST_BOOL (DaemonRecv (fds[1], &msg), "DaemonRecv() success");
+    TEST (msg.type, NNPKGD_REQ_WHY, "DaemonRecv() type");
+    TEST_BOOL (msg.error == 3 && msg.sysErrno == 4, "DaemonRecv() error");
+    TEST (msg.numStrs, 3, "DaemonRecv() string count");
+    TEST_BOOL (!strcmp (msg.strs[0], strs[0]) && !strcmp (msg.strs[1], "") &&
+                   !strcmp (msg.strs[2], "pkg"),
+               "DaemonRecv() strings");
+    DaemonMsgFree (&msg);
+    TEST_BOOL (DaemonSend (fds[0], NNPKGD_REPLY, 0, 0, NULL, 0),
+               "DaemonSend() empty message");
+    TEST_BOOL (DaemonRecv (fds[1], &msg) && !msg.numStrs,
+               "DaemonRecv() empty message");
+    DaemonMsgFree (&msg);
+    // Messages that aren't ours are refused
+    uint32_t junk[6] = {0x12345678, 1, 0, 0, 0, 0};
+    TEST_BOOL (write (fds[0], junk, sizeof (junk)) == sizeof (junk),
+               "write() success");
+    TEST_BOOL (!DaemonRecv (fds[1], &msg) && errno == EPROTO,
+               "DaemonRecv() bad magic");
+    close (fds[0]);
+    close (fds[1]);
+    // Only one daemon can listen on a socket, and it is only open to its user
+    char dir[] = "/tmp/nnpkgdXXXXXX";
+    TEST_BOOL (mkdtemp (dir), "mkdtemp() success");
+    char sockPath[64];
+    snprintf (sockPath, sizeof (sockPath), "%s/sock", dir);
+    TEST (DaemonConnect (sockPath), -1, "DaemonConnect() without daemon");
+    int listenFd = DaemonListen (sockPath);
+    TEST_BOOL (listenFd != -1, "DaemonListen() success");
+    struct stat st;
+    TEST_BOOL (!stat (sockPath, &st) && (st.st_mode & 0777) == 0600,
+               "DaemonListen() permissions");
+    TEST_BOOL (DaemonListen (sockPath) == -1 && errno == EADDRINUSE,
+               "DaemonListen() while listening");
+    int fd = DaemonConnect (sockPath);
+    TEST_BOOL (fd != -1, "DaemonConnect() success");
+    close (fd);
+    close (listenFd);
+    // A socket left behind is taken over
+    listenFd = DaemonListen (sockPath);
+    TEST_BOOL (listenFd != -1, "DaemonListen() on stale socket");
+    close (listenFd);
+    unlink (sockPath);
+    rmdir (dir);
+    return 0;
+}
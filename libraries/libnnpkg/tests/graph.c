@@ -0,0 +1,254 @@
+/*
+    graph.c - contains test suite for dependency graph
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file graph.c
+
+#include <stdio.h>
+#define NEXTEST_NAME "graph"
+#include <errno.h>
+#ifdef NNPKG_ENABLE_NLS
+#include <libintl.h>
+#endif
+#include <libnex/base.h>
+#include <libnex/error.h>
+#include <libnex/progname.h>
+#include <libnex/safemalloc.h>
+#include <locale.h>
+#include <nextest.h>
+#include <nnpkg/graph.h>
+#include <nnpkg/pkg.h>
+#include <nnpkg/transaction.h>
+#include <string.h>
+#include <unistd.h>
+
+// Set if links were removed while the database was still open
+static bool uncommittedRemove = false;
+
+void progHandler (NnpkgTransCb_t* cb, int state)
+{
+    printf ("%d\n", cb->error);
+    if (state == NNPKG_STATE_REMOVE_INDEX && cb->pkgDbs)
+        uncommittedRemove = true;
+}
+
+// Destroys a package
+static void pkgDestroy (const Object_t* obj)
+{
+    NnpkgPackage_t* pkg = ObjGetContainer (obj, NnpkgPackage_t, obj);
+    StrRefDestroy (pkg->id);
+    StrRefDestroy (pkg->description);
+    StrRefDestroy (pkg->prefix);
+    if (pkg->prop)
+        ObjDeRef (&pkg->prop->obj);
+    ListDestroy (pkg->deps);
+    free (pkg);
+}
+
+// Creates a package depending on the packages in deps
+static NnpkgPackage_t* makePkg (const char32_t* id,
+                                bool isDependency,
+                                NnpkgPackage_t** deps,
+                                int numDeps)
+{
+    NnpkgPackage_t* pkg = calloc_s (sizeof (NnpkgPackage_t));
+    if (!pkg)
+        return NULL;
+    pkg->id = StrRefCreate (id);
+    StrRefNoFree (pkg->id);
+    pkg->description = StrRefCreate (U"This is a test package that does nothing");
+    StrRefNoFree (pkg->description);
+    pkg->prefix = StrRefCreate (U"Package prefix");
+    StrRefNoFree (pkg->prefix);
+    pkg->isDependency = isDependency;
+    pkg->type = NNPKG_PKG_TYPE_PACKAGE;
+    ObjCreate ("NnpkgPackage_t", &pkg->obj);
+    ObjSetDestroy (&pkg->obj, pkgDestroy);
+    pkg->deps = ListCreate ("NnpkgPackage_t", true, offsetof (NnpkgPackage_t, obj));
+    for (int i = 0; i < numDeps; ++i)
+    {
+        ListAddBack (pkg->deps,
+                     ObjGetContainer (ObjRef (&deps[i]->obj), NnpkgPackage_t, obj),
+                     0);
+    }
+    return pkg;
+}
+
+// Records order of visited nodes
+typedef struct _visitlog
+{
+    uint32_t nodes[16];
+    int count;
+} visitLog_t;
+
+static bool logVisit (NnpkgGraph_t* graph, uint32_t node, void* data)
+{
+    UNUSED (graph);
+    visitLog_t* log = data;
+    log->nodes[log->count++] = node;
+    return true;
+}
+
+int main (int argc, char** argv)
+{
+    setprogname (argv[0]);
+#ifdef NNPKG_ENABLE_NLS
+    setlocale (LC_ALL, "");
+    bindtextdomain ("libnnpkg", NNPKG_LOCALE_BASE);
+#endif
+    NnpkgTransCb_t cb = {0};
+    cb.progress = progHandler;
+    TEST_BOOL (PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH),
+               "PkgParseMainConf success");
+    NnpkgDbLocation_t* dbLoc = &cb.conf->dbLoc;
+    if (unlink (StrRefGet (dbLoc->dbPath)) == -1 && errno != ENOENT)
+    {
+        error ("%s: %s", dbLoc->dbPath, strerror (errno));
+        return 1;
+    }
+    if (unlink (StrRefGet (dbLoc->strtabPath)) == -1 && errno != ENOENT)
+    {
+        error ("%s: %s", dbLoc->strtabPath, strerror (errno));
+        return 1;
+    }
+    TEST_BOOL (PropDbCreate (dbLoc), "PkgDbCreate() success");
+    // app depends on liba and libb, and liba depends on libc. cyc1 and cyc2 depend
+    // on each other. Packages added in the same session reference each other by
+    // name
+    NnpkgPropDb_t* db = PkgDbOpen (&cb, dbLoc);
+    TEST_BOOL (db, "PkgDbOpen() success");
+    NnpkgPackage_t* pkgs[8];
+    pkgs[0] = makePkg (U"libc", true, NULL, 0);
+    pkgs[1] = makePkg (U"liba", true, &pkgs[0], 1);
+    pkgs[2] = makePkg (U"libb", true, NULL, 0);
+    pkgs[3] = makePkg (U"app", false, &pkgs[1], 2);
+    pkgs[4] = makePkg (U"cyc1", true, NULL, 0);
+    pkgs[5] = makePkg (U"cyc2", true, &pkgs[4], 1);
+    pkgs[6] = makePkg (U"orphan", true, NULL, 0);
+    ListAddBack (pkgs[4]->deps,
+                 ObjGetContainer (ObjRef (&pkgs[5]->obj), NnpkgPackage_t, obj),
+                 0);
+    for (int i = 0; i < 7; ++i)
+        TEST_BOOL (PkgDbAddPackage (&cb, db, pkgs[i]), "PkgDbAddPackage() success");
+    PkgDbClose (db);
+    for (int i = 0; i < 7; ++i)
+        ObjDestroy (&pkgs[i]->obj);
+    // tool depends on libc through a slot reference
+    db = PkgDbOpen (&cb, dbLoc);
+    NnpkgPackage_t* libc = PkgDbFindPackage (&cb, db, U"libc");
+    TEST_BOOL (libc, "PkgDbFindPackage() success");
+    pkgs[7] = makePkg (U"tool", false, &libc, 1);
+    TEST_BOOL (PkgDbAddPackage (&cb, db, pkgs[7]), "PkgDbAddPackage() success 2");
+    ObjDeRef (&libc->obj);
+    PkgDbClose (db);
+    ObjDestroy (&pkgs[7]->obj);
+    db = PkgDbOpen (&cb, dbLoc);
+    NnpkgGraph_t* graph = PkgGraphBuild (&cb, db);
+    TEST_BOOL (graph, "PkgGraphBuild() success");
+    TEST (graph->numEdges, 6, "PkgGraphBuild() validity");
+    uint32_t app = PkgGraphFindNode (graph, U"app");
+    uint32_t liba = PkgGraphFindNode (graph, U"liba");
+    uint32_t libb = PkgGraphFindNode (graph, U"libb");
+    uint32_t libcNode = PkgGraphFindNode (graph, U"libc");
+    uint32_t cyc1 = PkgGraphFindNode (graph, U"cyc1");
+    uint32_t cyc2 = PkgGraphFindNode (graph, U"cyc2");
+    uint32_t orphan = PkgGraphFindNode (graph, U"orphan");
+    uint32_t tool = PkgGraphFindNode (graph, U"tool");
+    TEST_BOOL (app != NNPKG_GRAPH_NO_NODE && tool != NNPKG_GRAPH_NO_NODE,
+               "PkgGraphFindNode() success");
+    TEST (PkgGraphFindNode (graph, U"nothing"),
+          NNPKG_GRAPH_NO_NODE,
+          "PkgGraphFindNode() on missing package");
+    TEST_BOOL (!c32cmp (PkgGraphGetName (graph, liba), U"liba"),
+               "PkgGraphGetName() validity");
+    // Traversals
+    visitLog_t log = {0};
+    TEST (PkgGraphBfs (&cb, graph, app, logVisit, &log), 4, "PkgGraphBfs() count");
+    TEST_BOOL (log.nodes[0] == app && log.nodes[1] == liba && log.nodes[2] == libb &&
+                   log.nodes[3] == libcNode,
+               "PkgGraphBfs() order");
+    memset (&log, 0, sizeof (visitLog_t));
+    TEST (PkgGraphDfs (&cb, graph, app, logVisit, &log), 4, "PkgGraphDfs() count");
+    TEST_BOOL (log.nodes[0] == app && log.nodes[1] == liba &&
+                   log.nodes[2] == libcNode && log.nodes[3] == libb,
+               "PkgGraphDfs() order");
+    TEST (PkgGraphBfs (&cb, graph, cyc1, NULL, NULL), 2, "PkgGraphBfs() on cycle");
+    // Cycles
+    uint32_t comps[16];
+    uint32_t numComps = 0;
+    TEST_BOOL (graph->numNodes <= 16, "Graph size");
+    TEST_BOOL (PkgGraphFindSccs (&cb, graph, comps, &numComps),
+               "PkgGraphFindSccs() success");
+    TEST (numComps, 7, "PkgGraphFindSccs() count");
+    TEST (comps[cyc1], comps[cyc2], "PkgGraphFindSccs() cycle");
+    TEST_BOOL (comps[app] != comps[liba], "PkgGraphFindSccs() no cycle");
+    TEST_BOOL (comps[libcNode] < comps[liba] && comps[liba] < comps[app],
+               "PkgGraphFindSccs() order");
+    // Path queries
+    uint32_t* path = NULL;
+    size_t pathLen = 0;
+    TEST_BOOL (PkgGraphWhy (&cb, graph, libcNode, &path, &pathLen),
+               "PkgGraphWhy() success");
+    TEST (pathLen, 2, "PkgGraphWhy() shortest path");
+    TEST_BOOL (path[0] == tool && path[1] == libcNode, "PkgGraphWhy() validity");
+    free (path);
+    PkgGraphWhy (&cb, graph, app, &path, &pathLen);
+    TEST (pathLen, 1, "PkgGraphWhy() on explicit package");
+    free (path);
+    PkgGraphWhy (&cb, graph, orphan, &path, &pathLen);
+    TEST (pathLen, 0, "PkgGraphWhy() on orphan");
+    TEST_BOOL (!path, "PkgGraphWhy() on orphan 2");
+    // Orphans
+    uint32_t* orphans = NULL;
+    size_t numOrphans = 0;
+    TEST_BOOL (PkgGraphFindOrphans (&cb, graph, &orphans, &numOrphans),
+               "PkgGraphFindOrphans() success");
+    TEST (numOrphans, 3, "PkgGraphFindOrphans() count");
+    TEST_BOOL (orphans[0] == cyc1 && orphans[1] == cyc2 && orphans[2] == orphan,
+               "PkgGraphFindOrphans() validity");
+    free (orphans);
+    PkgGraphDestroy (graph);
+    PkgDbClose (db);
+    PkgDestroyMainConf (&cb);
+    // Auto-remove them
+    cb.type = NNPKG_TRANS_AUTOREMOVE;
+    cb.confFile = NNPKG_CONFFILE_PATH;
+    NnpkgTransAutoRemove_t autoRm = {0};
+    cb.transactData = &autoRm;
+    TEST_BOOL (TransactExecute (&cb), "NNPKG_TRANS_AUTOREMOVE success");
+    // Links only go once the database no longer has the orphans
+    TEST_BOOL (!uncommittedRemove,
+               "NNPKG_TRANS_AUTOREMOVE commits before removing links");
+    PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH);
+    dbLoc = &cb.conf->dbLoc;
+    db = PkgDbOpen (&cb, dbLoc);
+    graph = PkgGraphBuild (&cb, db);
+    TEST_BOOL (graph, "PkgGraphBuild() success 2");
+    TEST (PkgGraphFindNode (graph, U"cyc1"),
+          NNPKG_GRAPH_NO_NODE,
+          "NNPKG_TRANS_AUTOREMOVE validity");
+    TEST (PkgGraphFindNode (graph, U"orphan"),
+          NNPKG_GRAPH_NO_NODE,
+          "NNPKG_TRANS_AUTOREMOVE validity 2");
+    TEST_BOOL (PkgGraphFindNode (graph, U"libc") != NNPKG_GRAPH_NO_NODE,
+               "NNPKG_TRANS_AUTOREMOVE validity 3");
+    PkgGraphFindOrphans (&cb, graph, &orphans, &numOrphans);
+    TEST (numOrphans, 0, "NNPKG_TRANS_AUTOREMOVE validity 4");
+    PkgGraphDestroy (graph);
+    PkgDbClose (db);
+    PkgDestroyMainConf (&cb);
+    return 0;
+}
@@ -54,6 +54,26 @@ static pkgDestroy (const Object_t* obj)
     free (pkg);
 }
 
+// Creates a package with no dependencies
+static NnpkgPackage_t* makePkg (const char32_t* id)
+{
+    NnpkgPackage_t* pkg = calloc_s (sizeof (NnpkgPackage_t));
+    if (!pkg)
+        return NULL;
+    pkg->id = StrRefCreate (id);
+    StrRefNoFree (pkg->id);
+    pkg->description = StrRefCreate (U"This is a test package that does nothing");
+    StrRefNoFree (pkg->description);
+    pkg->isDependency = false;
+    ObjCreate ("NnpkgPackage_t", &pkg->obj);
+    ObjSetDestroy (&pkg->obj, pkgDestroy);
+    pkg->prefix = StrRefCreate (U"Package prefix");
+    StrRefNoFree (pkg->prefix);
+    pkg->type = NNPKG_PKG_TYPE_PACKAGE;
+    pkg->deps = ListCreate ("NnpkgPackage_t", true, offsetof (NnpkgPackage_t, obj));
+    return pkg;
+}
+
 int main (int argc, char** argv)
 {
     setprogname (argv[0]);
@@ -62,7 +82,7 @@ int main (int argc, char** argv)
     bindtextdomain ("libnnpkg", NNPKG_LOCALE_BASE);
 #endif
     // Remove old database(s)
-    NnpkgTransCb_t cb;
+    NnpkgTransCb_t cb = {0};
     cb.progress = progHandler;
     TEST_BOOL (PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH),
                "PkgParseMainConf success");
@@ -131,10 +151,32 @@ int main (int argc, char** argv)
                  ObjGetContainer (ObjRef (&pkg->obj), NnpkgPackage_t, obj),
                  0);
     PkgAddPackage (&cb, pkg3);
-    PkgCloseDbs();
+    NnpkgPackage_t* pkg4 = calloc_s (sizeof (NnpkgPackage_t));
+    if (!pkg4)
+        return 1;
+    pkg4->id = StrRefCreate (U"pkgtest4");
+    StrRefNoFree (pkg4->id);
+    pkg4->description = StrRefCreate (U"This is a test package that does nothing");
+    StrRefNoFree (pkg4->description);
+    pkg4->isDependency = false;
+    ObjCreate ("NnpkgPackage_t", &pkg4->obj);
+    ObjSetDestroy (&pkg4->obj, pkgDestroy);
+    pkg4->prefix = StrRefCreate (U"Package prefix");
+    StrRefNoFree (pkg4->prefix);
+    pkg4->type = NNPKG_PKG_TYPE_PACKAGE;
+    pkg4->deps = ListCreate ("NnpkgPackage_t", true, offsetof (NnpkgPackage_t, obj));
+    ListAddBack (pkg4->deps,
+                 ObjGetContainer (ObjRef (&pkg3->obj), NnpkgPackage_t, obj),
+                 0);
+    ListAddBack (pkg4->deps,
+                 ObjGetContainer (ObjRef (&pkg2->obj), NnpkgPackage_t, obj),
+                 0);
+    PkgAddPackage (&cb, pkg4);
+    PkgCloseDbs (&cb);
     ObjDestroy (&pkg->obj);
     ObjDestroy (&pkg2->obj);
     ObjDestroy (&pkg3->obj);
+    ObjDestroy (&pkg4->obj);
     TEST_BOOL (PkgOpenDb (&cb, dbLoc, NNPKGDB_TYPE_DEST, NNPKGDB_LOCATION_LOCAL),
                "PkgOpenDb() success");
     pkg2 = PkgFindPackage (&cb, U"pkgtest3");
@@ -152,17 +194,123 @@ int main (int argc, char** argv)
     pkg3 = ListEntryData (pkg2->deps->front->next);
     TEST_BOOL (!c32cmp (StrRefGet (pkg3->id), U"pkgtest"),
                "PkgDbFindPackage() validity 5");
+    // A dependency reachable through multiple paths must only be loaded once
+    pkg4 = PkgFindPackage (&cb, U"pkgtest4");
+    TEST_BOOL (pkg4, "PkgDbFindPackage() success 3");
+    TEST (ListEntryData (ListFront (pkg4->deps)),
+          pkg2,
+          "PkgDbFindPackage() identity");
+    TEST (ListEntryData (pkg4->deps->front->next),
+          ListEntryData (ListFront (pkg2->deps)),
+          "PkgDbFindPackage() identity 2");
+    ObjDeRef (&pkg4->obj);
     ObjDeRef (&pkg2->obj);
-    PkgCloseDbs();
+    PkgCloseDbs (&cb);
+    // Lazily found packages only resolve dependencies when asked to
+    TEST_BOOL (PkgOpenDb (&cb, dbLoc, NNPKGDB_TYPE_DEST, NNPKGDB_LOCATION_LOCAL),
+               "PkgOpenDb() success");
+    pkg4 = PkgFindPackageLazy (&cb, U"pkgtest4");
+    TEST_BOOL (pkg4, "PkgDbFindPackageLazy() success");
+    TEST_BOOL (!pkg4->deps, "PkgDbFindPackageLazy() laziness");
+    TEST (pkg4->numDeps, 2, "PkgDbFindPackageLazy() validity");
+    ListHead_t* deps = PkgGetDeps (&cb, pkg4);
+    TEST_BOOL (deps, "PkgGetDeps() success");
+    pkg3 = ListEntryData (ListFront (deps));
+    TEST_BOOL (!c32cmp (StrRefGet (pkg3->id), U"pkgtest3"), "PkgGetDeps() validity");
+    TEST_BOOL (!pkg3->deps, "PkgGetDeps() laziness");
+    pkg2 = PkgFindPackage (&cb, U"pkgtest3");
+    TEST (pkg2, pkg3, "PkgGetDeps() identity");
+    TEST_BOOL (pkg3->deps, "PkgDbFindPackage() on lazy package");
+    ObjDeRef (&pkg2->obj);
+    ObjDeRef (&pkg4->obj);
+    PkgCloseDbs (&cb);
     TEST_BOOL (PkgOpenDb (&cb, dbLoc, NNPKGDB_TYPE_DEST, NNPKGDB_LOCATION_LOCAL),
                "PkgOpenDb() success");
     pkg2 = PkgFindPackage (&cb, U"pkgtest");
     TEST_BOOL (PkgRemovePackage (&cb, pkg2), "PkgDbRemovePackage success");
-    PkgCloseDbs();
+    // Removed packages leave the cache
+    pkg3 = PkgFindPackage (&cb, U"pkgtest");
+    TEST_BOOL (pkg3 && pkg3 != pkg2, "PkgDbRemovePackage() cache");
+    ObjDeRef (&pkg3->obj);
+    ObjDeRef (&pkg2->obj);
+    PkgCloseDbs (&cb);
     PkgOpenDb (&cb, dbLoc, NNPKGDB_TYPE_DEST, NNPKGDB_LOCATION_LOCAL);
     pkg2 = PkgFindPackage (&cb, U"pkgtest");
     TEST_BOOL (!pkg2, "PkgDbRemovePackage() validity");
-    PkgCloseDbs();
+    // Reuse the freed slot for another package, so that pkgtest3's reference to
+    // pkgtest goes stale, then add pkgtest back somewhere else
+    pkg = makePkg (U"pkgtest5");
+    TEST_BOOL (pkg && PkgAddPackage (&cb, pkg), "PkgAddPackage() on freed slot");
+    pkg2 = makePkg (U"pkgtest");
+    TEST_BOOL (pkg2 && PkgAddPackage (&cb, pkg2), "PkgAddPackage() after remove");
+    PkgCloseDbs (&cb);
+    ObjDestroy (&pkg->obj);
+    ObjDestroy (&pkg2->obj);
+    PkgOpenDb (&cb, dbLoc, NNPKGDB_TYPE_DEST, NNPKGDB_LOCATION_LOCAL);
+    pkg2 = PkgFindPackage (&cb, U"pkgtest3");
+    TEST_BOOL (pkg2, "PkgDbFindPackage() with stale slot");
+    pkg3 = ListEntryData (pkg2->deps->front->next);
+    TEST_BOOL (!c32cmp (StrRefGet (pkg3->id), U"pkgtest"),
+               "PkgDbFindPackage() stale slot validity");
+    ObjDeRef (&pkg2->obj);
+    // Look up several packages at once, with a miss in between
+    const char32_t* names[3] = {U"pkgtest3", U"pkgnonexistent", U"pkgtest"};
+    NnpkgPackage_t* pkgs[3];
+    TEST_BOOL (PkgFindPackages (&cb, names, 3, pkgs), "PkgFindPackages() success");
+    TEST_BOOL (pkgs[0] && !c32cmp (StrRefGet (pkgs[0]->id), U"pkgtest3") &&
+                   !pkgs[1] && pkgs[2] &&
+                   !c32cmp (StrRefGet (pkgs[2]->id), U"pkgtest"),
+               "PkgFindPackages() validity");
+    ObjDestroy (&pkgs[0]->obj);
+    ObjDestroy (&pkgs[2]->obj);
+    // Names can be given and gotten in UTF-8 too
+    pkg = makePkg (U"pkgt\u00E9st");
+    TEST_BOOL (pkg && PkgAddPackage (&cb, pkg), "PkgAddPackage() non-ASCII name");
+    PkgCloseDbs (&cb);
+    ObjDestroy (&pkg->obj);
+    PkgOpenDb (&cb, dbLoc, NNPKGDB_TYPE_DEST, NNPKGDB_LOCATION_LOCAL);
+    pkg = PkgFindPackageLazyUtf8 (&cb, "pkgt\xC3\xA9st");
+    TEST_BOOL (pkg && !strcmp (PkgGetIdUtf8 (pkg), "pkgt\xC3\xA9st") &&
+                   PkgGetIdUtf8 (pkg) == PkgGetIdUtf8 (pkg) &&
+                   !strcmp (PkgGetPrefixUtf8 (pkg), "Package prefix"),
+               "PkgFindPackageLazyUtf8() success");
+    ObjDestroy (&pkg->obj);
+    const char* namesUtf8[2] = {"pkgnonexistent", "pkgtest3"};
+    TEST_BOOL (PkgFindPackagesUtf8 (&cb, namesUtf8, 2, pkgs) && !pkgs[0] &&
+                   pkgs[1] && !strcmp (PkgGetIdUtf8 (pkgs[1]), "pkgtest3"),
+               "PkgFindPackagesUtf8() success");
+    ObjDestroy (&pkgs[1]->obj);
+    // Long names go through the vectorized conversions, and must come back
+    // the same when non-ASCII characters are mixed in
+    pkg = makePkg (U"pkg-long-name-with-a-lot-of-ascii-first-\u00E9-then-some-more-"
+                   U"ascii-and-\U0001F600-plus-a-tail-of-ascii");
+    TEST_BOOL (pkg && PkgAddPackage (&cb, pkg), "PkgAddPackage() long name");
+    PkgCloseDbs (&cb);
+    ObjDestroy (&pkg->obj);
+    PkgOpenDb (&cb, dbLoc, NNPKGDB_TYPE_DEST, NNPKGDB_LOCATION_LOCAL);
+    const char* longName = "pkg-long-name-with-a-lot-of-ascii-first-\xC3\xA9-then-"
+                           "some-more-ascii-and-\xF0\x9F\x98\x80-plus-a-tail-of-"
+                           "ascii";
+    pkg = PkgFindPackageUtf8 (&cb, longName);
+    TEST_BOOL (pkg && !strcmp (PkgGetIdUtf8 (pkg), longName),
+               "PkgFindPackageUtf8() long name");
+    ObjDeRef (&pkg->obj);
+    // Versioned dependencies of a configuration file are resolved against the
+    // database
+    pkg = PkgReadConf (&cb, "pkgdeps.conf");
+    TEST_BOOL (pkg, "PkgReadConf() with versioned dependencies");
+    TEST (pkg->version[0], 1, "PkgReadConf() version");
+    TEST (pkg->depRefs[1].verOp, NNPKG_VER_GE, "PkgReadConf() dependency version");
+    pkg3 = ListEntryData (pkg->deps->front->next);
+    TEST_BOOL (!c32cmp (StrRefGet (pkg3->id), U"pkgtest4"),
+               "PkgReadConf() dependency validity");
+    ObjDestroy (&pkg->obj);
+    TEST_BOOL (!PkgReadConf (&cb, "pkgdeps2.conf"),
+               "PkgReadConf() with unsatisfiable dependencies");
+    TEST (cb.error, NNPKG_ERR_DEP_CONFLICT, "PkgReadConf() dependency conflict");
+    StrRefDestroy (cb.errHint[0]);
+    StrRefDestroy (cb.errHint[1]);
+    PkgCloseDbs (&cb);
     StrRefDestroy (dbLoc->dbPath);
     StrRefDestroy (dbLoc->strtabPath);
     return 0;
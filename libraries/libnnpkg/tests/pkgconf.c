@@ -19,20 +19,110 @@
 
 #include <stdio.h>
 #define NEXTEST_NAME "pkgconf"
+#include <fcntl.h>
 #ifdef NNPKG_ENABLE_NLS
 #include <libintl.h>
 #endif
+#include <libnex/char32.h>
 #include <libnex/progname.h>
 #include <libnex/stringref.h>
+#include <limits.h>
 #include <locale.h>
 #include <nextest.h>
 #include <nnpkg/pkg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void progHandler (NnpkgTransCb_t* cb, int state)
 {
     printf ("%d\n", cb->error);
 }
 
+// Writes a package configuration file with the specified description
+static void writeConf (const char* file, const char* description)
+{
+    FILE* f = fopen (file, "w");
+    fprintf (f,
+             "package cached\n{\n    description: \"%s\";\n"
+             "    prefix: '/home/nexos/Programs/Cached';\n"
+             "    dependencies: test, \"pkgdeps >= 1.0\";\n}\n",
+             description);
+    fclose (f);
+}
+
+// Writes a package configuration file with numDeps dependencies, split over
+// several properties
+static void writeDepsConf (const char* file, int numDeps)
+{
+    FILE* f = fopen (file, "w");
+    fprintf (f,
+             "package manydeps\n{\n    description: \"Many dependencies\";\n"
+             "    prefix: '/home/nexos/Programs/ManyDeps';\n");
+    for (int i = 0; i < numDeps; ++i)
+    {
+        if (!(i % 16))
+            fprintf (f, "%s    dependencies: ", i ? ";\n" : "");
+        else
+            fprintf (f, ", ");
+        fprintf (f, "dep%d", i);
+    }
+    fprintf (f, ";\n}\n");
+    fclose (f);
+}
+
+// Breaks the version operator of a dependency in the cache of a package
+// configuration file. The cache is named after the FNV-1a hash of the file's path,
+// and the dependency record holds the offset of its name
+static bool breakCachedDep (const char* cacheDir,
+                            const char* file,
+                            const char32_t* depName)
+{
+    uint64_t hash = 0xCBF29CE484222325;
+    for (const char* s = file; *s; ++s)
+        hash = (hash ^ (uint8_t) *s) * 0x100000001B3;
+    char cachePath[PATH_MAX];
+    snprintf (cachePath,
+              sizeof (cachePath),
+              "%s/%016llx.pkgc",
+              cacheDir,
+              (unsigned long long) hash);
+    uint8_t buf[4096];
+    int fd = open (cachePath, O_RDWR);
+    if (fd == -1)
+        return false;
+    ssize_t size = read (fd, buf, sizeof (buf));
+    size_t nameSz = (c32len (depName) + 1) * sizeof (char32_t);
+    bool res = false;
+    for (ssize_t off = 4; !res && off + (ssize_t) nameSz <= size; off += 4)
+    {
+        if (memcmp (buf + off, depName, nameSz))
+            continue;
+        uint32_t nameOff = (uint32_t) off - sizeof (uint32_t);
+        for (ssize_t rec = 0; !res && rec + 5 <= size; rec += 4)
+        {
+            if (memcmp (buf + rec, &nameOff, sizeof (nameOff)))
+                continue;
+            buf[rec + 4] = 0xFF;
+            res = pwrite (fd, buf + rec + 4, 1, rec + 4) == 1;
+        }
+    }
+    close (fd);
+    return res;
+}
+
+// Writes a main configuration file with the specified index path
+static void writeMainConf (const char* file, const char* idxPath)
+{
+    FILE* f = fopen (file, "w");
+    fprintf (f,
+             "settings\n{\n    packageDb: \"/nonexistent/db\";\n"
+             "    strtab: \"/nonexistent/strtab\";\n    indexPath: \"%s\";\n}\n",
+             idxPath);
+    fclose (f);
+}
+
 int main (int argc, char** argv)
 {
     setprogname (argv[0]);
@@ -40,7 +130,7 @@ int main (int argc, char** argv)
     setlocale (LC_ALL, "");
     bindtextdomain ("libnnpkg", NNPKG_LOCALE_BASE);
 #endif
-    NnpkgTransCb_t cb;
+    NnpkgTransCb_t cb = {0};
     cb.progress = progHandler;
     TEST_BOOL (PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH),
                "PkgParseMainConf success");
@@ -55,9 +145,123 @@ int main (int argc, char** argv)
     TEST_BOOL (!c32cmp (StrRefGet (pkg->prefix), U"/home/nexos/Programs/Test"),
                "Package validity 3");
     TEST_BOOL (pkg->isDependency, "Package validity 4");
+    TEST_BOOL (pkg->version[0] == 1 && pkg->version[1] == 2 && pkg->version[2] == 3,
+               "Package validity 5");
+    ObjDestroy (&pkg->obj);
+    // Read a batch of files concurrently
+    const char* files[64];
+    NnpkgPackage_t* pkgs[64];
+    for (int i = 0; i < 64; ++i)
+        files[i] = (i % 2) ? "pkgdeps.conf" : "pkgconf.conf";
+    TEST_BOOL (PkgReadConfs (&cb, files, 64, 4, pkgs), "PkgReadConfs() success");
+    bool valid = true;
+    for (int i = 0; i < 64; ++i)
+    {
+        const char32_t* id = (i % 2) ? U"pkgdeps" : U"test";
+        if (!pkgs[i] || c32cmp (StrRefGet (pkgs[i]->id), id) ||
+            pkgs[i]->numDeps != ((i % 2) ? 2 : 0))
+        {
+            valid = false;
+        }
+        if (pkgs[i])
+            ObjDestroy (&pkgs[i]->obj);
+    }
+    TEST_BOOL (valid, "PkgReadConfs() validity");
+    files[40] = "nonexistent.conf";
+    TEST_BOOL (!PkgReadConfs (&cb, files, 64, 4, pkgs), "PkgReadConfs() failure");
+    TEST_BOOL (!pkgs[0] && !pkgs[41], "PkgReadConfs() failure 2");
+    // Errors get printed from several workers at once
+    char badConf[] = "/tmp/nnpkgbadXXXXXX";
+    close (mkstemp (badConf));
+    FILE* f = fopen (badConf, "w");
+    fprintf (f, "package bad\n{\n    version: 1;\n}\n");
+    fclose (f);
+    for (int i = 0; i < 64; ++i)
+        files[i] = (i % 2) ? badConf : "pkgconf.conf";
+    TEST_BOOL (!PkgReadConfs (&cb, files, 64, 4, pkgs) &&
+                   cb.error == NNPKG_ERR_SYNTAX_ERR,
+               "PkgReadConfs() syntax errors");
+    unlink (badConf);
+    // Compiled configuration files are used as long as the file is unchanged
+    char cachedConf[] = "/tmp/nnpkgconfXXXXXX";
+    close (mkstemp (cachedConf));
+    writeConf (cachedConf, "Cached 1");
+    struct stat st;
+    stat (cachedConf, &st);
+    pkg = PkgReadConfUnresolved (&cb, cachedConf);
+    TEST_BOOL (pkg, "PkgReadConfUnresolved() success");
+    ObjDestroy (&pkg->obj);
+    // Change the file behind the cache's back, keeping its size and time
+    writeConf (cachedConf, "Cached 2");
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    utimensat (AT_FDCWD, cachedConf, times, 0);
+    pkg = PkgReadConfUnresolved (&cb, cachedConf);
+    TEST_BOOL (pkg && !c32cmp (StrRefGet (pkg->description), U"Cached 1") &&
+                   !c32cmp (StrRefGet (pkg->prefix), U"/home/nexos/Programs/Cached"),
+               "PkgReadConfUnresolved() cached");
+    TEST_BOOL (pkg->numDeps == 2 && !c32cmp (StrRefGet (pkg->depRefs[1].name),
+                                             U"pkgdeps") &&
+                   pkg->depRefs[1].verOp == NNPKG_VER_GE &&
+                   pkg->depRefs[1].ver[0] == 1,
+               "PkgReadConfUnresolved() cached dependencies");
+    ObjDestroy (&pkg->obj);
+    // A corrupt cache gets the file parsed again
+    const char* cacheDir = StrRefGet (cb.conf->cachePath);
+    TEST_BOOL (breakCachedDep (cacheDir, cachedConf, U"pkgdeps"), "Cache corrupted");
+    pkg = PkgReadConfUnresolved (&cb, cachedConf);
+    TEST_BOOL (pkg && !c32cmp (StrRefGet (pkg->description), U"Cached 2") &&
+                   pkg->depRefs[1].verOp == NNPKG_VER_GE,
+               "PkgReadConfUnresolved() corrupt cache");
+    ObjDestroy (&pkg->obj);
+    // A new time makes the cache stale
+    times[1].tv_sec += 1;
+    utimensat (AT_FDCWD, cachedConf, times, 0);
+    pkg = PkgReadConfUnresolved (&cb, cachedConf);
+    TEST_BOOL (pkg && !c32cmp (StrRefGet (pkg->description), U"Cached 2"),
+               "PkgReadConfUnresolved() stale cache");
+    ObjDestroy (&pkg->obj);
+    unlink (cachedConf);
+    // Packages may only have as many dependencies as a database record holds
+    char depsConf[] = "/tmp/nnpkgdepsXXXXXX";
+    close (mkstemp (depsConf));
+    writeDepsConf (depsConf, NNPKG_MAX_DEPS);
+    pkg = PkgReadConfUnresolved (&cb, depsConf);
+    TEST_BOOL (pkg && pkg->numDeps == NNPKG_MAX_DEPS,
+               "PkgReadConfUnresolved() most dependencies");
     ObjDestroy (&pkg->obj);
-    PkgCloseDbs();
-    StrRefDestroy (dbLoc->dbPath);
-    StrRefDestroy (dbLoc->strtabPath);
+    writeDepsConf (depsConf, NNPKG_MAX_DEPS + 1);
+    pkg = PkgReadConfUnresolved (&cb, depsConf);
+    TEST_BOOL (!pkg && cb.error == NNPKG_ERR_DEPS_LIMIT &&
+                   !c32cmp (StrRefGet (cb.errHint[0]), U"manydeps"),
+               "PkgReadConfUnresolved() too many dependencies");
+    StrRefDestroy (cb.errHint[0]);
+    cb.errHint[0] = NULL;
+    unlink (depsConf);
+    PkgCloseDbs (&cb);
+    PkgDestroyMainConf (&cb);
+    // Snapshots of the main configuration work the same way
+    char mainConf[] = "/tmp/nnpkgmainXXXXXX";
+    close (mkstemp (mainConf));
+    writeMainConf (mainConf, "/Index1");
+    stat (mainConf, &st);
+    TEST_BOOL (PkgParseMainConf (&cb, mainConf), "PkgParseMainConf() new file");
+    PkgDestroyMainConf (&cb);
+    writeMainConf (mainConf, "/Index2");
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    utimensat (AT_FDCWD, mainConf, times, 0);
+    TEST_BOOL (PkgParseMainConf (&cb, mainConf) &&
+                   !c32cmp (StrRefGet (cb.conf->idxPath), U"/Index1") &&
+                   !strcmp (StrRefGet (cb.conf->dbLoc.dbPath), "/nonexistent/db") &&
+                   !cb.conf->cachePath,
+               "PkgParseMainConf() cached");
+    PkgDestroyMainConf (&cb);
+    times[1].tv_sec += 1;
+    utimensat (AT_FDCWD, mainConf, times, 0);
+    TEST_BOOL (PkgParseMainConf (&cb, mainConf) &&
+                   !c32cmp (StrRefGet (cb.conf->idxPath), U"/Index2"),
+               "PkgParseMainConf() stale cache");
+    PkgDestroyMainConf (&cb);
+    unlink (mainConf);
     return 0;
 }
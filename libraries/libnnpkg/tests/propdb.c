@@ -18,16 +18,20 @@
 
 /// @file propdb.c
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #define NEXTEST_NAME "propdb"
 #include <errno.h>
+#include <fcntl.h>
 #include <libnex/error.h>
 #include <libnex/progname.h>
+#include <limits.h>
 #include <locale.h>
 #include <nextest.h>
 #include <nnpkg/pkg.h>
 #include <nnpkg/propdb.h>
 #include <nnpkg/transaction.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,13 +42,29 @@ void progHandler (NnpkgTransCb_t* cb, int state)
     printf ("%d\n", cb->error);
 }
 
+static NnpkgTransCb_t waitCb;
+
+// Opens the database shared from another thread
+static void* waitJob (void* data)
+{
+    return PropDbOpenShared (&waitCb, data);
+}
+
+// Lets go of the lock file a little while after it was locked
+static void* unlockJob (void* data)
+{
+    usleep (20000);
+    close (*(int*) data);
+    return NULL;
+}
+
 int main (int argc, char** argv)
 {
     setprogname (argv[0]);
     setlocale (LC_ALL, "");
     bindtextdomain ("libnnpkg", NNPKG_LOCALE_BASE);
     // Remove old database
-    NnpkgTransCb_t cb;
+    NnpkgTransCb_t cb = {0};
     cb.progress = progHandler;
     TEST_BOOL (PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH),
                "PkgParseMainConf success");
@@ -74,6 +94,16 @@ int main (int argc, char** argv)
     // Test that database is locked
     TEST (PropDbOpen (&cb, dbLoc), NULL, "property database is locked");
     PropDbClose (db);
+    // Databases of other revisions are turned away
+    int dbFd = open (StrRefGet (pkgDb), O_RDWR);
+    uint8_t revision = 0;
+    pread (dbFd, &revision, 1, 9);
+    uint8_t oldRevision = revision - 1;
+    pwrite (dbFd, &oldRevision, 1, 9);
+    TEST_BOOL (!PropDbOpen (&cb, dbLoc) && cb.error == NNPKG_ERR_DB_REVISION,
+               "PropDbOpen() revision mismatch");
+    pwrite (dbFd, &revision, 1, 9);
+    close (dbFd);
     // Test that database is actually unlocked
     db = PropDbOpen (&cb, dbLoc);
     TEST_BOOL (db, "PropDbClose() unlocking");
@@ -131,9 +161,113 @@ int main (int argc, char** argv)
     // Ensure property is at correct location
     prop = malloc (sizeof (NnpkgProp_t));
     TEST_BOOL (PropDbFindProp (db, U"testPkg", prop), "PropDbFindProp() success");
-    TEST (prop->internal, db->memBase + 28, "PropDbAddProp() on reused entry");
+    TEST (prop->internal, db->memBase + 32, "PropDbAddProp() on reused entry");
+    // Reused slot should be on a new generation
+    uint32_t slot = 0;
+    uint16_t gen = 0;
+    TEST_BOOL (PropDbGetPropRef (db, prop, &slot, &gen),
+               "PropDbGetPropRef() success");
+    TEST (slot, 1, "PropDbGetPropRef() slot");
+    TEST (gen, 1, "PropDbGetPropRef() generation");
+    NnpkgProp_t* slotProp = malloc (sizeof (NnpkgProp_t));
+    TEST_BOOL (PropDbGetPropBySlot (db, slot, gen, slotProp),
+               "PropDbGetPropBySlot() success");
+    TEST (slotProp->internal, prop->internal, "PropDbGetPropBySlot() validity");
+    ObjDeRef (&slotProp->obj);
+    slotProp = malloc (sizeof (NnpkgProp_t));
+    TEST_BOOL (!PropDbGetPropBySlot (db, slot, 0, slotProp),
+               "PropDbGetPropBySlot() stale generation");
+    free (slotProp);
     PropDbClose (db);
     ObjDeRef (&prop->obj);
+    // Readers share the database, and keep writers out until one locks it
+    NnpkgPropDb_t* reader = PropDbOpenShared (&cb, dbLoc);
+    db = PropDbOpenShared (&cb, dbLoc);
+    TEST_BOOL (reader && db, "PropDbOpenShared() success");
+    TEST (PropDbOpen (&cb, dbLoc), NULL, "shared database is locked");
+    PropDbClose (reader);
+    TEST_BOOL (PropDbLock (&cb, db), "PropDbLock() success");
+    uint32_t dbGen = db->gen;
+    prop = calloc (sizeof (NnpkgProp_t), 1);
+    prop->id = StrRefCreate (U"test3Pkg");
+    StrRefNoFree (prop->id);
+    prop->type = NNPKG_PROP_TYPE_PKG;
+    prop->data = strdup ("test data");
+    prop->dataLen = strlen (prop->data);
+    PropDbAddProp (&cb, db, prop);
+    PropDbClose (db);
+    // Commits move the database to a new generation, which is caught when a
+    // database opened before it is locked
+    db = PropDbOpenShared (&cb, dbLoc);
+    TEST (db->gen, dbGen + 1, "PropDbClose() generation");
+    ++*(uint32_t*) (db->memBase + 28);    // As if another writer committed
+    TEST_BOOL (!PropDbLock (&cb, db) && cb.error == NNPKG_ERR_DB_CHANGED,
+               "PropDbLock() on changed database");
+    PropDbClose (db);
+    pthread_t thread;
+#ifdef F_OFD_SETLK
+    // Somebody holding the counters of the lock file for a moment doesn't make a
+    // free database look locked
+    char lockPath[PATH_MAX];
+    snprintf (lockPath,
+              sizeof (lockPath),
+              "%s.lock",
+              (const char*) StrRefGet (dbLoc->dbPath));
+    int lockFd = open (lockPath, O_RDWR);
+    struct flock fl = {0};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_len = 16;
+    TEST_BOOL (lockFd != -1 && fcntl (lockFd, F_OFD_SETLK, &fl) != -1,
+               "Lock file counters locked");
+    pthread_create (&thread, NULL, unlockJob, &lockFd);
+    db = PropDbOpen (&cb, dbLoc);
+    pthread_join (thread, NULL);
+    TEST_BOOL (db, "PropDbOpen() waits for lock file counters");
+    PropDbClose (db);
+#endif
+    // Waiters give up once the lock timeout runs out
+    db = PropDbOpen (&cb, dbLoc);
+    cb.conf->lockTimeout = 20;
+    cb.stats.lockWait = 0;
+    TEST_BOOL (!PropDbOpenShared (&cb, dbLoc) && cb.error == NNPKG_ERR_DB_LOCKED,
+               "PropDbOpenShared() timeout");
+    TEST_BOOL (cb.stats.lockWait >= 20000000, "PropDbOpenShared() wait time");
+    // Others wait for the holder, without waiting on ones that gave up
+    cb.conf->lockTimeout = -1;
+    waitCb.progress = progHandler;
+    waitCb.conf = cb.conf;
+    pthread_create (&thread, NULL, waitJob, dbLoc);
+    usleep (20000);
+    PropDbClose (db);
+    pthread_join (thread, (void**) &reader);
+    TEST_BOOL (reader, "PropDbOpenShared() waits for holder");
+    // Readers can let go of the database and take it back later
+    PropDbUnlock (reader);
+    db = PropDbOpen (&cb, dbLoc);
+    TEST_BOOL (db, "PropDbUnlock() lets writers in");
+    PropDbClose (db);
+    TEST_BOOL (PropDbRelock (&cb, reader), "PropDbRelock() success");
+    PropDbUnlock (reader);
+    ++*(uint32_t*) (reader->memBase + 28);    // As if another writer committed
+    TEST_BOOL (!PropDbRelock (&cb, reader) && cb.error == NNPKG_ERR_DB_CHANGED,
+               "PropDbRelock() on changed database");
+    PropDbClose (reader);
+    // A planner that only read the database must not write back what it read of
+    // the header when another writer got in first
+    NnpkgPropDb_t* planner = PropDbOpenShared (&cb, dbLoc);
+    PropDbUnlock (planner);
+    db = PropDbOpen (&cb, dbLoc);
+    prop = malloc (sizeof (NnpkgProp_t));
+    TEST_BOOL (PropDbFindProp (db, U"test2Pkg", prop), "PropDbFindProp() success");
+    PropDbRemoveProp (&cb, db, prop);
+    PropDbClose (db);
+    TEST_BOOL (!PropDbLock (&cb, planner) && cb.error == NNPKG_ERR_DB_CHANGED,
+               "PropDbLock() after another writer");
+    PropDbClose (planner);
+    db = PropDbOpen (&cb, dbLoc);
+    TEST (db->numFreeProps, 1, "PropDbClose() keeps other writer's header");
+    PropDbClose (db);
     StrRefDestroy (pkgDb);
     StrRefDestroy (strtab);
     return 0;
@@ -0,0 +1,266 @@
+/*
+    resolver.c - contains test suite for dependency resolver
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file resolver.c
+
+#include <stdio.h>
+#define NEXTEST_NAME "resolver"
+#ifdef NNPKG_ENABLE_NLS
+#include <libintl.h>
+#endif
+#include <libnex/progname.h>
+#include <libnex/safemalloc.h>
+#include <locale.h>
+#include <nextest.h>
+#include <nnpkg/resolver.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Size of synthetic repository
+#define BENCH_PKGS     50000
+#define BENCH_MAX_VERS 3
+#define BENCH_MAX_DEPS 3
+
+// Dependency in synthetic repository
+typedef struct _benchdep
+{
+    size_t pkg;
+    uint8_t verOp;
+    uint8_t ver[3];
+} benchDep_t;
+
+// Version of a package in synthetic repository
+typedef struct _benchver
+{
+    size_t cand;
+    uint8_t ver[3];
+    benchDep_t deps[BENCH_MAX_DEPS];
+    int numDeps;
+} benchVer_t;
+
+typedef struct _benchpkg
+{
+    char32_t name[16];
+    size_t idx;
+    benchVer_t vers[BENCH_MAX_VERS];
+    int numVers;
+} benchPkg_t;
+
+static unsigned int seed = 12345;
+
+static unsigned int benchRand()
+{
+    seed = (seed * 1103515245) + 12345;
+    return (seed >> 16) & 0x7FFF;
+}
+
+// Writes name of package into buffer
+static void benchMakeName (char32_t* buf, size_t n)
+{
+    char tmp[16];
+    int len = snprintf (tmp, sizeof (tmp), "pkg%zu", n);
+    for (int i = 0; i <= len; ++i)
+        buf[i] = tmp[i];
+}
+
+// Generates a repository where every package is required. Every version 1.0.0
+// only has unversioned dependencies, so a solution always exists, while newer
+// versions have constraints that often clash and need backtracking
+static benchPkg_t* benchGenerate()
+{
+    benchPkg_t* pkgs = calloc_s (BENCH_PKGS * sizeof (benchPkg_t));
+    if (!pkgs)
+        return NULL;
+    for (size_t i = 0; i < BENCH_PKGS; ++i)
+    {
+        benchPkg_t* pkg = &pkgs[i];
+        benchMakeName (pkg->name, i);
+        pkg->numVers = (int) (benchRand() % BENCH_MAX_VERS) + 1;
+        for (int j = 0; j < pkg->numVers; ++j)
+        {
+            benchVer_t* ver = &pkg->vers[j];
+            ver->ver[0] = j + 1;
+            ver->numDeps = i ? (int) (benchRand() % (BENCH_MAX_DEPS + 1)) : 0;
+            for (int k = 0; k < ver->numDeps; ++k)
+            {
+                benchDep_t* dep = &ver->deps[k];
+                // Depend on nearby older packages, keeping the graph acyclic
+                size_t dist = (benchRand() % 64) + 1;
+                dep->pkg = (dist > i) ? 0 : i - dist;
+                dep->verOp = NNPKG_VER_ANY;
+                if (j)
+                {
+                    static const uint8_t ops[] = {NNPKG_VER_LT,
+                                                  NNPKG_VER_GE,
+                                                  NNPKG_VER_EQ,
+                                                  NNPKG_VER_GT};
+                    dep->verOp = ops[benchRand() % 4];
+                    dep->ver[0] = (benchRand() % BENCH_MAX_VERS) + 1;
+                }
+            }
+        }
+    }
+    return pkgs;
+}
+
+// Runs resolver on synthetic repository and checks the result
+static int benchRun()
+{
+    benchPkg_t* pkgs = benchGenerate();
+    TEST_BOOL (pkgs, "Benchmark generation");
+    struct timespec start, end;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    NnpkgResolver_t* res = ResolverCreate();
+    TEST_BOOL (res, "Benchmark ResolverCreate()");
+    for (size_t i = 0; i < BENCH_PKGS; ++i)
+    {
+        pkgs[i].idx = ResolverAddPackage (res, pkgs[i].name, NULL);
+        for (int j = 0; j < pkgs[i].numVers; ++j)
+        {
+            pkgs[i].vers[j].cand =
+                ResolverAddCandidate (res, pkgs[i].idx, pkgs[i].vers[j].ver, NULL);
+        }
+    }
+    for (size_t i = 0; i < BENCH_PKGS; ++i)
+    {
+        for (int j = 0; j < pkgs[i].numVers; ++j)
+        {
+            benchVer_t* ver = &pkgs[i].vers[j];
+            for (int k = 0; k < ver->numDeps; ++k)
+            {
+                ResolverAddDep (res,
+                                ver->cand,
+                                pkgs[ver->deps[k].pkg].idx,
+                                ver->deps[k].verOp,
+                                ver->deps[k].ver);
+            }
+        }
+        ResolverRequire (res, pkgs[i].idx, NNPKG_VER_ANY, pkgs[i].vers[0].ver);
+    }
+    bool solved = ResolverSolve (res);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    double elapsed =
+        (double) (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1e9);
+    printf ("resolved %d packages in %.3f seconds\n", BENCH_PKGS, elapsed);
+    // Resolving should take well under a second. The limit is generous, as only
+    // big regressions should fail, and is only checked in optimized builds unless
+    // NNPKG_BENCH_LIMIT gives one in seconds
+    double limit = 0;
+#ifdef NDEBUG
+    limit = 5.0;
+#endif
+    const char* limitStr = getenv ("NNPKG_BENCH_LIMIT");
+    if (limitStr)
+        limit = atof (limitStr);
+    if (limit > 0)
+    {
+        TEST_BOOL (elapsed < limit, "Benchmark time");
+    }
+    TEST_BOOL (solved, "Benchmark ResolverSolve()");
+    // Check that every dependency of every selected version holds
+    size_t newest = 0;
+    for (size_t i = 0; i < BENCH_PKGS; ++i)
+    {
+        size_t cand = ResolverGetSelection (res, pkgs[i].idx);
+        TEST_BOOL (cand != RESOLVER_NONE, "Benchmark selection");
+        benchVer_t* ver = NULL;
+        for (int j = 0; j < pkgs[i].numVers; ++j)
+        {
+            if (pkgs[i].vers[j].cand == cand)
+                ver = &pkgs[i].vers[j];
+        }
+        TEST_BOOL (ver, "Benchmark candidate");
+        if (ver == &pkgs[i].vers[pkgs[i].numVers - 1])
+            ++newest;
+        for (int k = 0; k < ver->numDeps; ++k)
+        {
+            benchPkg_t* depPkg = &pkgs[ver->deps[k].pkg];
+            size_t depCand = ResolverGetSelection (res, depPkg->idx);
+            uint8_t* depVer = NULL;
+            for (int j = 0; j < depPkg->numVers; ++j)
+            {
+                if (depPkg->vers[j].cand == depCand)
+                    depVer = depPkg->vers[j].ver;
+            }
+            TEST_BOOL (depVer && ResolverVersionMatches (ver->deps[k].verOp,
+                                                         ver->deps[k].ver,
+                                                         depVer),
+                       "Benchmark dependency satisfied");
+        }
+    }
+    printf ("%zu of %d packages at newest version\n", newest, BENCH_PKGS);
+    ResolverDestroy (res);
+    free (pkgs);
+    return 0;
+}
+
+int main (int argc, char** argv)
+{
+    setprogname (argv[0]);
+#ifdef NNPKG_ENABLE_NLS
+    setlocale (LC_ALL, "");
+    bindtextdomain ("libnnpkg", NNPKG_LOCALE_BASE);
+#endif
+    static const uint8_t v1[3] = {1, 0, 0};
+    static const uint8_t v2[3] = {2, 0, 0};
+    static const uint8_t v3[3] = {3, 0, 0};
+    // a 2.0.0 needs c, whose only version needs b >= 3.0.0, which doesn't exist.
+    // So a has to fall back to 1.0.0, which needs b >= 2.0.0
+    NnpkgResolver_t* res = ResolverCreate();
+    TEST_BOOL (res, "ResolverCreate()");
+    size_t a = ResolverAddPackage (res, U"a", NULL);
+    size_t b = ResolverAddPackage (res, U"b", NULL);
+    size_t c = ResolverAddPackage (res, U"c", NULL);
+    bool isNew = true;
+    TEST (ResolverAddPackage (res, U"b", &isNew), b, "ResolverAddPackage() lookup");
+    TEST_BOOL (!isNew, "ResolverAddPackage() lookup 2");
+    size_t a1 = ResolverAddCandidate (res, a, v1, NULL);
+    size_t a2 = ResolverAddCandidate (res, a, v2, NULL);
+    size_t b1 = ResolverAddCandidate (res, b, v1, NULL);
+    size_t b2 = ResolverAddCandidate (res, b, v2, NULL);
+    size_t c1 = ResolverAddCandidate (res, c, v1, NULL);
+    TEST_BOOL (ResolverAddDep (res, a1, b, NNPKG_VER_GE, v2), "ResolverAddDep()");
+    ResolverAddDep (res, a2, c, NNPKG_VER_ANY, v1);
+    ResolverAddDep (res, a2, b, NNPKG_VER_LT, v2);
+    ResolverAddDep (res, c1, b, NNPKG_VER_GE, v3);
+    TEST_BOOL (ResolverRequire (res, a, NNPKG_VER_ANY, v1), "ResolverRequire()");
+    TEST_BOOL (ResolverSolve (res), "ResolverSolve()");
+    TEST (ResolverGetSelection (res, a), a1, "ResolverSolve() backtrack 1");
+    TEST (ResolverGetSelection (res, b), b2, "ResolverSolve() backtrack 2");
+    TEST (ResolverGetSelection (res, c),
+          RESOLVER_NONE,
+          "ResolverSolve() backtrack 3");
+    (void) b1;
+    ResolverDestroy (res);
+    // x and y need different versions of z
+    res = ResolverCreate();
+    size_t x = ResolverAddPackage (res, U"x", NULL);
+    size_t y = ResolverAddPackage (res, U"y", NULL);
+    size_t z = ResolverAddPackage (res, U"z", NULL);
+    size_t x1 = ResolverAddCandidate (res, x, v1, NULL);
+    size_t y1 = ResolverAddCandidate (res, y, v1, NULL);
+    ResolverAddCandidate (res, z, v1, NULL);
+    ResolverAddCandidate (res, z, v2, NULL);
+    ResolverAddDep (res, x1, z, NNPKG_VER_EQ, v1);
+    ResolverAddDep (res, y1, z, NNPKG_VER_EQ, v2);
+    ResolverRequire (res, x, NNPKG_VER_ANY, v1);
+    ResolverRequire (res, y, NNPKG_VER_ANY, v1);
+    TEST_BOOL (!ResolverSolve (res), "ResolverSolve() conflict");
+    TEST_BOOL (ResolverGetConflict (res), "ResolverGetConflict()");
+    ResolverDestroy (res);
+    return benchRun();
+}
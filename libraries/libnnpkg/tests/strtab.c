@@ -41,7 +41,7 @@ int main (int argc, char** argv)
     setlocale (LC_ALL, "");
     bindtextdomain ("libnnpkg", NNPKG_LOCALE_BASE);
 #endif
-    NnpkgTransCb_t cb;
+    NnpkgTransCb_t cb = {0};
     TEST_BOOL (PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH),
                "PkgParseMainConf success");
     NnpkgDbLocation_t* dbLoc = &cb.conf->dbLoc;
@@ -0,0 +1,125 @@
+/*
+    trace.c - contains trace test suite
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file trace.c
+
+#include <stdio.h>
+#define NEXTEST_NAME "trace"
+#include <libnex/error.h>
+#include <libnex/progname.h>
+#include <locale.h>
+#include <nextest.h>
+#include <nnpkg/pkg.h>
+#include <nnpkg/propdb.h>
+#include <nnpkg/trace.h>
+#include <nnpkg/transaction.h>
+#include <nnpkg/workpool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void progHandler (NnpkgTransCb_t* cb, int state)
+{
+    printf ("%d\n", cb->error);
+}
+
+// Reads a whole file
+static char* readFile (const char* name)
+{
+    static char buf[8192];
+    FILE* file = fopen (name, "r");
+    if (!file)
+        return NULL;
+    size_t len = fread (buf, 1, sizeof (buf) - 1, file);
+    buf[len] = 0;
+    fclose (file);
+    return buf;
+}
+
+// Counts occurrences of needle in str
+static int countStr (const char* str, const char* needle)
+{
+    int count = 0;
+    while ((str = strstr (str, needle)))
+    {
+        ++count;
+        ++str;
+    }
+    return count;
+}
+
+// Looks up a property from a worker thread
+static void findJob (void* data)
+{
+    NnpkgProp_t prop;
+    PropDbFindProp (data, U"tracePkg", &prop);
+}
+
+int main (int argc, char** argv)
+{
+    setprogname (argv[0]);
+    setlocale (LC_ALL, "");
+    bindtextdomain ("libnnpkg", NNPKG_LOCALE_BASE);
+    NnpkgTransCb_t cb = {0};
+    cb.progress = progHandler;
+    TEST_BOOL (PkgParseMainConf (&cb, NNPKG_CONFFILE_PATH),
+               "PkgParseMainConf success");
+    NnpkgDbLocation_t* dbLoc = &cb.conf->dbLoc;
+    unlink (StrRefGet (dbLoc->dbPath));
+    unlink (StrRefGet (dbLoc->strtabPath));
+    TEST_BOOL (PropDbCreate (dbLoc), "PropDbCreate() success");
+    char traceFile[] = "/tmp/nnpkgtraceXXXXXX";
+    int fd = mkstemp (traceFile);
+    TEST_BOOL (fd != -1, "mkstemp() success");
+    close (fd);
+    // Nothing is recorded until tracing starts
+    NnpkgPropDb_t* db = PropDbOpen (&cb, dbLoc);
+    TEST_BOOL (db, "PropDbOpen() success");
+    PropDbClose (db);
+    TEST_BOOL (TraceStart (traceFile), "TraceStart() success");
+    TEST_BOOL (NnpkgTraceOn, "TraceStart() enables tracing");
+    db = PropDbOpen (&cb, dbLoc);
+    TEST_BOOL (db, "PropDbOpen() success");
+    NnpkgProp_t prop;
+    TEST_BOOL (!PropDbFindProp (db, U"tracePkg", &prop), "PropDbFindProp() success");
+    // Spans from other threads get their own thread IDs
+    NnpkgWorkPool_t* pool = WorkPoolCreate (1);
+    TEST_BOOL (pool && WorkPoolSubmit (pool, findJob, db),
+               "WorkPoolSubmit() success");
+    WorkPoolDestroy (pool);
+    PropDbClose (db);
+    TraceStop();
+    TEST_BOOL (!NnpkgTraceOn, "TraceStop() disables tracing");
+    const char* trace = readFile (traceFile);
+    TEST_BOOL (trace, "trace file written");
+    TEST_BOOL (!strncmp (trace, "{\"traceEvents\":[", 16), "trace file format");
+    TEST (countStr (trace, "\"ph\":\"X\""), 4, "trace span count");
+    TEST (countStr (trace, "\"name\":\"PropDbFindProp\""), 2, "trace span names");
+    TEST_BOOL (strstr (trace, "\"name\":\"PropDbOpen\"") &&
+                   strstr (trace, "\"name\":\"PropDbClose\""),
+               "trace span names 2");
+    TEST_BOOL (strstr (trace, "\"tid\":1") && strstr (trace, "\"tid\":2"),
+               "trace thread IDs");
+    // A new trace leaves out spans from the last one
+    TEST_BOOL (TraceStart (traceFile), "TraceStart() restart");
+    TraceStop();
+    trace = readFile (traceFile);
+    TEST_BOOL (trace && !countStr (trace, "\"ph\""), "trace restart");
+    unlink (traceFile);
+    PkgDestroyMainConf (&cb);
+    return 0;
+}
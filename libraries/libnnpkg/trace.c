@@ -0,0 +1,215 @@
+/*
+    trace.c - contains tracing functions
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file trace.c
+
+#include <libnex/safemalloc.h>
+#include <nnpkg/trace.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of spans kept per thread. Once a ring fills, the oldest spans are
+// overwritten
+#define TRACE_RING_SIZE 8192
+
+// A recorded span
+typedef struct _traceevent
+{
+    const char* name;    ///< Name of span
+    uint64_t start;      ///< Start time in nanoseconds
+    uint64_t end;        ///< End time in nanoseconds
+} traceEvent_t;
+
+// Spans recorded by one thread. Only the owning thread writes to a ring, so
+// recording takes no locks
+typedef struct _tracering
+{
+    traceEvent_t events[TRACE_RING_SIZE];    ///< Recorded spans
+    uint64_t numEvents;                      ///< Number of spans ever recorded
+    int tid;                                 ///< Thread number shown in trace
+    bool done;                               ///< If its thread has exited
+    struct _tracering* next;                 ///< Next ring in list
+} traceRing_t;
+
+bool NnpkgTraceOn = false;
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static traceRing_t* traceRings = NULL;    // Every ring, protected by traceLock
+static int traceNextTid = 1;              // Protected by traceLock
+static char* traceFile = NULL;            // Where to write spans
+static uint64_t traceBase = 0;            // Time that tracing started
+static pthread_key_t traceKey;            // Ring of current thread
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+
+// Takes a ring out of the list and frees it. traceLock must be held
+static void traceFreeRing (traceRing_t* ring)
+{
+    traceRing_t** prev = &traceRings;
+    while (*prev != ring)
+        prev = &(*prev)->next;
+    *prev = ring->next;
+    free (ring);
+}
+
+// Called as a thread exits. Rings outlive their threads while a trace is being
+// recorded, so that spans from finished worker threads still get written out, and
+// TraceStop frees them then
+static void traceRingDone (void* data)
+{
+    traceRing_t* ring = data;
+    pthread_mutex_lock (&traceLock);
+    if (traceFile)
+        ring->done = true;
+    else
+        traceFreeRing (ring);
+    pthread_mutex_unlock (&traceLock);
+}
+
+static void traceMakeKey()
+{
+    pthread_key_create (&traceKey, traceRingDone);
+}
+
+NNPKG_PUBLIC uint64_t TraceNow()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+// Gets the ring of the calling thread, creating it if need be
+static traceRing_t* traceGetRing()
+{
+    traceRing_t* ring = pthread_getspecific (traceKey);
+    if (ring)
+        return ring;
+    ring = calloc_s (sizeof (traceRing_t));
+    if (!ring)
+        return NULL;
+    pthread_setspecific (traceKey, ring);
+    pthread_mutex_lock (&traceLock);
+    ring->tid = traceNextTid++;
+    ring->next = traceRings;
+    traceRings = ring;
+    pthread_mutex_unlock (&traceLock);
+    return ring;
+}
+
+NNPKG_PUBLIC void TraceRecord (const NnpkgTraceSpan_t* span)
+{
+    traceRing_t* ring = traceGetRing();
+    if (!ring)
+        return;
+    traceEvent_t* event = &ring->events[ring->numEvents % TRACE_RING_SIZE];
+    event->name = span->name;
+    event->start = span->start;
+    event->end = TraceNow();
+    ++ring->numEvents;
+}
+
+NNPKG_PUBLIC bool TraceStart (const char* file)
+{
+    pthread_once (&traceOnce, traceMakeKey);
+    pthread_mutex_lock (&traceLock);
+    free (traceFile);
+    size_t len = strlen (file);
+    traceFile = malloc_s (len + 1);
+    if (!traceFile)
+    {
+        pthread_mutex_unlock (&traceLock);
+        return false;
+    }
+    memcpy (traceFile, file, len + 1);
+    traceBase = TraceNow();
+    pthread_mutex_unlock (&traceLock);
+    NnpkgTraceOn = true;
+    return true;
+}
+
+// Writes one ring's spans, oldest first. Returns true while nothing has been written
+static bool traceWriteRing (FILE* file, traceRing_t* ring, bool first)
+{
+    uint64_t i = 0;
+    if (ring->numEvents > TRACE_RING_SIZE)
+        i = ring->numEvents - TRACE_RING_SIZE;
+    for (; i < ring->numEvents; ++i)
+    {
+        traceEvent_t* event = &ring->events[i % TRACE_RING_SIZE];
+        // Spans that started before tracing did are from an earlier trace
+        if (event->start < traceBase)
+            continue;
+        // Times are in microseconds
+        fprintf (file,
+                 "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                 "\"pid\":%d,\"tid\":%d}",
+                 first ? "" : ",",
+                 event->name,
+                 (event->start - traceBase) / 1000.0,
+                 (event->end - event->start) / 1000.0,
+                 (int) getpid(),
+                 ring->tid);
+        first = false;
+    }
+    return first;
+}
+
+NNPKG_PUBLIC void TraceStop()
+{
+    if (!NnpkgTraceOn)
+        return;
+    NnpkgTraceOn = false;
+    pthread_mutex_lock (&traceLock);
+    FILE* file = fopen (traceFile, "w");
+    if (file)
+    {
+        fprintf (file, "{\"traceEvents\":[");
+        bool first = true;
+        for (traceRing_t* ring = traceRings; ring; ring = ring->next)
+            first = traceWriteRing (file, ring, first);
+        fprintf (file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        fclose (file);
+    }
+    // Rings of running threads stay around, as their threads may still be using
+    // them. Old spans are left out of later traces by their start times
+    traceRing_t* ring = traceRings;
+    while (ring)
+    {
+        traceRing_t* next = ring->next;
+        if (ring->done)
+            traceFreeRing (ring);
+        ring = next;
+    }
+    free (traceFile);
+    traceFile = NULL;
+    pthread_mutex_unlock (&traceLock);
+}
+
+__attribute__ ((constructor)) static void traceInit()
+{
+    const char* file = getenv ("NNPKG_TRACE");
+    if (file && *file)
+        TraceStart (file);
+}
+
+__attribute__ ((destructor)) static void traceFini()
+{
+    TraceStop();
+}
@@ -16,10 +16,29 @@
 */
 
 #include <assert.h>
+#include <libnex/base.h>
 #include <libnex/safemalloc.h>
 #include <nnpkg/fsstuff.h>
+#include <nnpkg/graph.h>
 #include <nnpkg/pkg.h>
+#include <nnpkg/resolver.h>
 #include <nnpkg/transaction.h>
+#include <nnpkg/workpool.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+// Number of times a transaction is planned before giving up on a database that
+// keeps changing under it
+#define TRANSACT_MAX_PLANS 8
+
+// Gets monotonic time in nanoseconds
+static inline uint64_t transactNow()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + (uint64_t) ts.tv_nsec;
+}
 
 // Reports the next valid state for specified control block
 static inline int transactNextState (NnpkgTransCb_t* cb)
@@ -35,7 +54,8 @@ static inline int transactNextState (NnpkgTransCb_t* cb)
     // Do type-dependent transitions
     switch (cb->type)
     {
-        case NNPKG_TRANS_ADD: {
+        case NNPKG_TRANS_ADD:
+        case NNPKG_TRANS_ADD_MULTI: {
             switch (cb->state)
             {
                 case NNPKG_STATE_ADDPKG:
@@ -45,6 +65,8 @@ static inline int transactNextState (NnpkgTransCb_t* cb)
                 case NNPKG_STATE_READ_PKGCONF:
                     return NNPKG_STATE_COLLECT_INDEX;
                 case NNPKG_STATE_COLLECT_INDEX:
+                    return NNPKG_STATE_LOCK_DB;
+                case NNPKG_STATE_LOCK_DB:
                     return NNPKG_STATE_WRITE_INDEX;
                 case NNPKG_STATE_WRITE_INDEX:
                     return NNPKG_STATE_ADDPKG;
@@ -54,6 +76,48 @@ static inline int transactNextState (NnpkgTransCb_t* cb)
                     assert (!"Invalid state");
             }
         }
+        case NNPKG_TRANS_AUTOREMOVE: {
+            switch (cb->state)
+            {
+                case NNPKG_STATE_INIT_PKGSYS:
+                    return NNPKG_STATE_FIND_ORPHANS;
+                case NNPKG_STATE_FIND_ORPHANS:
+                    return NNPKG_STATE_COLLECT_INDEX;
+                case NNPKG_STATE_COLLECT_INDEX:
+                    return NNPKG_STATE_LOCK_DB;
+                case NNPKG_STATE_LOCK_DB:
+                    return NNPKG_STATE_RMPKG;
+                case NNPKG_STATE_RMPKG:
+                    return NNPKG_STATE_REMOVE_INDEX;
+                case NNPKG_STATE_REMOVE_INDEX:
+                    return NNPKG_STATE_CLEANUP_PKGSYS;
+                case NNPKG_STATE_CLEANUP_PKGSYS:
+                    return NNPKG_STATE_ACCEPT;
+                default:
+                    assert (!"Invalid state");
+            }
+        }
+        case NNPKG_TRANS_REMOVE: {
+            switch (cb->state)
+            {
+                case NNPKG_STATE_INIT_PKGSYS:
+                    return NNPKG_STATE_FIND_PKG;
+                case NNPKG_STATE_FIND_PKG:
+                    return NNPKG_STATE_COLLECT_INDEX;
+                case NNPKG_STATE_COLLECT_INDEX:
+                    return NNPKG_STATE_LOCK_DB;
+                case NNPKG_STATE_LOCK_DB:
+                    return NNPKG_STATE_RMPKG;
+                case NNPKG_STATE_RMPKG:
+                    return NNPKG_STATE_REMOVE_INDEX;
+                case NNPKG_STATE_REMOVE_INDEX:
+                    return NNPKG_STATE_CLEANUP_PKGSYS;
+                case NNPKG_STATE_CLEANUP_PKGSYS:
+                    return NNPKG_STATE_ACCEPT;
+                default:
+                    assert (!"Invalid state");
+            }
+        }
         default:
             assert (!"Invalid transaction type");
     }
@@ -61,6 +125,7 @@ static inline int transactNextState (NnpkgTransCb_t* cb)
 }
 
 // Cleans up add transaction block
+// Blocks are left ready to be planned again, so everything freed is cleared
 static void transactCleanupAdd (const Object_t* obj)
 {
     NnpkgTransAdd_t* add = ObjGetContainer (obj, NnpkgTransAdd_t, obj);
@@ -68,18 +133,83 @@ static void transactCleanupAdd (const Object_t* obj)
         ObjDestroy (&add->pkg->obj);
     if (add->idxEntries)
         ListDestroy (add->idxEntries);
+    add->pkg = NULL;
+    add->idxEntries = NULL;
+}
+
+// Cleans up multi-package add transaction block
+static void transactCleanupAddMulti (const Object_t* obj)
+{
+    NnpkgTransAddMulti_t* add = ObjGetContainer (obj, NnpkgTransAddMulti_t, obj);
+    for (size_t i = 0; i < add->numPkgs; ++i)
+    {
+        if (add->pkgs && add->pkgs[i])
+            ObjDestroy (&add->pkgs[i]->obj);
+        if (add->idxEntries && add->idxEntries[i])
+            ListDestroy (add->idxEntries[i]);
+    }
+    free (add->pkgs);
+    free (add->order);
+    free (add->levels);
+    free (add->idxEntries);
+    add->pkgs = NULL;
+    add->order = NULL;
+    add->levels = NULL;
+    add->idxEntries = NULL;
+}
+
+// Cleans up auto-remove transaction block
+static void transactCleanupAutoRemove (const Object_t* obj)
+{
+    NnpkgTransAutoRemove_t* autoRm =
+        ObjGetContainer (obj, NnpkgTransAutoRemove_t, obj);
+    if (autoRm->orphans)
+        ListDestroy (autoRm->orphans);
+    if (autoRm->idxEntries)
+        ListDestroy (autoRm->idxEntries);
+    autoRm->orphans = NULL;
+    autoRm->idxEntries = NULL;
+}
+
+// Cleans up remove transaction block
+static void transactCleanupRemove (const Object_t* obj)
+{
+    NnpkgTransRemove_t* rm = ObjGetContainer (obj, NnpkgTransRemove_t, obj);
+    if (rm->pkg)
+        ObjDestroy (&rm->pkg->obj);
+    if (rm->idxEntries)
+        ListDestroy (rm->idxEntries);
+    rm->pkg = NULL;
+    rm->idxEntries = NULL;
 }
 
 // Cleans up package system
 static bool transactCleanupPkgSys (NnpkgTransCb_t* cb)
 {
-    PkgCloseDbs();
-    PkgDestroyMainConf();
+    PkgCloseDbs (cb);
+    if (!cb->keepConf)
+        PkgDestroyMainConf (cb);
     switch (cb->type)
     {
         case NNPKG_TRANS_ADD: {
             NnpkgTransAdd_t* transData = cb->transactData;
             ObjDestroy (&transData->obj);
+            break;
+        }
+        case NNPKG_TRANS_AUTOREMOVE: {
+            NnpkgTransAutoRemove_t* transData = cb->transactData;
+            ObjDestroy (&transData->obj);
+            break;
+        }
+        case NNPKG_TRANS_ADD_MULTI: {
+            NnpkgTransAddMulti_t* transData = cb->transactData;
+            ObjDestroy (&transData->obj);
+            break;
+        }
+        case NNPKG_TRANS_REMOVE: {
+            NnpkgTransRemove_t* transData = cb->transactData;
+            ObjDestroy (&transData->obj);
+            break;
         }
     }
     return true;
@@ -88,11 +218,18 @@ static bool transactCleanupPkgSys (NnpkgTransCb_t* cb)
 // Sets state, performing any special processing that must be done
 NNPKG_PUBLIC void TransactSetState (NnpkgTransCb_t* cb, int state)
 {
+    // Charge the time since the last change to the state being left
+    uint64_t now = transactNow();
+    if (cb->stats.stateStart && cb->state >= 0 && cb->state < NNPKG_NUM_STATES)
+        cb->stats.time[cb->state] += now - cb->stats.stateStart;
+    cb->stats.stateStart = now;
     cb->state = state;
     // Set up progress info
     switch (cb->state)
     {
         case NNPKG_STATE_ADDPKG: {
+            if (cb->type != NNPKG_TRANS_ADD)
+                break;
             NnpkgTransAdd_t* addTrans = cb->transactData;
             cb->progressHint[0] = StrRefNew (addTrans->pkg->id);
             break;
@@ -103,14 +240,24 @@ NNPKG_PUBLIC void TransactSetState (NnpkgTransCb_t* cb, int state)
 }
 
 // Prepares package system
+// Transactions are planned with the database shared, and only lock it to apply
+// the plan. See transactLockDb
 static bool transactRunInit (NnpkgTransCb_t* cb)
 {
-    // Parse configuration
-    if (!PkgParseMainConf (cb, cb->confFile))
+    // Parse configuration, unless the caller has it parsed already
+    assert (!cb->keepConf || cb->conf);
+    if (!cb->keepConf && !PkgParseMainConf (cb, cb->confFile))
         return false;    // No extra cleanup needed
     // Open local database
-    if (!PkgOpenDb (cb, &cb->conf->dbLoc, NNPKGDB_TYPE_DEST, NNPKGDB_LOCATION_LOCAL))
+    if (!PkgOpenDbShared (cb,
+                          &cb->conf->dbLoc,
+                          NNPKGDB_TYPE_DEST,
+                          NNPKGDB_LOCATION_LOCAL))
+    {
+        if (!cb->keepConf)
+            PkgDestroyMainConf (cb);
         return false;
+    }
     // Initialize control block data object
     switch (cb->type)
     {
@@ -120,6 +267,24 @@ static bool transactRunInit (NnpkgTransCb_t* cb)
             ObjSetDestroy (&addTrans->obj, transactCleanupAdd);
             break;
         }
+        case NNPKG_TRANS_AUTOREMOVE: {
+            NnpkgTransAutoRemove_t* autoRmTrans = cb->transactData;
+            ObjCreate ("NnpkgTransAutoRemove_t", &autoRmTrans->obj);
+            ObjSetDestroy (&autoRmTrans->obj, transactCleanupAutoRemove);
+            break;
+        }
+        case NNPKG_TRANS_ADD_MULTI: {
+            NnpkgTransAddMulti_t* multiTrans = cb->transactData;
+            ObjCreate ("NnpkgTransAddMulti_t", &multiTrans->obj);
+            ObjSetDestroy (&multiTrans->obj, transactCleanupAddMulti);
+            break;
+        }
+        case NNPKG_TRANS_REMOVE: {
+            NnpkgTransRemove_t* rmTrans = cb->transactData;
+            ObjCreate ("NnpkgTransRemove_t", &rmTrans->obj);
+            ObjSetDestroy (&rmTrans->obj, transactCleanupRemove);
+            break;
+        }
     }
     return true;
 }
@@ -159,11 +324,524 @@ static bool transactCollectIndex (NnpkgTransCb_t* cb, NnpkgTransAdd_t* add)
     return true;
 }
 
+// Locks the dest database to apply the plan. Everything before this only reads the
+// database, so concurrent transactions only wait on each other from here on. If
+// another transaction committed since the database was opened, the plan is thrown
+// out, to be made again by TransactExecute
+static bool transactLockDb (NnpkgTransCb_t* cb)
+{
+    if (!PkgLockDestDb (cb))
+    {
+        transactCleanupPkgSys (cb);
+        return false;
+    }
+    return true;
+}
+
 static bool transactWriteIndex (NnpkgTransCb_t* cb, NnpkgTransAdd_t* add)
 {
     return IdxWriteIndex (cb, add->idxEntries);
 }
 
+// Adds every package to the database. They are committed together when the
+// database is closed
+static bool transactAddPkgs (NnpkgTransCb_t* cb, NnpkgTransAddMulti_t* add)
+{
+    for (size_t i = 0; i < add->numPkgs; ++i)
+    {
+        if (!PkgAddPackage (cb, add->pkgs[add->order[i]]))
+        {
+            transactCleanupPkgSys (cb);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Stages a package goes through in the pipeline
+#define TRANSACT_PIPE_QUEUED     0
+#define TRANSACT_PIPE_READING    1
+#define TRANSACT_PIPE_READ       2
+#define TRANSACT_PIPE_COLLECTING 3
+#define TRANSACT_PIPE_COLLECTED  4
+#define TRANSACT_PIPE_WRITING    5
+#define TRANSACT_PIPE_WRITTEN    6
+
+// Number of packages that may be read before their index is collected
+#define TRANSACT_PIPE_DEPTH 4
+
+typedef struct _transpipe transactPipe_t;
+
+// Pipeline job run on a worker thread
+// Each job has a control block of its own, so that workers never touch the
+// transaction's one
+typedef struct _transjob
+{
+    NnpkgTransCb_t cb;         ///< Control block of job
+    transactPipe_t* pipe;      ///< Pipeline job belongs to
+    size_t pkg;                ///< Index of package job works on
+    int stage;                 ///< Stage package is in. See above
+    bool res;                  ///< Result of job
+} transactJob_t;
+
+// Pipelined add of several packages
+// Reading a package, collecting its index entries and writing them are separate
+// jobs, so that one package's links can be written while the next one's
+// directories are read and the one after that is parsed. The thread running the
+// transaction schedules jobs and reports progress; it is the only one that touches
+// the transaction's control block
+typedef struct _transpipe
+{
+    NnpkgTransAddMulti_t* add;    ///< Transaction being run
+    NnpkgWorkPool_t* pool;        ///< Workers jobs run on
+    transactJob_t* jobs;          ///< Job of each package
+    pthread_mutex_t lock;         ///< Protects everything below and job stages
+    pthread_cond_t jobDone;       ///< Signaled when a job finishes
+    size_t numRunning;            ///< Number of jobs queued or running
+    size_t numRead;               ///< Number of packages read
+    size_t numCollected;          ///< Number of packages collected
+    size_t numWritten;            ///< Number of packages written
+    bool failed;                  ///< If a job failed. No more jobs are started
+} transactPipe_t;
+
+// Errors of jobs are reported through the transaction once all jobs are done
+static void transactJobProgress (NnpkgTransCb_t* cb, int newState)
+{
+    UNUSED (cb);
+    UNUSED (newState);
+}
+
+// Runs next stage of a package
+static void transactPipeJob (void* data)
+{
+    transactJob_t* job = data;
+    transactPipe_t* pipe = job->pipe;
+    NnpkgTransAddMulti_t* add = pipe->add;
+    size_t i = job->pkg;
+    int stage = job->stage;
+    // Work of a job is counted against the state of its stage
+    if (stage == TRANSACT_PIPE_READING)
+    {
+        job->cb.state = NNPKG_STATE_READ_PKGCONF;
+        add->pkgs[i] = PkgReadConfUnresolved (&job->cb, add->pkgConfs[i]);
+        job->res = add->pkgs[i] != NULL;
+    }
+    else if (stage == TRANSACT_PIPE_COLLECTING)
+    {
+        job->cb.state = NNPKG_STATE_COLLECT_INDEX;
+        add->idxEntries[i] = IdxCollectEntries (&job->cb, add->pkgs[i]);
+        job->res = add->idxEntries[i] != NULL;
+    }
+    else
+    {
+        assert (stage == TRANSACT_PIPE_WRITING);
+        job->cb.state = NNPKG_STATE_WRITE_INDEX;
+        job->res = IdxWriteIndex (&job->cb, add->idxEntries[i]);
+    }
+    pthread_mutex_lock (&pipe->lock);
+    job->stage = stage + 1;
+    if (!job->res)
+        pipe->failed = true;
+    else if (stage == TRANSACT_PIPE_READING)
+        ++pipe->numRead;
+    else if (stage == TRANSACT_PIPE_COLLECTING)
+        ++pipe->numCollected;
+    else
+        ++pipe->numWritten;
+    --pipe->numRunning;
+    pthread_cond_signal (&pipe->jobDone);
+    pthread_mutex_unlock (&pipe->lock);
+}
+
+// Starts next stage of a package. Called with the pipeline locked
+static void transactPipeStart (transactPipe_t* pipe, transactJob_t* job)
+{
+    ++job->stage;
+    ++pipe->numRunning;
+    if (!WorkPoolSubmit (pipe->pool, transactPipeJob, job))
+    {
+        // Run it here instead
+        pthread_mutex_unlock (&pipe->lock);
+        transactPipeJob (job);
+        pthread_mutex_lock (&pipe->lock);
+    }
+}
+
+// Orders the packages and picks their dependencies once all of them are read
+// Packages of the set can satisfy each other's dependencies
+static bool transactPlanBatch (NnpkgTransCb_t* cb, NnpkgTransAddMulti_t* add)
+{
+    if (!PkgGraphSortBatch (cb, add->pkgs, add->numPkgs, add->order, add->levels))
+        return false;
+    for (size_t i = 0; i < add->numPkgs; ++i)
+    {
+        NnpkgPackage_t* pkg = add->pkgs[add->order[i]];
+        if (pkg->numDeps &&
+            !ResolverSelectDepsFrom (cb, pkg, add->pkgs, add->numPkgs))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Passes the counters of a set of jobs, and their first error, on to the
+// transaction. The error is dropped if the transaction has one of its own already
+static bool transactJoinJobs (NnpkgTransCb_t* cb,
+                              transactJob_t* jobs,
+                              size_t numJobs)
+{
+    bool res = cb->state != NNPKG_TRANS_STATE_ERR;
+    bool report = res;
+    for (size_t i = 0; i < numJobs; ++i)
+    {
+        for (int j = 0; j < NNPKG_NUM_STATES; ++j)
+        {
+            for (int k = 0; k < NNPKG_NUM_COUNTS; ++k)
+                cb->stats.counts[j][k] += jobs[i].cb.stats.counts[j][k];
+        }
+        if (jobs[i].res)
+            continue;
+        if (report)
+        {
+            cb->error = jobs[i].cb.error;
+            cb->sysErrno = jobs[i].cb.sysErrno;
+            memcpy (cb->errHint, jobs[i].cb.errHint, sizeof (cb->errHint));
+            report = false;
+        }
+        else
+        {
+            for (size_t j = 0; j < ARRAY_SIZE (jobs[i].cb.errHint); ++j)
+            {
+                if (jobs[i].cb.errHint[j])
+                    StrRefDestroy (jobs[i].cb.errHint[j]);
+            }
+        }
+        res = false;
+    }
+    if (!report && cb->state != NNPKG_TRANS_STATE_ERR)
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+    return res;
+}
+
+// Reads, collects and writes the index of every package, overlapping the three.
+// Collection only needs a package to be read, so it follows reading closely.
+// Writing has to wait until every package is read and the set is ordered, as a
+// package's links go in after the ones of the packages of the set it depends on;
+// then the dest database is locked once everything is collected, and each level of
+// the order is written once the levels below it are in place. A staged index is
+// instead written all at once, so that each directory only gets swapped once.
+// Runs through NNPKG_STATE_WRITE_INDEX, entering each state in order as its first
+// job starts
+static bool transactRunPipeline (NnpkgTransCb_t* cb, NnpkgTransAddMulti_t* add)
+{
+    size_t numPkgs = add->numPkgs;
+    add->pkgs = calloc_s (numPkgs * sizeof (NnpkgPackage_t*));
+    add->order = malloc_s (numPkgs * sizeof (size_t));
+    add->levels = malloc_s (numPkgs * sizeof (uint32_t));
+    add->idxEntries = calloc_s (numPkgs * sizeof (ListHead_t*));
+    transactPipe_t pipe = {0};
+    pipe.add = add;
+    pipe.jobs = calloc_s (numPkgs * sizeof (transactJob_t));
+    if (!add->pkgs || !add->order || !add->levels || !add->idxEntries ||
+        !pipe.jobs || !(pipe.pool = WorkPoolCreate (add->numThreads)))
+    {
+        free (pipe.jobs);
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        transactCleanupPkgSys (cb);
+        return false;
+    }
+    for (size_t i = 0; i < numPkgs; ++i)
+    {
+        pipe.jobs[i].cb.type = cb->type;
+        pipe.jobs[i].cb.progress = transactJobProgress;
+        pipe.jobs[i].cb.pkgDbs = cb->pkgDbs;
+        pipe.jobs[i].cb.destDb = cb->destDb;
+        pipe.jobs[i].cb.confFile = cb->confFile;
+        pipe.jobs[i].cb.conf = cb->conf;
+        pipe.jobs[i].pipe = &pipe;
+        pipe.jobs[i].pkg = i;
+        pipe.jobs[i].res = true;
+    }
+    pthread_mutex_init (&pipe.lock, NULL);
+    pthread_cond_init (&pipe.jobDone, NULL);
+    size_t nextRead = 0, nextCollect = 0, nextWrite = 0;
+    size_t levelStart = 0;    // Position in order of first package of level
+    bool planned = false;
+    bool locked = false;
+    bool lockFailed = false;
+    bool staged = cb->conf->stagedIdx;
+    pthread_mutex_lock (&pipe.lock);
+    while (!pipe.failed && pipe.numWritten < numPkgs)
+    {
+        // The lock is dropped at times below, so jobs may finish before the wait
+        size_t numDone = pipe.numRead + pipe.numCollected + pipe.numWritten;
+        // Read ahead, but only so far
+        while (nextRead < numPkgs &&
+               nextRead - pipe.numCollected < TRANSACT_PIPE_DEPTH)
+        {
+            transactPipeStart (&pipe, &pipe.jobs[nextRead++]);
+        }
+        // Collect packages in the order they were given, as they get read
+        bool collecting = false;
+        while (nextCollect < nextRead &&
+               pipe.jobs[nextCollect].stage == TRANSACT_PIPE_READ)
+        {
+            transactPipeStart (&pipe, &pipe.jobs[nextCollect++]);
+            collecting = true;
+        }
+        if (collecting && cb->state == NNPKG_STATE_READ_PKGCONF)
+        {
+            pthread_mutex_unlock (&pipe.lock);
+            TransactSetState (cb, NNPKG_STATE_COLLECT_INDEX);
+            pthread_mutex_lock (&pipe.lock);
+        }
+        if (!planned && pipe.numRead == numPkgs)
+        {
+            // Collection may go on meanwhile, it only reads package prefixes
+            pthread_mutex_unlock (&pipe.lock);
+            bool res = transactPlanBatch (cb, add);
+            pthread_mutex_lock (&pipe.lock);
+            if (!res)
+            {
+                pipe.failed = true;
+                break;
+            }
+            planned = true;
+        }
+        // Nothing is written before the plan is complete and the database locked.
+        // Nothing is running then
+        if (planned && !locked && pipe.numCollected == numPkgs)
+        {
+            pthread_mutex_unlock (&pipe.lock);
+            TransactSetState (cb, NNPKG_STATE_LOCK_DB);
+            locked = PkgLockDestDb (cb);
+            pthread_mutex_lock (&pipe.lock);
+            if (!locked)
+            {
+                lockFailed = true;
+                break;
+            }
+            if (staged)
+                break;
+        }
+        // Write packages a level at a time
+        bool writing = false;
+        while (locked && nextWrite < numPkgs)
+        {
+            transactJob_t* job = &pipe.jobs[add->order[nextWrite]];
+            if (nextWrite && add->levels[job->pkg] !=
+                                 add->levels[add->order[nextWrite - 1]])
+            {
+                levelStart = nextWrite;
+            }
+            if (job->stage != TRANSACT_PIPE_COLLECTED ||
+                pipe.numWritten < levelStart)
+            {
+                break;
+            }
+            transactPipeStart (&pipe, job);
+            ++nextWrite;
+            writing = true;
+        }
+        if (writing && cb->state == NNPKG_STATE_LOCK_DB)
+        {
+            pthread_mutex_unlock (&pipe.lock);
+            TransactSetState (cb, NNPKG_STATE_WRITE_INDEX);
+            pthread_mutex_lock (&pipe.lock);
+        }
+        if (!pipe.failed &&
+            numDone == pipe.numRead + pipe.numCollected + pipe.numWritten)
+        {
+            pthread_cond_wait (&pipe.jobDone, &pipe.lock);
+        }
+    }
+    pthread_mutex_unlock (&pipe.lock);
+    // Let running jobs finish before looking at their results
+    WorkPoolDestroy (pipe.pool);
+    pthread_cond_destroy (&pipe.jobDone);
+    pthread_mutex_destroy (&pipe.lock);
+    bool res = transactJoinJobs (cb, pipe.jobs, numPkgs) && !lockFailed;
+    free (pipe.jobs);
+    if (res && staged)
+    {
+        TransactSetState (cb, NNPKG_STATE_WRITE_INDEX);
+        ListHead_t** idxLists = malloc_s (numPkgs * sizeof (ListHead_t*));
+        if (!idxLists)
+        {
+            cb->error = NNPKG_ERR_OOM;
+            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+            res = false;
+        }
+        else
+        {
+            for (size_t i = 0; i < numPkgs; ++i)
+                idxLists[i] = add->idxEntries[add->order[i]];
+            res = IdxWriteIndexes (cb, idxLists, numPkgs);
+            free (idxLists);
+        }
+    }
+    if (!res)
+        transactCleanupPkgSys (cb);
+    return res;
+}
+
+// Finds packages to auto-remove
+static bool transactFindOrphans (NnpkgTransCb_t* cb, NnpkgTransAutoRemove_t* autoRm)
+{
+    if ((autoRm->orphans = PkgFindOrphans (cb)) == NULL)
+    {
+        transactCleanupPkgSys (cb);
+        return false;
+    }
+    return true;
+}
+
+// Destroys index entry list of an orphan
+static void transactDestroyIdxList (const void* data)
+{
+    ListDestroy ((ListHead_t*) data);
+}
+
+// Collects index entries of every orphan
+static bool transactCollectOrphanIndex (NnpkgTransCb_t* cb,
+                                        NnpkgTransAutoRemove_t* autoRm)
+{
+    autoRm->idxEntries = ListCreate ("ListHead_t", false, 0);
+    if (!autoRm->idxEntries)
+    {
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        transactCleanupPkgSys (cb);
+        return false;
+    }
+    ListSetDestroy (autoRm->idxEntries, transactDestroyIdxList);
+    ListEntry_t* entry = ListFront (autoRm->orphans);
+    while (entry)
+    {
+        ListHead_t* pkgEntries = IdxCollectEntries (cb, ListEntryData (entry));
+        if (!pkgEntries)
+        {
+            transactCleanupPkgSys (cb);
+            return false;
+        }
+        if (!ListAddBack (autoRm->idxEntries, pkgEntries, 0))
+        {
+            cb->error = NNPKG_ERR_OOM;
+            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+            ListDestroy (pkgEntries);
+            transactCleanupPkgSys (cb);
+            return false;
+        }
+        entry = ListIterate (entry);
+    }
+    return true;
+}
+
+// Removes index links of orphans
+static bool transactRemoveIndex (NnpkgTransCb_t* cb, NnpkgTransAutoRemove_t* autoRm)
+{
+    // Removed all together, so a staged index swaps each directory once
+    size_t numLists = 0;
+    ListEntry_t* entry = ListFront (autoRm->idxEntries);
+    for (; entry; entry = ListIterate (entry))
+        ++numLists;
+    ListHead_t** idxLists = malloc_s ((numLists + 1) * sizeof (ListHead_t*));
+    if (!idxLists)
+    {
+        cb->error = NNPKG_ERR_OOM;
+        TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        transactCleanupPkgSys (cb);
+        return false;
+    }
+    size_t i = 0;
+    for (entry = ListFront (autoRm->idxEntries); entry; entry = ListIterate (entry))
+        idxLists[i++] = ListEntryData (entry);
+    bool res = IdxRemoveIndexes (cb, idxLists, i);
+    free (idxLists);
+    if (!res)
+        transactCleanupPkgSys (cb);
+    return res;
+}
+
+// Removes orphans from database. They are all committed together, before their
+// links are removed, so the database never has a package whose links are gone
+static bool transactRemoveOrphans (NnpkgTransCb_t* cb,
+                                   NnpkgTransAutoRemove_t* autoRm)
+{
+    ListEntry_t* entry = ListFront (autoRm->orphans);
+    while (entry)
+    {
+        if (!PkgRemovePackage (cb, ListEntryData (entry)))
+        {
+            transactCleanupPkgSys (cb);
+            return false;
+        }
+        entry = ListIterate (entry);
+    }
+    PkgCloseDbs (cb);
+    return true;
+}
+
+// Finds package to remove, and makes sure nothing needs it
+static bool transactFindPkg (NnpkgTransCb_t* cb, NnpkgTransRemove_t* rm)
+{
+    rm->pkg = PkgFindPackageUtf8 (cb, rm->pkgName);
+    if (!rm->pkg)
+    {
+        // The caller knows the name already, so no hint is given
+        if (cb->state != NNPKG_TRANS_STATE_ERR)
+        {
+            cb->error = NNPKG_ERR_PKG_NO_EXIST;
+            TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+        }
+        transactCleanupPkgSys (cb);
+        return false;
+    }
+    if (!PkgCheckRemovable (cb, rm->pkg))
+    {
+        transactCleanupPkgSys (cb);
+        return false;
+    }
+    return true;
+}
+
+// Collects index entries of package being removed
+static bool transactCollectRemoveIndex (NnpkgTransCb_t* cb, NnpkgTransRemove_t* rm)
+{
+    if ((rm->idxEntries = IdxCollectEntries (cb, rm->pkg)) == NULL)
+    {
+        transactCleanupPkgSys (cb);
+        return false;
+    }
+    return true;
+}
+
+// Unlinks index entries of package being removed
+static bool transactRemovePkgIndex (NnpkgTransCb_t* cb, NnpkgTransRemove_t* rm)
+{
+    if (!IdxRemoveEntries (cb, rm->idxEntries))
+    {
+        transactCleanupPkgSys (cb);
+        return false;
+    }
+    return true;
+}
+
+// Removes package from database. The removal is committed before the package's
+// links are removed
+static bool transactRemovePkg (NnpkgTransCb_t* cb, NnpkgTransRemove_t* rm)
+{
+    if (!PkgRemovePackage (cb, rm->pkg))
+    {
+        transactCleanupPkgSys (cb);
+        return false;
+    }
+    PkgCloseDbs (cb);
+    return true;
+}
+
 // Runs current state of state machine
 static inline bool transactRunState (NnpkgTransCb_t* cb)
 {
@@ -174,15 +852,37 @@ static inline bool transactRunState (NnpkgTransCb_t* cb)
         case NNPKG_STATE_INIT_PKGSYS:
             return transactRunInit (cb);
         case NNPKG_STATE_READ_PKGCONF:
+            if (cb->type == NNPKG_TRANS_ADD_MULTI)
+                return transactRunPipeline (cb, cb->transactData);
             return transactReadPkgConf (cb, cb->transactData);
         case NNPKG_STATE_ADDPKG:
+            if (cb->type == NNPKG_TRANS_ADD_MULTI)
+                return transactAddPkgs (cb, cb->transactData);
             return transactAddPkg (cb, cb->transactData);
         case NNPKG_STATE_CLEANUP_PKGSYS:
             return transactCleanupPkgSys (cb);
         case NNPKG_STATE_COLLECT_INDEX:
+            if (cb->type == NNPKG_TRANS_REMOVE)
+                return transactCollectRemoveIndex (cb, cb->transactData);
+            else if (cb->type == NNPKG_TRANS_AUTOREMOVE)
+                return transactCollectOrphanIndex (cb, cb->transactData);
             return transactCollectIndex (cb, cb->transactData);
+        case NNPKG_STATE_LOCK_DB:
+            return transactLockDb (cb);
         case NNPKG_STATE_WRITE_INDEX:
             return transactWriteIndex (cb, cb->transactData);
+        case NNPKG_STATE_FIND_ORPHANS:
+            return transactFindOrphans (cb, cb->transactData);
+        case NNPKG_STATE_FIND_PKG:
+            return transactFindPkg (cb, cb->transactData);
+        case NNPKG_STATE_REMOVE_INDEX:
+            if (cb->type == NNPKG_TRANS_REMOVE)
+                return transactRemovePkgIndex (cb, cb->transactData);
+            return transactRemoveIndex (cb, cb->transactData);
+        case NNPKG_STATE_RMPKG:
+            if (cb->type == NNPKG_TRANS_REMOVE)
+                return transactRemovePkg (cb, cb->transactData);
+            return transactRemoveOrphans (cb, cb->transactData);
         default:
             assert (0);
     }
@@ -192,13 +892,60 @@ static inline bool transactRunState (NnpkgTransCb_t* cb)
 // Executes transaction state machine
 NNPKG_PUBLIC bool TransactExecute (NnpkgTransCb_t* cb)
 {
+    memset (&cb->stats, 0, sizeof (NnpkgTransStats_t));
+    cb->stats.numPlans = 1;
     TransactSetState (cb, NNPKG_STATE_INIT_PKGSYS);
     // Run each state
     while (cb->state != NNPKG_STATE_ACCEPT)
     {
         if (!transactRunState (cb))
-            return false;
+        {
+            if (cb->state == NNPKG_TRANS_STATE_ERR ||
+                cb->error != NNPKG_ERR_DB_CHANGED)
+            {
+                return false;
+            }
+            // The plan went stale before it could be applied. Make it again,
+            // unless the database just won't hold still
+            if (cb->stats.numPlans == TRANSACT_MAX_PLANS)
+            {
+                TransactSetState (cb, NNPKG_TRANS_STATE_ERR);
+                return false;
+            }
+            ++cb->stats.numPlans;
+            cb->error = NNPKG_ERR_NONE;
+            TransactSetState (cb, NNPKG_STATE_INIT_PKGSYS);
+            continue;
+        }
         TransactSetState (cb, transactNextState (cb));
     }
     return true;
 }
+
+NNPKG_PUBLIC void TransactCount (NnpkgTransCb_t* cb, int counter, uint64_t n)
+{
+    assert (counter < NNPKG_NUM_COUNTS);
+    if (cb->state >= 0 && cb->state < NNPKG_NUM_STATES)
+        cb->stats.counts[cb->state][counter] += n;
+}
+
+NNPKG_PUBLIC const char* TransactGetStateName (int state)
+{
+    static const char* names[] = {"none",
+                                  "error",
+                                  "add package",
+                                  "initialize package system",
+                                  "read package configuration",
+                                  "accept",
+                                  "clean up package system",
+                                  "collect index",
+                                  "write index",
+                                  "find orphans",
+                                  "remove index",
+                                  "remove package",
+                                  "find package",
+                                  "lock database"};
+    if (state < 0 || (size_t) state >= ARRAY_SIZE (names))
+        return "unknown";
+    return names[state];
+}
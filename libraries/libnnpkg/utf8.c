@@ -0,0 +1,360 @@
+/*
+    utf8.c - contains UTF-8 conversion functions
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file utf8.c
+
+#include <libnex/char32.h>
+#include <libnex/safemalloc.h>
+#include <langinfo.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined __x86_64__ || defined __i386__
+#include <immintrin.h>
+#define UTF8_HAVE_X86
+#endif
+
+// Replacement character, used for anything that can't be converted
+#define UTF8_REPLACEMENT 0xFFFD
+
+// Gets number of bytes c takes up in UTF-8
+static inline size_t utf8CharLen (char32_t c)
+{
+    if (c < 0x80)
+        return 1;
+    else if (c < 0x800)
+        return 2;
+    else if (c < 0x10000)
+        return 3;
+    else if (c < 0x110000)
+        return 4;
+    return 3;    // Replaced
+}
+
+// Encodes c into out, returning number of bytes written
+static inline size_t utf8EncodeChar (char32_t c, char* out)
+{
+    if ((c >= 0xD800 && c < 0xE000) || c >= 0x110000)
+        c = UTF8_REPLACEMENT;
+    if (c < 0x80)
+    {
+        out[0] = (char) c;
+        return 1;
+    }
+    else if (c < 0x800)
+    {
+        out[0] = (char) (0xC0 | (c >> 6));
+        out[1] = (char) (0x80 | (c & 0x3F));
+        return 2;
+    }
+    else if (c < 0x10000)
+    {
+        out[0] = (char) (0xE0 | (c >> 12));
+        out[1] = (char) (0x80 | ((c >> 6) & 0x3F));
+        out[2] = (char) (0x80 | (c & 0x3F));
+        return 3;
+    }
+    out[0] = (char) (0xF0 | (c >> 18));
+    out[1] = (char) (0x80 | ((c >> 12) & 0x3F));
+    out[2] = (char) (0x80 | ((c >> 6) & 0x3F));
+    out[3] = (char) (0x80 | (c & 0x3F));
+    return 4;
+}
+
+// Decodes one character from s, storing it in c. Returns number of bytes used
+// Malformed sequences decode to UTF8_REPLACEMENT, one byte at a time
+static inline size_t utf8DecodeChar (const uint8_t* s, char32_t* c)
+{
+    if (s[0] < 0x80)
+    {
+        *c = s[0];
+        return 1;
+    }
+    size_t len = 0;
+    char32_t min = 0;
+    if ((s[0] & 0xE0) == 0xC0)
+    {
+        len = 2;
+        min = 0x80;
+        *c = s[0] & 0x1F;
+    }
+    else if ((s[0] & 0xF0) == 0xE0)
+    {
+        len = 3;
+        min = 0x800;
+        *c = s[0] & 0x0F;
+    }
+    else if ((s[0] & 0xF8) == 0xF0)
+    {
+        len = 4;
+        min = 0x10000;
+        *c = s[0] & 0x07;
+    }
+    else
+    {
+        *c = UTF8_REPLACEMENT;
+        return 1;
+    }
+    for (size_t i = 1; i < len; ++i)
+    {
+        // A NUL terminator fails this check too
+        if ((s[i] & 0xC0) != 0x80)
+        {
+            *c = UTF8_REPLACEMENT;
+            return 1;
+        }
+        *c = (*c << 6) | (s[i] & 0x3F);
+    }
+    // Reject overlong forms, surrogates, and anything out of range
+    if (*c < min || (*c >= 0xD800 && *c < 0xE000) || *c >= 0x110000)
+    {
+        *c = UTF8_REPLACEMENT;
+        return 1;
+    }
+    return len;
+}
+
+// ASCII fast path kernels. Each converts the run of ASCII characters at the
+// start of a buffer of n characters, returning how many it converted. They may
+// stop short of a non-ASCII character; the caller handles the rest one
+// character at a time
+typedef size_t (*utf8Narrow_t) (const char32_t*, size_t, char*);
+typedef size_t (*utf8Widen_t) (const uint8_t*, size_t, char32_t*);
+
+static size_t utf8NarrowScalar (const char32_t* in, size_t n, char* out)
+{
+    size_t i = 0;
+    for (; i < n && in[i] < 0x80; ++i)
+        out[i] = (char) in[i];
+    return i;
+}
+
+static size_t utf8WidenScalar (const uint8_t* in, size_t n, char32_t* out)
+{
+    size_t i = 0;
+    for (; i < n && in[i] < 0x80; ++i)
+        out[i] = in[i];
+    return i;
+}
+
+#ifdef UTF8_HAVE_X86
+// SSE2 kernels, 16 characters at a time
+__attribute__ ((target ("sse2"))) static size_t utf8NarrowSse2 (
+    const char32_t* in,
+    size_t n,
+    char* out)
+{
+    const __m128i high = _mm_set1_epi32 (~0x7F);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128 ((const __m128i*) (in + i));
+        __m128i b = _mm_loadu_si128 ((const __m128i*) (in + i + 4));
+        __m128i c = _mm_loadu_si128 ((const __m128i*) (in + i + 8));
+        __m128i d = _mm_loadu_si128 ((const __m128i*) (in + i + 12));
+        __m128i any = _mm_or_si128 (_mm_or_si128 (a, b), _mm_or_si128 (c, d));
+        if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (_mm_and_si128 (any, high),
+                                                _mm_setzero_si128())) != 0xFFFF)
+            break;
+        // Every value fits in 7 bits, so the saturating packs are exact
+        __m128i bytes = _mm_packus_epi16 (_mm_packs_epi32 (a, b),
+                                          _mm_packs_epi32 (c, d));
+        _mm_storeu_si128 ((__m128i*) (out + i), bytes);
+    }
+    return i + utf8NarrowScalar (in + i, n - i, out + i);
+}
+
+__attribute__ ((target ("sse2"))) static size_t utf8WidenSse2 (
+    const uint8_t* in,
+    size_t n,
+    char32_t* out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128 ((const __m128i*) (in + i));
+        if (_mm_movemask_epi8 (v))
+            break;
+        __m128i lo = _mm_unpacklo_epi8 (v, zero);
+        __m128i hi = _mm_unpackhi_epi8 (v, zero);
+        _mm_storeu_si128 ((__m128i*) (out + i), _mm_unpacklo_epi16 (lo, zero));
+        _mm_storeu_si128 ((__m128i*) (out + i + 4), _mm_unpackhi_epi16 (lo, zero));
+        _mm_storeu_si128 ((__m128i*) (out + i + 8), _mm_unpacklo_epi16 (hi, zero));
+        _mm_storeu_si128 ((__m128i*) (out + i + 12),
+                          _mm_unpackhi_epi16 (hi, zero));
+    }
+    return i + utf8WidenScalar (in + i, n - i, out + i);
+}
+
+// AVX2 kernels, 32 characters at a time
+__attribute__ ((target ("avx2"))) static size_t utf8NarrowAvx2 (
+    const char32_t* in,
+    size_t n,
+    char* out)
+{
+    const __m256i high = _mm256_set1_epi32 (~0x7F);
+    // Undoes the per-lane interleaving of the packs below
+    const __m256i order = _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256 ((const __m256i*) (in + i));
+        __m256i b = _mm256_loadu_si256 ((const __m256i*) (in + i + 8));
+        __m256i c = _mm256_loadu_si256 ((const __m256i*) (in + i + 16));
+        __m256i d = _mm256_loadu_si256 ((const __m256i*) (in + i + 24));
+        __m256i any =
+            _mm256_or_si256 (_mm256_or_si256 (a, b), _mm256_or_si256 (c, d));
+        if (!_mm256_testz_si256 (any, high))
+            break;
+        __m256i bytes = _mm256_packus_epi16 (_mm256_packs_epi32 (a, b),
+                                             _mm256_packs_epi32 (c, d));
+        bytes = _mm256_permutevar8x32_epi32 (bytes, order);
+        _mm256_storeu_si256 ((__m256i*) (out + i), bytes);
+    }
+    return i + utf8NarrowSse2 (in + i, n - i, out + i);
+}
+
+__attribute__ ((target ("avx2"))) static size_t utf8WidenAvx2 (
+    const uint8_t* in,
+    size_t n,
+    char32_t* out)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256 ((const __m256i*) (in + i));
+        if (_mm256_movemask_epi8 (v))
+            break;
+        for (size_t j = 0; j < 32; j += 8)
+        {
+            __m128i part = _mm_loadl_epi64 ((const __m128i*) (in + i + j));
+            _mm256_storeu_si256 ((__m256i*) (out + i + j),
+                                 _mm256_cvtepu8_epi32 (part));
+        }
+    }
+    return i + utf8WidenSse2 (in + i, n - i, out + i);
+}
+#endif
+
+static utf8Narrow_t utf8Narrow = utf8NarrowScalar;
+static utf8Widen_t utf8Widen = utf8WidenScalar;
+static pthread_once_t utf8Once = PTHREAD_ONCE_INIT;
+
+// Picks the best kernels this CPU can run
+static void utf8PickKernels()
+{
+#ifdef UTF8_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports ("avx2"))
+    {
+        utf8Narrow = utf8NarrowAvx2;
+        utf8Widen = utf8WidenAvx2;
+    }
+    else if (__builtin_cpu_supports ("sse2"))
+    {
+        utf8Narrow = utf8NarrowSse2;
+        utf8Widen = utf8WidenSse2;
+    }
+#endif
+}
+
+// Converts a UTF-32 string to a newly allocated UTF-8 string
+char* pkgUtf32ToUtf8 (const char32_t* s)
+{
+    pthread_once (&utf8Once, utf8PickKernels);
+    size_t len = c32len (s);
+    // Guess that it's all ASCII, which it nearly always is
+    char* out = malloc_s (len + 1);
+    if (!out)
+        return NULL;
+    size_t done = utf8Narrow (s, len, out);
+    if (done == len)
+    {
+        out[len] = 0;
+        return out;
+    }
+    // It's not, so grow the buffer to fit the rest
+    size_t outLen = done + 1;
+    for (size_t i = done; i < len; ++i)
+        outLen += utf8CharLen (s[i]);
+    char* newOut = realloc_s (out, outLen);
+    if (!newOut)
+    {
+        free (out);
+        return NULL;
+    }
+    out = newOut;
+    char* o = out + done;
+    while (done < len)
+    {
+        o += utf8EncodeChar (s[done++], o);
+        size_t run = utf8Narrow (s + done, len - done, o);
+        o += run;
+        done += run;
+    }
+    *o = 0;
+    return out;
+}
+
+// Checks if the host encoding is UTF-8
+bool pkgHostIsUtf8()
+{
+    return !strcmp (nl_langinfo (CODESET), "UTF-8");
+}
+
+// Converts a UTF-32 string to a newly allocated string in host encoding
+char* pkgUtf32ToHost (const char32_t* s)
+{
+    // UTF-8 hosts can skip the locale machinery
+    if (pkgHostIsUtf8())
+        return pkgUtf32ToUtf8 (s);
+    size_t hostLen = (c32len (s) * MB_CUR_MAX) + 1;
+    char* hostStr = malloc_s (hostLen);
+    if (!hostStr)
+        return NULL;
+    mbstate_t mbstate = {0};
+    c32stombs (hostStr, s, hostLen, &mbstate);
+    return hostStr;
+}
+
+// Converts a UTF-8 string to a newly allocated UTF-32 string
+char32_t* pkgUtf8ToUtf32 (const char* s)
+{
+    pthread_once (&utf8Once, utf8PickKernels);
+    size_t len = strlen (s);
+    // A UTF-8 string never has more characters than bytes
+    char32_t* out = malloc_s ((len + 1) * sizeof (char32_t));
+    if (!out)
+        return NULL;
+    const uint8_t* in = (const uint8_t*) s;
+    const uint8_t* end = in + len;
+    char32_t* o = out;
+    while (in < end)
+    {
+        size_t run = utf8Widen (in, (size_t) (end - in), o);
+        in += run;
+        o += run;
+        if (in < end)
+            in += utf8DecodeChar (in, o++);
+    }
+    *o = 0;
+    return out;
+}
@@ -0,0 +1,165 @@
+/*
+    workpool.c - contains worker thread pool
+    Copyright 2022 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file workpool.c
+
+#include <libnex/safemalloc.h>
+#include <nnpkg/workpool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Queued job
+typedef struct _workjob
+{
+    NnpkgWorkFunc_t func;    ///< Function to run
+    void* data;              ///< Argument of function
+} workJob_t;
+
+typedef struct _nnpkgworkpool
+{
+    pthread_t* threads;         ///< Worker threads
+    int numThreads;             ///< Number of worker threads
+    pthread_mutex_t lock;       ///< Protects everything below
+    pthread_cond_t jobReady;    ///< Signaled when a job is queued or on shutdown
+    pthread_cond_t allDone;     ///< Signaled when the last running job finishes
+    workJob_t* jobs;            ///< Circular queue of jobs
+    size_t maxJobs;             ///< Size of job queue
+    size_t head;                ///< Next job to run
+    size_t numJobs;             ///< Number of queued jobs
+    size_t numRunning;          ///< Number of jobs being run
+    bool stop;                  ///< If workers should exit
+} NnpkgWorkPool_t;
+
+#define WORKPOOL_INIT_JOBS 16
+
+// Main loop of worker threads
+static void* workPoolWorker (void* arg)
+{
+    NnpkgWorkPool_t* pool = arg;
+    pthread_mutex_lock (&pool->lock);
+    for (;;)
+    {
+        while (!pool->numJobs && !pool->stop)
+            pthread_cond_wait (&pool->jobReady, &pool->lock);
+        if (!pool->numJobs)
+            break;
+        workJob_t job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->maxJobs;
+        --pool->numJobs;
+        ++pool->numRunning;
+        pthread_mutex_unlock (&pool->lock);
+        job.func (job.data);
+        pthread_mutex_lock (&pool->lock);
+        --pool->numRunning;
+        if (!pool->numJobs && !pool->numRunning)
+            pthread_cond_broadcast (&pool->allDone);
+    }
+    pthread_mutex_unlock (&pool->lock);
+    return NULL;
+}
+
+NNPKG_PUBLIC NnpkgWorkPool_t* WorkPoolCreate (int numThreads)
+{
+    if (!numThreads)
+    {
+        long numCpus = sysconf (_SC_NPROCESSORS_ONLN);
+        numThreads = (numCpus > 0) ? (int) numCpus : 1;
+    }
+    NnpkgWorkPool_t* pool = calloc_s (sizeof (NnpkgWorkPool_t));
+    if (!pool)
+        return NULL;
+    pool->threads = malloc_s (numThreads * sizeof (pthread_t));
+    pool->jobs = malloc_s (WORKPOOL_INIT_JOBS * sizeof (workJob_t));
+    if (!pool->threads || !pool->jobs)
+    {
+        free (pool->threads);
+        free (pool->jobs);
+        free (pool);
+        return NULL;
+    }
+    pool->maxJobs = WORKPOOL_INIT_JOBS;
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->jobReady, NULL);
+    pthread_cond_init (&pool->allDone, NULL);
+    for (int i = 0; i < numThreads; ++i)
+    {
+        if (pthread_create (&pool->threads[i], NULL, workPoolWorker, pool))
+            break;
+        ++pool->numThreads;
+    }
+    if (!pool->numThreads)
+    {
+        WorkPoolDestroy (pool);
+        return NULL;
+    }
+    return pool;
+}
+
+NNPKG_PUBLIC bool WorkPoolSubmit (NnpkgWorkPool_t* pool,
+                                  NnpkgWorkFunc_t func,
+                                  void* data)
+{
+    pthread_mutex_lock (&pool->lock);
+    if (pool->numJobs == pool->maxJobs)
+    {
+        // Grow queue, unwrapping it in the process
+        workJob_t* jobs = malloc_s (pool->maxJobs * 2 * sizeof (workJob_t));
+        if (!jobs)
+        {
+            pthread_mutex_unlock (&pool->lock);
+            return false;
+        }
+        for (size_t i = 0; i < pool->numJobs; ++i)
+            jobs[i] = pool->jobs[(pool->head + i) % pool->maxJobs];
+        free (pool->jobs);
+        pool->jobs = jobs;
+        pool->head = 0;
+        pool->maxJobs *= 2;
+    }
+    workJob_t* job = &pool->jobs[(pool->head + pool->numJobs) % pool->maxJobs];
+    job->func = func;
+    job->data = data;
+    ++pool->numJobs;
+    pthread_cond_signal (&pool->jobReady);
+    pthread_mutex_unlock (&pool->lock);
+    return true;
+}
+
+NNPKG_PUBLIC void WorkPoolWait (NnpkgWorkPool_t* pool)
+{
+    pthread_mutex_lock (&pool->lock);
+    while (pool->numJobs || pool->numRunning)
+        pthread_cond_wait (&pool->allDone, &pool->lock);
+    pthread_mutex_unlock (&pool->lock);
+}
+
+NNPKG_PUBLIC void WorkPoolDestroy (NnpkgWorkPool_t* pool)
+{
+    // Workers drain the queue before they exit
+    pthread_mutex_lock (&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast (&pool->jobReady);
+    pthread_mutex_unlock (&pool->lock);
+    for (int i = 0; i < pool->numThreads; ++i)
+        pthread_join (pool->threads[i], NULL);
+    pthread_cond_destroy (&pool->allDone);
+    pthread_cond_destroy (&pool->jobReady);
+    pthread_mutex_destroy (&pool->lock);
+    free (pool->threads);
+    free (pool->jobs);
+    free (pool);
+}